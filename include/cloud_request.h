@@ -12,6 +12,8 @@ typedef struct req_cbr_t req_cbr_t;
 struct req_cbr_t
 {
     void *ctx;
+    /* optional, adds header fields to the request */
+    void (*request)(void *ctx, HttpClientContext *cloud_ctx);
     void (*response)(void *ctx, HttpClientContext *cloud_ctx);
     void (*header)(void *ctx, HttpClientContext *cloud_ctx, const char *header, const char *value);
     void (*body)(void *ctx, HttpClientContext *cloud_ctx, const char *payload, size_t length, error_t error);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "os_port.h"
+#include "error.h"
+
+/**
+ * One-shot completion with progress wakeups.
+ *
+ * The producer calls completion_signal whenever waiters should re-check their
+ * state (e.g. a stream became active) and completion_complete when it is done.
+ * Waiters block in completion_wait instead of polling with osDelayTask.
+ * Signals are not lost when they happen before the wait.
+ */
+typedef struct
+{
+    OsEvent event;
+    bool_t initialized;
+    volatile bool_t done;
+    volatile bool_t cancelled;
+    error_t error;
+} completion_t;
+
+error_t completion_init(completion_t *completion);
+void completion_deinit(completion_t *completion);
+/* re-arms a completion for the next use, keeps the event */
+void completion_reset(completion_t *completion);
+
+void completion_signal(completion_t *completion);
+void completion_complete(completion_t *completion, error_t error);
+void completion_cancel(completion_t *completion);
+
+bool_t completion_is_done(completion_t *completion);
+
+/**
+ * @brief Waits for the next signal or the completion.
+ *
+ * @return NO_ERROR when signalled or completed, ERROR_ABORTED when cancelled,
+ *         ERROR_TIMEOUT when the timeout elapsed without any of them
+ */
+error_t completion_wait(completion_t *completion, systime_t timeout);
+
+/**
+ * @brief Waits until completed, cancelled or the timeout elapsed.
+ *
+ * @return the error passed to completion_complete, ERROR_ABORTED or ERROR_TIMEOUT
+ */
+error_t completion_wait_done(completion_t *completion, systime_t timeout);
+
+/**
+ * @brief Like completion_wait_done, but ignores cancellation. Used to wait for a worker to exit.
+ */
+error_t completion_join(completion_t *completion, systime_t timeout);
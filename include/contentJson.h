@@ -57,5 +57,7 @@ typedef struct
 error_t load_content_json(const char *content_path, contentJson_t *content_json, bool create_if_missing);
 error_t load_content_json_settings(const char *content_path, contentJson_t *content_json, bool create_if_missing, settings_t *settings);
 error_t save_content_json(const char *content_path, contentJson_t *content_json);
+/* incremented on every successful save_content_json */
+uint32_t content_json_version();
 void content_json_update_model(contentJson_t *content_json, uint32_t audio_id, uint8_t *hash);
 void free_content_json(contentJson_t *content_json);
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "error.h"
+#include "completion.h"
+#include "http/http_server.h"
+
+#define CONTENT_FLIGHT_MAX 16
+#define CONTENT_FLIGHT_FOLLOWERS 8
+/* followers give up when the leader made no progress for this long */
+#define CONTENT_FLIGHT_TIMEOUT 30000
+/* how long the leader waits for joined followers to open the cache file before renaming it */
+#define CONTENT_FLIGHT_OPEN_TIMEOUT 5000
+
+/**
+ * Single-flight coalescing of cloud content downloads.
+ *
+ * The first request for a content path becomes the leader: it performs the
+ * upstream download and writes the .tmp cache file. Requests for the same
+ * content arriving meanwhile become followers and stream the growing cache
+ * file instead of opening their own upstream connection. The leader reports
+ * progress, every follower is woken through its own completion. Requests
+ * joining after the seal wait until the leader renamed the file and are
+ * then served from the cache.
+ */
+typedef struct content_flight_s content_flight_t;
+
+/**
+ * @brief Joins the running download of contentPath or starts a new one.
+ *
+ * @param wake Completion of the caller, signalled on leader progress when following
+ * @param leader Set if the caller has to perform the download
+ * @return NULL if no flight or follower slot is available, the caller then streams
+ *         the content without caching it, as only the flight owner may write the .tmp file
+ */
+content_flight_t *content_flight_join(const char *contentPath, completion_t *wake, bool_t *leader);
+void content_flight_release(content_flight_t *flight, completion_t *wake);
+
+/* leader side, all functions accept NULL */
+void content_flight_set_length(content_flight_t *flight, size_t length);
+/* records a header of the upstream 200 response, followers answer with the same headers */
+void content_flight_add_header(content_flight_t *flight, uint16_t version, const char *header, const char *value);
+void content_flight_file_ready(content_flight_t *flight);
+void content_flight_progress(content_flight_t *flight, size_t length);
+/* stops new followers from joining and waits until joined ones opened the cache file */
+void content_flight_seal(content_flight_t *flight);
+void content_flight_complete(content_flight_t *flight, error_t error);
+/**
+ * @brief Replaces contentPath by the downloaded tmpPath, flight may be NULL.
+ *
+ * Followers still reading tmpPath keep their handles. Where open files can't be
+ * renamed, the rename is retried after they closed it.
+ */
+error_t content_flight_finish(content_flight_t *flight, const char *tmpPath, const char *contentPath);
+
+/**
+ * @brief Sends the content to connection while the leader is downloading it.
+ *
+ * @return ERROR_ABORTED if the leader failed before anything was sent, the caller
+ *         may then request the content itself
+ */
+error_t content_flight_follow(content_flight_t *flight, completion_t *wake, HttpConnection *connection);
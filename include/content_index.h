@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "settings.h"
+#include "hash/sha1.h"
+
+#define CONTENT_INDEX_FILE "content_index.db"
+#define CONTENT_INDEX_BUCKETS 1024
+
+/**
+ * Persistent index of content and library files.
+ *
+ * Listings need the TAF header and the content json of every entry. The
+ * index keeps what they show per content path, together with the size and
+ * modification time of the content json and the TAF it was read from. An
+ * entry is used as long as both files are unchanged, so changes on disk
+ * are picked up by the next lookup without reading any file.
+ *
+ * Only valid TAFs are indexed, other paths are read on every lookup.
+ *
+ * The index saves reading files, not visiting them: listings still read
+ * their directories and every lookup stats the content json and the TAF.
+ * A listing therefore costs a readdir per directory and two stats per
+ * entry, proportional to the collection rather than to the result. Trusting
+ * directory mtimes instead would miss TAFs rewritten in place from outside,
+ * e.g. copied over on a network share, which doesn't touch the directory.
+ *
+ * The index is stored as an append-only log of JSON lines in the config
+ * directory, later lines replace earlier ones. It is compacted on startup
+ * and whenever it holds more than twice as many lines as entries.
+ */
+typedef struct content_index_entry_s
+{
+    char *path;
+
+    /* files the entry was built from, mtime is -1 if a file is missing */
+    int64_t json_mtime;
+    uint32_t json_size;
+    char *content_path;
+    int64_t content_mtime;
+    uint32_t content_size;
+
+    /* TAF header */
+    bool_t exists;
+    bool_t valid;
+    uint32_t audio_id;
+    uint8_t sha1[SHA1_DIGEST_SIZE];
+    uint64_t num_bytes;
+    size_t n_tracks;
+    uint32_t *tracks;
+
+    /* content json */
+    bool_t json_valid;
+    bool_t live;
+    bool_t nocloud;
+    bool_t has_cloud_auth;
+    char *source;
+    char *tonie_model;
+
+    struct content_index_entry_s *next;
+} content_index_entry_t;
+
+void content_index_init();
+
+/**
+ * @brief Returns the indexed info of a content path, refreshing it if the files changed.
+ *
+ * @param contentPath Content path without .json, or the path of a library file
+ * @return A copy to be freed with content_index_free
+ */
+content_index_entry_t *content_index_get(const char *contentPath, settings_t *settings);
+void content_index_free(content_index_entry_t *entry);
+
+/* forces the next lookup to read the files again */
+void content_index_invalidate(const char *contentPath);
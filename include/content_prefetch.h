@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "settings.h"
+
+#define CONTENT_PREFETCH_QUEUE_SIZE 64
+#define CONTENT_PREFETCH_WORKERS_MAX 4
+
+/**
+ * Background prefetch of cloud content into the local content cache.
+ *
+ * Tonies are queued from freshness checks, RTNL tag events and the API. Up to
+ * cloud.prefetchWorkers workers download missing (or, when forced, updated)
+ * content with the rUID/auth stored in the content json, sharing the
+ * cloud.prefetchBandwidth budget. Downloads run through content_flight, so a
+ * box requesting the same content meanwhile follows the prefetch.
+ */
+void content_prefetch_init();
+
+/**
+ * @brief Queues the content of a tonie for download.
+ *
+ * @param force Download even if valid content is cached, e.g. when the cloud marked it as updated
+ * @return FALSE if prefetching is disabled for the overlay or the queue is full
+ */
+bool_t content_prefetch_enqueue(uint64_t uid, settings_t *settings, bool_t force);
+size_t content_prefetch_pending();
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "os_port.h"
+#include "error.h"
+
+#define CONTENT_STORE_FILE "content_store.json"
+#define CONTENT_STORE_TMP_EXT ".store.tmp"
+
+/**
+ * Content-addressed store of TAF files.
+ *
+ * Every distinct audio is kept once as a blob named by the SHA1 from its
+ * TAF header. Library and content files with that audio are placed as a
+ * FICLONE reflink of the blob, as a hardlink if the filesystem can't share
+ * extents, and only copied if neither works. If init can't link into the
+ * library and content dirs, e.g. as they are on other filesystems, no blobs
+ * are created and files are copied directly. The index in the config dir
+ * holds the files placed from each blob as its references. Blobs without
+ * references are removed by the garbage collection, which runs on startup.
+ */
+void content_store_init();
+
+/* copies a TAF through the store, other files are copied plainly */
+error_t content_store_copy(const char *source, const char *target);
+
+/* adds a TAF in place, it is replaced by the blob if the store already has its audio */
+error_t content_store_add(const char *path);
+
+/**
+ * @brief Drops references to files that are gone or changed and deletes unreferenced blobs.
+ *
+ * @param removed number of deleted blobs, may be NULL
+ * @param removed_bytes their size, disk space is freed once no other link is left, may be NULL
+ */
+error_t content_store_gc(uint32_t *removed, uint64_t *removed_bytes);
+
+/* blobs with their size and references as JSON */
+char *content_store_json();
+
+/* adds, replaces and deletes files in a scratch store in the config dir and checks what the garbage collection keeps */
+error_t content_store_check();
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "os_port.h"
+#include "error.h"
+
+/* bytes buffered per decoder, a multiple of one stereo s16 frame */
+#define FFMPEG_DECODER_BUFFER_SIZE (64 * 1024)
+/* maximum time a read waits for ffmpeg before returning ERROR_WOULD_BLOCK */
+#define FFMPEG_DECODER_POLL_MS 500
+/* how long ffmpeg_decoder_start waits for a free decoder, below STREAM_START_TIMEOUT so a box gets a clean error */
+#define FFMPEG_DECODER_WAIT_MS 15000
+#define FFMPEG_DECODER_WAIT_POLL_MS 100
+
+/**
+ * ffmpeg decoding to 48kHz stereo s16le PCM.
+ *
+ * ffmpeg is spawned directly (posix_spawn on Linux, no shell) with its
+ * stdout connected to a non-blocking pipe, so readers can check their
+ * abort flag while a source stalls. At most encode.ffmpeg_decoders_max
+ * ffmpeg processes run at once. A decoder needed now waits for a free slot,
+ * prefetched decoders for the next source only start while slots are free
+ * and no other decoder waits for one.
+ *
+ * Local 16 bit 48kHz WAV files and Ogg Opus files are decoded in-process
+ * and do not need ffmpeg at all.
+ */
+typedef struct ffmpeg_decoder_s ffmpeg_decoder_t;
+
+/**
+ * @brief Starts a decoder for a source that is read right away.
+ *
+ * @return NULL if ffmpeg could not be started or no decoder became free within FFMPEG_DECODER_WAIT_MS
+ */
+ffmpeg_decoder_t *ffmpeg_decoder_start(const char *source, size_t skip_seconds);
+
+/**
+ * @brief Starts a decoder for a source that will be read later.
+ *
+ * ffmpeg opens and probes the source and fills the pipe in the background.
+ *
+ * @return NULL if the decoder pool is exhausted or ffmpeg could not be started
+ */
+ffmpeg_decoder_t *ffmpeg_decoder_prefetch(const char *source);
+
+/**
+ * @brief Reads decoded samples, always whole stereo frames.
+ *
+ * @return NO_ERROR, ERROR_WOULD_BLOCK if ffmpeg produced nothing within FFMPEG_DECODER_POLL_MS
+ *         or ERROR_END_OF_STREAM once ffmpeg closed its output
+ */
+error_t ffmpeg_decoder_read(ffmpeg_decoder_t *decoder, int16_t *buffer, size_t samples, size_t *samples_read);
+
+/* TRUE while the source is Opus that can be copied into a TAF without re-encoding */
+bool_t ffmpeg_decoder_can_remux(ffmpeg_decoder_t *decoder);
+
+/**
+ * @brief Returns the next opus packet of a remuxable source, valid until the next call.
+ *
+ * @return ERROR_UNSUPPORTED_FEATURE once a packet needs re-encoding, ffmpeg_decoder_read continues with it
+ */
+error_t ffmpeg_decoder_read_packet(ffmpeg_decoder_t *decoder, const uint8_t **packet, size_t *length);
+
+/* stops ffmpeg if it is still running and frees the decoder, accepts NULL */
+void ffmpeg_decoder_end(ffmpeg_decoder_t *decoder);
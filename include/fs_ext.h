@@ -20,4 +20,13 @@ FsFile *fsOpenFileEx(const char_t *path, char *mode);
 error_t fsCompareFiles(const char_t *source_path, const char_t *target_path, size_t *diff_position);
 error_t fsCopyFile(const char_t *source_path, const char_t *target_path, bool_t overwrite);
 error_t fsMoveFile(const char_t *source_path, const char_t *target_path, bool_t overwrite);
-error_t fsCreateDirEx(const char_t *path, bool_t recursive);
\ No newline at end of file
+error_t fsCreateDirEx(const char_t *path, bool_t recursive);
+
+/* hardlink, ERROR_NOT_IMPLEMENTED where links are not used */
+error_t fsLinkFile(const char_t *source_path, const char_t *target_path);
+/* FICLONE reflink, ERROR_NOT_IMPLEMENTED if the filesystem can't share extents */
+error_t fsCloneFile(const char_t *source_path, const char_t *target_path);
+/* makes a hardlinked file a copy of its own, so it can be written in place */
+error_t fsUnshareFile(const char_t *path);
+/* sets the modification time to now */
+error_t fsTouchFile(const char_t *path);
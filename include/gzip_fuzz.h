@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "error.h"
+
+/* largest input a fuzz run compresses, several windows long */
+#define GZIP_FUZZ_INPUT_MAX (256 * 1024)
+
+/**
+ * @brief Compresses random inputs written in random pieces and inflates them again.
+ */
+error_t gzip_fuzz_run(uint32_t count);
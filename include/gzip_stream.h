@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "os_port.h"
+#include "error.h"
+
+#define GZIP_STREAM_WINDOW_BITS 15
+#define GZIP_STREAM_WINDOW_SIZE (1 << GZIP_STREAM_WINDOW_BITS)
+/* window and hash used for a response known to be small */
+#define GZIP_STREAM_MIN_WINDOW_BITS 10
+/* candidates checked per position, trades ratio against CPU */
+#define GZIP_STREAM_MAX_CHAIN 32
+#define GZIP_STREAM_OUTPUT_SIZE 4096
+
+/* files smaller than this are not worth a precompressed variant */
+#define GZIP_PRECOMPRESS_MIN_SIZE 1024
+
+typedef error_t (*gzip_stream_output_t)(void *ctx, const void *data, size_t length);
+
+/**
+ * Streaming gzip (RFC 1952) compressor.
+ *
+ * Uses LZ77 over a window of up to 32k with hash chains and the fixed Huffman
+ * codes of deflate, so it needs no tables per block and no third party library.
+ * Window and hash table are allocated behind the struct and sized to the
+ * response, so a small body does not cost the ~320k a full window takes.
+ * Compressed data is passed to the output callback in blocks of
+ * GZIP_STREAM_OUTPUT_SIZE bytes and once more by gzip_stream_finish.
+ */
+typedef struct
+{
+    gzip_stream_output_t output;
+    void *ctx;
+    error_t error;
+
+    /* window holds two window_size halves, prev one entry per window position */
+    size_t window_size;
+    uint8_t *window;
+    size_t pos;
+    size_t lookahead;
+    uint32_t hash_bits;
+    uint32_t hash_shift;
+    int32_t *head;
+    int32_t *prev;
+
+    uint32_t bits;
+    uint32_t bit_count;
+    uint8_t out[GZIP_STREAM_OUTPUT_SIZE];
+    size_t out_used;
+
+    uint32_t crc;
+    uint32_t size;
+    size_t total_out;
+} gzip_stream_t;
+
+/**
+ * @brief Allocates a compressor and writes the gzip header, NULL if out of memory.
+ *
+ * size_hint is the expected body length or 0 if unknown. Writing more than
+ * the hint still works, matches are just limited to the smaller window.
+ */
+gzip_stream_t *gzip_stream_start(gzip_stream_output_t output, void *ctx, size_t size_hint);
+error_t gzip_stream_write(gzip_stream_t *gzip, const void *data, size_t length);
+/* compresses what is left, writes the trailer and frees the compressor */
+error_t gzip_stream_finish(gzip_stream_t *gzip, size_t *total_out);
+
+/**
+ * @brief Writes <path>.gz unless it is already newer than the file.
+ *
+ * The variant is written to a temporary file first and renamed, so it is
+ * never served half written.
+ */
+error_t gzip_precompress_file(const char *path);
+
+/* precompresses the text files below a directory, recursively */
+void gzip_precompress_dir(const char *path);
+
+/* precompresses the web interface and tonies.json in the background */
+void gzip_precompress_start();
+
+/**
+ * @brief Compresses a file repeatedly and reports size and CPU time per response.
+ */
+error_t gzip_bench_run(const char *path, uint32_t count);
+
+/* deflate length and distance codes, also used by the inflater in gzip_fuzz.c */
+extern const uint16_t gzip_length_base[29];
+extern const uint8_t gzip_length_extra[29];
+extern const uint16_t gzip_dist_base[30];
+extern const uint8_t gzip_dist_extra[30];
+
+/* CRC-32 of the gzip trailer, start with crc 0 */
+uint32_t gzip_crc32(uint32_t crc, const uint8_t *data, size_t length);
@@ -16,6 +16,8 @@
 #include "cloud_request.h"
 
 #include "contentJson.h"
+#include "completion.h"
+#include "content_flight.h"
 
 #define CONTENT_LENGTH_UNKNOWN ((size_t) - 1)
 
@@ -67,6 +69,10 @@ typedef struct
     size_t customDataLen;
     HttpConnection *connection;
     client_ctx_t *client_ctx;
+    /* optional, completed by the passthrough callbacks when the request ended */
+    completion_t *completion;
+    /* optional, set when this request downloads content other requests follow */
+    content_flight_t *flight;
 } cbr_ctx_t;
 
 void fillBaseCtx(HttpConnection *connection, const char_t *uri, const char_t *queryString, cloudapi_t api, cbr_ctx_t *ctx, client_ctx_t *client_ctx);
@@ -83,19 +89,27 @@ void cbrCloudServerDiscoPassthrough(void *src_ctx, HttpClientContext *cloud_ctx)
 char *strupr(char input[]);
 
 #define TAF_HEADER_SIZE 4092
+#define TAF_SHA1_SIZE 20
 
 void getContentPathFromCharRUID(char ruid[17], char **pcontentPath, settings_t *settings);
 void getContentPathFromUID(uint64_t uid, char **pcontentPath, settings_t *settings);
 void setTonieboxSettings(TonieFreshnessCheckResponse *freshResp, settings_t *settings);
 bool_t isValidTaf(const char *contentPath);
+/* SHA1 of the audio from the TAF header, false if the file is no valid TAF */
+bool_t getTafSha1(const char *contentPath, uint8_t *sha1);
 tonie_info_t *getTonieInfoFromUid(uint64_t uid, settings_t *settings);
 tonie_info_t *getTonieInfoFromRuid(char ruid[17], settings_t *settings);
 tonie_info_t *getTonieInfo(const char *contentPath, settings_t *settings);
 void freeTonieInfo(tonie_info_t *tonieInfo);
+void cacheContentToLibrary(const char *contentPath, settings_t *settings);
 
 void httpPrepareHeader(HttpConnection *connection, const void *contentType, size_t contentLength);
 error_t httpWriteResponseString(HttpConnection *connection, char_t *data, bool_t freeMemory);
+/* JSON bodies of at least core.gzip_min_size bytes are sent gzip compressed if the client accepts it */
 error_t httpWriteResponse(HttpConnection *connection, void *data, size_t size, bool_t freeMemory);
+bool_t httpGzipAccepted(HttpConnection *connection, size_t size);
+/* gzip_stream output writing to the response */
+error_t httpGzipOutput(void *ctx, const void *data, size_t length);
 error_t httpWriteString(HttpConnection *connection, const char_t *content);
 error_t httpFlushStream(HttpConnection *connection);
 
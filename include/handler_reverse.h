@@ -15,4 +15,7 @@
 #define PROX_STATUS_BODY 3
 #define PROX_STATUS_DONE 4
 
+/* upper bound for a proxied request to finish once cloud_request_get returned */
+#define REVERSE_PROXY_TIMEOUT 30000
+
 error_t handleReverse(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx);
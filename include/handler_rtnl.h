@@ -101,5 +101,8 @@ error_t handleRtnl(HttpConnection *connection, const char_t *uri, const char_t *
 void rtnlEvent(HttpConnection *connection, TonieRtnlRPC *rpc, client_ctx_t *client_ctx);
 void rtnlEventLog(HttpConnection *connection, TonieRtnlRPC *rpc);
 void rtnlEventDump(HttpConnection *connection, TonieRtnlRPC *rpc, settings_t *settings);
+error_t handleApiRtnlQuery(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx);
+/* times rtnlEvent per packet for a plain log2 and an AUDIO_ID packet */
+error_t rtnl_format_bench_run(uint32_t payload, uint32_t count);
 
 #endif
\ No newline at end of file
@@ -5,6 +5,8 @@
 
 #define MAX_LEN 128
 #define MAX_ENTITIES (3 * 9 + 16 * 7 + 32)
+/* birth and last will topic of Home Assistant itself */
+#define HA_STATUS_TOPIC "homeassistant/status"
 
 /* https://www.home-assistant.io/integrations/mqtt/#mqtt-discovery */
 typedef enum
@@ -96,6 +98,15 @@ struct s_ha_entity
     void *transmit_ctx;
 };
 
+/* what the broker last got for an entity, only changes are published again, guarded by MUTEX_HA_PUBLISHED */
+typedef struct
+{
+    uint32_t discovery_hash;
+    uint32_t discovery_session;
+    uint32_t state_hash;
+    uint32_t state_session;
+} t_ha_published;
+
 struct s_ha_info
 {
     bool initialized;
@@ -110,10 +121,15 @@ struct s_ha_info
     char via[MAX_LEN];
     char availability_topic[MAX_LEN];
     t_ha_entity entities[MAX_ENTITIES];
+    t_ha_published published[MAX_ENTITIES];
     int entitiy_count;
+    uint32_t discovery_session;
+    uint64_t next_refresh;
 };
 
 void ha_setup(t_ha_info *ha_info);
+void ha_session_start();
+void ha_status_received(const char *topic, const char *payload);
 void ha_connected(t_ha_info *ha_info);
 bool ha_loop(t_ha_info *ha_info);
 void ha_transmit_all(t_ha_info *ha_info);
@@ -2,9 +2,12 @@
 
 #include "error.h"
 #include "handler.h"
+#include "mqtt_queue.h"
 
 void mqtt_init();
 error_t mqtt_sendEvent(const char *eventname, const char *content, client_ctx_t *client_ctx);
 error_t mqtt_sendBoxEvent(const char *eventname, const char *content, client_ctx_t *client_ctx);
 bool mqtt_publish(const char *item_topic, const char *content);
+bool mqtt_publish_tracked(const char *item_topic, const char *content, mqtt_queue_sent_cb_t sent, void *sent_ctx);
+bool mqtt_publish_event(const char *item_topic, const char *content);
 bool mqtt_subscribe(const char *item_topic);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define MQTT_QUEUE_SIZE 512
+#define MQTT_QUEUE_BUCKETS 256
+#define MQTT_QUEUE_BATCH 32
+
+typedef enum
+{
+    MQTT_QUEUE_OVERFLOW_DROP_NEW = 0,
+    MQTT_QUEUE_OVERFLOW_DROP_OLDEST = 1,
+} mqtt_queue_overflow_t;
+
+/* called by the MQTT thread once a message was handed to the broker, dropped messages never get here */
+typedef void (*mqtt_queue_sent_cb_t)(void *ctx, const char *topic, const char *payload);
+
+/* a dequeued message, topic and payload share one allocation owned by data */
+typedef struct
+{
+    char *data;
+    const char *topic;
+    const char *payload;
+    size_t payload_len;
+    mqtt_queue_sent_cb_t sent;
+    void *sent_ctx;
+} mqtt_queue_msg_t;
+
+/**
+ * @brief Queues a message for the MQTT thread, safe to call from any task.
+ *
+ * With coalesce set, a message still waiting for the same topic gets its payload
+ * replaced (last value wins) instead of queueing a second one. Events must not
+ * be coalesced, every occurrence is delivered.
+ * When the queue is full, the overflow policy decides whether the new or the
+ * oldest queued message gets dropped.
+ * The optional sent callback is carried along with the message (a coalesced message
+ * takes the newer one) and has to be called by the consumer after publishing it.
+ *
+ * @return false if the message was dropped
+ */
+bool mqtt_queue_push(const char *topic, const char *payload, bool coalesce, mqtt_queue_overflow_t overflow, mqtt_queue_sent_cb_t sent, void *sent_ctx);
+
+/**
+ * @brief Takes up to max messages from the head of the queue.
+ *
+ * The caller owns the returned messages and has to release them with mqtt_queue_free.
+ */
+size_t mqtt_queue_pop(mqtt_queue_msg_t *msgs, size_t max);
+void mqtt_queue_free(mqtt_queue_msg_t *msg);
+size_t mqtt_queue_pending();
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "os_port.h"
+#include "error.h"
+
+#define MULTIPART_BUFFER_SIZE_DEFAULT (64 * 1024)
+#define MULTIPART_BUFFER_SIZE_MIN 4096
+/* RFC 2046 limit, same as HTTP_SERVER_BOUNDARY_MAX_LEN */
+#define MULTIPART_BOUNDARY_MAX_LEN 70
+/* "\r\n--" followed by the boundary */
+#define MULTIPART_DELIMITER_MAX_LEN (MULTIPART_BOUNDARY_MAX_LEN + 4)
+/* transport padding allowed between a delimiter and its CRLF */
+#define MULTIPART_PADDING_MAX 256
+
+#define MULTIPART_BENCH_SYNTHETIC "synthetic"
+#define MULTIPART_BENCH_SYNTHETIC_SIZE (32 * 1024 * 1024)
+/* bytes handed to the parser per call, about what a socket read returns */
+#define MULTIPART_BENCH_FRAGMENT 16384
+
+typedef struct
+{
+    error_t (*multipart_start)(void *ctx, const char *name, const char *filename);
+    error_t (*multipart_add)(void *ctx, void *data, size_t length);
+    error_t (*multipart_end)(void *ctx);
+} multipart_cbr_t;
+
+typedef enum
+{
+    MULTIPART_PREAMBLE,
+    MULTIPART_DELIMITER,
+    MULTIPART_HEADERS,
+    MULTIPART_BODY,
+    MULTIPART_DONE
+} multipart_state_t;
+
+/**
+ * Incremental multipart/form-data parser.
+ *
+ * Data is received directly into the parser's buffer. The delimiter is
+ * searched with a Boyer-Moore-Horspool skip table, and file data is
+ * passed to multipart_add in blocks of at least half the buffer, except
+ * for the last block of each part. Parts without a filename are skipped.
+ */
+typedef struct
+{
+    multipart_cbr_t *cbr;
+    void *ctx;
+    multipart_state_t state;
+    error_t error;
+
+    uint8_t delimiter[MULTIPART_DELIMITER_MAX_LEN];
+    size_t delimiter_len;
+    size_t skip[256];
+
+    uint8_t *buffer;
+    size_t size;
+    size_t used;
+    /* no delimiter starts before this offset, saves searching again after a receive */
+    size_t searched;
+
+    /* the current part is a file and multipart_start was called */
+    bool_t in_file;
+    char name[256];
+    char filename[256];
+} multipart_parser_t;
+
+/**
+ * @brief Prepares a parser for one request body.
+ *
+ * @param buffer_size Size of the receive window, at least MULTIPART_BUFFER_SIZE_MIN
+ */
+error_t multipart_parser_init(multipart_parser_t *parser, const char *boundary, size_t buffer_size, multipart_cbr_t *cbr, void *ctx);
+void multipart_parser_free(multipart_parser_t *parser);
+
+/* free space at the end of the buffer to receive the next data into */
+uint8_t *multipart_parser_space(multipart_parser_t *parser, size_t *length);
+/* parses length bytes that were received into the space */
+error_t multipart_parser_commit(multipart_parser_t *parser, size_t length);
+/* copies data into the buffer and parses it */
+error_t multipart_parser_write(multipart_parser_t *parser, const void *data, size_t length);
+/* end of the request body, fails if it ended within a part */
+error_t multipart_parser_finish(multipart_parser_t *parser);
+bool_t multipart_parser_done(multipart_parser_t *parser);
+
+/**
+ * @brief Parses a file wrapped into a multipart body repeatedly and reports the throughput.
+ *
+ * @param source File to use as part data or MULTIPART_BENCH_SYNTHETIC
+ */
+error_t multipart_bench_run(const char *source, uint32_t count);
+
+/**
+ * @brief Parses random bodies with random boundaries, windows and fragmentation.
+ *
+ * Each body is checked against the parts it was built from, truncated
+ * bodies must fail or return a prefix of the parts.
+ */
+error_t multipart_fuzz_run(uint32_t count);
@@ -17,6 +17,17 @@ typedef enum
     MUTEX_RTNL_FILE,
     MUTEX_MQTT_TX_BUFFER,
     MUTEX_MQTT_BOX,
+    MUTEX_CONTENT_FLIGHT,
+    MUTEX_CONTENT_PREFETCH,
+    MUTEX_FFMPEG_DECODER,
+    MUTEX_CONTENT_INDEX,
+    MUTEX_SETTINGS_INDEX,
+    MUTEX_TONIES_UPDATE,
+    MUTEX_TONIES_CACHE,
+    MUTEX_UPLOAD_SESSION,
+    MUTEX_TRANSCODE_JOBS,
+    MUTEX_CONTENT_STORE,
+    MUTEX_HA_PUBLISHED,
     MUTEX_LAST
 } mutex_id_t;
 
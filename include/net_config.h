@@ -202,6 +202,7 @@ typedef struct
 #define HTTP_SERVER_TLS_SUPPORT ENABLED
 
 #define HTTP_SERVER_MULTIPART_TYPE_SUPPORT ENABLED
+#define HTTP_SERVER_GZIP_TYPE_SUPPORT ENABLED
 
 /* match original cloud settings */
 #define HTTP_SERVER_IDLE_TIMEOUT (5 * 60000)
@@ -4,4 +4,6 @@
 #include "os_port.h"
 
 FILE *osPopen(const char *command, const char *type);
-int osPclose(FILE *stream);
\ No newline at end of file
+int osPclose(FILE *stream);
+/* lowers the CPU priority of the calling task, niceness as in nice(1) */
+void osSetTaskNice(uint32_t niceness);
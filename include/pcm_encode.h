@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "os_port.h"
+#include "error.h"
+#include "completion.h"
+#include "toniefile.h"
+
+/* about six seconds of 48kHz stereo, the upload stalls when the encoder falls behind further */
+#define PCM_ENCODE_QUEUE_SIZE (1024 * 1024)
+/* samples are handed to the encoder in runs of at most this many bytes, so the queue drains steadily */
+#define PCM_ENCODE_BLOCK_SIZE (64 * 1024)
+#define PCM_ENCODE_FRAME_SIZE 4
+#define PCM_ENCODE_PROGRESS_INTERVAL 1000
+
+/**
+ * Encodes 16 bit stereo PCM to a TAF on a worker task.
+ *
+ * The writer copies PCM into a bounded byte queue and only blocks while
+ * the queue is full, so receiving the next data overlaps with encoding.
+ * Progress is sent as "PcmEncodeProgress" SSE events.
+ */
+typedef struct
+{
+    char *file_path;
+    toniefile_t *taf;
+
+    uint8_t *queue;
+    /* bytes written and encoded since the start, their difference is the fill level */
+    uint64_t head;
+    uint64_t tail;
+    /* queue offsets where the next chapter starts, frame aligned */
+    uint64_t chapters[TONIEFILE_MAX_CHAPTERS];
+    size_t chapter_count;
+
+    OsMutex mutex;
+    /* wakes the worker for new data, the writer for free space */
+    completion_t data;
+    completion_t space;
+    /* completed by the worker when it exits */
+    completion_t done;
+    volatile bool_t closing;
+    volatile bool_t aborting;
+    systime_t last_progress;
+} pcm_encode_t;
+
+/**
+ * @brief Creates the TAF and starts the encoder.
+ *
+ * @return NULL if the file can't be created or no task is available
+ */
+pcm_encode_t *pcm_encode_start(const char *file_path, uint32_t audio_id);
+
+/* queues PCM, blocks while the queue is full, fails once the encoder failed */
+error_t pcm_encode_write(pcm_encode_t *encoder, const void *data, size_t length);
+
+/* starts a new chapter behind the data queued so far */
+error_t pcm_encode_chapter(pcm_encode_t *encoder);
+
+/* encodes what is queued, closes the TAF and frees the encoder */
+error_t pcm_encode_finish(pcm_encode_t *encoder);
+
+/* stops the encoder, deletes the partial TAF and frees the encoder */
+void pcm_encode_abort(pcm_encode_t *encoder);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+
+#define RTNL_BENCH_SYNTHETIC "synthetic"
+#define RTNL_BENCH_DEFAULT_BOXES 1
+#define RTNL_BENCH_DEFAULT_COUNT 1000
+#define RTNL_BENCH_DELAYED_MS 1000
+#define RTNL_BENCH_GRACE_MS 3000
+
+typedef struct
+{
+    const char *hostname;
+    uint16_t port;
+    /* raw RTNL log (rtnl.logRawFile) to replay or RTNL_BENCH_SYNTHETIC */
+    const char *source;
+    uint32_t boxes;
+    /* packets per box, for replays the file is repeated until reached */
+    uint32_t count;
+    /* packets per second and box, 0 sends as fast as possible */
+    uint32_t rate;
+} rtnl_bench_options_t;
+
+/**
+ * @brief Replays or synthesizes RTNL traffic against a running teddyCloud instance.
+ *
+ * Every simulated box uses its own connection to the binary RTNL handler. The
+ * log2 uptime/sequence fields get rewritten to box/packet numbers, so the
+ * "rtnl-raw-log2" events read back from /api/sse can be matched to the sent
+ * packets. Server side drops are taken from /api/stats.
+ */
+error_t rtnl_bench_run(const rtnl_bench_options_t *options);
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "settings.h"
+#include "proto/toniebox.pb.rtnl.pb-c.h"
+
+#define RTNL_LOG_SEGMENT_MAGIC "TCRTNLSG"
+#define RTNL_LOG_INDEX_MAGIC "TCRTNLIX"
+#define RTNL_LOG_KEYS_MAGIC "TCRTNLKY"
+#define RTNL_LOG_VERSION 1
+#define RTNL_LOG_KEYS_VERSION 2
+#define RTNL_LOG_BOX_LEN 32
+
+#define RTNL_LOG_FLAG_LOG2 0x01
+#define RTNL_LOG_FLAG_LOG3 0x02
+
+#define RTNL_LOG_QUERY_LIMIT_DEFAULT 100
+#define RTNL_LOG_QUERY_LIMIT_MAX 1000
+
+/* header at the start of each segment (.seg) and index (.idx) file */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t segment;
+    uint64_t created;
+} rtnl_log_header_t;
+
+/* fixed size index record, one per RTNL packet stored in the segment */
+typedef struct
+{
+    uint64_t timestamp;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t flags;
+    uint32_t function_group;
+    uint32_t function;
+    uint32_t log3_type;
+    char box[RTNL_LOG_BOX_LEN];
+} rtnl_log_index_t;
+
+#define RTNL_LOG_KEY_BOX 1
+#define RTNL_LOG_KEY_LOG2 2
+#define RTNL_LOG_KEY_LOG3 3
+
+/**
+ * secondary key of a sealed segment (.keys), one per distinct box, log2 function and log3 type.
+ * Its count index positions are stored in ascending order at offset in the position table.
+ */
+typedef struct
+{
+    uint32_t kind;
+    uint32_t function_group;
+    uint32_t function;
+    uint32_t log3_type;
+    char box[RTNL_LOG_BOX_LEN];
+    uint32_t count;
+    uint32_t offset;
+} rtnl_log_key_t;
+
+/* start of a .keys file, followed by keyCount keys and positionCount uint32_t index positions */
+typedef struct
+{
+    rtnl_log_header_t header;
+    uint32_t keyCount;
+    uint32_t positionCount;
+} rtnl_log_keys_header_t;
+
+typedef struct
+{
+    uint64_t from;
+    uint64_t to;
+    const char *box;
+    int64_t function_group;
+    int64_t function;
+    int64_t log3_type;
+    uint32_t cursor_segment;
+    uint32_t cursor_entry;
+    size_t limit;
+} rtnl_log_query_t;
+
+typedef void (*rtnl_log_query_cbr)(void *ctx, const rtnl_log_index_t *entry, const uint8_t *record, size_t length);
+
+/**
+ * @brief Initializes a query with no filters and the default page size.
+ */
+void rtnl_log_query_init(rtnl_log_query_t *query);
+
+/**
+ * @brief Appends one length-prefixed RTNL packet to the current segment and its index.
+ *
+ * @param settings Settings of the box that sent the packet
+ * @param record Raw packet including the 4 byte length header
+ * @param length Length of the raw packet
+ * @param rpc Decoded packet, used for the index fields
+ */
+error_t rtnl_log_append(settings_t *settings, const uint8_t *record, size_t length, const TonieRtnlRPC *rpc);
+
+/**
+ * @brief Runs a filtered query over all segments using the sidecar indexes.
+ *
+ * Time ranges are found by binary search in the index. With a box or event
+ * type filter, only the index positions stored for the most selective of the
+ * wanted keys are read in sealed segments, which are skipped if they have none.
+ *
+ * Matching events are passed to cbr in chronological order. After returning,
+ * the cursor fields of query point to the next page and more is set if the
+ * limit was reached before the end of the log.
+ */
+error_t rtnl_log_query(rtnl_log_query_t *query, rtnl_log_query_cbr cbr, void *ctx, bool_t *more);
@@ -6,13 +6,7 @@
 
 #include "core/net.h"
 #include "http/http_server.h"
-
-typedef struct
-{
-    error_t (*multipart_start)(void *ctx, const char *name, const char *filename);
-    error_t (*multipart_add)(void *ctx, void *data, size_t length);
-    error_t (*multipart_end)(void *ctx);
-} multipart_cbr_t;
+#include "multipart.h"
 
 error_t multipart_handle(HttpConnection *connection, multipart_cbr_t *cbr, void *multipart_ctx);
 
@@ -23,6 +17,8 @@ char_t *ipv6AddrToString(const Ipv6Addr *ipAddr, char_t *str);
 char_t *ipv4AddrToString(Ipv4Addr ipAddr, char_t *str);
 void time_format(time_t time, char_t *buffer);
 void time_format_current(char_t *buffer);
+/* writes len bytes as uppercase hex plus terminator, output must hold len * 2 + 1 chars */
+char_t *hexEncode(char_t *output, const uint8_t *data, size_t len);
 char *custom_asprintf(const char *fmt, ...);
 
 error_t httpServerUriNotFoundCallback(HttpConnection *connection, const char_t *uri);
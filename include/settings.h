@@ -20,6 +20,7 @@
 #define TONIES_JSON_FILE "tonies.json"
 #define TONIESV2_JSON_FILE "toniesV2.json"
 #define TONIES_JSON_TMP_FILE TONIES_JSON_FILE ".tmp"
+#define TONIES_JSON_META_FILE TONIES_JSON_FILE ".meta"
 #define TONIES_CUSTOM_JSON_FILE "tonies.custom.json"
 #define TONIESV2_CUSTOM_JSON_FILE "tonies.custom.json"
 #define CONFIG_FILE "config.ini"
@@ -73,15 +74,25 @@ typedef struct
     bool prioCustomContent;
     bool updateOnLowerAudioId;
     bool dumpRuidAuthContentJson;
+    bool prefetch;
+    uint32_t prefetchWorkers;
+    uint32_t prefetchBandwidth;
 } settings_cloud_t;
 
 typedef struct
 {
     uint32_t bitrate;
     uint32_t ffmpeg_stream_buffer_ms;
+    uint32_t ffmpeg_stream_ring_pages;
+    bool ffmpeg_stream_spill;
+    uint32_t ffmpeg_decoders_max;
     bool ffmpeg_stream_restart;
     bool ffmpeg_sweep_startup_buffer;
     uint32_t ffmpeg_sweep_delay_ms;
+    bool tap_chapter_cache;
+    uint32_t tap_chapter_cache_days;
+    uint32_t job_workers;
+    uint32_t job_nice;
 
 } settings_encode_t;
 
@@ -95,6 +106,8 @@ typedef struct
     char *identification;
     char *topic;
     uint32_t qosLevel;
+    uint32_t txBatchSize;
+    uint32_t txOverflowPolicy;
 } settings_mqtt_t;
 
 typedef struct
@@ -241,6 +254,10 @@ typedef struct
     settings_cert_opt_t client_cert;
     char *allowOrigin;
     bool webHttpOnly;
+    uint32_t gzip_min_size;
+    bool gzip_precompress;
+    uint32_t multipart_buffer_size;
+    bool content_store;
 
     bool flex_enabled;
     char *flex_uid;
@@ -273,6 +290,9 @@ typedef struct
     char *logRawFile;
     bool logHuman;
     char *logHumanFile;
+    bool logIndexed;
+    char *logIndexDir;
+    uint32_t logIndexSegmentSize;
 } settings_rtnl_t;
 
 typedef struct
@@ -412,6 +432,8 @@ void settings_resolve_dir(char **resolvedPath, char *path, char *basePath);
 void settings_generate_internal_dirs(settings_t *settings);
 void settings_changed();
 void settings_changed_id(uint8_t settingsId);
+/* changes whenever a value of any overlay is set, reset or loaded */
+uint32_t settings_get_version();
 void settings_loop();
 
 void settings_init_opt(setting_item_t *opt);
@@ -480,6 +502,7 @@ uint16_t settings_get_size();
  */
 setting_item_t *settings_get(int index);
 setting_item_t *settings_get_ovl(int index, const char *overlay_name);
+setting_item_t *settings_get_id(int index, uint8_t settingsId);
 setting_item_t *settings_get_by_name_id(const char *item, uint8_t settingsId);
 
 /**
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "os_port.h"
+#include "error.h"
+#include "completion.h"
+
+#define STREAM_RING_PAGE_SIZE 4096
+
+/**
+ * In-memory ring of the TAF an encoder is currently producing.
+ *
+ * The encoder publishes the header page and the audio bytes, addressed by
+ * their offset in the TAF file. The ring keeps the header page and the most
+ * recent audio, older audio is read back from the spill file on disk, if
+ * there is one. Without a spill file the writer blocks instead of
+ * overwriting audio the reader did not send yet. Readers are woken through
+ * the completion of the stream.
+ */
+typedef struct
+{
+    OsMutex lock;
+    /* signalled to a blocked writer when the reader moved on or left */
+    completion_t space;
+    /* the writer must not overwrite audio behind read_pos */
+    bool_t blocking;
+    bool_t reader_gone;
+    /* TAF offset behind the audio the reader copied out */
+    size_t read_pos;
+    uint8_t *data;
+    size_t capacity;
+    uint8_t header[STREAM_RING_PAGE_SIZE];
+    bool_t header_valid;
+    /* TAF offset of the first audio byte written through the ring */
+    size_t start;
+    /* TAF offset behind the last audio byte written */
+    size_t end;
+    bool_t closed;
+} stream_ring_t;
+
+/* blocking is set when there is no spill file to read overwritten audio back from */
+error_t stream_ring_init(stream_ring_t *ring, size_t pages, bool_t blocking);
+void stream_ring_deinit(stream_ring_t *ring);
+
+/* writer side, all functions accept NULL */
+void stream_ring_reset(stream_ring_t *ring, size_t start);
+void stream_ring_set_header(stream_ring_t *ring, const uint8_t *page);
+void stream_ring_write(stream_ring_t *ring, const uint8_t *data, size_t length);
+void stream_ring_close(stream_ring_t *ring);
+
+/* TAF offset behind the last audio byte written */
+size_t stream_ring_end(stream_ring_t *ring);
+
+/* the reader stops reading, a blocked writer continues and overwrites from now on */
+void stream_ring_leave(stream_ring_t *ring);
+
+/**
+ * @brief Copies data at a TAF offset out of the ring.
+ *
+ * @return NO_ERROR if data was copied, ERROR_WOULD_BLOCK if it was not written yet,
+ *         ERROR_END_OF_STREAM if the ring was closed before it,
+ *         ERROR_NOT_FOUND if it is no longer (or never was) in the ring
+ */
+error_t stream_ring_read(stream_ring_t *ring, size_t offset, uint8_t *buffer, size_t length, size_t *read);
+
+/**
+ * @brief Waits until the header page and at least audio_bytes of audio are available.
+ *
+ * Returns early when the ring gets closed or the stream ends.
+ */
+error_t stream_ring_wait_ready(stream_ring_t *ring, size_t audio_bytes, completion_t *wake, systime_t timeout);
+
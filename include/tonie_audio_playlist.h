@@ -1,8 +1,11 @@
 #pragma once
 
 #include "debug.h"
+#include "completion.h"
 
 #define TAP_TYPE_TAP "tap"
+/* below the data dir, one TAF per encoded playlist source */
+#define TAP_CHAPTER_CACHE_DIR "tapcache"
 
 typedef struct
 {
@@ -16,6 +19,8 @@ typedef struct
     time_t audio_id;
     char *filepath;
     char *_filepath_resolved;
+    /* the TAP file itself, the target of its transcoding jobs */
+    char *_filepath_tap;
     char *name;
     tap_file_t *files;
     size_t filesCount;
@@ -33,5 +38,7 @@ bool_t is_valid_tap(char *filename);
 error_t tap_load(char *filename, tonie_audio_playlist_t *tap);
 error_t tap_save(char *filename, tonie_audio_playlist_t *tap);
 void tap_free(tonie_audio_playlist_t *tap);
-error_t tap_generate_taf(tonie_audio_playlist_t *tap, size_t *current_source, bool_t *active, bool_t force);
-void tap_generate_task(void *param);
\ No newline at end of file
+error_t tap_generate_taf(tonie_audio_playlist_t *tap, size_t *current_source, bool_t *active, bool_t force, completion_t *progress, volatile uint64_t *encoded);
+void tap_generate_task(void *param);
+/* deletes cached chapters unused for encode.tap_chapter_cache_days, run on startup and after each generation */
+void tap_chapter_cache_prune();
\ No newline at end of file
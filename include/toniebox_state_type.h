@@ -55,10 +55,24 @@ typedef struct
     bool custom;
 } toniebox_state_tag_t;
 
+/* title/picture of the last resolved audio id, reused until tag or tonies.json change */
+typedef struct
+{
+    bool valid;
+    uint64_t uid;
+    uint32_t audio_id;
+    uint32_t tonies_version;
+    uint32_t content_version;
+    bool known;
+    char *title;
+    char *picture;
+} toniebox_state_content_t;
+
 typedef struct
 {
     toniebox_state_box_t box;
     toniebox_state_tag_t tag;
+    toniebox_state_content_t content;
 } toniebox_state_t;
 
 typedef enum
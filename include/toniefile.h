@@ -2,6 +2,8 @@
 #pragma once
 #include <stdint.h>
 #include "fs_ext.h"
+#include "completion.h"
+#include "stream_ring.h"
 
 #define OPUS_FRAME_SIZE_MS OPUS_FRAMESIZE_60_MS
 #define OPUS_SAMPLING_RATE 48000
@@ -10,10 +12,14 @@
 #define OPUS_CHANNELS 2
 #define OPUS_PACKET_PAD 64
 #define OPUS_PACKET_MINSIZE 64
+#define OPUS_PRE_SKIP 0x138
 
 #define TONIEFILE_FRAME_SIZE 4096
 #define TONIEFILE_MAX_CHAPTERS 100
 #define TONIEFILE_PAD_END 64
+/* remuxed packets must leave room in the page for padding, which may need more segments */
+#define TONIEFILE_REMUX_PACKET_MAX (TONIEFILE_FRAME_SIZE - 2 * OGG_HEADER_LENGTH - 256)
+#define TONIEFILE_REMUX_LACING_MAX (255 - (TONIEFILE_FRAME_SIZE / 255 + 1))
 
 #define OGG_HEADER_LENGTH 27
 /*
@@ -40,10 +46,15 @@ typedef struct
     OsTaskId taskId;
     bool_t quit;
     bool_t stop_on_playback_stop;
+    /* signalled when the stream became active, completed when the task ends */
+    completion_t completion;
 
     void *ctx;
 } stream_ctx_t;
 
+/* how long a handler waits for a stream task to produce data */
+#define STREAM_START_TIMEOUT 30000
+
 typedef struct
 {
     char *source;
@@ -51,18 +62,39 @@ typedef struct
     char *targetFile;
     bool_t append;
     bool_t sweep;
+    /* optional, publishes the TAF for the sender, targetFile is only written when spill is set */
+    stream_ring_t *ring;
+    bool_t spill;
 } ffmpeg_stream_ctx_t;
 
 toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool append);
+/* fullPath may be NULL to only publish to the ring, progress is signalled for every written page */
+toniefile_t *toniefile_create_stream(const char *fullPath, uint32_t audio_id, bool append, stream_ring_t *ring, completion_t *progress);
 error_t toniefile_close(toniefile_t *ctx);
 error_t toniefile_encode(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available);
+/* copies an already encoded 60ms stereo opus packet into the TAF without re-encoding */
+error_t toniefile_remux(toniefile_t *ctx, const uint8_t *packet, size_t length);
 error_t toniefile_write_header(toniefile_t *ctx);
 error_t toniefile_new_chapter(toniefile_t *ctx);
+/* completes the last page with the buffered samples, padded with silence, so close does not drop them */
+error_t toniefile_flush(toniefile_t *ctx);
+/* audio packets written to ctx are remuxed into tee as well, NULL stops it */
+void toniefile_set_tee(toniefile_t *ctx, toniefile_t *tee);
+
+/* optional consumers of ffmpeg_stream, NULL members are not used */
+typedef struct
+{
+    /* signalled whenever encoding progressed */
+    completion_t *progress;
+    /* publishes the TAF for a sender while it is encoded */
+    stream_ring_t *ring;
+    /* counts the encoded samples per channel */
+    volatile uint64_t *encoded;
+    /* per source, a path there also gets the source as a TAF of its own, unless it is remuxed anyway */
+    char *const *chapter_cache;
+} ffmpeg_stream_opts_t;
 
-FILE *ffmpeg_decode_audio_start(const char *input_source);
-FILE *ffmpeg_decode_audio_start_skip(const char *input_source, size_t skip_seconds);
-error_t ffmpeg_decode_audio_end(FILE *ffmpeg_pipe, error_t error);
-error_t ffmpeg_decode_audio(FILE *ffmpeg_pipe, int16_t *buffer, size_t size, size_t *bytes_read);
-error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds, bool_t *active, bool_t *sweep, bool_t append);
+/* opts may be NULL, stopping via active returns ERROR_ABORTED */
+error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds, bool_t *active, bool_t *sweep, bool_t append, const ffmpeg_stream_opts_t *opts);
 error_t ffmpeg_convert(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds);
 void ffmpeg_stream_task(void *param);
\ No newline at end of file
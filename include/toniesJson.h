@@ -59,13 +59,24 @@ typedef struct
 } toniesV2Json_item_t;
 
 void tonies_init();
+/* downloads tonies.json unless the server reports it unchanged, then reloads the cache */
 error_t tonies_update();
+/* runs tonies_update in the background and reports progress as "ToniesJsonUpdate" SSE events */
+error_t tonies_update_start();
+/* runs the 200 and 304 paths of tonies_update against a stand-in server on scratch files in the config dir */
+error_t tonies_update_check();
 error_t toniesV2_update();
 void tonies_readJson(char *source, toniesJson_item_t **toniesCache, size_t *toniesCount);
+/* items returned by the lookups stay valid until tonies_read_end, a reload frees the old cache after the last reader */
+void tonies_read_begin();
+void tonies_read_end();
 void toniesV2_readJson(char *source, toniesV2Json_item_t **toniesCache, size_t *toniesCount);
 toniesJson_item_t *tonies_byAudioId(uint32_t audio_id);
 toniesJson_item_t *tonies_byAudioIdHash(uint32_t audio_id, uint8_t *hash);
 toniesJson_item_t *tonies_byModel(char *model);
 toniesJson_item_t *tonies_byAudioIdHashModel(uint32_t audio_id, uint8_t *hash, char *model);
 bool tonies_byModelSeriesEpisode(char *model, char *series, char *episode, toniesJson_item_t *result[18], size_t *result_size);
-void tonies_deinit();
\ No newline at end of file
+void tonies_deinit_base(toniesJson_item_t *toniesCache, size_t *toniesCount);
+void tonies_deinit();
+/* changes whenever the cache is reloaded, items looked up before are no longer valid */
+uint32_t tonies_version();
\ No newline at end of file
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "os_port.h"
+#include "error.h"
+
+/* finished jobs are kept for the API until their slot is needed */
+#define TRANSCODE_JOB_MAX 64
+#define TRANSCODE_JOB_WORKERS_MAX 8
+/* ffmpeg_stream takes at most 99 sources, one per chapter */
+#define TRANSCODE_JOB_SOURCES_MAX 99
+#define TRANSCODE_JOB_PROGRESS_INTERVAL 1000
+#define TRANSCODE_JOB_FILE "transcode_jobs.json"
+/* request body of /api/jobs/add, room for all sources with long paths */
+#define TRANSCODE_JOB_BODY_SIZE (64 * 1024)
+/* PCM jobs read their source in blocks of this size */
+#define TRANSCODE_JOB_PCM_BUFFER_SIZE (16 * 1024)
+/* how often transcode_job_claim checks for a free worker slot */
+#define TRANSCODE_JOB_CLAIM_POLL 100
+
+typedef enum
+{
+    TRANSCODE_JOB_ENCODE,
+    TRANSCODE_JOB_TAP,
+    /* raw 48kHz stereo PCM of a committed upload, the source is deleted when the job ends */
+    TRANSCODE_JOB_PCM,
+    /* a committed upload moved to its target, possibly copied from another filesystem */
+    TRANSCODE_JOB_MOVE
+} transcode_job_type_t;
+
+typedef enum
+{
+    TRANSCODE_JOB_UNUSED,
+    TRANSCODE_JOB_QUEUED,
+    TRANSCODE_JOB_RUNNING,
+    TRANSCODE_JOB_DONE,
+    TRANSCODE_JOB_FAILED,
+    TRANSCODE_JOB_CANCELLED
+} transcode_job_state_t;
+
+typedef struct
+{
+    uint32_t id;
+    transcode_job_type_t type;
+    transcode_job_state_t state;
+    time_t created;
+
+    /* the TAF for encode jobs, the TAP for TAP jobs */
+    char *target;
+    char **sources;
+    size_t source_count;
+    uint32_t skip_seconds;
+    bool_t force;
+    /* PCM jobs only */
+    uint32_t audio_id;
+    /* run by the caller of transcode_job_claim instead of a worker, never stored */
+    bool_t claimed;
+
+    /* updated by the encoder while the job runs */
+    bool_t active;
+    volatile bool_t cancelled;
+    size_t current_source;
+    volatile uint64_t samples;
+    systime_t started;
+    systime_t elapsed;
+    error_t error;
+} transcode_job_t;
+
+/**
+ * Background TAF transcoding.
+ *
+ * Encode jobs convert a list of files or URLs into one TAF, TAP jobs
+ * (re)generate the TAF of a playlist, PCM and move jobs commit uploads. Up to
+ * encode.job_workers jobs run in parallel, including claimed ones, at the CPU
+ * niceness encode.job_nice, so streaming to a box keeps priority. Queued jobs are stored in the config dir and restarted after a
+ * restart. Progress is sent as "TranscodeJob" SSE events.
+ */
+void transcode_job_init();
+
+/**
+ * @brief Queues a job, or returns the identical job that is queued or running.
+ *
+ * @param target TAF to write for encode jobs, the TAP file for TAP jobs
+ * @param force TAP jobs only, regenerate even if the TAF is up to date
+ * @return ERROR_OUT_OF_RESOURCES if all slots are taken by unfinished jobs
+ */
+error_t transcode_job_add(transcode_job_type_t type, const char *target, const char **sources, size_t source_count, uint32_t skip_seconds, bool_t force, uint32_t *id);
+
+/**
+ * @brief Queues the encoding of an uploaded PCM staging file to target.
+ *
+ * The staging file belongs to the job from now on, it is deleted once the job
+ * is done, failed or cancelled.
+ */
+error_t transcode_job_add_pcm(const char *target, const char *staging, uint32_t audio_id, uint32_t *id);
+
+/**
+ * @brief Queues moving a committed upload from its staging file to target.
+ *
+ * Like transcode_job_add_pcm, the staging file belongs to the job from now on.
+ */
+error_t transcode_job_add_move(const char *target, const char *staging, uint32_t *id);
+
+/**
+ * @brief Runs a job for target on the calling task, e.g. a TAP a box streams while it is generated.
+ *
+ * The claimed job takes one of the encode.job_workers slots, waiting up to
+ * timeout for one to become free. Workers do not start queued jobs while the
+ * slots are taken, so a waiting claim gets the next free slot. A queued job of
+ * the same type for target is taken over, any other pending job for target
+ * makes the claim fail, so only one encoder writes the TAF.
+ *
+ * @return ERROR_ALREADY_RUNNING if another job for target is pending,
+ *         ERROR_TIMEOUT if no slot became free in time
+ */
+error_t transcode_job_claim(transcode_job_type_t type, const char *target, systime_t timeout, uint32_t *id);
+
+/* ends a claimed job and frees its slot */
+void transcode_job_release(uint32_t id, error_t error);
+
+/* true if a queued or running job still reads path, e.g. a staging file that survived a restart */
+bool_t transcode_job_uses(const char *path);
+
+/* cancels a queued or running job, the partial TAF is deleted */
+error_t transcode_job_cancel(uint32_t id);
+
+/* one job as JSON, all jobs if id is 0, NULL if there is no such job */
+char *transcode_job_json(uint32_t id);
+
+/* queues, deduplicates and cancels jobs without workers and without touching the stored jobs */
+error_t transcode_job_check();
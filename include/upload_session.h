@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "os_port.h"
+#include "error.h"
+
+#define UPLOAD_SESSION_MAX 8
+#define UPLOAD_SESSION_ID_LEN 16
+/* sessions without any request for this many seconds are dropped with their staging file */
+#define UPLOAD_SESSION_TIMEOUT (24 * 60 * 60)
+#define UPLOAD_SESSION_CHUNK_SIZE (4 * 1024 * 1024)
+#define UPLOAD_SESSION_CHUNK_MAX (16 * 1024 * 1024)
+/* chunk bodies are received and written in blocks of this size */
+#define UPLOAD_SESSION_BUFFER_SIZE (16 * 1024)
+/* staging files live in this directory below the data dir, not in the library */
+#define UPLOAD_SESSION_DIR "upload"
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+} upload_range_t;
+
+/**
+ * Resumable upload of a single file.
+ *
+ * Chunks are written at their offset into a staging file in the private
+ * upload dir, in any order and from any number of connections. The ranges
+ * received are tracked, so a client can ask for what is missing after a
+ * reconnect. Sessions only live in memory, staging files left over from
+ * before a restart are deleted by upload_session_init.
+ */
+typedef struct
+{
+    bool_t used;
+    char id[UPLOAD_SESSION_ID_LEN + 1];
+    char *target;
+    char *staging;
+    uint64_t size;
+
+    /* PCM uploads are encoded to a TAF on commit */
+    bool_t pcm;
+    uint32_t audio_id;
+
+    /* received ranges, sorted and merged */
+    upload_range_t *ranges;
+    size_t n_ranges;
+    size_t ranges_alloc;
+
+    /* chunks being written, the session can't be committed meanwhile */
+    size_t writers;
+    time_t last_active;
+} upload_session_t;
+
+/* creates the upload dir and deletes staging files no transcoding job reads anymore */
+void upload_session_init();
+
+/**
+ * @brief Creates a session and an empty staging file for target.
+ *
+ * @param id Receives the id of the session, UPLOAD_SESSION_ID_LEN + 1 bytes
+ */
+error_t upload_session_create(const char *target, uint64_t size, bool_t pcm, uint32_t audio_id, char *id);
+
+/**
+ * @brief Reserves the range of a chunk for writing.
+ *
+ * @param staging Receives a copy of the staging path, to be freed by the caller
+ */
+error_t upload_session_chunk_begin(const char *id, uint64_t offset, uint64_t length, char **staging);
+/* releases the chunk and records its range as received if it was written completely, otherwise as missing */
+void upload_session_chunk_end(const char *id, uint64_t offset, uint64_t length, bool_t received);
+
+/* state and missing ranges as JSON, NULL if the session does not exist */
+char *upload_session_status(const char *id);
+
+/**
+ * @brief Removes a complete session from the table for committing.
+ *
+ * @param session Receives the session, to be freed with upload_session_free after the staging file was handled
+ */
+error_t upload_session_take(const char *id, upload_session_t *session);
+error_t upload_session_abort(const char *id);
+void upload_session_free(upload_session_t *session);
+
+/* runs chunks out of order, failed retries and a commit through a session in the config dir, no data is written */
+error_t upload_session_check();
@@ -247,6 +247,11 @@ error_t web_request(const char *server, int port, bool https, const char *uri, c
             snprintf(host_line, sizeof(host_line), "%s:%d", server, port);
             httpClientAddHeaderField(&httpClientContext, "Host", host_line);
 
+            if (cbr && cbr->request)
+            {
+                cbr->request(cbr->ctx, &httpClientContext);
+            }
+
             if (hash)
             {
                 char tmp[3];
@@ -0,0 +1,132 @@
+#include "completion.h"
+
+error_t completion_init(completion_t *completion)
+{
+    osMemset(completion, 0x00, sizeof(completion_t));
+
+    if (!osCreateEvent(&completion->event))
+    {
+        return ERROR_OUT_OF_RESOURCES;
+    }
+    completion->initialized = TRUE;
+
+    return NO_ERROR;
+}
+
+void completion_deinit(completion_t *completion)
+{
+    if (completion->initialized)
+    {
+        osDeleteEvent(&completion->event);
+        completion->initialized = FALSE;
+    }
+}
+
+void completion_reset(completion_t *completion)
+{
+    completion->done = FALSE;
+    completion->cancelled = FALSE;
+    completion->error = NO_ERROR;
+    if (completion->initialized)
+    {
+        osResetEvent(&completion->event);
+    }
+}
+
+void completion_signal(completion_t *completion)
+{
+    if (completion->initialized)
+    {
+        osSetEvent(&completion->event);
+    }
+}
+
+void completion_complete(completion_t *completion, error_t error)
+{
+    completion->error = error;
+    completion->done = TRUE;
+    completion_signal(completion);
+}
+
+void completion_cancel(completion_t *completion)
+{
+    completion->cancelled = TRUE;
+    completion_signal(completion);
+}
+
+bool_t completion_is_done(completion_t *completion)
+{
+    return completion->done;
+}
+
+static error_t completion_wait_internal(completion_t *completion, systime_t timeout, bool_t cancellable)
+{
+    if (cancellable && completion->cancelled)
+    {
+        return ERROR_ABORTED;
+    }
+    if (completion->done)
+    {
+        return NO_ERROR;
+    }
+    if (!completion->initialized)
+    {
+        /* no event available, degrade to a short sleep */
+        osDelayTask(timeout < 10 ? timeout : 10);
+        return NO_ERROR;
+    }
+
+    bool_t signalled = osWaitForEvent(&completion->event, timeout);
+
+    if (cancellable && completion->cancelled)
+    {
+        return ERROR_ABORTED;
+    }
+    if (!signalled && !completion->done)
+    {
+        return ERROR_TIMEOUT;
+    }
+    return NO_ERROR;
+}
+
+static error_t completion_wait_done_internal(completion_t *completion, systime_t timeout, bool_t cancellable)
+{
+    systime_t start = osGetSystemTime();
+
+    while (!completion->done)
+    {
+        systime_t remaining = INFINITE_DELAY;
+        if (timeout != INFINITE_DELAY)
+        {
+            systime_t elapsed = osGetSystemTime() - start;
+            if (elapsed >= timeout)
+            {
+                return ERROR_TIMEOUT;
+            }
+            remaining = timeout - elapsed;
+        }
+
+        error_t error = completion_wait_internal(completion, remaining, cancellable);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+    }
+
+    return completion->error;
+}
+
+error_t completion_wait(completion_t *completion, systime_t timeout)
+{
+    return completion_wait_internal(completion, timeout, TRUE);
+}
+
+error_t completion_wait_done(completion_t *completion, systime_t timeout)
+{
+    return completion_wait_done_internal(completion, timeout, TRUE);
+}
+
+error_t completion_join(completion_t *completion, systime_t timeout)
+{
+    return completion_wait_done_internal(completion, timeout, FALSE);
+}
@@ -8,6 +8,9 @@
 #include "toniesJson.h"
 #include "handler.h"
 #include "json_helper.h"
+#include "content_index.h"
+
+static uint32_t contentJsonVersion = 0;
 
 error_t load_content_json(const char *content_path, contentJson_t *content_json, bool create_if_missing)
 {
@@ -207,6 +210,8 @@ error_t save_content_json(const char *content_path, contentJson_t *content_json)
     {
         content_json->_updated = false;
         content_json->_version = CONTENT_JSON_VERSION;
+        contentJsonVersion++;
+        content_index_invalidate(content_path);
     }
 
     cJSON_Delete(contentJson);
@@ -216,10 +221,16 @@ error_t save_content_json(const char *content_path, contentJson_t *content_json)
     return error;
 }
 
+uint32_t content_json_version()
+{
+    return contentJsonVersion;
+}
+
 void content_json_update_model(contentJson_t *content_json, uint32_t audio_id, uint8_t *hash)
 {
     if (content_json->_valid)
     {
+        tonies_read_begin();
         toniesJson_item_t *toniesJson = tonies_byAudioIdHash(audio_id, hash);
         if (toniesJson != NULL && osStrcmp(content_json->tonie_model, toniesJson->model) != 0)
         {
@@ -238,6 +249,7 @@ void content_json_update_model(contentJson_t *content_json, uint32_t audio_id, u
             // TODO add to tonies.custom.json + report
             TRACE_DEBUG("Audio-id %08X unknown but previous content known by model %s.\r\n", audio_id, content_json->tonie_model);
         }
+        tonies_read_end();
     }
 }
 
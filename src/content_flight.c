@@ -0,0 +1,569 @@
+#include <string.h>
+
+#include "os_port.h"
+#include "debug.h"
+#include "fs_port.h"
+#include "mutex_manager.h"
+#include "server_helpers.h"
+#include "handler.h"
+#include "content_flight.h"
+
+struct content_flight_s
+{
+    bool_t used;
+    char *key;
+    char *tmpPath;
+    uint32_t refs;
+    bool_t file_ready;
+    bool_t sealed;
+    bool_t done;
+    error_t error;
+    bool_t length_known;
+    size_t length;
+    size_t written;
+    /* upstream HTTP version and header lines, complete once the file is ready */
+    uint16_t version;
+    char *headers;
+    /* set once the .tmp file was renamed to the content path or the leader gave up */
+    bool_t finished;
+    bool_t cached;
+    /* followers that joined but did not open the cache file yet */
+    uint32_t pending_open;
+    /* followers that joined after the seal and did not open the renamed file yet */
+    uint32_t pending_cached;
+    /* followers reading the .tmp file */
+    uint32_t tmp_readers;
+    completion_t *followers[CONTENT_FLIGHT_FOLLOWERS];
+    bool_t follower_late[CONTENT_FLIGHT_FOLLOWERS];
+    bool_t follower_pending[CONTENT_FLIGHT_FOLLOWERS];
+    /* signalled to the leader whenever a follower opened or closed a file */
+    completion_t opened;
+};
+
+static content_flight_t content_flights[CONTENT_FLIGHT_MAX];
+
+/* caller holds MUTEX_CONTENT_FLIGHT */
+static int content_flight_follower(content_flight_t *flight, completion_t *wake)
+{
+    for (int pos = 0; pos < CONTENT_FLIGHT_FOLLOWERS; pos++)
+    {
+        if (flight->followers[pos] == wake)
+        {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+/* caller holds MUTEX_CONTENT_FLIGHT */
+static void content_flight_unpend(content_flight_t *flight, int pos)
+{
+    if (pos < 0 || !flight->follower_pending[pos])
+    {
+        return;
+    }
+    flight->follower_pending[pos] = FALSE;
+    if (flight->follower_late[pos])
+    {
+        flight->pending_cached--;
+    }
+    else
+    {
+        flight->pending_open--;
+    }
+    completion_signal(&flight->opened);
+}
+
+/* caller holds MUTEX_CONTENT_FLIGHT */
+static void content_flight_wake(content_flight_t *flight)
+{
+    for (size_t pos = 0; pos < CONTENT_FLIGHT_FOLLOWERS; pos++)
+    {
+        if (flight->followers[pos])
+        {
+            completion_signal(flight->followers[pos]);
+        }
+    }
+}
+
+content_flight_t *content_flight_join(const char *contentPath, completion_t *wake, bool_t *leader)
+{
+    content_flight_t *flight = NULL;
+    content_flight_t *free_slot = NULL;
+
+    *leader = TRUE;
+
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    for (size_t pos = 0; pos < CONTENT_FLIGHT_MAX; pos++)
+    {
+        content_flight_t *entry = &content_flights[pos];
+        if (!entry->used)
+        {
+            if (!free_slot)
+            {
+                free_slot = entry;
+            }
+            continue;
+        }
+        /* a sealed download is renamed soon, joining it waits for the cache instead of downloading into the same .tmp */
+        if ((entry->sealed || !entry->done) && !osStrcmp(entry->key, contentPath))
+        {
+            for (size_t follower = 0; follower < CONTENT_FLIGHT_FOLLOWERS; follower++)
+            {
+                if (!entry->followers[follower])
+                {
+                    entry->followers[follower] = wake;
+                    entry->follower_late[follower] = entry->sealed;
+                    entry->follower_pending[follower] = TRUE;
+                    entry->refs++;
+                    if (entry->sealed)
+                    {
+                        entry->pending_cached++;
+                    }
+                    else
+                    {
+                        entry->pending_open++;
+                    }
+                    flight = entry;
+                    *leader = FALSE;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+
+    if (*leader && free_slot && completion_init(&free_slot->opened) == NO_ERROR)
+    {
+        flight = free_slot;
+        flight->used = TRUE;
+        flight->key = strdup(contentPath);
+        flight->tmpPath = custom_asprintf("%s.tmp", contentPath);
+        flight->refs = 1;
+    }
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+    return flight;
+}
+
+void content_flight_release(content_flight_t *flight, completion_t *wake)
+{
+    if (!flight)
+    {
+        return;
+    }
+
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    if (wake)
+    {
+        int pos = content_flight_follower(flight, wake);
+        if (pos >= 0)
+        {
+            /* followers that never opened a file must not hold up the leader */
+            content_flight_unpend(flight, pos);
+            flight->followers[pos] = NULL;
+        }
+    }
+    else
+    {
+        if (!flight->done)
+        {
+            /* leader gave up without completing */
+            flight->done = TRUE;
+            flight->error = ERROR_ABORTED;
+        }
+        flight->finished = TRUE;
+        content_flight_wake(flight);
+    }
+
+    if (--flight->refs == 0)
+    {
+        osFreeMem(flight->key);
+        osFreeMem(flight->tmpPath);
+        osFreeMem(flight->headers);
+        completion_deinit(&flight->opened);
+        osMemset(flight, 0x00, sizeof(content_flight_t));
+    }
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+}
+
+void content_flight_set_length(content_flight_t *flight, size_t length)
+{
+    if (!flight)
+    {
+        return;
+    }
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    flight->length = length;
+    flight->length_known = TRUE;
+    content_flight_wake(flight);
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+}
+
+void content_flight_add_header(content_flight_t *flight, uint16_t version, const char *header, const char *value)
+{
+    if (!flight || !header || !osStrcmp(header, "Access-Control-Allow-Origin"))
+    {
+        return;
+    }
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    char *headers = custom_asprintf("%s%s: %s\r\n", flight->headers ? flight->headers : "", header, value);
+    osFreeMem(flight->headers);
+    flight->headers = headers;
+    flight->version = version;
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+}
+
+void content_flight_file_ready(content_flight_t *flight)
+{
+    if (!flight)
+    {
+        return;
+    }
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    flight->file_ready = TRUE;
+    content_flight_wake(flight);
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+}
+
+void content_flight_progress(content_flight_t *flight, size_t length)
+{
+    if (!flight)
+    {
+        return;
+    }
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    flight->written += length;
+    content_flight_wake(flight);
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+}
+
+void content_flight_seal(content_flight_t *flight)
+{
+    if (!flight)
+    {
+        return;
+    }
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    flight->sealed = TRUE;
+    content_flight_wake(flight);
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+    systime_t start = osGetSystemTime();
+    while (osGetSystemTime() - start < CONTENT_FLIGHT_OPEN_TIMEOUT)
+    {
+        mutex_lock(MUTEX_CONTENT_FLIGHT);
+        uint32_t pending = flight->pending_open;
+        mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+        if (pending == 0)
+        {
+            return;
+        }
+        completion_wait(&flight->opened, CONTENT_FLIGHT_OPEN_TIMEOUT - (osGetSystemTime() - start));
+    }
+    TRACE_WARNING("Followers of %s did not open the cache file in time\r\n", flight->key);
+}
+
+void content_flight_complete(content_flight_t *flight, error_t error)
+{
+    if (!flight)
+    {
+        return;
+    }
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    if (!flight->done)
+    {
+        flight->done = TRUE;
+        flight->error = error;
+    }
+    content_flight_wake(flight);
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+}
+
+error_t content_flight_finish(content_flight_t *flight, const char *tmpPath, const char *contentPath)
+{
+    fsDeleteFile(contentPath);
+    error_t error = fsRenameFile(tmpPath, contentPath);
+
+    /* Windows can't rename a file followers still have open, retry once they closed it */
+    systime_t start = osGetSystemTime();
+    while (flight && error != NO_ERROR && osGetSystemTime() - start < CONTENT_FLIGHT_TIMEOUT)
+    {
+        mutex_lock(MUTEX_CONTENT_FLIGHT);
+        uint32_t readers = flight->tmp_readers;
+        mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+        if (readers == 0)
+        {
+            error = fsRenameFile(tmpPath, contentPath);
+            break;
+        }
+        completion_wait(&flight->opened, CONTENT_FLIGHT_TIMEOUT - (osGetSystemTime() - start));
+        error = fsRenameFile(tmpPath, contentPath);
+    }
+
+    if (!flight)
+    {
+        return error;
+    }
+
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    flight->finished = TRUE;
+    flight->cached = (error == NO_ERROR);
+    content_flight_wake(flight);
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+    /* keep the file in place until followers that joined after the seal opened it */
+    start = osGetSystemTime();
+    while (osGetSystemTime() - start < CONTENT_FLIGHT_OPEN_TIMEOUT)
+    {
+        mutex_lock(MUTEX_CONTENT_FLIGHT);
+        uint32_t pending = flight->pending_cached;
+        mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+        if (pending == 0)
+        {
+            break;
+        }
+        completion_wait(&flight->opened, CONTENT_FLIGHT_OPEN_TIMEOUT - (osGetSystemTime() - start));
+    }
+
+    return error;
+}
+
+/* called exactly once per follower, after opening a file or giving up */
+static void content_flight_opened(content_flight_t *flight, completion_t *wake, bool_t reading_tmp)
+{
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    content_flight_unpend(flight, content_flight_follower(flight, wake));
+    if (reading_tmp)
+    {
+        flight->tmp_readers++;
+    }
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+}
+
+static void content_flight_close_tmp(content_flight_t *flight, FsFile *file)
+{
+    fsCloseFile(file);
+
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    flight->tmp_readers--;
+    completion_signal(&flight->opened);
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+}
+
+/* sends the status line and headers the leader got from upstream */
+static error_t content_flight_send_header(content_flight_t *flight, HttpConnection *connection)
+{
+    char line[128];
+
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    uint16_t version = flight->version;
+    char *headers = flight->headers ? strdup(flight->headers) : NULL;
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+    if (headers == NULL)
+    {
+        return ERROR_ABORTED;
+    }
+
+    osSprintf(line, "HTTP/%u.%u 200 %s\r\n", MSB(version), LSB(version), httpStatusCodeText(200));
+    error_t error = httpSend(connection, line, osStrlen(line), HTTP_FLAG_DELAY);
+
+    char_t *allowOrigin = connection->serverContext->settings.allowOrigin;
+    if (error == NO_ERROR && allowOrigin != NULL && osStrlen(allowOrigin) > 0)
+    {
+        osSnprintf(line, sizeof(line), "Access-Control-Allow-Origin: %s\r\n", allowOrigin);
+        error = httpSend(connection, line, osStrlen(line), HTTP_FLAG_DELAY);
+    }
+    if (error == NO_ERROR)
+    {
+        error = httpSend(connection, headers, osStrlen(headers), HTTP_FLAG_DELAY);
+    }
+    if (error == NO_ERROR)
+    {
+        error = httpSend(connection, "\r\n", 2, HTTP_FLAG_DELAY);
+    }
+    osFreeMem(headers);
+
+    return error;
+}
+
+/* joined after the seal, the content is sent from the cache file once the leader renamed it */
+static error_t content_flight_follow_cached(content_flight_t *flight, completion_t *wake, HttpConnection *connection)
+{
+    FsFile *file = NULL;
+    uint32_t length = 0;
+    error_t error = NO_ERROR;
+
+    while (true)
+    {
+        mutex_lock(MUTEX_CONTENT_FLIGHT);
+        bool_t finished = flight->finished;
+        mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+        if (finished)
+        {
+            break;
+        }
+        if (completion_wait(wake, CONTENT_FLIGHT_TIMEOUT) != NO_ERROR)
+        {
+            error = ERROR_ABORTED;
+            break;
+        }
+    }
+
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    bool_t cached = flight->cached;
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+    if (error == NO_ERROR && cached && fsGetFileSize(flight->key, &length) == NO_ERROR)
+    {
+        file = fsOpenFile(flight->key, FS_FILE_MODE_READ);
+    }
+    content_flight_opened(flight, wake, FALSE);
+    if (!file)
+    {
+        return ERROR_ABORTED;
+    }
+
+    error = content_flight_send_header(flight, connection);
+
+    size_t sent = 0;
+    while (error == NO_ERROR && sent < length)
+    {
+        size_t read = 0;
+        error = fsReadFile(file, connection->buffer, MIN(length - sent, HTTP_SERVER_BUFFER_SIZE), &read);
+        if (error == NO_ERROR)
+        {
+            error = httpSend(connection, connection->buffer, read, HTTP_FLAG_DELAY);
+            sent += read;
+        }
+    }
+    fsCloseFile(file);
+
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Sending cached %s failed after %" PRIuSIZE " of %" PRIu32 " bytes, error=%s\r\n", flight->key, sent, length, error2text(error));
+    }
+
+    return error;
+}
+
+error_t content_flight_follow(content_flight_t *flight, completion_t *wake, HttpConnection *connection)
+{
+    FsFile *file = NULL;
+    size_t length = 0;
+    error_t error = NO_ERROR;
+
+    mutex_lock(MUTEX_CONTENT_FLIGHT);
+    int pos = content_flight_follower(flight, wake);
+    bool_t late = (pos >= 0 && flight->follower_late[pos]);
+    mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+    if (late)
+    {
+        return content_flight_follow_cached(flight, wake, connection);
+    }
+
+    /* wait for the cache file and the content length */
+    while (true)
+    {
+        mutex_lock(MUTEX_CONTENT_FLIGHT);
+        bool_t file_ready = flight->file_ready;
+        bool_t length_known = flight->length_known;
+        bool_t done = flight->done;
+        length = flight->length;
+        mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+        if (file_ready && !file)
+        {
+            file = fsOpenFile(flight->tmpPath, FS_FILE_MODE_READ);
+            content_flight_opened(flight, wake, file != NULL);
+            if (!file)
+            {
+                TRACE_ERROR("Could not open %s to follow the download\r\n", flight->tmpPath);
+                return ERROR_ABORTED;
+            }
+        }
+        if (file && length_known)
+        {
+            break;
+        }
+        if (done)
+        {
+            error = ERROR_ABORTED;
+            break;
+        }
+        if (completion_wait(wake, CONTENT_FLIGHT_TIMEOUT) != NO_ERROR)
+        {
+            error = ERROR_ABORTED;
+            break;
+        }
+    }
+
+    if (error != NO_ERROR)
+    {
+        if (file)
+        {
+            content_flight_close_tmp(flight, file);
+        }
+        else
+        {
+            content_flight_opened(flight, wake, FALSE);
+        }
+        return error;
+    }
+
+    error = content_flight_send_header(flight, connection);
+
+    size_t sent = 0;
+    while (error == NO_ERROR && sent < length)
+    {
+        size_t read = 0;
+        error = fsReadFile(file, connection->buffer, MIN(length - sent, HTTP_SERVER_BUFFER_SIZE), &read);
+        if (error == NO_ERROR && read > 0)
+        {
+            error = httpSend(connection, connection->buffer, read, HTTP_FLAG_DELAY);
+            sent += read;
+            continue;
+        }
+        if (error != NO_ERROR && error != ERROR_END_OF_FILE)
+        {
+            break;
+        }
+
+        /* caught up with the leader */
+        mutex_lock(MUTEX_CONTENT_FLIGHT);
+        bool_t done = flight->done;
+        error_t flight_error = flight->error;
+        size_t written = flight->written;
+        mutex_unlock(MUTEX_CONTENT_FLIGHT);
+
+        if (done && sent >= written)
+        {
+            error = (flight_error != NO_ERROR) ? flight_error : ERROR_UNEXPECTED_STATE;
+            break;
+        }
+        if (!done)
+        {
+            error = completion_wait(wake, CONTENT_FLIGHT_TIMEOUT);
+        }
+        else
+        {
+            error = NO_ERROR;
+        }
+        /* clears the EOF indicator of the stream */
+        fsSeekFile(file, sent, FS_SEEK_SET);
+    }
+    content_flight_close_tmp(flight, file);
+
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Following %s failed after %" PRIuSIZE " of %" PRIuSIZE " bytes, error=%s\r\n", flight->key, sent, length, error2text(error));
+    }
+
+    return error;
+}
@@ -0,0 +1,463 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "content_index.h"
+#include "contentJson.h"
+#include "handler.h"
+#include "fs_ext.h"
+#include "fs_port.h"
+#include "json_helper.h"
+#include "mutex_manager.h"
+#include "server_helpers.h"
+#include "os_port.h"
+#include "date_time.h"
+#include "debug.h"
+#include "cJSON.h"
+
+#define CONTENT_INDEX_TMP_FILE CONTENT_INDEX_FILE ".tmp"
+
+static content_index_entry_t *content_index_buckets[CONTENT_INDEX_BUCKETS];
+static size_t content_index_count = 0;
+/* lines in the log, compacted once mostly outdated */
+static size_t content_index_log_lines = 0;
+static char *content_index_path = NULL;
+static char *content_index_tmp_path = NULL;
+
+static size_t content_index_hash(const char *path)
+{
+    size_t hash = 5381;
+    while (*path)
+    {
+        hash = ((hash << 5) + hash) + (uint8_t)*path++;
+    }
+    return hash % CONTENT_INDEX_BUCKETS;
+}
+
+static char *content_index_strdup(const char *str)
+{
+    return strdup(str ? str : "");
+}
+
+static void content_index_stat(const char *path, int64_t *mtime, uint32_t *size)
+{
+    FsFileStat stat;
+
+    *mtime = -1;
+    *size = 0;
+    if (path != NULL && fsGetFileStat(path, &stat) == NO_ERROR)
+    {
+        *mtime = convertDateToUnixTime(&stat.modified);
+        *size = stat.size;
+    }
+}
+
+void content_index_free(content_index_entry_t *entry)
+{
+    if (entry == NULL)
+    {
+        return;
+    }
+    osFreeMem(entry->path);
+    osFreeMem(entry->content_path);
+    osFreeMem(entry->tracks);
+    osFreeMem(entry->source);
+    osFreeMem(entry->tonie_model);
+    osFreeMem(entry);
+}
+
+static content_index_entry_t *content_index_copy(const content_index_entry_t *entry)
+{
+    content_index_entry_t *copy = osAllocMem(sizeof(content_index_entry_t));
+
+    osMemcpy(copy, entry, sizeof(content_index_entry_t));
+    copy->path = content_index_strdup(entry->path);
+    copy->content_path = content_index_strdup(entry->content_path);
+    copy->source = content_index_strdup(entry->source);
+    copy->tonie_model = content_index_strdup(entry->tonie_model);
+    copy->tracks = NULL;
+    if (entry->n_tracks > 0)
+    {
+        copy->tracks = osAllocMem(entry->n_tracks * sizeof(uint32_t));
+        osMemcpy(copy->tracks, entry->tracks, entry->n_tracks * sizeof(uint32_t));
+    }
+    copy->next = NULL;
+
+    return copy;
+}
+
+static cJSON *content_index_to_json(const content_index_entry_t *entry)
+{
+    cJSON *json = cJSON_CreateObject();
+
+    jsonAddStringToObject(json, "path", entry->path);
+    cJSON_AddNumberToObject(json, "json_mtime", (double)entry->json_mtime);
+    cJSON_AddNumberToObject(json, "json_size", entry->json_size);
+    jsonAddStringToObject(json, "content_path", entry->content_path);
+    cJSON_AddNumberToObject(json, "content_mtime", (double)entry->content_mtime);
+    cJSON_AddNumberToObject(json, "content_size", entry->content_size);
+    cJSON_AddBoolToObject(json, "exists", entry->exists);
+    cJSON_AddBoolToObject(json, "valid", entry->valid);
+    if (entry->valid)
+    {
+        cJSON_AddNumberToObject(json, "audio_id", entry->audio_id);
+        jsonAddByteArrayToObject(json, "sha1", (uint8_t *)entry->sha1, sizeof(entry->sha1));
+        cJSON_AddNumberToObject(json, "num_bytes", (double)entry->num_bytes);
+        cJSON *tracks = cJSON_AddArrayToObject(json, "tracks");
+        for (size_t i = 0; i < entry->n_tracks; i++)
+        {
+            cJSON_AddItemToArray(tracks, cJSON_CreateNumber(entry->tracks[i]));
+        }
+    }
+    cJSON_AddBoolToObject(json, "json_valid", entry->json_valid);
+    cJSON_AddBoolToObject(json, "live", entry->live);
+    cJSON_AddBoolToObject(json, "nocloud", entry->nocloud);
+    cJSON_AddBoolToObject(json, "has_cloud_auth", entry->has_cloud_auth);
+    jsonAddStringToObject(json, "source", entry->source);
+    jsonAddStringToObject(json, "tonie_model", entry->tonie_model);
+
+    return json;
+}
+
+static double content_index_number(cJSON *json, const char *name, double fallback)
+{
+    cJSON *item = cJSON_GetObjectItemCaseSensitive(json, name);
+    return cJSON_IsNumber(item) ? item->valuedouble : fallback;
+}
+
+static content_index_entry_t *content_index_from_json(cJSON *json)
+{
+    content_index_entry_t *entry = osAllocMem(sizeof(content_index_entry_t));
+    osMemset(entry, 0x00, sizeof(content_index_entry_t));
+
+    entry->path = jsonGetString(json, "path");
+    entry->json_mtime = (int64_t)content_index_number(json, "json_mtime", -1);
+    entry->json_size = (uint32_t)content_index_number(json, "json_size", 0);
+    entry->content_path = jsonGetString(json, "content_path");
+    entry->content_mtime = (int64_t)content_index_number(json, "content_mtime", -1);
+    entry->content_size = (uint32_t)content_index_number(json, "content_size", 0);
+    entry->exists = jsonGetBool(json, "exists");
+    entry->valid = jsonGetBool(json, "valid");
+    if (entry->valid)
+    {
+        size_t sha1_len = 0;
+        uint8_t *sha1 = jsonGetBytes(json, "sha1", &sha1_len);
+        if (sha1 != NULL && sha1_len == sizeof(entry->sha1))
+        {
+            osMemcpy(entry->sha1, sha1, sizeof(entry->sha1));
+        }
+        else
+        {
+            /* unusable, gets rebuilt on the next lookup */
+            entry->content_mtime = -2;
+        }
+        osFreeMem(sha1);
+
+        entry->audio_id = (uint32_t)content_index_number(json, "audio_id", 0);
+        entry->num_bytes = (uint64_t)content_index_number(json, "num_bytes", 0);
+        cJSON *tracks = cJSON_GetObjectItemCaseSensitive(json, "tracks");
+        entry->n_tracks = cJSON_GetArraySize(tracks);
+        if (entry->n_tracks > 0)
+        {
+            entry->tracks = osAllocMem(entry->n_tracks * sizeof(uint32_t));
+            for (size_t i = 0; i < entry->n_tracks; i++)
+            {
+                cJSON *track = cJSON_GetArrayItem(tracks, i);
+                entry->tracks[i] = cJSON_IsNumber(track) ? (uint32_t)track->valuedouble : 0;
+            }
+        }
+    }
+    entry->json_valid = jsonGetBool(json, "json_valid");
+    entry->live = jsonGetBool(json, "live");
+    entry->nocloud = jsonGetBool(json, "nocloud");
+    entry->has_cloud_auth = jsonGetBool(json, "has_cloud_auth");
+    entry->source = jsonGetString(json, "source");
+    entry->tonie_model = jsonGetString(json, "tonie_model");
+
+    return entry;
+}
+
+/* caller holds MUTEX_CONTENT_INDEX */
+static content_index_entry_t **content_index_find(const char *path)
+{
+    content_index_entry_t **slot = &content_index_buckets[content_index_hash(path)];
+    while (*slot != NULL && osStrcmp((*slot)->path, path))
+    {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+/* caller holds MUTEX_CONTENT_INDEX, takes ownership of the entry, NULL removes */
+static void content_index_put(const char *path, content_index_entry_t *entry)
+{
+    content_index_entry_t **slot = content_index_find(path);
+    content_index_entry_t *old = *slot;
+
+    if (old != NULL)
+    {
+        *slot = old->next;
+        content_index_free(old);
+        content_index_count--;
+    }
+    if (entry != NULL)
+    {
+        entry->next = content_index_buckets[content_index_hash(path)];
+        content_index_buckets[content_index_hash(path)] = entry;
+        content_index_count++;
+    }
+}
+
+static void content_index_write_line(FsFile *file, cJSON *json)
+{
+    char *line = cJSON_PrintUnformatted(json);
+    fsWriteFile(file, line, osStrlen(line));
+    fsWriteFile(file, "\n", 1);
+    osFreeMem(line);
+}
+
+static void content_index_compact();
+
+/* caller holds MUTEX_CONTENT_INDEX */
+static void content_index_append(const char *path, const content_index_entry_t *entry)
+{
+    if (content_index_path == NULL)
+    {
+        return;
+    }
+    FsFile *file = fsOpenFileEx(content_index_path, "ab");
+    if (file == NULL)
+    {
+        return;
+    }
+
+    cJSON *json;
+    if (entry != NULL)
+    {
+        json = content_index_to_json(entry);
+    }
+    else
+    {
+        json = cJSON_CreateObject();
+        jsonAddStringToObject(json, "path", path);
+        cJSON_AddBoolToObject(json, "deleted", true);
+    }
+    content_index_write_line(file, json);
+    cJSON_Delete(json);
+    fsCloseFile(file);
+
+    if (++content_index_log_lines > 2 * content_index_count + 64)
+    {
+        content_index_compact();
+    }
+}
+
+/* rewrites the log with only the current entries */
+static void content_index_compact()
+{
+    FsFile *file = fsOpenFile(content_index_tmp_path, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    if (file == NULL)
+    {
+        return;
+    }
+    for (size_t bucket = 0; bucket < CONTENT_INDEX_BUCKETS; bucket++)
+    {
+        for (content_index_entry_t *entry = content_index_buckets[bucket]; entry != NULL; entry = entry->next)
+        {
+            cJSON *json = content_index_to_json(entry);
+            content_index_write_line(file, json);
+            cJSON_Delete(json);
+        }
+    }
+    fsCloseFile(file);
+
+    if (fsMoveFile(content_index_tmp_path, content_index_path, true) != NO_ERROR)
+    {
+        TRACE_WARNING("Could not compact content index\r\n");
+        return;
+    }
+    content_index_log_lines = content_index_count;
+}
+
+void content_index_init()
+{
+    const char *configDir = settings_get_string("internal.configdirfull");
+    content_index_path = custom_asprintf("%s%c%s", configDir, PATH_SEPARATOR, CONTENT_INDEX_FILE);
+    content_index_tmp_path = custom_asprintf("%s%c%s", configDir, PATH_SEPARATOR, CONTENT_INDEX_TMP_FILE);
+
+    uint32_t fileSize = 0;
+    if (fsGetFileSize(content_index_path, &fileSize) != NO_ERROR || fileSize == 0)
+    {
+        return;
+    }
+
+    char *data = osAllocMem(fileSize + 1);
+    FsFile *file = fsOpenFile(content_index_path, FS_FILE_MODE_READ);
+    size_t read = 0;
+    if (data == NULL || file == NULL || fsReadFile(file, data, fileSize, &read) != NO_ERROR)
+    {
+        read = 0;
+    }
+    if (file != NULL)
+    {
+        fsCloseFile(file);
+    }
+    if (data == NULL)
+    {
+        return;
+    }
+    data[read] = '\0';
+
+    size_t lines = 0;
+    mutex_lock(MUTEX_CONTENT_INDEX);
+    char *line = data;
+    while (line != NULL && *line != '\0')
+    {
+        char *end = osStrchr(line, '\n');
+        if (end != NULL)
+        {
+            *end = '\0';
+        }
+
+        /* a partially written last line is skipped */
+        cJSON *json = cJSON_Parse(line);
+        if (json != NULL)
+        {
+            char *path = jsonGetString(json, "path");
+            if (jsonGetBool(json, "deleted"))
+            {
+                content_index_put(path, NULL);
+            }
+            else if (path[0] != '\0')
+            {
+                content_index_put(path, content_index_from_json(json));
+            }
+            osFreeMem(path);
+            cJSON_Delete(json);
+            lines++;
+        }
+        line = end ? end + 1 : NULL;
+    }
+
+    content_index_log_lines = lines;
+    if (lines > 2 * content_index_count + 64)
+    {
+        content_index_compact();
+    }
+    mutex_unlock(MUTEX_CONTENT_INDEX);
+    osFreeMem(data);
+
+    TRACE_INFO("Loaded %" PRIuSIZE " content index entries\r\n", content_index_count);
+}
+
+/* caller holds MUTEX_CONTENT_INDEX, logs a tombstone if the path was indexed */
+static void content_index_remove(const char *path)
+{
+    if (*content_index_find(path) != NULL)
+    {
+        content_index_put(path, NULL);
+        content_index_append(path, NULL);
+    }
+}
+
+static content_index_entry_t *content_index_build(const char *contentPath, settings_t *settings)
+{
+    content_index_entry_t *entry = osAllocMem(sizeof(content_index_entry_t));
+    osMemset(entry, 0x00, sizeof(content_index_entry_t));
+
+    tonie_info_t *tonieInfo = getTonieInfo(contentPath, settings);
+    contentJson_t contentJson;
+    load_content_json(contentPath, &contentJson, false);
+
+    entry->path = content_index_strdup(contentPath);
+    entry->content_path = content_index_strdup(tonieInfo->contentPath);
+    entry->exists = tonieInfo->exists;
+    entry->valid = tonieInfo->valid;
+    if (tonieInfo->valid)
+    {
+        entry->audio_id = tonieInfo->tafHeader->audio_id;
+        osMemcpy(entry->sha1, tonieInfo->tafHeader->sha1_hash.data, sizeof(entry->sha1));
+        entry->num_bytes = tonieInfo->tafHeader->num_bytes;
+        entry->n_tracks = tonieInfo->tafHeader->n_track_page_nums;
+        if (entry->n_tracks > 0)
+        {
+            entry->tracks = osAllocMem(entry->n_tracks * sizeof(uint32_t));
+            osMemcpy(entry->tracks, tonieInfo->tafHeader->track_page_nums, entry->n_tracks * sizeof(uint32_t));
+        }
+    }
+    entry->json_valid = contentJson._valid;
+    entry->live = tonieInfo->json.live;
+    entry->nocloud = tonieInfo->json.nocloud;
+    entry->has_cloud_auth = contentJson._has_cloud_auth;
+    entry->source = content_index_strdup(tonieInfo->json.source);
+    /* getTonieInfo only loads the content json of content paths */
+    entry->tonie_model = content_index_strdup(tonieInfo->json.tonie_model ? tonieInfo->json.tonie_model : contentJson.tonie_model);
+
+    freeTonieInfo(tonieInfo);
+    free_content_json(&contentJson);
+
+    /* stat after reading, getTonieInfo may have created the content json */
+    char *jsonPath = custom_asprintf("%s.json", contentPath);
+    content_index_stat(jsonPath, &entry->json_mtime, &entry->json_size);
+    content_index_stat(entry->content_path, &entry->content_mtime, &entry->content_size);
+    osFreeMem(jsonPath);
+
+    return entry;
+}
+
+content_index_entry_t *content_index_get(const char *contentPath, settings_t *settings)
+{
+    int64_t json_mtime;
+    uint32_t json_size;
+    char *jsonPath = custom_asprintf("%s.json", contentPath);
+    content_index_stat(jsonPath, &json_mtime, &json_size);
+    osFreeMem(jsonPath);
+
+    content_index_entry_t *copy = NULL;
+    mutex_lock(MUTEX_CONTENT_INDEX);
+    content_index_entry_t *entry = *content_index_find(contentPath);
+    if (entry != NULL && entry->json_mtime == json_mtime && entry->json_size == json_size)
+    {
+        copy = content_index_copy(entry);
+    }
+    mutex_unlock(MUTEX_CONTENT_INDEX);
+
+    if (copy != NULL)
+    {
+        int64_t content_mtime;
+        uint32_t content_size;
+        content_index_stat(copy->content_path, &content_mtime, &content_size);
+        if (copy->content_mtime == content_mtime && copy->content_size == content_size)
+        {
+            return copy;
+        }
+        content_index_free(copy);
+    }
+
+    entry = content_index_build(contentPath, settings);
+
+    mutex_lock(MUTEX_CONTENT_INDEX);
+    copy = content_index_copy(entry);
+    if (entry->valid)
+    {
+        /* put first, appending may compact the log from the current entries */
+        content_index_put(contentPath, entry);
+        content_index_append(contentPath, entry);
+    }
+    else
+    {
+        /* only TAFs are worth indexing, a deleted or replaced one drops its entry */
+        content_index_remove(contentPath);
+        content_index_free(entry);
+    }
+    mutex_unlock(MUTEX_CONTENT_INDEX);
+
+    return copy;
+}
+
+void content_index_invalidate(const char *contentPath)
+{
+    mutex_lock(MUTEX_CONTENT_INDEX);
+    content_index_remove(contentPath);
+    mutex_unlock(MUTEX_CONTENT_INDEX);
+}
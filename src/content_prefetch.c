@@ -0,0 +1,392 @@
+#include <string.h>
+#include <byteswap.h>
+
+#include "os_port.h"
+#include "debug.h"
+#include "fs_port.h"
+#include "mutex_manager.h"
+#include "server_helpers.h"
+#include "stats.h"
+#include "handler.h"
+#include "cloud_request.h"
+#include "content_flight.h"
+#include "completion.h"
+#include "content_prefetch.h"
+
+typedef struct
+{
+    uint64_t uid;
+    uint8_t settingsId;
+    bool_t force;
+} content_prefetch_job_t;
+
+typedef struct
+{
+    /* first member, cloud_request accesses the callback context as cbr_ctx_t */
+    cbr_ctx_t base;
+    client_ctx_t client_ctx;
+    char *tmpPath;
+    size_t received;
+    bool_t failed;
+} content_prefetch_ctx_t;
+
+static content_prefetch_job_t prefetch_queue[CONTENT_PREFETCH_QUEUE_SIZE];
+static size_t prefetch_head = 0;
+static size_t prefetch_count = 0;
+/* jobs currently downloaded by each worker, uid 0 marks an idle worker */
+static content_prefetch_job_t prefetch_active[CONTENT_PREFETCH_WORKERS_MAX];
+/* one per worker, so queuing a batch wakes all idle workers at once */
+static completion_t prefetch_wake[CONTENT_PREFETCH_WORKERS_MAX];
+/* start of the next free transfer slot of the bandwidth budget */
+static systime_t prefetch_next_slot = 0;
+
+static bool_t content_prefetch_same(content_prefetch_job_t *job, uint64_t uid, uint8_t settingsId)
+{
+    return job->uid == uid && job->settingsId == settingsId;
+}
+
+bool_t content_prefetch_enqueue(uint64_t uid, settings_t *settings, bool_t force)
+{
+    bool_t queued = FALSE;
+
+    if (!settings->cloud.prefetch || !settings->cloud.cacheContent)
+    {
+        return FALSE;
+    }
+
+    mutex_lock(MUTEX_CONTENT_PREFETCH);
+    for (size_t pos = 0; pos < CONTENT_PREFETCH_WORKERS_MAX; pos++)
+    {
+        if (content_prefetch_same(&prefetch_active[pos], uid, settings->internal.overlayNumber))
+        {
+            queued = TRUE;
+        }
+    }
+    for (size_t pos = 0; pos < prefetch_count && !queued; pos++)
+    {
+        content_prefetch_job_t *job = &prefetch_queue[(prefetch_head + pos) % CONTENT_PREFETCH_QUEUE_SIZE];
+        if (content_prefetch_same(job, uid, settings->internal.overlayNumber))
+        {
+            job->force |= force;
+            queued = TRUE;
+        }
+    }
+    if (!queued && prefetch_count < CONTENT_PREFETCH_QUEUE_SIZE)
+    {
+        content_prefetch_job_t *job = &prefetch_queue[(prefetch_head + prefetch_count) % CONTENT_PREFETCH_QUEUE_SIZE];
+        job->uid = uid;
+        job->settingsId = settings->internal.overlayNumber;
+        job->force = force;
+        prefetch_count++;
+        queued = TRUE;
+        for (size_t worker = 0; worker < CONTENT_PREFETCH_WORKERS_MAX; worker++)
+        {
+            completion_signal(&prefetch_wake[worker]);
+        }
+    }
+    mutex_unlock(MUTEX_CONTENT_PREFETCH);
+
+    if (!queued)
+    {
+        TRACE_WARNING("Prefetch queue full, dropped %016" PRIX64 "\r\n", uid);
+    }
+
+    return queued;
+}
+
+size_t content_prefetch_pending()
+{
+    mutex_lock(MUTEX_CONTENT_PREFETCH);
+    size_t count = prefetch_count;
+    mutex_unlock(MUTEX_CONTENT_PREFETCH);
+
+    return count;
+}
+
+/* delays the caller so all workers together stay within cloud.prefetchBandwidth */
+static void content_prefetch_throttle(size_t length)
+{
+    uint32_t bandwidth = get_settings()->cloud.prefetchBandwidth;
+
+    if (bandwidth == 0)
+    {
+        return;
+    }
+
+    systime_t duration = (systime_t)((uint64_t)length * 1000 / ((uint64_t)bandwidth * 1024));
+
+    mutex_lock(MUTEX_CONTENT_PREFETCH);
+    systime_t now = osGetSystemTime();
+    if (prefetch_next_slot < now)
+    {
+        prefetch_next_slot = now;
+    }
+    systime_t start = prefetch_next_slot;
+    prefetch_next_slot += duration;
+    mutex_unlock(MUTEX_CONTENT_PREFETCH);
+
+    if (start > now)
+    {
+        osDelayTask(start - now);
+    }
+}
+
+static void content_prefetch_header(void *src_ctx, HttpClientContext *cloud_ctx, const char *header, const char *value)
+{
+    content_prefetch_ctx_t *ctx = (content_prefetch_ctx_t *)src_ctx;
+
+    if (cloud_ctx->statusCode != 200)
+    {
+        return;
+    }
+    content_flight_add_header(ctx->base.flight, cloud_ctx->version, header, value);
+    if (header && osStrcmp(header, "Content-Length") == 0)
+    {
+        content_flight_set_length(ctx->base.flight, strtoul(value, NULL, 10));
+    }
+}
+
+static void content_prefetch_body(void *src_ctx, HttpClientContext *cloud_ctx, const char *payload, size_t length, error_t error)
+{
+    content_prefetch_ctx_t *ctx = (content_prefetch_ctx_t *)src_ctx;
+    const char *contentPath = ctx->base.tonieInfo->contentPath;
+    settings_t *settings = ctx->client_ctx.settings;
+
+    if (ctx->failed)
+    {
+        return;
+    }
+    if (cloud_ctx->statusCode != 200)
+    {
+        TRACE_WARNING("Prefetch of %s failed with status %u\r\n", contentPath, cloud_ctx->statusCode);
+        content_flight_complete(ctx->base.flight, ERROR_FAILURE);
+        ctx->failed = TRUE;
+        return;
+    }
+
+    if (ctx->base.file == NULL)
+    {
+        char *dir = strdup(contentPath);
+        dir[osStrlen(dir) - 8] = '\0';
+        fsCreateDir(dir);
+        osFreeMem(dir);
+
+        ctx->base.file = fsOpenFile(ctx->tmpPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_TRUNC);
+        if (ctx->base.file == NULL)
+        {
+            TRACE_ERROR("Could not open file %s\r\n", ctx->tmpPath);
+            content_flight_complete(ctx->base.flight, ERROR_FILE_OPENING_FAILED);
+            ctx->failed = TRUE;
+            return;
+        }
+        content_flight_file_ready(ctx->base.flight);
+    }
+
+    if (length > 0)
+    {
+        error_t write_error = fsWriteFile(ctx->base.file, (void *)payload, length);
+        if (write_error != NO_ERROR)
+        {
+            TRACE_ERROR("fsWriteFile Error: %s\r\n", error2text(write_error));
+            error = write_error;
+        }
+        else
+        {
+            content_flight_progress(ctx->base.flight, length);
+            ctx->received += length;
+            content_prefetch_throttle(length);
+        }
+    }
+
+    if (error == NO_ERROR)
+    {
+        return;
+    }
+
+    fsCloseFile(ctx->base.file);
+    ctx->base.file = NULL;
+
+    if (error != ERROR_END_OF_STREAM)
+    {
+        TRACE_ERROR("Prefetch of %s failed, error=%s\r\n", contentPath, error2text(error));
+        content_flight_complete(ctx->base.flight, error);
+        fsDeleteFile(ctx->tmpPath);
+        ctx->failed = TRUE;
+        return;
+    }
+
+    content_flight_seal(ctx->base.flight);
+    content_flight_complete(ctx->base.flight, NO_ERROR);
+
+    content_flight_finish(ctx->base.flight, ctx->tmpPath, contentPath);
+    if (!fsFileExists(contentPath))
+    {
+        TRACE_ERROR("Error caching %s\r\n", contentPath);
+        return;
+    }
+
+    TRACE_INFO("Prefetched %" PRIuSIZE " bytes to %s\r\n", ctx->received, contentPath);
+    stats_update("content_prefetched", 1);
+
+    if (settings->cloud.cacheToLibrary)
+    {
+        cacheContentToLibrary(contentPath, settings);
+    }
+}
+
+static void content_prefetch_run(content_prefetch_job_t *job)
+{
+    settings_t *settings = get_settings_id(job->settingsId);
+
+    if (!settings->cloud.enabled || !settings->cloud.enableV2Content || !settings->cloud.cacheContent)
+    {
+        return;
+    }
+
+    tonie_info_t *tonieInfo = getTonieInfoFromUid(job->uid, settings);
+
+    do
+    {
+        if (tonieInfo->json.nocloud && !tonieInfo->json.cloud_override)
+        {
+            break;
+        }
+        if (tonieInfo->json.source && osStrlen(tonieInfo->json.source) > 0)
+        {
+            /* custom, library or streamed content is never replaced by the cloud */
+            break;
+        }
+        if (tonieInfo->exists && tonieInfo->valid && !job->force)
+        {
+            break;
+        }
+
+        char ruid[17];
+        osSprintf(ruid, "%016" PRIx64, bswap_64(job->uid));
+        if (tonieInfo->json.cloud_override)
+        {
+            osStrncpy(ruid, tonieInfo->json.cloud_ruid, 16);
+            ruid[16] = '\0';
+        }
+        if (!tonieInfo->json.cloud_auth || tonieInfo->json.cloud_auth_len != TONIE_AUTH_TOKEN_LENGTH)
+        {
+            TRACE_DEBUG("No auth known for %s, not prefetching\r\n", ruid);
+            break;
+        }
+
+        completion_t wake;
+        bool_t leader = TRUE;
+        osMemset(&wake, 0x00, sizeof(completion_t));
+        if (completion_init(&wake) != NO_ERROR)
+        {
+            break;
+        }
+
+        content_flight_t *flight = content_flight_join(tonieInfo->contentPath, &wake, &leader);
+        if (!leader || flight == NULL)
+        {
+            /* a box is already downloading it, or without a flight the .tmp file may be in use */
+            content_flight_release(flight, &wake);
+            completion_deinit(&wake);
+            break;
+        }
+
+        char uri[32];
+        osSnprintf(uri, sizeof(uri), "/v2/content/%s", ruid);
+        TRACE_INFO("Prefetching %s to %s\r\n", uri, tonieInfo->contentPath);
+
+        content_prefetch_ctx_t ctx;
+        osMemset(&ctx, 0x00, sizeof(ctx));
+        ctx.client_ctx.settings = settings;
+        fillBaseCtx(NULL, uri, "", V2_CONTENT, &ctx.base, &ctx.client_ctx);
+        ctx.base.tonieInfo = tonieInfo;
+        ctx.base.flight = flight;
+        ctx.tmpPath = custom_asprintf("%s.tmp", tonieInfo->contentPath);
+
+        req_cbr_t cbr = {
+            .ctx = &ctx,
+            .response = NULL,
+            .header = &content_prefetch_header,
+            .body = &content_prefetch_body,
+            .disconnect = NULL};
+
+        error_t error = cloud_request_get(NULL, 0, uri, "", tonieInfo->json.cloud_auth, &cbr);
+        if (error != NO_ERROR && error != ERROR_END_OF_STREAM)
+        {
+            TRACE_WARNING("Prefetch request for %s failed, error=%s\r\n", uri, error2text(error));
+        }
+        if (ctx.base.file)
+        {
+            fsCloseFile(ctx.base.file);
+            fsDeleteFile(ctx.tmpPath);
+        }
+
+        content_flight_release(flight, NULL);
+        completion_deinit(&wake);
+        osFreeMem(ctx.tmpPath);
+    } while (0);
+
+    freeTonieInfo(tonieInfo);
+}
+
+static void content_prefetch_task(void *param)
+{
+    size_t worker = (size_t)param;
+
+    while (!settings_get_bool("internal.exit"))
+    {
+        if (worker >= get_settings()->cloud.prefetchWorkers)
+        {
+            /* not waiting on the queue, so no job wakeup gets lost to a disabled worker */
+            osDelayTask(1000);
+            continue;
+        }
+
+        bool_t found = FALSE;
+        content_prefetch_job_t job;
+        mutex_lock(MUTEX_CONTENT_PREFETCH);
+        if (prefetch_count > 0)
+        {
+            job = prefetch_queue[prefetch_head];
+            prefetch_active[worker] = job;
+            prefetch_head = (prefetch_head + 1) % CONTENT_PREFETCH_QUEUE_SIZE;
+            prefetch_count--;
+            found = TRUE;
+        }
+        mutex_unlock(MUTEX_CONTENT_PREFETCH);
+
+        if (!found)
+        {
+            completion_wait(&prefetch_wake[worker], 1000);
+            continue;
+        }
+
+        content_prefetch_run(&job);
+
+        mutex_lock(MUTEX_CONTENT_PREFETCH);
+        osMemset(&prefetch_active[worker], 0x00, sizeof(content_prefetch_job_t));
+        mutex_unlock(MUTEX_CONTENT_PREFETCH);
+    }
+
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void content_prefetch_init()
+{
+    for (size_t worker = 0; worker < CONTENT_PREFETCH_WORKERS_MAX; worker++)
+    {
+        if (completion_init(&prefetch_wake[worker]) != NO_ERROR)
+        {
+            TRACE_ERROR("Could not create prefetch event\r\n");
+            return;
+        }
+    }
+
+    for (size_t worker = 0; worker < CONTENT_PREFETCH_WORKERS_MAX; worker++)
+    {
+        if (osCreateTask("Prefetch", &content_prefetch_task, (void *)worker, 16 * 1024, 0) == OS_INVALID_TASK_ID)
+        {
+            TRACE_ERROR("Could not create prefetch worker %" PRIuSIZE "\r\n", worker);
+        }
+    }
+}
@@ -0,0 +1,748 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "content_store.h"
+#include "handler.h"
+#include "fs_ext.h"
+#include "fs_port.h"
+#include "json_helper.h"
+#include "mutex_manager.h"
+#include "server_helpers.h"
+#include "settings.h"
+#include "os_port.h"
+#include "debug.h"
+#include "cJSON.h"
+#include "proto/toniebox.pb.taf-header.pb-c.h"
+
+typedef struct content_store_blob_s
+{
+    uint8_t sha1[TAF_SHA1_SIZE];
+    uint32_t size;
+    /* files placed from the blob */
+    char **refs;
+    size_t ref_count;
+
+    struct content_store_blob_s *next;
+} content_store_blob_t;
+
+static content_store_blob_t *content_store_blobs = NULL;
+static char *content_store_dir = NULL;
+static char *content_store_index_path = NULL;
+/* the self check runs on a scratch store, even if the store is off */
+static bool_t content_store_checking = false;
+/* the library and content dirs can link to the blobs, else every placement would be a copy next to its blob */
+static bool_t content_store_linkable = false;
+
+static char *content_store_blob_path(const uint8_t *sha1)
+{
+    char hex[2 * TAF_SHA1_SIZE + 1];
+    for (size_t i = 0; i < TAF_SHA1_SIZE; i++)
+    {
+        osSprintf(&hex[2 * i], "%02x", sha1[i]);
+    }
+    return custom_asprintf("%s%c%s.taf", content_store_dir, PATH_SEPARATOR, hex);
+}
+
+static void content_store_blob_free(content_store_blob_t *blob)
+{
+    for (size_t i = 0; i < blob->ref_count; i++)
+    {
+        osFreeMem(blob->refs[i]);
+    }
+    osFreeMem(blob->refs);
+    osFreeMem(blob);
+}
+
+/* caller holds MUTEX_CONTENT_STORE */
+static content_store_blob_t *content_store_find(const uint8_t *sha1)
+{
+    content_store_blob_t *blob = content_store_blobs;
+    while (blob != NULL && osMemcmp(blob->sha1, sha1, TAF_SHA1_SIZE))
+    {
+        blob = blob->next;
+    }
+    return blob;
+}
+
+static void content_store_ref_remove(content_store_blob_t *blob, size_t index)
+{
+    osFreeMem(blob->refs[index]);
+    blob->refs[index] = blob->refs[--blob->ref_count];
+}
+
+/* caller holds MUTEX_CONTENT_STORE, a path references one blob at most */
+static void content_store_ref_add(content_store_blob_t *blob, const char *path)
+{
+    for (content_store_blob_t *other = content_store_blobs; other != NULL; other = other->next)
+    {
+        for (size_t i = 0; i < other->ref_count; i++)
+        {
+            if (!osStrcmp(other->refs[i], path))
+            {
+                if (other == blob)
+                {
+                    return;
+                }
+                content_store_ref_remove(other, i);
+                break;
+            }
+        }
+    }
+
+    char **refs = osAllocMem((blob->ref_count + 1) * sizeof(char *));
+    if (blob->ref_count > 0)
+    {
+        osMemcpy(refs, blob->refs, blob->ref_count * sizeof(char *));
+    }
+    refs[blob->ref_count++] = strdup(path);
+    osFreeMem(blob->refs);
+    blob->refs = refs;
+}
+
+static cJSON *content_store_to_json()
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON *jsonBlobs = cJSON_AddArrayToObject(json, "blobs");
+    for (content_store_blob_t *blob = content_store_blobs; blob != NULL; blob = blob->next)
+    {
+        cJSON *jsonBlob = cJSON_CreateObject();
+        jsonAddByteArrayToObject(jsonBlob, "sha1", blob->sha1, TAF_SHA1_SIZE);
+        cJSON_AddNumberToObject(jsonBlob, "size", blob->size);
+        cJSON *jsonRefs = cJSON_AddArrayToObject(jsonBlob, "refs");
+        for (size_t i = 0; i < blob->ref_count; i++)
+        {
+            cJSON_AddItemToArray(jsonRefs, cJSON_CreateString(blob->refs[i]));
+        }
+        cJSON_AddItemToArray(jsonBlobs, jsonBlob);
+    }
+    return json;
+}
+
+/* caller holds MUTEX_CONTENT_STORE */
+static void content_store_save()
+{
+    cJSON *json = content_store_to_json();
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    char *tmpPath = custom_asprintf("%s.tmp", content_store_index_path);
+    FsFile *file = fsOpenFile(tmpPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    if (file != NULL)
+    {
+        error_t error = fsWriteFile(file, jsonString, osStrlen(jsonString));
+        fsCloseFile(file);
+        if (error == NO_ERROR)
+        {
+            fsMoveFile(tmpPath, content_store_index_path, true);
+        }
+    }
+    else
+    {
+        TRACE_ERROR("Could not write '%s'\r\n", tmpPath);
+    }
+    osFreeMem(tmpPath);
+    osFreeMem(jsonString);
+}
+
+static void content_store_load()
+{
+    uint32_t fileSize = 0;
+    if (fsGetFileSize(content_store_index_path, &fileSize) != NO_ERROR || fileSize == 0)
+    {
+        return;
+    }
+
+    FsFile *file = fsOpenFile(content_store_index_path, FS_FILE_MODE_READ);
+    char *data = osAllocMem(fileSize);
+    size_t pos = 0;
+    size_t sizeRead = 0;
+    while (file != NULL && data != NULL && pos < fileSize && fsReadFile(file, &data[pos], fileSize - pos, &sizeRead) == NO_ERROR)
+    {
+        pos += sizeRead;
+    }
+    if (file != NULL)
+    {
+        fsCloseFile(file);
+    }
+    cJSON *json = (data != NULL && pos == fileSize) ? cJSON_ParseWithLengthOpts(data, fileSize, 0, 0) : NULL;
+    osFreeMem(data);
+    if (json == NULL)
+    {
+        /* the blobs stay, unindexed ones are removed by the next garbage collection */
+        TRACE_ERROR("Could not load content store index from '%s'\r\n", content_store_index_path);
+        return;
+    }
+
+    size_t blobCount = 0;
+    cJSON *jsonBlob;
+    cJSON_ArrayForEach(jsonBlob, cJSON_GetObjectItemCaseSensitive(json, "blobs"))
+    {
+        size_t sha1Len = 0;
+        uint8_t *sha1 = jsonGetBytes(jsonBlob, "sha1", &sha1Len);
+        if (sha1 == NULL || sha1Len != TAF_SHA1_SIZE || content_store_find(sha1) != NULL)
+        {
+            osFreeMem(sha1);
+            continue;
+        }
+
+        content_store_blob_t *blob = osAllocMem(sizeof(content_store_blob_t));
+        osMemset(blob, 0x00, sizeof(content_store_blob_t));
+        osMemcpy(blob->sha1, sha1, TAF_SHA1_SIZE);
+        osFreeMem(sha1);
+        blob->size = jsonGetUInt32(jsonBlob, "size");
+
+        cJSON *jsonRef;
+        cJSON_ArrayForEach(jsonRef, cJSON_GetObjectItemCaseSensitive(jsonBlob, "refs"))
+        {
+            if (cJSON_IsString(jsonRef))
+            {
+                content_store_ref_add(blob, jsonRef->valuestring);
+            }
+        }
+
+        blob->next = content_store_blobs;
+        content_store_blobs = blob;
+        blobCount++;
+    }
+    cJSON_Delete(json);
+
+    TRACE_INFO("Loaded %" PRIuSIZE " content store blobs\r\n", blobCount);
+}
+
+/* places target as a reflink, hardlink or copy of source, replacing an existing file */
+static error_t content_store_place(const char *source, const char *target)
+{
+    char *tmpPath = custom_asprintf("%s%s", target, CONTENT_STORE_TMP_EXT);
+    fsDeleteFile(tmpPath);
+
+    error_t error = fsCloneFile(source, tmpPath);
+    if (error != NO_ERROR)
+    {
+        error = fsLinkFile(source, tmpPath);
+    }
+    if (error != NO_ERROR)
+    {
+        error = fsCopyFile(source, tmpPath, true);
+    }
+    if (error == NO_ERROR)
+    {
+        error = fsMoveFile(tmpPath, target, true);
+    }
+    if (error != NO_ERROR)
+    {
+        fsDeleteFile(tmpPath);
+    }
+    osFreeMem(tmpPath);
+
+    return error;
+}
+
+/**
+ * Returns the blob of a TAF, creating it from the TAF if the store has no such blob on disk.
+ * Caller holds MUTEX_CONTENT_STORE.
+ */
+static content_store_blob_t *content_store_blob_get(const char *source, const uint8_t *sha1, bool_t *created)
+{
+    uint32_t sourceSize = 0;
+    uint32_t blobSize = 0;
+    uint8_t blobSha1[TAF_SHA1_SIZE];
+    char *blobPath = content_store_blob_path(sha1);
+
+    *created = false;
+    if (fsGetFileSize(source, &sourceSize) != NO_ERROR)
+    {
+        osFreeMem(blobPath);
+        return NULL;
+    }
+    if (fsGetFileSize(blobPath, &blobSize) != NO_ERROR || blobSize != sourceSize ||
+        !getTafSha1(blobPath, blobSha1) || osMemcmp(blobSha1, sha1, TAF_SHA1_SIZE))
+    {
+        /* a blob that doesn't match was damaged on disk, the files placed from it have their own link or copy */
+        error_t error = content_store_place(source, blobPath);
+        if (error != NO_ERROR)
+        {
+            TRACE_ERROR("Could not add '%s' to the content store, error=%s\r\n", source, error2text(error));
+            osFreeMem(blobPath);
+            return NULL;
+        }
+        *created = true;
+    }
+    osFreeMem(blobPath);
+
+    content_store_blob_t *blob = content_store_find(sha1);
+    if (blob == NULL)
+    {
+        blob = osAllocMem(sizeof(content_store_blob_t));
+        osMemset(blob, 0x00, sizeof(content_store_blob_t));
+        osMemcpy(blob->sha1, sha1, TAF_SHA1_SIZE);
+        blob->next = content_store_blobs;
+        content_store_blobs = blob;
+    }
+    blob->size = sourceSize;
+
+    return blob;
+}
+
+static bool_t content_store_enabled()
+{
+    return content_store_dir != NULL && content_store_linkable && (content_store_checking || settings_get_bool("core.content_store"));
+}
+
+/* links a probe file from the store into dir, fails e.g. with EXDEV if dir is on another filesystem */
+static bool_t content_store_probe(const char *dir)
+{
+    char *probe = custom_asprintf("%s%cprobe%s", content_store_dir, PATH_SEPARATOR, CONTENT_STORE_TMP_EXT);
+    char *target = custom_asprintf("%s%ccontent_store_probe%s", dir, PATH_SEPARATOR, CONTENT_STORE_TMP_EXT);
+    bool_t linked = false;
+
+    FsFile *file = fsOpenFile(probe, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    if (file != NULL)
+    {
+        fsCloseFile(file);
+        fsDeleteFile(target);
+        linked = fsCloneFile(probe, target) == NO_ERROR || fsLinkFile(probe, target) == NO_ERROR;
+        fsDeleteFile(target);
+        fsDeleteFile(probe);
+    }
+    osFreeMem(target);
+    osFreeMem(probe);
+
+    return linked;
+}
+
+error_t content_store_copy(const char *source, const char *target)
+{
+    uint8_t sha1[TAF_SHA1_SIZE];
+
+    if (!content_store_enabled() || !getTafSha1(source, sha1))
+    {
+        return fsCopyFile(source, target, true);
+    }
+
+    mutex_lock(MUTEX_CONTENT_STORE);
+    bool_t created = false;
+    content_store_blob_t *blob = content_store_blob_get(source, sha1, &created);
+    error_t error;
+    if (blob != NULL)
+    {
+        char *blobPath = content_store_blob_path(sha1);
+        error = content_store_place(blobPath, target);
+        osFreeMem(blobPath);
+        if (error == NO_ERROR)
+        {
+            content_store_ref_add(blob, target);
+            content_store_save();
+        }
+    }
+    else
+    {
+        error = fsCopyFile(source, target, true);
+    }
+    mutex_unlock(MUTEX_CONTENT_STORE);
+
+    return error;
+}
+
+error_t content_store_add(const char *path)
+{
+    uint8_t sha1[TAF_SHA1_SIZE];
+
+    if (!content_store_enabled())
+    {
+        return NO_ERROR;
+    }
+    if (!getTafSha1(path, sha1))
+    {
+        return ERROR_INVALID_FILE;
+    }
+
+    mutex_lock(MUTEX_CONTENT_STORE);
+    bool_t created = false;
+    content_store_blob_t *blob = content_store_blob_get(path, sha1, &created);
+    error_t error = (blob != NULL) ? NO_ERROR : ERROR_FAILURE;
+    if (blob != NULL && !created)
+    {
+        /* the same audio is already stored, the file becomes another link of it */
+        char *blobPath = content_store_blob_path(sha1);
+        error = content_store_place(blobPath, path);
+        osFreeMem(blobPath);
+    }
+    if (error == NO_ERROR)
+    {
+        content_store_ref_add(blob, path);
+        content_store_save();
+    }
+    mutex_unlock(MUTEX_CONTENT_STORE);
+
+    return error;
+}
+
+/* caller holds MUTEX_CONTENT_STORE */
+static bool_t content_store_indexed(const char *name)
+{
+    for (content_store_blob_t *blob = content_store_blobs; blob != NULL; blob = blob->next)
+    {
+        char *blobPath = content_store_blob_path(blob->sha1);
+        const char *blobName = strrchr(blobPath, PATH_SEPARATOR) + 1;
+        bool_t match = !osStrcmp(blobName, name);
+        osFreeMem(blobPath);
+        if (match)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+error_t content_store_gc(uint32_t *removed, uint64_t *removed_bytes)
+{
+    uint32_t removedCount = 0;
+    uint64_t removedSize = 0;
+    size_t droppedRefs = 0;
+
+    if (content_store_dir == NULL)
+    {
+        return ERROR_WRONG_STATE;
+    }
+
+    mutex_lock(MUTEX_CONTENT_STORE);
+    content_store_blob_t **slot = &content_store_blobs;
+    while (*slot != NULL)
+    {
+        content_store_blob_t *blob = *slot;
+        char *blobPath = content_store_blob_path(blob->sha1);
+        uint8_t sha1[TAF_SHA1_SIZE];
+
+        /* files that were deleted or replaced by other audio no longer reference the blob */
+        for (size_t i = 0; i < blob->ref_count;)
+        {
+            if (!getTafSha1(blob->refs[i], sha1) || osMemcmp(sha1, blob->sha1, TAF_SHA1_SIZE))
+            {
+                content_store_ref_remove(blob, i);
+                droppedRefs++;
+                continue;
+            }
+            i++;
+        }
+
+        bool_t blobValid = getTafSha1(blobPath, sha1) && !osMemcmp(sha1, blob->sha1, TAF_SHA1_SIZE);
+        if (blob->ref_count == 0 || !blobValid)
+        {
+            if (fsFileExists(blobPath) && fsDeleteFile(blobPath) == NO_ERROR)
+            {
+                removedCount++;
+                removedSize += blob->size;
+            }
+            *slot = blob->next;
+            content_store_blob_free(blob);
+        }
+        else
+        {
+            slot = &blob->next;
+        }
+        osFreeMem(blobPath);
+    }
+
+    /* blobs missing from the index, and leftovers of interrupted placements */
+    FsDir *dir = fsOpenDir(content_store_dir);
+    FsDirEntry entry;
+    while (dir != NULL && fsReadDir(dir, &entry) == NO_ERROR)
+    {
+        if (!osStrcmp(entry.name, ".") || !osStrcmp(entry.name, "..") ||
+            (entry.attributes & FS_FILE_ATTR_DIRECTORY) || content_store_indexed(entry.name))
+        {
+            continue;
+        }
+        char *entryPath = custom_asprintf("%s%c%s", content_store_dir, PATH_SEPARATOR, entry.name);
+        if (fsDeleteFile(entryPath) == NO_ERROR)
+        {
+            removedCount++;
+            removedSize += entry.size;
+        }
+        osFreeMem(entryPath);
+    }
+    if (dir != NULL)
+    {
+        fsCloseDir(dir);
+    }
+
+    content_store_save();
+    mutex_unlock(MUTEX_CONTENT_STORE);
+
+    if (removedCount > 0 || droppedRefs > 0)
+    {
+        TRACE_INFO("Content store: dropped %" PRIuSIZE " references, removed %" PRIu32 " blobs with %" PRIu64 " bytes\r\n", droppedRefs, removedCount, removedSize);
+    }
+    if (removed != NULL)
+    {
+        *removed = removedCount;
+    }
+    if (removed_bytes != NULL)
+    {
+        *removed_bytes = removedSize;
+    }
+
+    return NO_ERROR;
+}
+
+char *content_store_json()
+{
+    mutex_lock(MUTEX_CONTENT_STORE);
+    cJSON *json = content_store_to_json();
+    mutex_unlock(MUTEX_CONTENT_STORE);
+
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    return jsonString;
+}
+
+static void content_store_gc_task(void *param)
+{
+    content_store_gc(NULL, NULL);
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void content_store_init()
+{
+    content_store_dir = custom_asprintf("%s%cby%csha1", settings_get_string("internal.librarydirfull"), PATH_SEPARATOR, PATH_SEPARATOR);
+    content_store_index_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, CONTENT_STORE_FILE);
+
+    if (fsCreateDirEx(content_store_dir, true) != NO_ERROR && !fsDirExists(content_store_dir))
+    {
+        TRACE_ERROR("Could not create content store '%s'\r\n", content_store_dir);
+    }
+    content_store_linkable = content_store_probe(settings_get_string("internal.librarydirfull")) &&
+                             content_store_probe(settings_get_string("internal.contentdirfull"));
+
+    mutex_lock(MUTEX_CONTENT_STORE);
+    content_store_load();
+    mutex_unlock(MUTEX_CONTENT_STORE);
+
+    if (!settings_get_bool("core.content_store"))
+    {
+        return;
+    }
+    if (!content_store_linkable)
+    {
+        /* blobs would only add copies, files are copied directly as without the store */
+        TRACE_WARNING("Content store can't link into the library and content dirs, files are copied\r\n");
+    }
+    if (osCreateTask("ContentStoreGc", &content_store_gc_task, NULL, 16 * 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Failed to start content store garbage collection\r\n");
+    }
+}
+
+static void content_store_expect(bool_t ok, const char *what, uint32_t *checks, uint32_t *failures)
+{
+    (*checks)++;
+    if (!ok)
+    {
+        TRACE_ERROR("Check failed: %s\r\n", what);
+        (*failures)++;
+    }
+}
+
+/* writes a TAF header carrying the given audio hash followed by some payload */
+static error_t content_store_check_taf(const char *dir, const char *name, uint8_t audio, char **path)
+{
+    uint8_t sha1[TAF_SHA1_SIZE];
+    uint8_t buffer[4 + 256];
+    uint8_t payload[1024];
+
+    osMemset(sha1, audio, sizeof(sha1));
+    osMemset(payload, audio, sizeof(payload));
+
+    TonieboxAudioFileHeader tafHeader;
+    toniebox_audio_file_header__init(&tafHeader);
+    tafHeader.sha1_hash.data = sha1;
+    tafHeader.sha1_hash.len = TAF_SHA1_SIZE;
+    tafHeader.audio_id = audio;
+    size_t size = toniebox_audio_file_header__pack(&tafHeader, &buffer[4]);
+    buffer[0] = 0;
+    buffer[1] = 0;
+    buffer[2] = (uint8_t)(size >> 8);
+    buffer[3] = (uint8_t)size;
+
+    *path = custom_asprintf("%s%c%s", dir, PATH_SEPARATOR, name);
+    fsDeleteFile(*path);
+    FsFile *file = fsOpenFile(*path, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    if (file == NULL)
+    {
+        return ERROR_FILE_OPENING_FAILED;
+    }
+    error_t error = fsWriteFile(file, buffer, 4 + size);
+    if (error == NO_ERROR)
+    {
+        error = fsWriteFile(file, payload, sizeof(payload));
+    }
+    fsCloseFile(file);
+
+    return error;
+}
+
+static size_t content_store_check_refs(uint8_t audio)
+{
+    uint8_t sha1[TAF_SHA1_SIZE];
+    osMemset(sha1, audio, sizeof(sha1));
+
+    mutex_lock(MUTEX_CONTENT_STORE);
+    content_store_blob_t *blob = content_store_find(sha1);
+    size_t refs = (blob != NULL) ? blob->ref_count : 0;
+    mutex_unlock(MUTEX_CONTENT_STORE);
+
+    return refs;
+}
+
+static void content_store_check_clean(const char *dir)
+{
+    FsDir *handle = fsOpenDir(dir);
+    FsDirEntry entry;
+    while (handle != NULL && fsReadDir(handle, &entry) == NO_ERROR)
+    {
+        if (!osStrcmp(entry.name, ".") || !osStrcmp(entry.name, ".."))
+        {
+            continue;
+        }
+        char *entryPath = custom_asprintf("%s%c%s", dir, PATH_SEPARATOR, entry.name);
+        if (entry.attributes & FS_FILE_ATTR_DIRECTORY)
+        {
+            content_store_check_clean(entryPath);
+        }
+        else
+        {
+            fsDeleteFile(entryPath);
+        }
+        osFreeMem(entryPath);
+    }
+    if (handle != NULL)
+    {
+        fsCloseDir(handle);
+    }
+    fsRemoveDir(dir);
+}
+
+error_t content_store_check()
+{
+    uint32_t checks = 0;
+    uint32_t failures = 0;
+    uint32_t removed = 0;
+    uint64_t removedBytes = 0;
+    char *a = NULL;
+    char *b = NULL;
+    char *c = NULL;
+
+    /* the real store is set aside, the check has its own blob dir and index */
+    mutex_lock(MUTEX_CONTENT_STORE);
+    content_store_blob_t *blobs = content_store_blobs;
+    char *dir = content_store_dir;
+    char *indexPath = content_store_index_path;
+    char *scratch = custom_asprintf("%s%ccontent_store_check", settings_get_string("internal.configdirfull"), PATH_SEPARATOR);
+    content_store_blobs = NULL;
+    content_store_dir = custom_asprintf("%s%csha1", scratch, PATH_SEPARATOR);
+    content_store_index_path = custom_asprintf("%s%c%s", scratch, PATH_SEPARATOR, CONTENT_STORE_FILE);
+    content_store_checking = true;
+    bool_t linkable = content_store_linkable;
+    content_store_linkable = true;
+    mutex_unlock(MUTEX_CONTENT_STORE);
+
+    TRACE_WARNING("**********************************\r\n");
+    error_t error = fsCreateDirEx(content_store_dir, true);
+    if (error == NO_ERROR)
+    {
+        error = content_store_check_taf(scratch, "a.taf", 0xA0, &a);
+    }
+    if (error == NO_ERROR)
+    {
+        error = content_store_check_taf(scratch, "b.taf", 0xA0, &b);
+    }
+    if (error == NO_ERROR)
+    {
+        error = content_store_check_taf(scratch, "c.taf", 0xC0, &c);
+    }
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Cannot create check files in '%s', error=%s\r\n", scratch, error2text(error));
+        failures++;
+    }
+    else
+    {
+        content_store_expect(content_store_add(a) == NO_ERROR && content_store_add(b) == NO_ERROR && content_store_add(c) == NO_ERROR, "files are added", &checks, &failures);
+        content_store_expect(content_store_check_refs(0xA0) == 2 && content_store_check_refs(0xC0) == 1, "same audio shares one blob", &checks, &failures);
+        content_store_add(a);
+        content_store_expect(content_store_check_refs(0xA0) == 2, "adding a file again keeps one reference", &checks, &failures);
+
+        content_store_gc(&removed, &removedBytes);
+        content_store_expect(removed == 0 && content_store_check_refs(0xA0) == 2 && content_store_check_refs(0xC0) == 1, "referenced blobs are kept", &checks, &failures);
+
+        fsDeleteFile(c);
+        content_store_gc(&removed, &removedBytes);
+        content_store_expect(removed == 1 && removedBytes > 0 && content_store_check_refs(0xC0) == 0, "blob of a deleted file is removed", &checks, &failures);
+
+        /* replaced by other audio, not written in place as that would change the linked blob */
+        char *d = NULL;
+        fsDeleteFile(a);
+        content_store_check_taf(scratch, "a.taf", 0xD0, &d);
+        osFreeMem(d);
+        content_store_gc(&removed, &removedBytes);
+        content_store_expect(removed == 0 && content_store_check_refs(0xA0) == 1, "replaced file drops its reference only", &checks, &failures);
+
+        char *stray = custom_asprintf("%s%c%s%s", content_store_dir, PATH_SEPARATOR, "a.taf", CONTENT_STORE_TMP_EXT);
+        FsFile *file = fsOpenFile(stray, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+        if (file != NULL)
+        {
+            fsCloseFile(file);
+        }
+        content_store_gc(&removed, &removedBytes);
+        content_store_expect(removed == 1 && !fsFileExists(stray) && content_store_check_refs(0xA0) == 1, "unindexed leftovers are removed", &checks, &failures);
+        osFreeMem(stray);
+
+        fsDeleteFile(b);
+        content_store_gc(&removed, &removedBytes);
+        content_store_expect(removed == 1 && content_store_blobs == NULL, "last reference gone removes the blob", &checks, &failures);
+
+        /* on another filesystem a blob would be one more copy */
+        char *e = NULL;
+        char *f = custom_asprintf("%s%cf.taf", scratch, PATH_SEPARATOR);
+        content_store_linkable = false;
+        content_store_check_taf(scratch, "e.taf", 0xE0, &e);
+        error = content_store_copy(e, f);
+        content_store_expect(error == NO_ERROR && fsFileExists(f) && content_store_blobs == NULL, "unlinkable store copies without a blob", &checks, &failures);
+        content_store_expect(content_store_add(e) == NO_ERROR && content_store_blobs == NULL, "unlinkable store adds nothing", &checks, &failures);
+        content_store_linkable = true;
+#ifndef _WIN32
+        content_store_expect(content_store_probe(scratch), "store links into its own filesystem", &checks, &failures);
+#endif
+        osFreeMem(e);
+        osFreeMem(f);
+    }
+
+    mutex_lock(MUTEX_CONTENT_STORE);
+    content_store_check_clean(scratch);
+    while (content_store_blobs != NULL)
+    {
+        content_store_blob_t *blob = content_store_blobs;
+        content_store_blobs = blob->next;
+        content_store_blob_free(blob);
+    }
+    osFreeMem(content_store_dir);
+    osFreeMem(content_store_index_path);
+    content_store_blobs = blobs;
+    content_store_dir = dir;
+    content_store_index_path = indexPath;
+    content_store_checking = false;
+    content_store_linkable = linkable;
+    mutex_unlock(MUTEX_CONTENT_STORE);
+    osFreeMem(scratch);
+    osFreeMem(a);
+    osFreeMem(b);
+    osFreeMem(c);
+
+    TRACE_WARNING("Checks:           %" PRIu32 "\r\n", checks);
+    TRACE_WARNING("Failures:         %" PRIu32 "\r\n", failures);
+    TRACE_WARNING("**********************************\r\n");
+
+    return failures ? ERROR_FAILURE : NO_ERROR;
+}
@@ -933,19 +933,32 @@ error_t httpSendResponseStreamUnsafe(HttpConnection *connection, const char_t *u
    FsFile *file;
 
 #if (HTTP_SERVER_GZIP_TYPE_SUPPORT == ENABLED)
-   // Check whether gzip compression is supported by the client
-   if (connection->request.acceptGzipEncoding)
+   // Check whether gzip compression is supported by the client, ranges
+   // and streams refer to the uncompressed file
+   if (connection->request.acceptGzipEncoding && !isStream &&
+       connection->request.Range.start == 0 &&
+       !connection->private.client_ctx.skip_taf_header)
    {
+      FsFileStat stat;
+      FsFileStat statGz;
+
       // Calculate the length of the pathname
       n = osStrlen(connection->buffer);
 
       // Sanity check
-      if (n < (HTTP_SERVER_BUFFER_SIZE - 4))
+      if (n < (HTTP_SERVER_BUFFER_SIZE - 4) &&
+          fsGetFileStat(connection->buffer, &stat) == NO_ERROR)
       {
          // Append gzip extension
          osStrcpy(connection->buffer + n, ".gz");
-         // Retrieve the size of the compressed resource, if any
-         error = fsGetFileSize(connection->buffer, &length);
+         // Retrieve the compressed resource, if any
+         error = fsGetFileStat(connection->buffer, &statGz);
+
+         // A variant older than the file is stale until it is regenerated
+         if (!error && convertDateToUnixTime(&statGz.modified) < convertDateToUnixTime(&stat.modified))
+            error = ERROR_NOT_FOUND;
+         if (!error)
+            length = statGz.size;
       }
       else
       {
@@ -1042,6 +1055,27 @@ error_t httpSendResponseStreamUnsafe(HttpConnection *connection, const char_t *u
    }
 #endif
 
+#if (HTTP_SERVER_FS_SUPPORT == ENABLED)
+   // Validators from size and mtime, streams still grow while they are sent
+   if (!isStream)
+   {
+      FsFileStat stat;
+
+      if (fsGetFileStat(connection->buffer, &stat) == NO_ERROR)
+      {
+         connection->response.lastModified = convertDateToUnixTime(&stat.modified);
+         osSnprintf(connection->response.etag, sizeof(connection->response.etag), "\"%" PRIx32 "-%" PRIx32 "\"",
+                    stat.size, (uint32_t)connection->response.lastModified);
+      }
+
+      if (httpCheckNotModified(connection))
+      {
+         fsCloseFile(file);
+         return httpSendNotModifiedResponse(connection);
+      }
+   }
+#endif
+
    if (connection->private.client_ctx.skip_taf_header)
    {
       length -= 4096;
@@ -1137,7 +1171,12 @@ error_t httpSendResponseStreamUnsafe(HttpConnection *connection, const char_t *u
       // End of input stream?
       if (isStream && error == ERROR_END_OF_FILE && connection->private.client_ctx.state->box.stream_ctx.active)
       {
-         osDelayTask(100);
+         // Wake up as soon as the encoder wrote the next page
+         completion_t *progress = &connection->private.client_ctx.state->box.stream_ctx.completion;
+         if (completion_is_done(progress))
+            osDelayTask(100);
+         else
+            completion_wait(progress, 100);
          error = httpCloseStream(connection); // Test connection??? won't work TODO: exit after some seconds
          if (error)
             break;
@@ -1314,6 +1353,90 @@ error_t httpSendRedirectResponse(HttpConnection *connection,
    return error;
 }
 
+/**
+ * @brief Check whether the client already holds the current version of the response
+ *
+ * If-None-Match is compared against response.etag using the weak comparison,
+ * If-Modified-Since against response.lastModified when no If-None-Match was sent.
+ *
+ * @param[in] connection Structure representing an HTTP connection
+ * @return TRUE if the response can be answered with 304 Not Modified
+ **/
+
+bool_t httpCheckNotModified(HttpConnection *connection)
+{
+   // Only safe methods are answered from the client's cache
+   if (osStrcasecmp(connection->request.method, "GET") &&
+       osStrcasecmp(connection->request.method, "HEAD"))
+      return FALSE;
+
+   // If-None-Match takes precedence over If-Modified-Since
+   if (connection->request.ifNoneMatch[0] != '\0')
+   {
+      const char_t *etag = connection->response.etag;
+      const char_t *p = connection->request.ifNoneMatch;
+
+      if (etag[0] == '\0')
+         return FALSE;
+      if (!osStrncmp(etag, "W/", 2))
+         etag += 2;
+
+      while (*p != '\0')
+      {
+         const char_t *end;
+         size_t length;
+
+         while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+         if (*p == '*')
+            return TRUE;
+         if (!osStrncmp(p, "W/", 2))
+            p += 2;
+
+         end = osStrchr(p, ',');
+         if (end == NULL)
+            end = p + osStrlen(p);
+         length = end - p;
+         while (length > 0 && (p[length - 1] == ' ' || p[length - 1] == '\t'))
+            length--;
+
+         if (length > 0 && length == osStrlen(etag) && !osStrncmp(p, etag, length))
+            return TRUE;
+         p = end;
+      }
+      return FALSE;
+   }
+
+   return connection->response.lastModified != 0 &&
+          connection->request.ifModifiedSince != 0 &&
+          connection->response.lastModified <= connection->request.ifModifiedSince;
+}
+
+/**
+ * @brief Send 304 Not Modified with the validators already set in the response
+ * @param[in] connection Structure representing an HTTP connection
+ * @return Error code
+ **/
+
+error_t httpSendNotModifiedResponse(HttpConnection *connection)
+{
+   error_t error;
+
+   connection->response.statusCode = 304;
+   connection->response.contentType = NULL;
+   connection->response.chunkedEncoding = FALSE;
+   connection->response.contentLength = 0;
+
+   // Send the header to the client
+   error = httpWriteHeader(connection);
+   // Any error to report?
+   if (error)
+      return error;
+
+   // Properly close output stream
+   return httpCloseStream(connection);
+}
+
 /**
  * @brief Check whether the client's handshake is valid
  * @param[in] connection Structure representing an HTTP connection
@@ -33,6 +33,7 @@
 
 //Dependencies
 #include "os_port.h"
+#include "date_time.h"
 #include "core/socket.h"
 #include "web_socket/web_socket.h"
 #include "http/http_common.h"
@@ -218,6 +219,20 @@
 #error HTTP_SERVER_IFRANGE_MAX_LEN parameter is not valid
 #endif
 
+// Entity tag of a response, including the quotes
+#ifndef HTTP_SERVER_ETAG_MAX_LEN
+#define HTTP_SERVER_ETAG_MAX_LEN 63
+#elif (HTTP_SERVER_ETAG_MAX_LEN < 7)
+#error HTTP_SERVER_ETAG_MAX_LEN parameter is not valid
+#endif
+
+// If-None-Match may list several entity tags
+#ifndef HTTP_SERVER_IF_NONE_MATCH_MAX_LEN
+#define HTTP_SERVER_IF_NONE_MATCH_MAX_LEN 255
+#elif (HTTP_SERVER_IF_NONE_MATCH_MAX_LEN < HTTP_SERVER_ETAG_MAX_LEN)
+#error HTTP_SERVER_IF_NONE_MATCH_MAX_LEN parameter is not valid
+#endif
+
 //Maximum user name length
 #ifndef HTTP_SERVER_USERNAME_MAX_LEN
    #define HTTP_SERVER_USERNAME_MAX_LEN 31
@@ -497,6 +512,8 @@ typedef struct
    char_t userAgent[128 + 1];
    char_t ifRange[HTTP_SERVER_IFRANGE_MAX_LEN + 1];          ///< IfRange tag
    HttpRangeHeader Range;                                    ///< Range field
+   char_t ifNoneMatch[HTTP_SERVER_IF_NONE_MATCH_MAX_LEN + 1]; ///< If-None-Match entity tags
+   time_t ifModifiedSince;                                   ///< If-Modified-Since, 0 if not sent
    bool_t keepAlive;
    bool_t chunkedEncoding;
    size_t contentLength;
@@ -538,6 +555,8 @@ typedef struct
    const char_t *location;
    const char_t *contentType;
    const char_t *contentRange;
+   char_t etag[HTTP_SERVER_ETAG_MAX_LEN + 1];
+   time_t lastModified;
    bool_t chunkedEncoding;
    size_t contentLength;
    size_t byteCount;
@@ -546,6 +565,7 @@ typedef struct
 #endif
 #if (HTTP_SERVER_GZIP_TYPE_SUPPORT == ENABLED)
    bool_t gzipEncoding;
+   bool_t varyEncoding;                              ///<Body may be gzipped depending on the request
 #endif
 #if (HTTP_SERVER_COOKIE_SUPPORT == ENABLED)
    char_t setCookie[HTTP_SERVER_COOKIE_MAX_LEN + 1]; ///<Set-Cookie header field
@@ -691,6 +711,9 @@ error_t httpSendErrorResponse(HttpConnection *connection,
 error_t httpSendRedirectResponse(HttpConnection *connection,
    uint_t statusCode, const char_t *uri);
 
+bool_t httpCheckNotModified(HttpConnection *connection);
+error_t httpSendNotModifiedResponse(HttpConnection *connection);
+
 //HTTP authentication related functions
 bool_t httpCheckPassword(HttpConnection *connection,
    const char_t *password, HttpAuthMode mode);
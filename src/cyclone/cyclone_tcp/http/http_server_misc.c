@@ -465,6 +465,17 @@ void httpParseHeaderField(HttpConnection *connection,
       strSafeCopy(connection->request.ifRange, value,
                   HTTP_SERVER_IFRANGE_MAX_LEN);
    }
+   // If-None-Match header field?
+   else if (!osStrcasecmp(name, "If-None-Match"))
+   {
+      strSafeCopy(connection->request.ifNoneMatch, value,
+                  HTTP_SERVER_IF_NONE_MATCH_MAX_LEN);
+   }
+   // If-Modified-Since header field?
+   else if (!osStrcasecmp(name, "If-Modified-Since"))
+   {
+      httpParseDate(value, &connection->request.ifModifiedSince);
+   }
 #if (HTTP_SERVER_WEB_SOCKET_SUPPORT == ENABLED)
    //Upgrade header field?
    else if(!osStrcasecmp(name, "Upgrade"))
@@ -633,8 +644,19 @@ void httpParseAcceptEncodingField(HttpConnection *connection,
       //Trim whitespace characters
       value = strTrimWhitespace(token);
 
+      //Ignore parameters, but honour an explicit q=0
+      char_t *params = osStrchr(value, ';');
+      bool_t refused = FALSE;
+      if(params != NULL)
+      {
+         *params++ = '\0';
+         params = strTrimWhitespace(params);
+         refused = !osStrncasecmp(params, "q=0", 3) && strspn(params + 3, ".0") == osStrlen(params + 3);
+         value = strTrimWhitespace(value);
+      }
+
       //Check current value
-      if(!osStrcasecmp(value, "gzip"))
+      if(!osStrcasecmp(value, "gzip") && !refused)
       {
          //gzip compression is supported
          connection->request.acceptGzipEncoding = TRUE;
@@ -662,6 +684,65 @@ void httpParseCookieField(HttpConnection *connection, char_t *value)
 }
 
 
+static const char_t httpDayNames[7][4] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char_t httpMonthNames[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                             "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+/**
+ * @brief Parse an HTTP date (IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT")
+ * @param[in] value Date string
+ * @param[out] time Unix time, left untouched if the date is invalid
+ * @return TRUE if the date could be parsed
+ **/
+
+bool_t httpParseDate(const char_t *value, time_t *time)
+{
+   char_t month[4];
+   uint_t day, year, hours, minutes, seconds;
+   DateTime date;
+
+   if (sscanf(value, "%*3s, %u %3s %u %u:%u:%u", &day, month, &year,
+              &hours, &minutes, &seconds) != 6)
+      return FALSE;
+
+   osMemset(&date, 0, sizeof(date));
+   for (uint_t i = 0; i < arraysize(httpMonthNames); i++)
+   {
+      if (!osStrcasecmp(month, httpMonthNames[i]))
+         date.month = i + 1;
+   }
+   if (date.month == 0 || day < 1 || day > 31 || year < 1970 ||
+       hours > 23 || minutes > 59 || seconds > 60)
+      return FALSE;
+
+   date.year = year;
+   date.day = day;
+   date.hours = hours;
+   date.minutes = minutes;
+   date.seconds = seconds;
+   *time = convertDateToUnixTime(&date);
+
+   return TRUE;
+}
+
+
+/**
+ * @brief Format an HTTP date (IMF-fixdate)
+ * @param[in] time Unix time
+ * @param[out] buffer Output buffer, at least 30 characters
+ **/
+
+void httpFormatDate(time_t time, char_t *buffer)
+{
+   DateTime date;
+
+   convertUnixTimeToDate(time, &date);
+   osSprintf(buffer, "%s, %02" PRIu8 " %s %04" PRIu16 " %02" PRIu8 ":%02" PRIu8 ":%02" PRIu8 " GMT",
+             httpDayNames[date.dayOfWeek % 7], date.day, httpMonthNames[(date.month + 11) % 12],
+             date.year, date.hours, date.minutes, date.seconds);
+}
+
+
 /**
  * @brief Read chunk-size field from the input stream
  * @param[in] connection Structure representing an HTTP connection
@@ -757,11 +838,14 @@ void httpInitResponseHeader(HttpConnection *connection)
    connection->response.maxAge = 0;
    connection->response.location = NULL;
    connection->response.contentType = mimeGetType(connection->request.uri);
+   connection->response.etag[0] = '\0';
+   connection->response.lastModified = 0;
    connection->response.chunkedEncoding = FALSE;
 
 #if (HTTP_SERVER_GZIP_TYPE_SUPPORT == ENABLED)
    //Do not use gzip encoding
    connection->response.gzipEncoding = FALSE;
+   connection->response.varyEncoding = FALSE;
 #endif
 
 #if (HTTP_SERVER_PERSISTENT_CONN_SUPPORT == ENABLED)
@@ -921,6 +1005,19 @@ error_t httpFormatResponseHeader(HttpConnection *connection, char_t *buffer)
       p += osSprintf(p, "Content-Type: %s\r\n", connection->response.contentType);
    }
 
+   // Validators for conditional requests
+   if (connection->response.etag[0] != '\0')
+   {
+      p += osSprintf(p, "ETag: %s\r\n", connection->response.etag);
+   }
+   if (connection->response.lastModified != 0)
+   {
+      p += osSprintf(p, "Last-Modified: ");
+      httpFormatDate(connection->response.lastModified, p);
+      p += osStrlen(p);
+      p += osSprintf(p, "\r\n");
+   }
+
    // Range included?
    if (connection->response.contentRange != NULL)
    {
@@ -934,6 +1031,11 @@ error_t httpFormatResponseHeader(HttpConnection *connection, char_t *buffer)
       //Set Transfer-Encoding field
       p += osSprintf(p, "Content-Encoding: gzip\r\n");
    }
+   //Caches must keep the encodings apart, also for the identity variant
+   if(connection->response.gzipEncoding || connection->response.varyEncoding)
+   {
+      p += osSprintf(p, "Vary: Accept-Encoding\r\n");
+   }
 #endif
 
    //Use chunked encoding transfer?
@@ -1236,4 +1338,4 @@ void httpConvertArrayToHexString(const uint8_t *input,
    output[i * 2] = '\0';
 }
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
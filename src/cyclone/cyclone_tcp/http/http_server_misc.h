@@ -97,6 +97,9 @@ void httpParseRangeField(HttpConnection *connection,
 
 void httpParseCookieField(HttpConnection *connection, char_t *value);
 
+bool_t httpParseDate(const char_t *value, time_t *time);
+void httpFormatDate(time_t time, char_t *buffer);
+
 error_t httpReadChunkSize(HttpConnection *connection);
 
 void httpInitResponseHeader(HttpConnection *connection);
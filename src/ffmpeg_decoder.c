@@ -0,0 +1,744 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+#include "ffmpeg_decoder.h"
+#include "os_port.h"
+#include "os_ext.h"
+#include "debug.h"
+#include "settings.h"
+#include "mutex_manager.h"
+#include "fs_port.h"
+#include "opus.h"
+#include "ogg/ogg.h"
+#include "toniefile.h"
+
+#ifndef _WIN32
+extern char **environ;
+#endif
+
+/* one interleaved stereo s16 frame */
+#define FFMPEG_DECODER_FRAME_SIZE (2 * sizeof(int16_t))
+
+/* largest opus frame, 120ms at 48kHz */
+#define FFMPEG_DECODER_OPUS_FRAME_MAX 5760
+
+typedef enum
+{
+    FFMPEG_DECODER_FFMPEG,
+    FFMPEG_DECODER_WAV,
+    FFMPEG_DECODER_OPUS,
+} ffmpeg_decoder_type_t;
+
+struct ffmpeg_decoder_s
+{
+    ffmpeg_decoder_type_t type;
+    /* native decoders */
+    FsFile *file;
+    size_t data_remaining;
+    uint16_t channels;
+    ogg_sync_state oy;
+    ogg_stream_state os;
+    bool_t os_ready;
+    OpusDecoder *opus;
+    /* samples per channel to drop, pre-skip and skipped seconds */
+    size_t discard;
+    /* packets are handed out for remuxing instead of being decoded */
+    bool_t remux;
+    uint8_t packet[TONIEFILE_FRAME_SIZE];
+    size_t packet_length;
+#ifdef _WIN32
+    FILE *pipe;
+#else
+    pid_t pid;
+    int fd;
+#endif
+    bool_t eof;
+    size_t pos;
+    size_t len;
+    uint8_t buffer[FFMPEG_DECODER_BUFFER_SIZE];
+};
+
+static size_t ffmpeg_decoder_running = 0;
+/* decoders for playback waiting for a slot, prefetching leaves the free slots to them */
+static size_t ffmpeg_decoder_waiting = 0;
+
+#ifdef FFMPEG_DECODING
+static bool_t ffmpeg_decoder_acquire(bool_t prefetch)
+{
+    size_t max = get_settings()->encode.ffmpeg_decoders_max;
+    bool_t acquired = false;
+
+    mutex_lock(MUTEX_FFMPEG_DECODER);
+    if (prefetch)
+    {
+        acquired = ffmpeg_decoder_running + ffmpeg_decoder_waiting < max;
+    }
+    else
+    {
+        systime_t start = osGetSystemTime();
+        ffmpeg_decoder_waiting++;
+        while (ffmpeg_decoder_running >= max && osGetSystemTime() - start < FFMPEG_DECODER_WAIT_MS)
+        {
+            mutex_unlock(MUTEX_FFMPEG_DECODER);
+            osDelayTask(FFMPEG_DECODER_WAIT_POLL_MS);
+            mutex_lock(MUTEX_FFMPEG_DECODER);
+        }
+        ffmpeg_decoder_waiting--;
+        acquired = ffmpeg_decoder_running < max;
+        if (!acquired)
+        {
+            TRACE_ERROR("All %" PRIuSIZE " ffmpeg decoders are busy\r\n", max);
+        }
+    }
+    if (acquired)
+    {
+        ffmpeg_decoder_running++;
+    }
+    mutex_unlock(MUTEX_FFMPEG_DECODER);
+
+    return acquired;
+}
+#endif
+
+static void ffmpeg_decoder_release()
+{
+    mutex_lock(MUTEX_FFMPEG_DECODER);
+    ffmpeg_decoder_running--;
+    mutex_unlock(MUTEX_FFMPEG_DECODER);
+}
+
+#ifdef FFMPEG_DECODING
+#ifdef _WIN32
+static error_t ffmpeg_decoder_spawn(ffmpeg_decoder_t *decoder, const char *source, size_t skip_seconds)
+{
+    char ffmpeg_command[1024];
+    snprintf(ffmpeg_command, sizeof(ffmpeg_command), "ffmpeg -i \"%s\" -f s16le -acodec pcm_s16le -ar 48000 -ac 2 -ss %" PRIuSIZE " -", source, skip_seconds);
+
+    decoder->pipe = osPopen(ffmpeg_command, "rb");
+    if (decoder->pipe == NULL)
+    {
+        return ERROR_OPEN_FAILED;
+    }
+    return NO_ERROR;
+}
+#else
+static error_t ffmpeg_decoder_spawn(ffmpeg_decoder_t *decoder, const char *source, size_t skip_seconds)
+{
+    char skip[24];
+    osSprintf(skip, "%" PRIuSIZE, skip_seconds);
+
+    char *const argv[] = {
+        "ffmpeg", "-nostdin", "-i", (char *)source,
+        "-f", "s16le", "-acodec", "pcm_s16le", "-ar", "48000", "-ac", "2",
+        "-ss", skip, "-", NULL};
+
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return ERROR_OPEN_FAILED;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+    int ret = posix_spawnp(&decoder->pid, "ffmpeg", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+
+    if (ret != 0)
+    {
+        TRACE_ERROR("Could not spawn ffmpeg: %s\r\n", strerror(ret));
+        close(fds[0]);
+        return ERROR_OPEN_FAILED;
+    }
+
+#ifdef F_SETPIPE_SZ
+    /* lets a prefetched decoder run ahead while the current source is encoded */
+    fcntl(fds[0], F_SETPIPE_SZ, 1024 * 1024);
+#endif
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    decoder->fd = fds[0];
+
+    return NO_ERROR;
+}
+#endif
+#endif
+
+static void ffmpeg_decoder_close_native(ffmpeg_decoder_t *decoder)
+{
+    if (decoder->opus)
+    {
+        opus_decoder_destroy(decoder->opus);
+        decoder->opus = NULL;
+    }
+    if (decoder->os_ready)
+    {
+        ogg_stream_clear(&decoder->os);
+        decoder->os_ready = false;
+    }
+    ogg_sync_clear(&decoder->oy);
+    if (decoder->file)
+    {
+        fsCloseFile(decoder->file);
+        decoder->file = NULL;
+    }
+}
+
+static uint16_t ffmpeg_decoder_le16(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+static uint32_t ffmpeg_decoder_le32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+/* accepts 16 bit PCM at 48kHz, everything else needs resampling by ffmpeg */
+static bool_t ffmpeg_decoder_open_wav(ffmpeg_decoder_t *decoder, size_t skip_seconds)
+{
+    bool_t fmt_valid = false;
+    uint8_t chunk[16];
+    size_t read = 0;
+
+    while (fsReadFile(decoder->file, chunk, 8, &read) == NO_ERROR && read == 8)
+    {
+        uint32_t chunk_size = ffmpeg_decoder_le32(&chunk[4]);
+
+        if (!osMemcmp(chunk, "fmt ", 4))
+        {
+            if (chunk_size < 16 || fsReadFile(decoder->file, chunk, 16, &read) != NO_ERROR || read != 16)
+            {
+                return false;
+            }
+            uint16_t format = ffmpeg_decoder_le16(&chunk[0]);
+            decoder->channels = ffmpeg_decoder_le16(&chunk[2]);
+            uint32_t sample_rate = ffmpeg_decoder_le32(&chunk[4]);
+            uint16_t bits = ffmpeg_decoder_le16(&chunk[14]);
+
+            fmt_valid = (format == 1 || format == 0xFFFE) && sample_rate == 48000 && bits == 16 && (decoder->channels == 1 || decoder->channels == 2);
+            if (!fmt_valid)
+            {
+                return false;
+            }
+            chunk_size -= 16;
+        }
+        else if (!osMemcmp(chunk, "data", 4))
+        {
+            if (!fmt_valid)
+            {
+                return false;
+            }
+            size_t skip = MIN((size_t)chunk_size, skip_seconds * 48000 * decoder->channels * sizeof(int16_t));
+            if (skip > 0 && fsSeekFile(decoder->file, skip, FS_SEEK_CUR) != NO_ERROR)
+            {
+                return false;
+            }
+            decoder->data_remaining = chunk_size - skip;
+            return true;
+        }
+
+        /* chunks are padded to an even size */
+        chunk_size += chunk_size & 1;
+        if (chunk_size > 0 && fsSeekFile(decoder->file, chunk_size, FS_SEEK_CUR) != NO_ERROR)
+        {
+            return false;
+        }
+    }
+    return false;
+}
+
+static error_t ffmpeg_decoder_fill_wav(ffmpeg_decoder_t *decoder)
+{
+    size_t space = FFMPEG_DECODER_BUFFER_SIZE - decoder->len;
+    size_t read = 0;
+    error_t error;
+
+    if (decoder->channels == 2)
+    {
+        size_t length = MIN(space, decoder->data_remaining);
+        error = fsReadFile(decoder->file, &decoder->buffer[decoder->len], length, &read);
+        decoder->len += read;
+    }
+    else
+    {
+        /* upmix mono to the stereo layout the encoder expects */
+        uint8_t mono[4096];
+        size_t length = MIN(MIN(space / 2, sizeof(mono)), decoder->data_remaining);
+        error = fsReadFile(decoder->file, mono, length, &read);
+        read -= read % sizeof(int16_t);
+        for (size_t pos = 0; pos < read; pos += sizeof(int16_t))
+        {
+            osMemcpy(&decoder->buffer[decoder->len], &mono[pos], sizeof(int16_t));
+            osMemcpy(&decoder->buffer[decoder->len + sizeof(int16_t)], &mono[pos], sizeof(int16_t));
+            decoder->len += 2 * sizeof(int16_t);
+        }
+    }
+    decoder->data_remaining -= read;
+
+    if (read == 0 || decoder->data_remaining == 0)
+    {
+        decoder->eof = true;
+    }
+    if (read == 0)
+    {
+        return (error == NO_ERROR || error == ERROR_END_OF_FILE) ? ERROR_END_OF_STREAM : error;
+    }
+    return NO_ERROR;
+}
+
+/* returns the next packet of the first logical stream in the file */
+static error_t ffmpeg_decoder_ogg_packet(ffmpeg_decoder_t *decoder, ogg_packet *packet)
+{
+    while (true)
+    {
+        if (decoder->os_ready && ogg_stream_packetout(&decoder->os, packet) == 1)
+        {
+            return NO_ERROR;
+        }
+
+        ogg_page page;
+        if (ogg_sync_pageout(&decoder->oy, &page) == 1)
+        {
+            if (!decoder->os_ready)
+            {
+                ogg_stream_init(&decoder->os, ogg_page_serialno(&page));
+                decoder->os_ready = true;
+            }
+            /* pages of other logical streams are rejected by the serial number */
+            ogg_stream_pagein(&decoder->os, &page);
+            continue;
+        }
+
+        size_t read = 0;
+        char *buffer = ogg_sync_buffer(&decoder->oy, 4096);
+        error_t error = fsReadFile(decoder->file, buffer, 4096, &read);
+        if (error != NO_ERROR || read == 0)
+        {
+            return ERROR_END_OF_STREAM;
+        }
+        ogg_sync_wrote(&decoder->oy, read);
+    }
+}
+
+/* decodes a packet into the buffer, returns the number of samples per channel added */
+static size_t ffmpeg_decoder_decode_opus(ffmpeg_decoder_t *decoder, const uint8_t *data, size_t length)
+{
+    int16_t *pcm = (int16_t *)&decoder->buffer[decoder->len];
+    int samples = opus_decode(decoder->opus, data, length, pcm, FFMPEG_DECODER_OPUS_FRAME_MAX, 0);
+    if (samples <= 0)
+    {
+        /* skip corrupt packets */
+        return 0;
+    }
+    if (decoder->discard >= (size_t)samples)
+    {
+        decoder->discard -= samples;
+        return 0;
+    }
+
+    size_t keep = samples - decoder->discard;
+    osMemmove(pcm, &pcm[decoder->discard * 2], keep * FFMPEG_DECODER_FRAME_SIZE);
+    decoder->discard = 0;
+    decoder->len += keep * FFMPEG_DECODER_FRAME_SIZE;
+    return keep;
+}
+
+static error_t ffmpeg_decoder_fill_opus(ffmpeg_decoder_t *decoder)
+{
+    /* a packet that was peeked for remuxing but has to be decoded */
+    if (decoder->packet_length > 0)
+    {
+        size_t length = decoder->packet_length;
+        decoder->packet_length = 0;
+        if (ffmpeg_decoder_decode_opus(decoder, decoder->packet, length) > 0)
+        {
+            return NO_ERROR;
+        }
+    }
+
+    while (true)
+    {
+        ogg_packet packet;
+        if (ffmpeg_decoder_ogg_packet(decoder, &packet) != NO_ERROR)
+        {
+            decoder->eof = true;
+            return ERROR_END_OF_STREAM;
+        }
+        if (ffmpeg_decoder_decode_opus(decoder, packet.packet, packet.bytes) > 0)
+        {
+            return NO_ERROR;
+        }
+    }
+}
+
+/* 60ms stereo packets can be copied into a TAF as they are */
+static bool_t ffmpeg_decoder_remuxable(const uint8_t *packet, size_t length)
+{
+    if (length == 0 || length > TONIEFILE_REMUX_PACKET_MAX || opus_packet_get_nb_channels(packet) != OPUS_CHANNELS)
+    {
+        return false;
+    }
+    int frames = opus_packet_get_nb_frames(packet, length);
+    return frames > 0 && opus_packet_get_samples_per_frame(packet, OPUS_SAMPLING_RATE) * frames == OPUS_FRAME_SIZE;
+}
+
+/* reads the next packet into the peek buffer, or decodes it if it is too large */
+static error_t ffmpeg_decoder_peek_opus(ffmpeg_decoder_t *decoder)
+{
+    ogg_packet packet;
+    if (ffmpeg_decoder_ogg_packet(decoder, &packet) != NO_ERROR)
+    {
+        decoder->eof = true;
+        return ERROR_END_OF_STREAM;
+    }
+    if (packet.bytes > sizeof(decoder->packet))
+    {
+        decoder->remux = false;
+        ffmpeg_decoder_decode_opus(decoder, packet.packet, packet.bytes);
+        return ERROR_UNSUPPORTED_FEATURE;
+    }
+    osMemcpy(decoder->packet, packet.packet, packet.bytes);
+    /* packets from a TAF are padded to fill its pages, the target pads them for its own */
+    int length = opus_packet_unpad(decoder->packet, packet.bytes);
+    decoder->packet_length = (length > 0) ? (size_t)length : packet.bytes;
+    return NO_ERROR;
+}
+
+bool_t ffmpeg_decoder_can_remux(ffmpeg_decoder_t *decoder)
+{
+    return decoder != NULL && decoder->remux;
+}
+
+error_t ffmpeg_decoder_read_packet(ffmpeg_decoder_t *decoder, const uint8_t **packet, size_t *length)
+{
+    if (!ffmpeg_decoder_can_remux(decoder))
+    {
+        return ERROR_UNSUPPORTED_FEATURE;
+    }
+    if (decoder->packet_length == 0)
+    {
+        error_t error = ffmpeg_decoder_peek_opus(decoder);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+    }
+    if (!ffmpeg_decoder_remuxable(decoder->packet, decoder->packet_length))
+    {
+        /* the rest of the source gets decoded, starting with this packet */
+        TRACE_INFO("Opus packet not remuxable, decoding the rest of the source\r\n");
+        decoder->remux = false;
+        return ERROR_UNSUPPORTED_FEATURE;
+    }
+
+    *packet = decoder->packet;
+    *length = decoder->packet_length;
+    decoder->packet_length = 0;
+    return NO_ERROR;
+}
+
+/* offset is where the ogg stream starts, behind the header of a TAF */
+static bool_t ffmpeg_decoder_open_opus(ffmpeg_decoder_t *decoder, size_t skip_seconds, size_t offset)
+{
+    ogg_packet packet;
+
+    ogg_sync_init(&decoder->oy);
+    if (fsSeekFile(decoder->file, offset, FS_SEEK_SET) != NO_ERROR || ffmpeg_decoder_ogg_packet(decoder, &packet) != NO_ERROR)
+    {
+        return false;
+    }
+    if (packet.bytes < 19 || osMemcmp(packet.packet, "OpusHead", 8))
+    {
+        /* e.g. vorbis */
+        return false;
+    }
+    uint8_t channels = packet.packet[9];
+    uint16_t pre_skip = ffmpeg_decoder_le16(&packet.packet[10]);
+    int16_t gain = (int16_t)ffmpeg_decoder_le16(&packet.packet[16]);
+    uint8_t mapping_family = packet.packet[18];
+    if (channels < 1 || channels > 2 || mapping_family > 1)
+    {
+        return false;
+    }
+
+    /* the comment header */
+    if (ffmpeg_decoder_ogg_packet(decoder, &packet) != NO_ERROR)
+    {
+        return false;
+    }
+
+    int error = 0;
+    decoder->opus = opus_decoder_create(48000, 2, &error);
+    if (error != OPUS_OK)
+    {
+        decoder->opus = NULL;
+        return false;
+    }
+    opus_decoder_ctl(decoder->opus, OPUS_SET_GAIN(gain));
+    decoder->discard = pre_skip + skip_seconds * 48000;
+
+    /* the TAF header has a fixed pre-skip, so only untouched streams can be copied */
+    decoder->remux = (skip_seconds == 0 && pre_skip == OPUS_PRE_SKIP && gain == 0);
+    if (decoder->remux && ffmpeg_decoder_peek_opus(decoder) == NO_ERROR)
+    {
+        decoder->remux = ffmpeg_decoder_remuxable(decoder->packet, decoder->packet_length);
+    }
+
+    return true;
+}
+
+/* decodes local WAV and Ogg Opus files in-process, anything else goes to ffmpeg */
+static bool_t ffmpeg_decoder_open_native(ffmpeg_decoder_t *decoder, const char *source, size_t skip_seconds)
+{
+    if (!fsFileExists(source))
+    {
+        return false;
+    }
+    decoder->file = fsOpenFile(source, FS_FILE_MODE_READ);
+    if (decoder->file == NULL)
+    {
+        return false;
+    }
+
+    uint8_t magic[12];
+    size_t read = 0;
+    if (fsReadFile(decoder->file, magic, sizeof(magic), &read) == NO_ERROR && read == sizeof(magic))
+    {
+        if (!osMemcmp(magic, "RIFF", 4) && !osMemcmp(&magic[8], "WAVE", 4) && ffmpeg_decoder_open_wav(decoder, skip_seconds))
+        {
+            decoder->type = FFMPEG_DECODER_WAV;
+            return true;
+        }
+        if (!osMemcmp(magic, "OggS", 4) && ffmpeg_decoder_open_opus(decoder, skip_seconds, 0))
+        {
+            decoder->type = FFMPEG_DECODER_OPUS;
+            return true;
+        }
+        /* a TAF, the big endian size of the protobuf header and the ogg stream behind it */
+        if (magic[0] == 0x00 && magic[1] == 0x00 &&
+            fsSeekFile(decoder->file, TONIEFILE_FRAME_SIZE, FS_SEEK_SET) == NO_ERROR &&
+            fsReadFile(decoder->file, magic, 4, &read) == NO_ERROR && read == 4 &&
+            !osMemcmp(magic, "OggS", 4) && ffmpeg_decoder_open_opus(decoder, skip_seconds, TONIEFILE_FRAME_SIZE))
+        {
+            decoder->type = FFMPEG_DECODER_OPUS;
+            return true;
+        }
+    }
+
+    ffmpeg_decoder_close_native(decoder);
+    return false;
+}
+
+static ffmpeg_decoder_t *ffmpeg_decoder_create(const char *source, size_t skip_seconds, bool_t prefetch)
+{
+    ffmpeg_decoder_t *decoder = osAllocMem(sizeof(ffmpeg_decoder_t));
+    if (decoder == NULL)
+    {
+        return NULL;
+    }
+    osMemset(decoder, 0x00, offsetof(ffmpeg_decoder_t, buffer));
+
+    if (ffmpeg_decoder_open_native(decoder, source, skip_seconds))
+    {
+        TRACE_INFO("Decoding %s in-process\r\n", source);
+        return decoder;
+    }
+
+#ifdef FFMPEG_DECODING
+    if (!ffmpeg_decoder_acquire(prefetch))
+    {
+        osFreeMem(decoder);
+        return NULL;
+    }
+    decoder->type = FFMPEG_DECODER_FFMPEG;
+
+    TRACE_INFO("Start ffmpeg for %s%s...\r\n", prefetch ? "prefetching " : "decoding ", source);
+    if (ffmpeg_decoder_spawn(decoder, source, skip_seconds) != NO_ERROR)
+    {
+        TRACE_ERROR("Could not start ffmpeg\r\n");
+        osFreeMem(decoder);
+        ffmpeg_decoder_release();
+        return NULL;
+    }
+    return decoder;
+#else
+    osFreeMem(decoder);
+    return NULL;
+#endif
+}
+
+ffmpeg_decoder_t *ffmpeg_decoder_start(const char *source, size_t skip_seconds)
+{
+    return ffmpeg_decoder_create(source, skip_seconds, false);
+}
+
+ffmpeg_decoder_t *ffmpeg_decoder_prefetch(const char *source)
+{
+    return ffmpeg_decoder_create(source, 0, true);
+}
+
+/* refills the buffer, keeping a partial frame left from the last read */
+static error_t ffmpeg_decoder_fill(ffmpeg_decoder_t *decoder)
+{
+    if (decoder->pos > 0)
+    {
+        osMemmove(decoder->buffer, &decoder->buffer[decoder->pos], decoder->len - decoder->pos);
+        decoder->len -= decoder->pos;
+        decoder->pos = 0;
+    }
+
+    switch (decoder->type)
+    {
+    case FFMPEG_DECODER_WAV:
+        return ffmpeg_decoder_fill_wav(decoder);
+    case FFMPEG_DECODER_OPUS:
+        return ffmpeg_decoder_fill_opus(decoder);
+    default:
+        break;
+    }
+
+#ifdef _WIN32
+    size_t read = fread(&decoder->buffer[decoder->len], 1, FFMPEG_DECODER_BUFFER_SIZE - decoder->len, decoder->pipe);
+    if (read == 0)
+    {
+        decoder->eof = true;
+        return ERROR_END_OF_STREAM;
+    }
+    decoder->len += read;
+    return NO_ERROR;
+#else
+    while (true)
+    {
+        ssize_t bytes = read(decoder->fd, &decoder->buffer[decoder->len], FFMPEG_DECODER_BUFFER_SIZE - decoder->len);
+        if (bytes > 0)
+        {
+            decoder->len += bytes;
+            return NO_ERROR;
+        }
+        if (bytes == 0)
+        {
+            decoder->eof = true;
+            return ERROR_END_OF_STREAM;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            decoder->eof = true;
+            return ERROR_READ_FAILED;
+        }
+
+        struct pollfd pfd = {.fd = decoder->fd, .events = POLLIN};
+        if (poll(&pfd, 1, FFMPEG_DECODER_POLL_MS) == 0)
+        {
+            return ERROR_WOULD_BLOCK;
+        }
+    }
+#endif
+}
+
+error_t ffmpeg_decoder_read(ffmpeg_decoder_t *decoder, int16_t *buffer, size_t samples, size_t *samples_read)
+{
+    *samples_read = 0;
+
+    if (decoder == NULL)
+    {
+        return ERROR_ABORTED;
+    }
+
+    size_t wanted = samples * sizeof(int16_t);
+    wanted -= wanted % FFMPEG_DECODER_FRAME_SIZE;
+
+    error_t error = NO_ERROR;
+    size_t copied = 0;
+    while (copied < wanted)
+    {
+        size_t available = decoder->len - decoder->pos;
+        available -= available % FFMPEG_DECODER_FRAME_SIZE;
+        if (available == 0)
+        {
+            /* return what we have instead of waiting for more */
+            if (copied > 0 || decoder->eof)
+            {
+                break;
+            }
+            error = ffmpeg_decoder_fill(decoder);
+            if (error != NO_ERROR)
+            {
+                break;
+            }
+            continue;
+        }
+
+        size_t chunk = MIN(available, wanted - copied);
+        osMemcpy((uint8_t *)buffer + copied, &decoder->buffer[decoder->pos], chunk);
+        decoder->pos += chunk;
+        copied += chunk;
+    }
+
+    *samples_read = copied / sizeof(int16_t);
+    if (copied > 0)
+    {
+        return NO_ERROR;
+    }
+    if (decoder->eof && error == NO_ERROR)
+    {
+        return ERROR_END_OF_STREAM;
+    }
+    return error;
+}
+
+void ffmpeg_decoder_end(ffmpeg_decoder_t *decoder)
+{
+    if (decoder == NULL)
+    {
+        return;
+    }
+
+    if (decoder->type != FFMPEG_DECODER_FFMPEG)
+    {
+        ffmpeg_decoder_close_native(decoder);
+        osFreeMem(decoder);
+        return;
+    }
+
+#ifdef _WIN32
+    int error_code = osPclose(decoder->pipe);
+#else
+    close(decoder->fd);
+    if (!decoder->eof)
+    {
+        /* a source stalled on the network would not notice the closed pipe */
+        kill(decoder->pid, SIGTERM);
+    }
+    int status = 0;
+    while (waitpid(decoder->pid, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    int error_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+    TRACE_INFO("Stopped ffmpeg with error code=%i...\r\n", error_code);
+
+    osFreeMem(decoder);
+    ffmpeg_decoder_release();
+}
@@ -1,5 +1,18 @@
 
 #include "fs_ext.h"
+#include "server_helpers.h"
+
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <fcntl.h>
+#include <utime.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#endif
 
 #define FILE_COPY_BUFFER_SIZE 4096 // You can adjust this buffer size as needed
 
@@ -103,18 +116,23 @@ error_t fsCompareFiles(const char_t *source_path, const char_t *target_path, siz
     return error;
 }
 
-error_t fsCopyFile(const char_t *source_path, const char_t *target_path, bool_t overwrite)
+static bool_t fsSameFile(const char_t *path1, const char_t *path2)
 {
-    // Check if source_path and target_path are not NULL
-    if (source_path == NULL || target_path == NULL)
-        return ERROR_INVALID_FILE;
-
-    if (!overwrite && fsFileExists(target_path))
-        return ERROR_NOT_WRITABLE;
+    if (!osStrcmp(path1, path2))
+        return true;
+#ifndef _WIN32
+    // Also hardlinks of each other
+    struct stat st1;
+    struct stat st2;
+    if (stat(path1, &st1) == 0 && stat(path2, &st2) == 0)
+        return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+#endif
+    return false;
+}
 
+static error_t fsCopyFileData(const char_t *source_path, const char_t *target_path)
+{
     // Open the source file for reading
-    if (!fsFileExists(source_path))
-        return ERROR_FILE_NOT_FOUND;
     FsFile *source_file = fsOpenFileEx(source_path, "rb");
     if (source_file == NULL)
         return ERROR_FILE_OPENING_FAILED;
@@ -148,6 +166,43 @@ error_t fsCopyFile(const char_t *source_path, const char_t *target_path, bool_t
 
     return error;
 }
+
+error_t fsCopyFile(const char_t *source_path, const char_t *target_path, bool_t overwrite)
+{
+    // Check if source_path and target_path are not NULL
+    if (source_path == NULL || target_path == NULL)
+        return ERROR_INVALID_FILE;
+
+    if (!overwrite && fsFileExists(target_path))
+        return ERROR_NOT_WRITABLE;
+
+    if (!fsFileExists(source_path))
+        return ERROR_FILE_NOT_FOUND;
+
+    // Nothing to copy, opening the target for writing would truncate the source
+    if (fsSameFile(source_path, target_path))
+        return NO_ERROR;
+
+    // Copy to a temporary file that replaces the target once complete. The target
+    // is kept if the copy fails, and other hardlinks of it are left unchanged.
+    char_t *tmp_path = custom_asprintf("%s.copy", target_path);
+    error_t error = fsCopyFileData(source_path, tmp_path);
+    if (error == NO_ERROR)
+    {
+        error = fsRenameFile(tmp_path, target_path);
+        if (error != NO_ERROR && overwrite)
+        {
+            // Windows does not rename over an existing file
+            fsDeleteFile(target_path);
+            error = fsRenameFile(tmp_path, target_path);
+        }
+    }
+    if (error != NO_ERROR)
+        fsDeleteFile(tmp_path);
+    osFreeMem(tmp_path);
+
+    return error;
+}
 error_t fsMoveFile(const char_t *source_path, const char_t *target_path, bool_t overwrite)
 {
     error_t error = fsRenameFile(source_path, target_path);
@@ -206,4 +261,93 @@ error_t fsCreateDirEx(const char_t *path, bool_t recursive)
         free(path_copy);
     }
     return fsCreateDir(path);
-}
\ No newline at end of file
+}
+
+error_t fsLinkFile(const char_t *source_path, const char_t *target_path)
+{
+#ifdef _WIN32
+    // Not used on Windows, in-place writers could not tell a hardlink from a copy
+    return ERROR_NOT_IMPLEMENTED;
+#else
+    if (source_path == NULL || target_path == NULL)
+        return ERROR_INVALID_FILE;
+
+    if (link(source_path, target_path) != 0)
+        return ERROR_FAILURE;
+
+    return NO_ERROR;
+#endif
+}
+
+error_t fsCloneFile(const char_t *source_path, const char_t *target_path)
+{
+#if defined(__linux__) && defined(FICLONE)
+    if (source_path == NULL || target_path == NULL)
+        return ERROR_INVALID_FILE;
+
+    int source = open(source_path, O_RDONLY);
+    if (source < 0)
+        return ERROR_FILE_OPENING_FAILED;
+
+    int target = open(target_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (target < 0)
+    {
+        close(source);
+        return ERROR_FILE_OPENING_FAILED;
+    }
+
+    // Shares the extents copy-on-write, fails on filesystems without reflinks
+    int ret = ioctl(target, FICLONE, source);
+    close(target);
+    close(source);
+
+    if (ret != 0)
+    {
+        unlink(target_path);
+        return ERROR_NOT_IMPLEMENTED;
+    }
+
+    return NO_ERROR;
+#else
+    return ERROR_NOT_IMPLEMENTED;
+#endif
+}
+
+error_t fsUnshareFile(const char_t *path)
+{
+#ifndef _WIN32
+    struct stat st;
+
+    if (path == NULL || stat(path, &st) != 0 || st.st_nlink <= 1)
+        return NO_ERROR;
+
+    // Replace the hardlink by a copy of its own before writing to it in place
+    char_t *tmp_path = custom_asprintf("%s.unshare", path);
+
+    error_t error = fsCopyFile(path, tmp_path, true);
+    if (error == NO_ERROR)
+        error = fsMoveFile(tmp_path, path, true);
+    if (error != NO_ERROR)
+        fsDeleteFile(tmp_path);
+    osFreeMem(tmp_path);
+
+    return error;
+#else
+    return NO_ERROR;
+#endif
+}
+
+error_t fsTouchFile(const char_t *path)
+{
+    if (path == NULL)
+        return ERROR_INVALID_FILE;
+
+#ifdef _WIN32
+    if (_utime(path, NULL) != 0)
+#else
+    if (utime(path, NULL) != 0)
+#endif
+        return ERROR_FAILURE;
+
+    return NO_ERROR;
+}
@@ -0,0 +1,307 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gzip_fuzz.h"
+
+#include "gzip_stream.h"
+#include "os_port.h"
+#include "debug.h"
+
+#define GZIP_FUZZ_END_OF_BLOCK 256
+
+typedef struct
+{
+    uint8_t *data;
+    size_t length;
+    size_t alloc;
+} gzip_fuzz_buffer_t;
+
+static error_t gzip_fuzz_output(void *ctx, const void *data, size_t length)
+{
+    gzip_fuzz_buffer_t *buffer = (gzip_fuzz_buffer_t *)ctx;
+    if (buffer->length + length > buffer->alloc)
+    {
+        size_t alloc = MAX(2 * buffer->alloc, buffer->length + length);
+        uint8_t *grown = osAllocMem(alloc);
+        if (grown == NULL)
+        {
+            return ERROR_OUT_OF_MEMORY;
+        }
+        if (buffer->length > 0)
+        {
+            osMemcpy(grown, buffer->data, buffer->length);
+        }
+        osFreeMem(buffer->data);
+        buffer->data = grown;
+        buffer->alloc = alloc;
+    }
+    osMemcpy(&buffer->data[buffer->length], data, length);
+    buffer->length += length;
+    return NO_ERROR;
+}
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t length;
+    size_t pos;
+    uint32_t bit;
+    bool_t overrun;
+} gzip_fuzz_reader_t;
+
+static uint32_t gzip_fuzz_bits(gzip_fuzz_reader_t *reader, uint32_t count)
+{
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (reader->pos >= reader->length)
+        {
+            reader->overrun = true;
+            return 0;
+        }
+        value |= ((reader->data[reader->pos] >> reader->bit) & 1) << i;
+        if (++reader->bit == 8)
+        {
+            reader->bit = 0;
+            reader->pos++;
+        }
+    }
+    return value;
+}
+
+/* Huffman codes come most significant bit first */
+static uint32_t gzip_fuzz_code(gzip_fuzz_reader_t *reader, uint32_t length)
+{
+    uint32_t code = 0;
+    for (uint32_t i = 0; i < length; i++)
+    {
+        code = (code << 1) | gzip_fuzz_bits(reader, 1);
+    }
+    return code;
+}
+
+static uint32_t gzip_fuzz_symbol(gzip_fuzz_reader_t *reader)
+{
+    uint32_t code = gzip_fuzz_code(reader, 7);
+    if (code < 0x18)
+    {
+        return 256 + code;
+    }
+    code = (code << 1) | gzip_fuzz_bits(reader, 1);
+    if (code >= 0x30 && code < 0xC0)
+    {
+        return code - 0x30;
+    }
+    if (code >= 0xC0 && code < 0xC8)
+    {
+        return 280 + code - 0xC0;
+    }
+    code = (code << 1) | gzip_fuzz_bits(reader, 1);
+    return 144 + code - 0x190;
+}
+
+/* inflates the fixed code blocks gzip_stream writes and checks the trailer, other block types are errors */
+static error_t gzip_fuzz_inflate(const uint8_t *data, size_t length, uint8_t *out, size_t out_max, size_t *out_length)
+{
+    gzip_fuzz_reader_t reader = {.data = data, .length = length};
+    size_t pos = 0;
+
+    if (length < 18 || data[0] != 0x1F || data[1] != 0x8B || data[2] != 0x08 || data[3] != 0x00)
+    {
+        return ERROR_INVALID_HEADER;
+    }
+    reader.pos = 10;
+
+    bool_t final = false;
+    while (!final)
+    {
+        final = gzip_fuzz_bits(&reader, 1);
+        if (gzip_fuzz_bits(&reader, 2) != 1)
+        {
+            return ERROR_INVALID_SYNTAX;
+        }
+        while (!reader.overrun)
+        {
+            uint32_t symbol = gzip_fuzz_symbol(&reader);
+            if (symbol < 256)
+            {
+                if (pos >= out_max)
+                {
+                    return ERROR_BUFFER_OVERFLOW;
+                }
+                out[pos++] = symbol;
+                continue;
+            }
+            if (symbol == GZIP_FUZZ_END_OF_BLOCK)
+            {
+                break;
+            }
+            symbol -= 257;
+            if (symbol >= 29)
+            {
+                return ERROR_INVALID_SYNTAX;
+            }
+            size_t match = gzip_length_base[symbol] + gzip_fuzz_bits(&reader, gzip_length_extra[symbol]);
+            uint32_t code = gzip_fuzz_code(&reader, 5);
+            if (code >= 30)
+            {
+                return ERROR_INVALID_SYNTAX;
+            }
+            size_t distance = gzip_dist_base[code] + gzip_fuzz_bits(&reader, gzip_dist_extra[code]);
+            if (distance > pos || distance > GZIP_STREAM_WINDOW_SIZE || match > out_max - pos)
+            {
+                return ERROR_INVALID_SYNTAX;
+            }
+            for (size_t i = 0; i < match; i++, pos++)
+            {
+                out[pos] = out[pos - distance];
+            }
+        }
+        if (reader.overrun)
+        {
+            return ERROR_INVALID_LENGTH;
+        }
+    }
+
+    if (reader.bit > 0)
+    {
+        reader.bit = 0;
+        reader.pos++;
+    }
+    if (reader.pos + 8 != length)
+    {
+        return ERROR_INVALID_LENGTH;
+    }
+    const uint8_t *trailer = &data[reader.pos];
+    uint32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t)trailer[3] << 24);
+    uint32_t size = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((uint32_t)trailer[7] << 24);
+    if (crc != gzip_crc32(0, out, pos) || size != (uint32_t)pos)
+    {
+        return ERROR_WRONG_CHECKSUM;
+    }
+    *out_length = pos;
+
+    return NO_ERROR;
+}
+
+/* random bytes, runs, JSON like text, or blocks repeating at about the window size */
+static size_t gzip_fuzz_input(uint8_t *data)
+{
+    static const char *words[] = {"{\"id\":", "\"title\":\"", "Tonie", "\",", "\"audio_id\":[", "]}", ",", "\"pic\":\"https://", "0", "1", "2", "3"};
+    size_t length = rand() % (GZIP_FUZZ_INPUT_MAX + 1);
+    size_t pos = 0;
+
+    switch (rand() % 4)
+    {
+    case 0:
+        for (pos = 0; pos < length; pos++)
+        {
+            data[pos] = rand();
+        }
+        break;
+    case 1:
+        while (pos < length)
+        {
+            uint8_t byte = rand() % 3;
+            for (size_t run = 1 + rand() % 600; run > 0 && pos < length; run--)
+            {
+                data[pos++] = byte;
+            }
+        }
+        break;
+    case 2:
+        while (pos < length)
+        {
+            const char *word = words[rand() % (sizeof(words) / sizeof(words[0]))];
+            for (size_t i = 0; word[i] != '\0' && pos < length; i++)
+            {
+                data[pos++] = word[i];
+            }
+        }
+        break;
+    default:
+    {
+        size_t period = GZIP_STREAM_WINDOW_SIZE - 8 + rand() % 16;
+        for (pos = 0; pos < length; pos++)
+        {
+            data[pos] = (pos < period) ? rand() : data[pos - period];
+        }
+        break;
+    }
+    }
+
+    return length;
+}
+
+error_t gzip_fuzz_run(uint32_t count)
+{
+    uint32_t seed = (uint32_t)time(NULL);
+    uint32_t failures = 0;
+    gzip_fuzz_buffer_t compressed = {0};
+
+    uint8_t *input = osAllocMem(GZIP_FUZZ_INPUT_MAX);
+    uint8_t *output = osAllocMem(GZIP_FUZZ_INPUT_MAX);
+    if (input == NULL || output == NULL)
+    {
+        osFreeMem(input);
+        osFreeMem(output);
+        return ERROR_OUT_OF_MEMORY;
+    }
+
+    TRACE_WARNING("**********************************\r\n");
+    TRACE_WARNING("Seed:             %" PRIu32 "\r\n", seed);
+    srand(seed);
+
+    for (uint32_t run = 0; run < count; run++)
+    {
+        size_t length = gzip_fuzz_input(input);
+        size_t total_out = 0;
+        size_t inflated = 0;
+
+        /* unknown, exact or too small, the last one writes past the sized window */
+        size_t hint = (size_t[]){0, length, length / 2}[rand() % 3];
+
+        compressed.length = 0;
+        gzip_stream_t *gzip = gzip_stream_start(&gzip_fuzz_output, &compressed, hint);
+        if (gzip == NULL)
+        {
+            failures++;
+            break;
+        }
+        /* written in pieces of any size, like a listing or a file */
+        for (size_t pos = 0; pos < length;)
+        {
+            size_t piece = 1 + (size_t)rand() % (rand() % 2 ? 64 : 3 * GZIP_STREAM_WINDOW_SIZE);
+            piece = MIN(piece, length - pos);
+            gzip_stream_write(gzip, &input[pos], piece);
+            pos += piece;
+        }
+        error_t error = gzip_stream_finish(gzip, &total_out);
+        if (error == NO_ERROR && total_out != compressed.length)
+        {
+            error = ERROR_INVALID_LENGTH;
+        }
+        if (error == NO_ERROR)
+        {
+            error = gzip_fuzz_inflate(compressed.data, compressed.length, output, GZIP_FUZZ_INPUT_MAX, &inflated);
+        }
+        if (error != NO_ERROR || inflated != length || osMemcmp(input, output, length))
+        {
+            TRACE_ERROR("Run %" PRIu32 ": %" PRIuSIZE " bytes compressed to %" PRIuSIZE " did not inflate back (%s)\r\n", run, length, compressed.length, error2text(error));
+            failures++;
+        }
+    }
+
+    TRACE_WARNING("Runs:             %" PRIu32 "\r\n", count);
+    TRACE_WARNING("Failures:         %" PRIu32 "\r\n", failures);
+    TRACE_WARNING("**********************************\r\n");
+
+    osFreeMem(compressed.data);
+    osFreeMem(input);
+    osFreeMem(output);
+
+    return failures ? ERROR_FAILURE : NO_ERROR;
+}
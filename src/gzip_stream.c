@@ -0,0 +1,557 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "gzip_stream.h"
+
+#include "fs_ext.h"
+#include "fs_port.h"
+#include "os_port.h"
+#include "date_time.h"
+#include "debug.h"
+#include "server_helpers.h"
+#include "settings.h"
+
+#define GZIP_MIN_MATCH 3
+#define GZIP_MAX_MATCH 258
+/* positions are only encoded while a full match could follow, until finish */
+#define GZIP_MIN_LOOKAHEAD (GZIP_MAX_MATCH + GZIP_MIN_MATCH + 1)
+#define GZIP_END_OF_BLOCK 256
+
+const uint16_t gzip_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t gzip_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t gzip_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const uint8_t gzip_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/* CRC-32 (IEEE 802.3, reflected), one nibble at a time */
+static const uint32_t gzip_crc_table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+uint32_t gzip_crc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ gzip_crc_table[crc & 0x0F];
+        crc = (crc >> 4) ^ gzip_crc_table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+static void gzip_flush_output(gzip_stream_t *gzip)
+{
+    if (gzip->out_used > 0 && gzip->error == NO_ERROR)
+    {
+        gzip->error = gzip->output(gzip->ctx, gzip->out, gzip->out_used);
+    }
+    gzip->total_out += gzip->out_used;
+    gzip->out_used = 0;
+}
+
+static void gzip_put_byte(gzip_stream_t *gzip, uint8_t byte)
+{
+    gzip->out[gzip->out_used++] = byte;
+    if (gzip->out_used == sizeof(gzip->out))
+    {
+        gzip_flush_output(gzip);
+    }
+}
+
+/* deflate packs values starting at the least significant bit */
+static void gzip_put_bits(gzip_stream_t *gzip, uint32_t value, uint32_t count)
+{
+    gzip->bits |= value << gzip->bit_count;
+    gzip->bit_count += count;
+    while (gzip->bit_count >= 8)
+    {
+        gzip_put_byte(gzip, gzip->bits & 0xFF);
+        gzip->bits >>= 8;
+        gzip->bit_count -= 8;
+    }
+}
+
+/* Huffman codes are stored starting with their most significant bit */
+static void gzip_put_code(gzip_stream_t *gzip, uint32_t code, uint32_t length)
+{
+    uint32_t reversed = 0;
+    for (uint32_t i = 0; i < length; i++)
+    {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    gzip_put_bits(gzip, reversed, length);
+}
+
+static void gzip_put_symbol(gzip_stream_t *gzip, uint32_t symbol)
+{
+    if (symbol < 144)
+    {
+        gzip_put_code(gzip, 0x30 + symbol, 8);
+    }
+    else if (symbol < 256)
+    {
+        gzip_put_code(gzip, 0x190 + symbol - 144, 9);
+    }
+    else if (symbol < 280)
+    {
+        gzip_put_code(gzip, symbol - 256, 7);
+    }
+    else
+    {
+        gzip_put_code(gzip, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static void gzip_put_match(gzip_stream_t *gzip, size_t length, size_t distance)
+{
+    uint32_t code = 28;
+    while (gzip_length_base[code] > length)
+    {
+        code--;
+    }
+    gzip_put_symbol(gzip, 257 + code);
+    gzip_put_bits(gzip, length - gzip_length_base[code], gzip_length_extra[code]);
+
+    code = 29;
+    while (gzip_dist_base[code] > distance)
+    {
+        code--;
+    }
+    gzip_put_code(gzip, code, 5);
+    gzip_put_bits(gzip, distance - gzip_dist_base[code], gzip_dist_extra[code]);
+}
+
+/* all three bytes stay in the hash, whatever its size */
+static uint32_t gzip_hash(gzip_stream_t *gzip, const uint8_t *data)
+{
+    uint32_t shift = gzip->hash_shift;
+    return ((data[0] << (2 * shift)) ^ (data[1] << shift) ^ data[2]) & ((1 << gzip->hash_bits) - 1);
+}
+
+/* moves the upper half of the window down, positions older than the window are dropped */
+static void gzip_slide(gzip_stream_t *gzip)
+{
+    int32_t window_size = gzip->window_size;
+
+    osMemcpy(gzip->window, &gzip->window[window_size], window_size);
+    gzip->pos -= window_size;
+
+    for (size_t i = 0; i < (1U << gzip->hash_bits); i++)
+    {
+        gzip->head[i] = gzip->head[i] >= window_size ? gzip->head[i] - window_size : -1;
+    }
+    for (int32_t i = 0; i < window_size; i++)
+    {
+        gzip->prev[i] = gzip->prev[i] >= window_size ? gzip->prev[i] - window_size : -1;
+    }
+}
+
+static void gzip_insert(gzip_stream_t *gzip, size_t pos)
+{
+    uint32_t hash = gzip_hash(gzip, &gzip->window[pos]);
+    gzip->prev[pos & (gzip->window_size - 1)] = gzip->head[hash];
+    gzip->head[hash] = pos;
+}
+
+static void gzip_deflate(gzip_stream_t *gzip, bool_t finish)
+{
+    while (gzip->lookahead >= (finish ? 1 : GZIP_MIN_LOOKAHEAD))
+    {
+        size_t best_length = 0;
+        size_t best_distance = 0;
+
+        if (gzip->lookahead >= GZIP_MIN_MATCH)
+        {
+            const uint8_t *current = &gzip->window[gzip->pos];
+            size_t max_length = MIN(gzip->lookahead, GZIP_MAX_MATCH);
+            int32_t candidate = gzip->head[gzip_hash(gzip, current)];
+            uint32_t chain = GZIP_STREAM_MAX_CHAIN;
+
+            gzip_insert(gzip, gzip->pos);
+
+            /* a distance of a full window would read a slot that was just reused */
+            while (candidate >= 0 && gzip->pos - candidate < gzip->window_size && chain-- > 0)
+            {
+                const uint8_t *match = &gzip->window[candidate];
+                if (match[best_length] == current[best_length] && match[0] == current[0])
+                {
+                    size_t length = 1;
+                    while (length < max_length && match[length] == current[length])
+                    {
+                        length++;
+                    }
+                    if (length > best_length)
+                    {
+                        best_length = length;
+                        best_distance = gzip->pos - candidate;
+                        if (length == max_length)
+                        {
+                            break;
+                        }
+                    }
+                }
+                candidate = gzip->prev[candidate & (gzip->window_size - 1)];
+            }
+        }
+
+        if (best_length >= GZIP_MIN_MATCH)
+        {
+            gzip_put_match(gzip, best_length, best_distance);
+            for (size_t i = 1; i < best_length; i++)
+            {
+                if (gzip->lookahead - i >= GZIP_MIN_MATCH)
+                {
+                    gzip_insert(gzip, gzip->pos + i);
+                }
+            }
+            gzip->pos += best_length;
+            gzip->lookahead -= best_length;
+        }
+        else
+        {
+            gzip_put_symbol(gzip, gzip->window[gzip->pos]);
+            gzip->pos++;
+            gzip->lookahead--;
+        }
+    }
+}
+
+gzip_stream_t *gzip_stream_start(gzip_stream_output_t output, void *ctx, size_t size_hint)
+{
+    /* the smallest window that never slides for the body, a full one if unknown */
+    uint32_t window_bits = GZIP_STREAM_WINDOW_BITS;
+    if (size_hint > 0)
+    {
+        window_bits = GZIP_STREAM_MIN_WINDOW_BITS;
+        while (window_bits < GZIP_STREAM_WINDOW_BITS && (1U << window_bits) < size_hint)
+        {
+            window_bits++;
+        }
+    }
+    size_t window_size = (size_t)1 << window_bits;
+    size_t hash_size = (size_t)1 << window_bits;
+
+    /* head and prev right behind the struct keep their alignment, the window follows */
+    gzip_stream_t *gzip = osAllocMem(sizeof(gzip_stream_t) + (hash_size + window_size) * sizeof(int32_t) + 2 * window_size);
+    if (gzip == NULL)
+    {
+        return NULL;
+    }
+    osMemset(gzip, 0x00, sizeof(gzip_stream_t));
+    gzip->output = output;
+    gzip->ctx = ctx;
+    gzip->window_size = window_size;
+    gzip->hash_bits = window_bits;
+    gzip->hash_shift = (window_bits + GZIP_MIN_MATCH - 1) / GZIP_MIN_MATCH;
+    gzip->head = (int32_t *)&gzip[1];
+    gzip->prev = &gzip->head[hash_size];
+    gzip->window = (uint8_t *)&gzip->prev[window_size];
+    osMemset(gzip->head, 0xFF, (hash_size + window_size) * sizeof(int32_t));
+
+    /* magic, deflate, no flags, no mtime, no extra flags, unix */
+    static const uint8_t header[10] = {0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03};
+    for (size_t i = 0; i < sizeof(header); i++)
+    {
+        gzip_put_byte(gzip, header[i]);
+    }
+
+    /* one non-final block with fixed codes for the whole stream */
+    gzip_put_bits(gzip, 0, 1);
+    gzip_put_bits(gzip, 1, 2);
+
+    return gzip;
+}
+
+error_t gzip_stream_write(gzip_stream_t *gzip, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    gzip->crc = gzip_crc32(gzip->crc, bytes, length);
+    gzip->size += length;
+
+    while (length > 0 && gzip->error == NO_ERROR)
+    {
+        if (gzip->pos >= 2 * gzip->window_size - GZIP_MIN_LOOKAHEAD)
+        {
+            gzip_slide(gzip);
+        }
+        size_t end = gzip->pos + gzip->lookahead;
+        size_t chunk = MIN(length, 2 * gzip->window_size - end);
+
+        osMemcpy(&gzip->window[end], bytes, chunk);
+        gzip->lookahead += chunk;
+        bytes += chunk;
+        length -= chunk;
+
+        gzip_deflate(gzip, false);
+    }
+
+    return gzip->error;
+}
+
+error_t gzip_stream_finish(gzip_stream_t *gzip, size_t *total_out)
+{
+    gzip_deflate(gzip, true);
+    gzip_put_symbol(gzip, GZIP_END_OF_BLOCK);
+
+    /* empty final block */
+    gzip_put_bits(gzip, 1, 1);
+    gzip_put_bits(gzip, 1, 2);
+    gzip_put_symbol(gzip, GZIP_END_OF_BLOCK);
+    if (gzip->bit_count > 0)
+    {
+        gzip_put_bits(gzip, 0, 8 - gzip->bit_count);
+    }
+
+    for (size_t i = 0; i < 4; i++)
+    {
+        gzip_put_byte(gzip, (gzip->crc >> (8 * i)) & 0xFF);
+    }
+    for (size_t i = 0; i < 4; i++)
+    {
+        gzip_put_byte(gzip, (gzip->size >> (8 * i)) & 0xFF);
+    }
+    gzip_flush_output(gzip);
+
+    error_t error = gzip->error;
+    if (total_out != NULL)
+    {
+        *total_out = gzip->total_out;
+    }
+    osFreeMem(gzip);
+
+    return error;
+}
+
+static error_t gzip_file_output(void *ctx, const void *data, size_t length)
+{
+    return fsWriteFile((FsFile *)ctx, (void *)data, length);
+}
+
+static bool_t gzip_precompress_wanted(const char *name)
+{
+    static const char *extensions[] = {".html", ".htm", ".js", ".mjs", ".css", ".json", ".svg", ".txt", ".map", ".xml", ".webmanifest"};
+    const char *extension = strrchr(name, '.');
+
+    if (extension == NULL)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+    {
+        if (!osStrcasecmp(extension, extensions[i]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+error_t gzip_precompress_file(const char *path)
+{
+    FsFileStat stat;
+    FsFileStat statGz;
+
+    if (fsGetFileStat(path, &stat) != NO_ERROR)
+    {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    char *pathGz = custom_asprintf("%s.gz", path);
+    if (stat.size < GZIP_PRECOMPRESS_MIN_SIZE)
+    {
+        /* a stale variant of a file that shrunk must not be served */
+        if (fsFileExists(pathGz))
+        {
+            fsDeleteFile(pathGz);
+        }
+        osFreeMem(pathGz);
+        return NO_ERROR;
+    }
+    if (fsGetFileStat(pathGz, &statGz) == NO_ERROR &&
+        convertDateToUnixTime(&statGz.modified) >= convertDateToUnixTime(&stat.modified))
+    {
+        osFreeMem(pathGz);
+        return NO_ERROR;
+    }
+
+    char *pathTmp = custom_asprintf("%s.gz.tmp", path);
+    FsFile *source = fsOpenFile(path, FS_FILE_MODE_READ);
+    FsFile *target = fsOpenFile(pathTmp, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    gzip_stream_t *gzip = (source && target) ? gzip_stream_start(&gzip_file_output, target, stat.size) : NULL;
+    error_t error = gzip ? NO_ERROR : ERROR_FAILURE;
+
+    uint8_t *buffer = osAllocMem(GZIP_STREAM_OUTPUT_SIZE);
+    while (error == NO_ERROR)
+    {
+        size_t read = 0;
+        if (fsReadFile(source, buffer, GZIP_STREAM_OUTPUT_SIZE, &read) != NO_ERROR || read == 0)
+        {
+            break;
+        }
+        error = gzip_stream_write(gzip, buffer, read);
+    }
+    osFreeMem(buffer);
+
+    size_t compressed = 0;
+    if (gzip != NULL)
+    {
+        error_t finishError = gzip_stream_finish(gzip, &compressed);
+        error = error == NO_ERROR ? finishError : error;
+    }
+    if (source != NULL)
+    {
+        fsCloseFile(source);
+    }
+    if (target != NULL)
+    {
+        fsCloseFile(target);
+    }
+
+    if (error == NO_ERROR)
+    {
+        error = fsMoveFile(pathTmp, pathGz, true);
+    }
+    if (error != NO_ERROR)
+    {
+        TRACE_WARNING("Could not precompress '%s': %s\r\n", path, error2text(error));
+        fsDeleteFile(pathTmp);
+    }
+    else
+    {
+        TRACE_DEBUG("Precompressed '%s' %" PRIu32 " -> %" PRIuSIZE " bytes\r\n", path, stat.size, compressed);
+    }
+    osFreeMem(pathTmp);
+    osFreeMem(pathGz);
+
+    return error;
+}
+
+void gzip_precompress_dir(const char *path)
+{
+    FsDir *dir = fsOpenDir(path);
+    FsDirEntry entry;
+
+    if (dir == NULL)
+    {
+        return;
+    }
+    while (fsReadDir(dir, &entry) == NO_ERROR)
+    {
+        if (!osStrcmp(entry.name, ".") || !osStrcmp(entry.name, ".."))
+        {
+            continue;
+        }
+        char *entryPath = custom_asprintf("%s%c%s", path, PATH_SEPARATOR, entry.name);
+        if (entry.attributes & FS_FILE_ATTR_DIRECTORY)
+        {
+            gzip_precompress_dir(entryPath);
+        }
+        else if (gzip_precompress_wanted(entry.name))
+        {
+            gzip_precompress_file(entryPath);
+        }
+        osFreeMem(entryPath);
+    }
+    fsCloseDir(dir);
+}
+
+static void gzip_precompress_task(void *param)
+{
+    gzip_precompress_dir(settings_get_string("internal.wwwdirfull"));
+
+    char *toniesPath = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIES_JSON_FILE);
+    gzip_precompress_file(toniesPath);
+    osFreeMem(toniesPath);
+
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void gzip_precompress_start()
+{
+    if (!settings_get_bool("core.gzip_precompress"))
+    {
+        return;
+    }
+    if (osCreateTask("Precompress", &gzip_precompress_task, NULL, 16 * 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Failed to start precompression task\r\n");
+    }
+}
+
+static error_t gzip_bench_output(void *ctx, const void *data, size_t length)
+{
+    /* chunked transfer encoding adds "<hex length>\r\n" and "\r\n" per chunk */
+    char chunkHeader[16];
+    *(size_t *)ctx += length + osSprintf(chunkHeader, "%zX\r\n", length) + 2;
+    return NO_ERROR;
+}
+
+error_t gzip_bench_run(const char *path, uint32_t count)
+{
+    uint32_t size = 0;
+    if (fsGetFileSize(path, &size) != NO_ERROR || size == 0)
+    {
+        TRACE_ERROR("Cannot read '%s'\r\n", path);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    uint8_t *data = osAllocMem(size);
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+    size_t read = 0;
+    if (data == NULL || file == NULL || fsReadFile(file, data, size, &read) != NO_ERROR || read != size)
+    {
+        TRACE_ERROR("Cannot read '%s'\r\n", path);
+        if (file != NULL)
+        {
+            fsCloseFile(file);
+        }
+        osFreeMem(data);
+        return ERROR_READ_FAILED;
+    }
+    fsCloseFile(file);
+
+    size_t compressed = 0;
+    size_t wire = 0;
+    clock_t start = clock();
+    for (uint32_t run = 0; run < count; run++)
+    {
+        wire = 0;
+        gzip_stream_t *gzip = gzip_stream_start(&gzip_bench_output, &wire, size);
+        if (gzip == NULL)
+        {
+            osFreeMem(data);
+            return ERROR_OUT_OF_MEMORY;
+        }
+        /* fed in the chunks the file index writer uses */
+        for (size_t pos = 0; pos < size; pos += GZIP_STREAM_OUTPUT_SIZE)
+        {
+            gzip_stream_write(gzip, &data[pos], MIN(GZIP_STREAM_OUTPUT_SIZE, size - pos));
+        }
+        gzip_stream_finish(gzip, &compressed);
+        /* terminating chunk */
+        wire += 5;
+    }
+    double cpu_ms = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC / count;
+    osFreeMem(data);
+
+    TRACE_WARNING("**********************************\r\n");
+    TRACE_WARNING("File:             %s\r\n", path);
+    TRACE_WARNING("Runs:             %" PRIu32 "\r\n", count);
+    TRACE_WARNING("Uncompressed:     %" PRIu32 " bytes\r\n", size);
+    TRACE_WARNING("Compressed:       %" PRIuSIZE " bytes (%.1f%%)\r\n", compressed, 100.0 * compressed / size);
+    TRACE_WARNING("On the wire:      %" PRIuSIZE " bytes chunked\r\n", wire);
+    TRACE_WARNING("CPU per response: %.3f ms (%.1f MB/s)\r\n", cpu_ms, cpu_ms > 0 ? size / cpu_ms / 1000.0 : 0);
+    TRACE_WARNING("**********************************\r\n");
+
+    return NO_ERROR;
+}
@@ -1,6 +1,9 @@
 #include "handler.h"
 #include "server_helpers.h"
 #include "fs_ext.h"
+#include "content_prefetch.h"
+#include "gzip_stream.h"
+#include "content_store.h"
 
 void fillBaseCtx(HttpConnection *connection, const char_t *uri, const char_t *queryString, cloudapi_t api, cbr_ctx_t *ctx, client_ctx_t *client_ctx)
 {
@@ -199,6 +202,16 @@ void cbrCloudHeaderPassthrough(void *src_ctx, HttpClientContext *cloud_ctx, cons
     }
     switch (ctx->api)
     {
+    case V2_CONTENT:
+        if (cloud_ctx->statusCode == 200)
+        {
+            content_flight_add_header(ctx->flight, cloud_ctx->version, header, value);
+            if (header && osStrcmp(header, "Content-Length") == 0)
+            {
+                content_flight_set_length(ctx->flight, strtoul(value, NULL, 10));
+            }
+        }
+        break;
     case V1_FRESHNESS_CHECK:
         if (!header || osStrcmp(header, "Content-Length") == 0) // Skip empty line at the and + contentlen
         {
@@ -242,6 +255,82 @@ bool fillCbrBodyCache(cbr_ctx_t *ctx, HttpClientContext *httpClientContext, cons
     return (ctx->bufferPos == ctx->bufferLen);
 }
 
+void cacheContentToLibrary(const char *contentPath, settings_t *settings)
+{
+    tonie_info_t *tonieInfo = getTonieInfo(contentPath, settings);
+    if (tonieInfo->valid)
+    {
+        uint32_t audioId = tonieInfo->tafHeader->audio_id;
+        if (audioId <= 1)
+        {
+            TRACE_WARNING(">> Audio ID is %" PRIu32 ", not moving to library\r\n", audioId);
+        }
+        else
+        {
+            char *libraryByPath = custom_asprintf("%s/by", settings->internal.librarydirfull);
+            char *libraryBasePath = custom_asprintf("%s/audioID", libraryByPath);
+            char *libraryPath = custom_asprintf("%s/%" PRIu32 ".taf", libraryBasePath, audioId);
+
+            fsCreateDir(libraryByPath);
+            fsCreateDir(libraryBasePath);
+
+            tonie_info_t *tonieInfoLib = getTonieInfo(libraryPath, settings);
+            bool moveToLibrary = true;
+            bool skipMove = false;
+            if (tonieInfoLib->valid)
+            {
+                if (!osMemcmp(tonieInfoLib->tafHeader->sha1_hash.data, tonieInfo->tafHeader->sha1_hash.data, tonieInfoLib->tafHeader->sha1_hash.len))
+                {
+                    TRACE_WARNING(">> SHA1 Hash for Audio ID %" PRIu32 ", already in library, deleting downloaded file\r\n", audioId);
+                    fsDeleteFile(contentPath);
+                    skipMove = true;
+                }
+                else
+                {
+                    TRACE_WARNING(">> SHA1 Hash forAudio ID %" PRIu32 ", of downloaded file is different to library, not moving to library\r\n", audioId);
+                    moveToLibrary = false;
+                }
+            }
+            if (moveToLibrary)
+            {
+                error_t error = NO_ERROR;
+                if (!skipMove)
+                {
+                    error = fsMoveFile(contentPath, libraryPath, false);
+                }
+                if (error == NO_ERROR)
+                {
+                    char *libraryShortPath = custom_asprintf("lib://by/audioID/%" PRIu32 ".taf", audioId);
+
+                    free(tonieInfo->json.source);
+                    tonieInfo->json.source = libraryShortPath;
+
+                    save_content_json(tonieInfo->contentPath, &tonieInfo->json);
+                    TRACE_INFO(">> Successfully set to library %s\r\n", libraryShortPath);
+
+                    error = content_store_add(libraryPath);
+                    if (error != NO_ERROR)
+                    {
+                        TRACE_WARNING(">> Could not add %s to the content store, error=%s\r\n", libraryPath, error2text(error));
+                    }
+                }
+                else
+                {
+                    TRACE_ERROR(">> Failed to move %s to library %s, error=%s\r\n", contentPath, libraryPath, error2text(error));
+                }
+            }
+
+            free(libraryPath);
+            free(libraryBasePath);
+        }
+        freeTonieInfo(tonieInfo);
+    }
+    else
+    {
+        TRACE_ERROR(">> Invalid TAF, not moving to library\r\n");
+    }
+}
+
 void cbrCloudBodyPassthrough(void *src_ctx, HttpClientContext *cloud_ctx, const char *payload, size_t length, error_t error)
 {
     cbr_ctx_t *ctx = (cbr_ctx_t *)src_ctx;
@@ -251,7 +340,8 @@ void cbrCloudBodyPassthrough(void *src_ctx, HttpClientContext *cloud_ctx, const
     switch (ctx->api)
     {
     case V2_CONTENT: // Also handles V1_CONTENT
-        if (ctx->client_ctx->settings->cloud.cacheContent && httpClientContext->statusCode == 200)
+        /* only the owner of the flight writes the .tmp file others may be reading */
+        if (ctx->client_ctx->settings->cloud.cacheContent && ctx->flight != NULL && httpClientContext->statusCode == 200)
         {
             // TRACE_INFO(">> cbrCloudBodyPassthrough: %lu received\r\n", length);
             // TRACE_INFO(">> %s\r\n", ctx->uri);
@@ -277,6 +367,10 @@ void cbrCloudBodyPassthrough(void *src_ctx, HttpClientContext *cloud_ctx, const
                 {
                     TRACE_ERROR(">> Could not open file %s\r\n", tmpPath);
                 }
+                else
+                {
+                    content_flight_file_ready(ctx->flight);
+                }
                 free(tmpPath);
                 free(dir);
             }
@@ -284,87 +378,31 @@ void cbrCloudBodyPassthrough(void *src_ctx, HttpClientContext *cloud_ctx, const
             {
                 error_t error = fsWriteFile(ctx->file, (void *)payload, length);
                 if (error)
+                {
                     TRACE_ERROR(">> fsWriteFile Error: %s\r\n", error2text(error));
+                }
+                else
+                {
+                    content_flight_progress(ctx->flight, length);
+                }
             }
             if (error == ERROR_END_OF_STREAM)
             {
                 fsCloseFile(ctx->file);
                 char *tmpPath = custom_asprintf("%s.tmp", ctx->tonieInfo->contentPath);
 
-                fsDeleteFile(ctx->tonieInfo->contentPath);
-                fsRenameFile(tmpPath, ctx->tonieInfo->contentPath);
+                /* followers keep reading through their own handles after the rename */
+                content_flight_seal(ctx->flight);
+                content_flight_complete(ctx->flight, NO_ERROR);
+
+                content_flight_finish(ctx->flight, tmpPath, ctx->tonieInfo->contentPath);
                 if (fsFileExists(ctx->tonieInfo->contentPath))
                 {
                     TRACE_INFO(">> Successfully cached %s\r\n", ctx->tonieInfo->contentPath);
 
                     if (ctx->client_ctx->settings->cloud.cacheToLibrary)
                     {
-                        tonie_info_t *tonieInfo = getTonieInfo(ctx->tonieInfo->contentPath, ctx->client_ctx->settings);
-                        if (tonieInfo->valid)
-                        {
-                            uint32_t audioId = tonieInfo->tafHeader->audio_id;
-                            if (audioId <= 1)
-                            {
-                                TRACE_WARNING(">> Audio ID is %" PRIu32 ", not moving to library\r\n", audioId);
-                            }
-                            else
-                            {
-                                char *libraryByPath = custom_asprintf("%s/by", ctx->client_ctx->settings->internal.librarydirfull);
-                                char *libraryBasePath = custom_asprintf("%s/audioID", libraryByPath);
-                                char *libraryPath = custom_asprintf("%s/%" PRIu32 ".taf", libraryBasePath, audioId);
-
-                                fsCreateDir(libraryByPath);
-                                fsCreateDir(libraryBasePath);
-
-                                tonie_info_t *tonieInfoLib = getTonieInfo(libraryPath, ctx->client_ctx->settings);
-                                bool moveToLibrary = true;
-                                bool skipMove = false;
-                                if (tonieInfoLib->valid)
-                                {
-                                    if (!osMemcmp(tonieInfoLib->tafHeader->sha1_hash.data, tonieInfo->tafHeader->sha1_hash.data, tonieInfoLib->tafHeader->sha1_hash.len))
-                                    {
-                                        TRACE_WARNING(">> SHA1 Hash for Audio ID %" PRIu32 ", already in library, deleting downloaded file\r\n", audioId);
-                                        fsDeleteFile(ctx->tonieInfo->contentPath);
-                                        skipMove = true;
-                                    }
-                                    else
-                                    {
-                                        TRACE_WARNING(">> SHA1 Hash forAudio ID %" PRIu32 ", of downloaded file is different to library, not moving to library\r\n", audioId);
-                                        moveToLibrary = false;
-                                    }
-                                }
-                                if (moveToLibrary)
-                                {
-                                    error_t error = NO_ERROR;
-                                    if (!skipMove)
-                                    {
-                                        error = fsMoveFile(ctx->tonieInfo->contentPath, libraryPath, false);
-                                    }
-                                    if (error == NO_ERROR)
-                                    {
-                                        char *libraryShortPath = custom_asprintf("lib://by/audioID/%" PRIu32 ".taf", audioId);
-
-                                        free(tonieInfo->json.source);
-                                        tonieInfo->json.source = libraryShortPath;
-
-                                        save_content_json(tonieInfo->contentPath, &tonieInfo->json);
-                                        TRACE_INFO(">> Successfully set to library %s\r\n", libraryShortPath);
-                                    }
-                                    else
-                                    {
-                                        TRACE_ERROR(">> Failed to move %s to library %s, error=%s\r\n", ctx->tonieInfo->contentPath, libraryPath, error2text(error));
-                                    }
-                                }
-
-                                free(libraryPath);
-                                free(libraryBasePath);
-                            }
-                            freeTonieInfo(tonieInfo);
-                        }
-                        else
-                        {
-                            TRACE_ERROR(">> Invalid TAF, not moving to library\r\n");
-                        }
+                        cacheContentToLibrary(ctx->tonieInfo->contentPath, ctx->client_ctx->settings);
                     }
                 }
                 else
@@ -414,6 +452,7 @@ void cbrCloudBodyPassthrough(void *src_ctx, HttpClientContext *cloud_ctx, const
                     {
                         freshResp->tonie_marked[freshResp->n_tonie_marked++] = freshRespCloud->tonie_marked[i];
                         TRACE_INFO("Marked UID %016" PRIX64 " as updated from cloud\r\n", freshRespCloud->tonie_marked[i]);
+                        content_prefetch_enqueue(freshRespCloud->tonie_marked[i], ctx->client_ctx->settings, TRUE);
                     }
                     else
                     {
@@ -451,6 +490,15 @@ void cbrCloudBodyPassthrough(void *src_ctx, HttpClientContext *cloud_ctx, const
         break;
     }
     ctx->status = PROX_STATUS_BODY;
+
+    if (error != NO_ERROR && error != ERROR_END_OF_STREAM)
+    {
+        content_flight_complete(ctx->flight, error);
+        if (ctx->completion)
+        {
+            completion_complete(ctx->completion, error);
+        }
+    }
 }
 
 void cbrCloudServerDiscoPassthrough(void *src_ctx, HttpClientContext *cloud_ctx)
@@ -459,6 +507,10 @@ void cbrCloudServerDiscoPassthrough(void *src_ctx, HttpClientContext *cloud_ctx)
     TRACE_INFO(">> cbrCloudServerDiscoPassthrough\r\n");
     httpFlushStream(ctx->connection);
     ctx->status = PROX_STATUS_DONE;
+    if (ctx->completion)
+    {
+        completion_complete(ctx->completion, NO_ERROR);
+    }
 }
 
 char *strupr(char input[])
@@ -502,6 +554,12 @@ void setTonieboxSettings(TonieFreshnessCheckResponse *freshResp, settings_t *set
 }
 
 bool_t isValidTaf(const char *contentPath)
+{
+    uint8_t sha1[TAF_SHA1_SIZE];
+    return getTafSha1(contentPath, sha1);
+}
+
+bool_t getTafSha1(const char *contentPath, uint8_t *sha1)
 {
     bool_t valid = false;
     FsFile *file = fsOpenFile(contentPath, FS_FILE_MODE_READ);
@@ -521,8 +579,9 @@ bool_t isValidTaf(const char *contentPath)
                     TonieboxAudioFileHeader *tafHeader = toniebox_audio_file_header__unpack(NULL, protobufSize, (const uint8_t *)headerBuffer);
                     if (tafHeader)
                     {
-                        if (tafHeader->sha1_hash.len == 20)
+                        if (tafHeader->sha1_hash.len == TAF_SHA1_SIZE)
                         {
+                            osMemcpy(sha1, tafHeader->sha1_hash.data, TAF_SHA1_SIZE);
                             valid = true;
                         }
                         toniebox_audio_file_header__free_unpacked(tafHeader, NULL);
@@ -682,8 +741,55 @@ error_t httpWriteResponseString(HttpConnection *connection, char_t *data, bool_t
 {
     return httpWriteResponse(connection, data, osStrlen(data), freeMemory);
 }
+bool_t httpGzipAccepted(HttpConnection *connection, size_t size)
+{
+    uint32_t minSize = settings_get_unsigned("core.gzip_min_size");
+    const char_t *contentType = connection->response.contentType;
+
+    return connection->request.acceptGzipEncoding && minSize > 0 && size >= minSize &&
+           contentType != NULL && osStrstr(contentType, "json") != NULL;
+}
+
+error_t httpGzipOutput(void *ctx, const void *data, size_t length)
+{
+    return httpWriteStream((HttpConnection *)ctx, data, length);
+}
+
+static error_t httpWriteResponseGzip(HttpConnection *connection, gzip_stream_t *gzip, void *data, size_t size)
+{
+    connection->response.gzipEncoding = true;
+    connection->response.chunkedEncoding = true;
+
+    error_t error = httpWriteHeader(connection);
+    if (error == NO_ERROR)
+    {
+        error = gzip_stream_write(gzip, data, size);
+    }
+    error_t finishError = gzip_stream_finish(gzip, NULL);
+    if (error == NO_ERROR)
+    {
+        error = finishError;
+    }
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Failed to send compressed payload: %s\r\n", error2text(error));
+        return error;
+    }
+
+    return httpFlushStream(connection);
+}
+
 error_t httpWriteResponse(HttpConnection *connection, void *data, size_t size, bool_t freeMemory)
 {
+    gzip_stream_t *gzip = httpGzipAccepted(connection, size) ? gzip_stream_start(&httpGzipOutput, connection, size) : NULL;
+    if (gzip != NULL)
+    {
+        error_t error = httpWriteResponseGzip(connection, gzip, data, size);
+        if (freeMemory)
+            osFreeMem(data);
+        return error;
+    }
+
     error_t error = httpWriteHeader(connection);
     if (error != NO_ERROR)
     {
@@ -19,7 +19,15 @@
 #include "cJSON.h"
 #include "toniefile.h"
 #include "toniesJson.h"
+#include "content_prefetch.h"
+#include "content_index.h"
+#include "content_store.h"
+#include "gzip_stream.h"
 #include "fs_ext.h"
+#include "mutex_manager.h"
+#include "upload_session.h"
+#include "pcm_encode.h"
+#include "transcode_job.h"
 #include "cert.h"
 #include "esp32.h"
 
@@ -134,6 +142,26 @@ error_t queryPrepare(const char *queryString, const char **rootPath, char *overl
     return NO_ERROR;
 }
 
+/* FNV-1a, chained through hash to cover several fields */
+static uint64_t apiHash(uint64_t hash, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+#define API_HASH_INIT 14695981039346656037ull
+
+/* weak, as the same tag is sent for the gzip and the identity body */
+static void apiSetEtag(HttpConnection *connection, uint64_t hash)
+{
+    osSnprintf(connection->response.etag, sizeof(connection->response.etag), "W/\"%016" PRIx64 "\"", hash);
+    connection->response.varyEncoding = TRUE;
+}
+
 void addToniesJsonInfoJson(toniesJson_item_t *item, cJSON *parent)
 {
     cJSON *tracksJson = cJSON_CreateArray();
@@ -217,20 +245,24 @@ error_t handleApiAssignUnknown(HttpConnection *connection, const char_t *uri, co
     return httpWriteResponseString(connection, response, false);
 }
 
-error_t handleApiGetIndex(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+/* serialized settings index per overlay, rebuilt when the settings version changes */
+typedef struct
+{
+    char *json;
+    size_t length;
+    uint32_t version;
+} settings_index_cache_t;
+
+static settings_index_cache_t settingsIndexCache[MAX_OVERLAYS];
+
+static char *settingsIndexBuild(uint8_t settingsId)
 {
     cJSON *json = cJSON_CreateObject();
     cJSON *jsonArray = cJSON_AddArrayToObject(json, "options");
 
-    char overlay[16];
-    osStrcpy(overlay, "");
-    if (queryGet(queryString, "overlay", overlay, sizeof(overlay)))
-    {
-        TRACE_INFO("got overlay '%s'\r\n", overlay);
-    }
     for (size_t pos = 0; pos < settings_get_size(); pos++)
     {
-        setting_item_t *opt = settings_get_ovl(pos, overlay);
+        setting_item_t *opt = settings_get_id(pos, settingsId);
 
         if (opt->internal || opt->type == TYPE_TREE_DESC)
         {
@@ -244,37 +276,38 @@ error_t handleApiGetIndex(HttpConnection *connection, const char_t *uri, const c
         cJSON_AddStringToObject(jsonEntry, "label", opt->label);
         cJSON_AddBoolToObject(jsonEntry, "overlayed", opt->overlayed);
 
+        /* the item already belongs to the overlay, so its value needs no lookup by name */
         switch (opt->type)
         {
         case TYPE_BOOL:
             cJSON_AddStringToObject(jsonEntry, "type", "bool");
-            cJSON_AddBoolToObject(jsonEntry, "value", settings_get_bool_ovl(opt->option_name, overlay));
+            cJSON_AddBoolToObject(jsonEntry, "value", *((bool *)opt->ptr));
             break;
         case TYPE_UNSIGNED:
             cJSON_AddStringToObject(jsonEntry, "type", "uint");
-            cJSON_AddNumberToObject(jsonEntry, "value", settings_get_unsigned_ovl(opt->option_name, overlay));
+            cJSON_AddNumberToObject(jsonEntry, "value", *((uint32_t *)opt->ptr));
             cJSON_AddNumberToObject(jsonEntry, "min", opt->min.unsigned_value);
             cJSON_AddNumberToObject(jsonEntry, "max", opt->max.unsigned_value);
             break;
         case TYPE_SIGNED:
             cJSON_AddStringToObject(jsonEntry, "type", "int");
-            cJSON_AddNumberToObject(jsonEntry, "value", settings_get_signed_ovl(opt->option_name, overlay));
+            cJSON_AddNumberToObject(jsonEntry, "value", *((int32_t *)opt->ptr));
             cJSON_AddNumberToObject(jsonEntry, "min", opt->min.signed_value);
             cJSON_AddNumberToObject(jsonEntry, "max", opt->max.signed_value);
             break;
         case TYPE_HEX:
             cJSON_AddStringToObject(jsonEntry, "type", "hex");
-            cJSON_AddNumberToObject(jsonEntry, "value", settings_get_unsigned_ovl(opt->option_name, overlay));
+            cJSON_AddNumberToObject(jsonEntry, "value", *((uint32_t *)opt->ptr));
             cJSON_AddNumberToObject(jsonEntry, "min", opt->min.unsigned_value);
             cJSON_AddNumberToObject(jsonEntry, "max", opt->max.unsigned_value);
             break;
         case TYPE_STRING:
             cJSON_AddStringToObject(jsonEntry, "type", "string");
-            cJSON_AddStringToObject(jsonEntry, "value", settings_get_string_ovl(opt->option_name, overlay));
+            cJSON_AddStringToObject(jsonEntry, "value", *((char **)opt->ptr));
             break;
         case TYPE_FLOAT:
             cJSON_AddStringToObject(jsonEntry, "type", "float");
-            cJSON_AddNumberToObject(jsonEntry, "value", settings_get_float_ovl(opt->option_name, overlay));
+            cJSON_AddNumberToObject(jsonEntry, "value", *((float *)opt->ptr));
             cJSON_AddNumberToObject(jsonEntry, "min", opt->min.float_value);
             cJSON_AddNumberToObject(jsonEntry, "max", opt->max.float_value);
             break;
@@ -291,9 +324,53 @@ error_t handleApiGetIndex(HttpConnection *connection, const char_t *uri, const c
     char *jsonString = cJSON_PrintUnformatted(json);
     cJSON_Delete(json);
 
+    return jsonString;
+}
+
+error_t handleApiGetIndex(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char overlay[16];
+    osStrcpy(overlay, "");
+    if (queryGet(queryString, "overlay", overlay, sizeof(overlay)))
+    {
+        TRACE_INFO("got overlay '%s'\r\n", overlay);
+    }
+    uint8_t settingsId = get_overlay_id(overlay);
+    uint32_t version = settings_get_version();
+
     httpInitResponseHeader(connection);
     connection->response.contentType = "text/json";
-    connection->response.contentLength = osStrlen(jsonString);
+
+    uint64_t hash = apiHash(API_HASH_INIT, &version, sizeof(version));
+    hash = apiHash(hash, &settingsId, sizeof(settingsId));
+    apiSetEtag(connection, hash);
+    if (httpCheckNotModified(connection))
+    {
+        return httpSendNotModifiedResponse(connection);
+    }
+
+    mutex_lock(MUTEX_SETTINGS_INDEX);
+    settings_index_cache_t *cache = &settingsIndexCache[settingsId];
+    if (cache->json == NULL || cache->version != version)
+    {
+        osFreeMem(cache->json);
+        cache->json = settingsIndexBuild(settingsId);
+        cache->length = cache->json ? osStrlen(cache->json) : 0;
+        cache->version = version;
+    }
+    char *jsonString = cache->json ? osAllocMem(cache->length + 1) : NULL;
+    if (jsonString != NULL)
+    {
+        osMemcpy(jsonString, cache->json, cache->length + 1);
+    }
+    size_t length = cache->length;
+    mutex_unlock(MUTEX_SETTINGS_INDEX);
+
+    if (jsonString == NULL)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+    connection->response.contentLength = length;
 
     return httpWriteResponse(connection, jsonString, connection->response.contentLength, true);
 }
@@ -561,320 +638,725 @@ error_t handleApiSettingsReset(HttpConnection *connection, const char_t *uri, co
     return httpWriteResponseString(connection, response, false);
 }
 
-error_t handleApiFileIndexV2(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+/* sort keys and order of a paginated file index */
+typedef enum
 {
-    char overlay[16];
-    const char *rootPath = NULL;
+    FILE_INDEX_SORT_NONE,
+    FILE_INDEX_SORT_NAME,
+    FILE_INDEX_SORT_DATE,
+    FILE_INDEX_SORT_SIZE,
+} file_index_sort_t;
 
-    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
+typedef struct
+{
+    FsDirEntry entry;
+    int64_t key;
+} file_index_item_t;
+
+/**
+ * Directory listing of the file index APIs.
+ *
+ * Without sort, limit or cursor the directory is read as it is sent.
+ * Otherwise only the directory entries are collected and sorted, the
+ * expensive per entry details are still produced one by one. The cursor
+ * is "<key>/<name>" of the last entry sent, '/' can not occur in a name.
+ */
+typedef struct
+{
+    FsDir *dir;
+    file_index_item_t *items;
+    size_t count;
+    size_t pos;
+    file_index_sort_t sort;
+    bool_t desc;
+    size_t limit;
+    size_t sent;
+    bool_t skipParent;
+    file_index_item_t last;
+} file_index_t;
+
+#define FILE_INDEX_CHUNK_SIZE 4096
+
+/* collects JSON into chunks of the chunked transfer encoding, the header is
+ * sent with the first chunk once it is known whether the listing gets compressed */
+typedef struct
+{
+    HttpConnection *connection;
+    char buffer[FILE_INDEX_CHUNK_SIZE];
+    size_t used;
+    bool_t headerSent;
+    gzip_stream_t *gzip;
+    error_t error;
+} file_index_writer_t;
+
+static int64_t fileIndexKey(const FsDirEntry *entry, file_index_sort_t sort)
+{
+    switch (sort)
     {
-        return ERROR_FAILURE;
+    case FILE_INDEX_SORT_DATE:
+        return convertDateToUnixTime(&entry->modified);
+    case FILE_INDEX_SORT_SIZE:
+        return entry->size;
+    default:
+        return 0;
     }
+}
 
-    char path[128];
+static int fileIndexCompare(const void *a, const void *b)
+{
+    const file_index_item_t *itemA = (const file_index_item_t *)a;
+    const file_index_item_t *itemB = (const file_index_item_t *)b;
 
-    if (!queryGet(queryString, "path", path, sizeof(path)))
+    if (itemA->key != itemB->key)
     {
-        osStrcpy(path, "/");
+        return itemA->key < itemB->key ? -1 : 1;
     }
+    return osStrcmp(itemA->entry.name, itemB->entry.name);
+}
 
-    /* first canonicalize path, then merge to prevent directory traversal bugs */
-    pathSafeCanonicalize(path);
-    char *pathAbsolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, path);
-    pathSafeCanonicalize(pathAbsolute);
+static bool_t fileIndexSkip(file_index_t *index, const FsDirEntry *entry)
+{
+    if (!osStrcmp(entry->name, "."))
+    {
+        return true;
+    }
+    return !osStrcmp(entry->name, "..") && index->skipParent;
+}
 
-    FsDir *dir = fsOpenDir(pathAbsolute);
-    if (dir == NULL)
+static error_t fileIndexOpen(file_index_t *index, const char *pathAbsolute, const char_t *queryString, bool_t skipParent)
+{
+    char sort[8];
+    char order[8];
+    char limit[16];
+    char cursor[FS_MAX_NAME_LEN + 32];
+
+    osMemset(index, 0x00, sizeof(file_index_t));
+    index->skipParent = skipParent;
+
+    index->dir = fsOpenDir(pathAbsolute);
+    if (index->dir == NULL)
     {
-        TRACE_ERROR("Failed to open dir '%s'\r\n", pathAbsolute);
-        osFreeMem(pathAbsolute);
-        return ERROR_FAILURE;
+        return ERROR_FILE_NOT_FOUND;
     }
 
-    cJSON *json = cJSON_CreateObject();
-    cJSON *jsonArray = cJSON_AddArrayToObject(json, "files");
+    if (queryGet(queryString, "sort", sort, sizeof(sort)))
+    {
+        if (!osStrcmp(sort, "date"))
+        {
+            index->sort = FILE_INDEX_SORT_DATE;
+        }
+        else if (!osStrcmp(sort, "size"))
+        {
+            index->sort = FILE_INDEX_SORT_SIZE;
+        }
+        else
+        {
+            index->sort = FILE_INDEX_SORT_NAME;
+        }
+    }
+    if (queryGet(queryString, "order", order, sizeof(order)))
+    {
+        index->desc = !osStrcmp(order, "desc");
+    }
+    if (queryGet(queryString, "limit", limit, sizeof(limit)))
+    {
+        index->limit = osStrtoul(limit, NULL, 10);
+    }
+    bool_t hasCursor = queryGet(queryString, "cursor", cursor, sizeof(cursor)) && cursor[0] != '\0';
 
-    while (true)
+    if (index->sort == FILE_INDEX_SORT_NONE && index->limit == 0 && !hasCursor)
     {
-        FsDirEntry entry;
+        return NO_ERROR;
+    }
+    if (index->sort == FILE_INDEX_SORT_NONE)
+    {
+        /* pages need a stable order */
+        index->sort = FILE_INDEX_SORT_NAME;
+    }
 
-        if (fsReadDir(dir, &entry) != NO_ERROR)
+    size_t capacity = 64;
+    index->items = osAllocMem(capacity * sizeof(file_index_item_t));
+    while (index->items != NULL)
+    {
+        file_index_item_t *item = &index->items[index->count];
+        if (fsReadDir(index->dir, &item->entry) != NO_ERROR)
         {
-            fsCloseDir(dir);
             break;
         }
-
-        if (!osStrcmp(entry.name, "."))
+        if (fileIndexSkip(index, &item->entry))
         {
             continue;
         }
-        if (!osStrcmp(entry.name, "..") && path[0] == '\0')
+        item->key = fileIndexKey(&item->entry, index->sort);
+
+        if (++index->count == capacity)
         {
-            continue;
+            file_index_item_t *items = osAllocMem(2 * capacity * sizeof(file_index_item_t));
+            if (items != NULL)
+            {
+                osMemcpy(items, index->items, capacity * sizeof(file_index_item_t));
+                capacity *= 2;
+            }
+            osFreeMem(index->items);
+            index->items = items;
         }
-        bool isDir = (entry.attributes & FS_FILE_ATTR_DIRECTORY);
-        char *filePathAbsolute = custom_asprintf("%s%c%s", pathAbsolute, PATH_SEPARATOR, entry.name);
-        pathSafeCanonicalize(filePathAbsolute);
+    }
+    fsCloseDir(index->dir);
+    index->dir = NULL;
 
-        cJSON *jsonEntry = cJSON_CreateObject();
-        cJSON_AddStringToObject(jsonEntry, "name", entry.name);
-        cJSON_AddNumberToObject(jsonEntry, "date", convertDateToUnixTime(&entry.modified));
-        cJSON_AddNumberToObject(jsonEntry, "size", entry.size);
-        cJSON_AddBoolToObject(jsonEntry, "isDir", isDir);
+    if (index->items == NULL)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+    qsort(index->items, index->count, sizeof(file_index_item_t), &fileIndexCompare);
 
-        tonie_info_t *tafInfo = getTonieInfo(filePathAbsolute, client_ctx->settings);
-        toniesJson_item_t *item = NULL;
-        if (tafInfo->valid)
+    /* entries are taken from pos towards the end, or towards the start when descending */
+    index->pos = index->desc ? index->count : 0;
+    if (hasCursor)
+    {
+        char *name = osStrchr(cursor, '/');
+        if (name != NULL)
         {
-            cJSON *tafHeaderEntry = cJSON_AddObjectToObject(jsonEntry, "tafHeader");
-            cJSON_AddNumberToObject(tafHeaderEntry, "audioId", tafInfo->tafHeader->audio_id);
-            char sha1Hash[41];
-            sha1Hash[0] = '\0';
-            for (int pos = 0; pos < tafInfo->tafHeader->sha1_hash.len; pos++)
+            file_index_item_t after;
+            *name++ = '\0';
+            after.key = strtoll(cursor, NULL, 10);
+            osStrncpy(after.entry.name, name, sizeof(after.entry.name) - 1);
+            after.entry.name[sizeof(after.entry.name) - 1] = '\0';
+
+            while (index->pos < index->count && !index->desc && fileIndexCompare(&index->items[index->pos], &after) <= 0)
             {
-                char tmp[3];
-                osSprintf(tmp, "%02X", tafInfo->tafHeader->sha1_hash.data[pos]);
-                osStrcat(sha1Hash, tmp);
+                index->pos++;
             }
-            cJSON_AddStringToObject(tafHeaderEntry, "sha1Hash", sha1Hash);
-            cJSON_AddNumberToObject(tafHeaderEntry, "size", tafInfo->tafHeader->num_bytes);
-            cJSON *tracksArray = cJSON_AddArrayToObject(tafHeaderEntry, "tracks");
-            for (size_t i = 0; i < tafInfo->tafHeader->n_track_page_nums; i++)
+            while (index->pos > 0 && index->desc && fileIndexCompare(&index->items[index->pos - 1], &after) >= 0)
             {
-                cJSON_AddItemToArray(tracksArray, cJSON_CreateNumber(tafInfo->tafHeader->track_page_nums[i]));
+                index->pos--;
             }
-
-            item = tonies_byAudioIdHashModel(tafInfo->tafHeader->audio_id, tafInfo->tafHeader->sha1_hash.data, tafInfo->json.tonie_model);
-            freeTonieInfo(tafInfo);
         }
-        else
+    }
+    return NO_ERROR;
+}
+
+static bool_t fileIndexNext(file_index_t *index, FsDirEntry *entry)
+{
+    if (index->limit > 0 && index->sent >= index->limit)
+    {
+        return false;
+    }
+
+    if (index->dir != NULL)
+    {
+        do
         {
-            char *json_extension = NULL;
-            contentJson_t contentJson;
-            if (isDir)
-            {
-                char *filePathAbsoluteSub = NULL;
-                FsDir *subdir = fsOpenDir(filePathAbsolute);
-                FsDirEntry subentry;
-                if (subdir != NULL)
-                {
-                    while (true)
-                    {
-                        if (fsReadDir(subdir, &subentry) != NO_ERROR || item != NULL)
-                        {
-                            fsCloseDir(subdir);
-                            break;
-                        }
-                        filePathAbsoluteSub = custom_asprintf("%s%c%s", filePathAbsolute, PATH_SEPARATOR, subentry.name);
-
-                        json_extension = osStrstr(filePathAbsoluteSub, ".json");
-                        if (json_extension != NULL)
-                        {
-                            *json_extension = '\0';
-                        }
-
-                        load_content_json(filePathAbsoluteSub, &contentJson, false);
-                        item = tonies_byModel(contentJson.tonie_model);
-                        osFreeMem(filePathAbsoluteSub);
-                    }
-                }
-            }
-            else
+            if (fsReadDir(index->dir, entry) != NO_ERROR)
             {
-                json_extension = osStrstr(filePathAbsolute, ".json");
-                if (json_extension != NULL)
-                {
-                    *json_extension = '\0';
-                }
-                load_content_json(filePathAbsolute, &contentJson, false);
-                item = tonies_byModel(contentJson.tonie_model);
-
-                if (contentJson._has_cloud_auth)
-                {
-                    cJSON_AddBoolToObject(jsonEntry, "has_cloud_auth", true);
-                }
+                return false;
             }
-            free_content_json(&contentJson);
-        }
-        if (item != NULL)
+        } while (fileIndexSkip(index, entry));
+    }
+    else
+    {
+        if (index->desc ? index->pos == 0 : index->pos >= index->count)
         {
-            addToniesJsonInfoJson(item, jsonEntry);
+            return false;
         }
-
-        osFreeMem(filePathAbsolute);
-        cJSON_AddItemToArray(jsonArray, jsonEntry);
+        index->last = index->items[index->desc ? --index->pos : index->pos++];
+        *entry = index->last.entry;
     }
+    index->sent++;
+    return true;
+}
 
-    osFreeMem(pathAbsolute);
-    char *jsonString = cJSON_PrintUnformatted(json);
-    cJSON_Delete(json);
+/* writes the cursor of the next page, or null if this was the last one */
+static void fileIndexCursor(file_index_t *index, char *cursor, size_t size)
+{
+    bool_t more = index->desc ? index->pos > 0 : index->pos < index->count;
 
-    httpInitResponseHeader(connection);
-    connection->response.contentType = "text/json";
-    connection->response.contentLength = osStrlen(jsonString);
+    cursor[0] = '\0';
+    if (index->items != NULL && index->sent > 0 && more)
+    {
+        osSnprintf(cursor, size, "%" PRId64 "/%s", index->last.key, index->last.entry.name);
+    }
+}
 
-    return httpWriteResponse(connection, jsonString, connection->response.contentLength, true);
+static uint64_t fileIndexEtagEntry(uint64_t hash, const FsDirEntry *entry)
+{
+    hash = apiHash(hash, entry->name, osStrlen(entry->name));
+    hash = apiHash(hash, &entry->size, sizeof(entry->size));
+    hash = apiHash(hash, &entry->modified, sizeof(entry->modified));
+    return hash;
 }
-error_t handleApiFileIndex(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+
+/**
+ * Built from cheap signals only, nothing is read besides the directory's own
+ * date before the listing starts:
+ *  - the directory date, which changes when an entry is added, removed or
+ *    renamed. Content, content json and uploads are written to temporary
+ *    files and renamed into place.
+ *  - content_json_version, as a subdirectory is listed with the tonie of the
+ *    content json inside, and tonies_version for the tonie details
+ *  - the start of this run, both versions count from zero after a restart
+ *  - name, size and date of the entries, for sorted and paged listings
+ *    which have read them already
+ * A file rewritten in place without a rename only shows up in sorted listings.
+ */
+static uint64_t fileIndexEtag(file_index_t *index, const char *pathAbsolute)
 {
-    char *jsonString = strdup("{\"files\":[]}"); // Make warning go away
+    static time_t started = 0;
+    if (started == 0)
+    {
+        started = time(NULL);
+    }
+    uint32_t versions[2] = {tonies_version(), content_json_version()};
+    uint64_t hash = apiHash(API_HASH_INIT, &started, sizeof(started));
+    hash = apiHash(hash, versions, sizeof(versions));
 
-    do
+    FsFileStat stat;
+    if (fsGetFileStat(pathAbsolute, &stat) == NO_ERROR)
     {
-        char overlay[16];
-        const char *rootPath = NULL;
+        hash = apiHash(hash, &stat.modified, sizeof(stat.modified));
+    }
+
+    for (size_t i = 0; index->items != NULL && i < index->count; i++)
+    {
+        hash = fileIndexEtagEntry(hash, &index->items[i].entry);
+    }
+    return hash;
+}
+
+static void fileIndexClose(file_index_t *index)
+{
+    if (index->dir != NULL)
+    {
+        fsCloseDir(index->dir);
+    }
+    osFreeMem(index->items);
+}
 
-        if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
+static void fileIndexWriterFlush(file_index_writer_t *writer)
+{
+    if (!writer->headerSent)
+    {
+        HttpConnection *connection = writer->connection;
+        if (httpGzipAccepted(connection, writer->used))
         {
-            return ERROR_FAILURE;
+            /* a listing that ends before the first chunk is full has a known size */
+            writer->gzip = gzip_stream_start(&httpGzipOutput, connection, writer->used < sizeof(writer->buffer) ? writer->used : 0);
+        }
+        connection->response.gzipEncoding = (writer->gzip != NULL);
+        writer->error = httpWriteHeader(connection);
+        writer->headerSent = true;
+    }
+    if (writer->error == NO_ERROR && writer->used > 0)
+    {
+        if (writer->gzip != NULL)
+        {
+            writer->error = gzip_stream_write(writer->gzip, writer->buffer, writer->used);
+        }
+        else
+        {
+            writer->error = httpWriteStream(writer->connection, writer->buffer, writer->used);
         }
+    }
+    writer->used = 0;
+}
 
-        char path[128];
+static void fileIndexWrite(file_index_writer_t *writer, const char *data)
+{
+    size_t length = osStrlen(data);
+
+    while (length > 0 && writer->error == NO_ERROR)
+    {
+        size_t chunk = MIN(length, sizeof(writer->buffer) - writer->used);
+        osMemcpy(&writer->buffer[writer->used], data, chunk);
+        writer->used += chunk;
+        data += chunk;
+        length -= chunk;
 
-        if (!queryGet(queryString, "path", path, sizeof(path)))
+        if (writer->used == sizeof(writer->buffer))
         {
-            osStrcpy(path, "/");
+            fileIndexWriterFlush(writer);
         }
+    }
+}
 
-        /* first canonicalize path, then merge to prevent directory traversal bugs */
-        pathSafeCanonicalize(path);
-        char *pathAbsolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, path);
-        pathSafeCanonicalize(pathAbsolute);
+static error_t fileIndexWriterStart(file_index_writer_t *writer, HttpConnection *connection)
+{
+    writer->connection = connection;
+    writer->used = 0;
+    writer->headerSent = false;
+    writer->gzip = NULL;
+    writer->error = NO_ERROR;
+
+    connection->response.contentType = "text/json";
+    connection->response.chunkedEncoding = true;
+
+    fileIndexWrite(writer, "{\"files\":[");
+    return writer->error;
+}
+
+static void fileIndexWriteEntry(file_index_writer_t *writer, cJSON *jsonEntry, bool_t first)
+{
+    char *jsonString = cJSON_PrintUnformatted(jsonEntry);
+    cJSON_Delete(jsonEntry);
 
-        int pos = 0;
-        FsDir *dir = fsOpenDir(pathAbsolute);
-        if (dir == NULL)
+    if (jsonString == NULL)
+    {
+        /* skipping the entry would leave the array malformed, the response is aborted instead */
+        if (writer->error == NO_ERROR)
         {
-            TRACE_ERROR("Failed to open dir '%s'\r\n", pathAbsolute);
-            osFreeMem(pathAbsolute);
-            break;
+            writer->error = ERROR_OUT_OF_MEMORY;
         }
+        return;
+    }
+    if (!first)
+    {
+        fileIndexWrite(writer, ",");
+    }
+    fileIndexWrite(writer, jsonString);
+    osFreeMem(jsonString);
+}
+
+static error_t fileIndexWriterFinish(file_index_writer_t *writer, file_index_t *index)
+{
+    fileIndexWrite(writer, "]");
+    if (index->items != NULL)
+    {
+        char cursor[FS_MAX_NAME_LEN + 32];
+        fileIndexCursor(index, cursor, sizeof(cursor));
 
-        cJSON *json = cJSON_CreateObject();
-        cJSON *jsonArray = cJSON_AddArrayToObject(json, "files");
+        cJSON *jsonCursor = cursor[0] ? cJSON_CreateString(cursor) : cJSON_CreateNull();
+        char *jsonString = cJSON_PrintUnformatted(jsonCursor);
+        cJSON_Delete(jsonCursor);
 
-        while (true)
+        if (jsonString == NULL && writer->error == NO_ERROR)
         {
-            FsDirEntry entry;
+            writer->error = ERROR_OUT_OF_MEMORY;
+        }
+        fileIndexWrite(writer, ",\"nextCursor\":");
+        fileIndexWrite(writer, jsonString ? jsonString : "null");
+        osFreeMem(jsonString);
+    }
+    fileIndexWrite(writer, "}");
 
-            if (fsReadDir(dir, &entry) != NO_ERROR)
-            {
-                fsCloseDir(dir);
-                break;
-            }
+    fileIndexWriterFlush(writer);
+    if (writer->gzip != NULL)
+    {
+        error_t error = gzip_stream_finish(writer->gzip, NULL);
+        writer->gzip = NULL;
+        if (writer->error == NO_ERROR)
+        {
+            writer->error = error;
+        }
+    }
+    if (writer->error == NO_ERROR)
+    {
+        /* sends the terminating chunk */
+        writer->error = httpFlushStream(writer->connection);
+    }
+    return writer->error;
+}
 
-            if (!osStrcmp(entry.name, ".") || !osStrcmp(entry.name, ".."))
-            {
-                continue;
-            }
-            bool isDir = (entry.attributes & FS_FILE_ATTR_DIRECTORY);
-            char dateString[64];
-
-            osSnprintf(dateString, sizeof(dateString), " %04" PRIu16 "-%02" PRIu8 "-%02" PRIu8 ",  %02" PRIu8 ":%02" PRIu8 ":%02" PRIu8,
-                       entry.modified.year, entry.modified.month, entry.modified.day,
-                       entry.modified.hours, entry.modified.minutes, entry.modified.seconds);
-
-            char *filePathAbsolute = custom_asprintf("%s%c%s", pathAbsolute, PATH_SEPARATOR, entry.name);
-            pathSafeCanonicalize(filePathAbsolute);
-
-            cJSON *jsonEntry = cJSON_CreateObject();
-            cJSON_AddStringToObject(jsonEntry, "name", entry.name);
-            cJSON_AddStringToObject(jsonEntry, "date", dateString);
-            cJSON_AddNumberToObject(jsonEntry, "size", entry.size);
-            cJSON_AddBoolToObject(jsonEntry, "isDirectory", isDir);
-
-            char desc[3 + 1 + 8 + 1 + 40 + 1 + 64 + 1 + 64];
-            desc[0] = 0;
-            tonie_info_t *tafInfo = getTonieInfo(filePathAbsolute, client_ctx->settings);
-            toniesJson_item_t *item = NULL;
-            if (tafInfo->valid)
+static cJSON *fileIndexV2Entry(FsDirEntry *entry, const char *pathAbsolute, client_ctx_t *client_ctx)
+{
+    bool isDir = (entry->attributes & FS_FILE_ATTR_DIRECTORY);
+    char *filePathAbsolute = custom_asprintf("%s%c%s", pathAbsolute, PATH_SEPARATOR, entry->name);
+    pathSafeCanonicalize(filePathAbsolute);
+
+    cJSON *jsonEntry = cJSON_CreateObject();
+    cJSON_AddStringToObject(jsonEntry, "name", entry->name);
+    cJSON_AddNumberToObject(jsonEntry, "date", convertDateToUnixTime(&entry->modified));
+    cJSON_AddNumberToObject(jsonEntry, "size", entry->size);
+    cJSON_AddBoolToObject(jsonEntry, "isDir", isDir);
+
+    tonies_read_begin();
+    toniesJson_item_t *item = NULL;
+    if (isDir)
+    {
+        char *filePathAbsoluteSub = NULL;
+        FsDir *subdir = fsOpenDir(filePathAbsolute);
+        FsDirEntry subentry;
+        if (subdir != NULL)
+        {
+            while (true)
             {
-                osSnprintf(desc, sizeof(desc), "TAF:%08X:", tafInfo->tafHeader->audio_id);
-                for (int pos = 0; pos < tafInfo->tafHeader->sha1_hash.len; pos++)
+                if (fsReadDir(subdir, &subentry) != NO_ERROR || item != NULL)
                 {
-                    char tmp[3];
-                    osSprintf(tmp, "%02X", tafInfo->tafHeader->sha1_hash.data[pos]);
-                    osStrcat(desc, tmp);
+                    fsCloseDir(subdir);
+                    break;
                 }
-                char extraDesc[1 + 64 + 1 + 64];
-                osSnprintf(extraDesc, sizeof(extraDesc), ":%" PRIu64 ":%" PRIuSIZE, tafInfo->tafHeader->num_bytes, tafInfo->tafHeader->n_track_page_nums);
-                osStrcat(desc, extraDesc);
+                filePathAbsoluteSub = custom_asprintf("%s%c%s", filePathAbsolute, PATH_SEPARATOR, subentry.name);
 
-                item = tonies_byAudioIdHashModel(tafInfo->tafHeader->audio_id, tafInfo->tafHeader->sha1_hash.data, tafInfo->json.tonie_model);
-                freeTonieInfo(tafInfo);
-            }
-            else
-            {
-                char *json_extension = NULL;
-                contentJson_t contentJson;
-                if (isDir)
+                char *json_extension = osStrstr(filePathAbsoluteSub, ".json");
+                if (json_extension != NULL)
                 {
-                    char *filePathAbsoluteSub = NULL;
-                    FsDir *subdir = fsOpenDir(filePathAbsolute);
-                    FsDirEntry subentry;
-                    if (subdir != NULL)
-                    {
-                        while (true)
-                        {
-                            if (fsReadDir(subdir, &subentry) != NO_ERROR || item != NULL)
-                            {
-                                fsCloseDir(subdir);
-                                break;
-                            }
-                            filePathAbsoluteSub = custom_asprintf("%s%c%s", filePathAbsolute, PATH_SEPARATOR, subentry.name);
-
-                            json_extension = osStrstr(filePathAbsoluteSub, ".json");
-                            if (json_extension != NULL)
-                            {
-                                *json_extension = '\0';
-                            }
-
-                            load_content_json(filePathAbsoluteSub, &contentJson, false);
-                            item = tonies_byModel(contentJson.tonie_model);
-                            osFreeMem(filePathAbsoluteSub);
-                        }
-                    }
+                    *json_extension = '\0';
                 }
-                else
-                {
-                    json_extension = osStrstr(filePathAbsolute, ".json");
-                    if (json_extension != NULL)
-                    {
-                        *json_extension = '\0';
-                    }
-                    load_content_json(filePathAbsolute, &contentJson, false);
-                    item = tonies_byModel(contentJson.tonie_model);
 
-                    if (contentJson._has_cloud_auth)
-                    {
-                        cJSON_AddBoolToObject(jsonEntry, "has_cloud_auth", true);
-                    }
-                }
+                contentJson_t contentJson;
+                load_content_json(filePathAbsoluteSub, &contentJson, false);
+                item = tonies_byModel(contentJson.tonie_model);
                 free_content_json(&contentJson);
+                osFreeMem(filePathAbsoluteSub);
             }
-            if (item != NULL)
+        }
+    }
+    else
+    {
+        /* content json files are listed with the info of their content path */
+        char *json_extension = osStrstr(filePathAbsolute, ".json");
+        if (json_extension != NULL)
+        {
+            *json_extension = '\0';
+        }
+        content_index_entry_t *indexEntry = content_index_get(filePathAbsolute, client_ctx->settings);
+        if (indexEntry->valid && json_extension == NULL)
+        {
+            cJSON *tafHeaderEntry = cJSON_AddObjectToObject(jsonEntry, "tafHeader");
+            cJSON_AddNumberToObject(tafHeaderEntry, "audioId", indexEntry->audio_id);
+            char sha1Hash[41];
+            sha1Hash[0] = '\0';
+            for (size_t pos = 0; pos < sizeof(indexEntry->sha1); pos++)
             {
-                addToniesJsonInfoJson(item, jsonEntry);
+                char tmp[3];
+                osSprintf(tmp, "%02X", indexEntry->sha1[pos]);
+                osStrcat(sha1Hash, tmp);
+            }
+            cJSON_AddStringToObject(tafHeaderEntry, "sha1Hash", sha1Hash);
+            cJSON_AddNumberToObject(tafHeaderEntry, "size", indexEntry->num_bytes);
+            cJSON *tracksArray = cJSON_AddArrayToObject(tafHeaderEntry, "tracks");
+            for (size_t i = 0; i < indexEntry->n_tracks; i++)
+            {
+                cJSON_AddItemToArray(tracksArray, cJSON_CreateNumber(indexEntry->tracks[i]));
+            }
+            item = tonies_byAudioIdHashModel(indexEntry->audio_id, indexEntry->sha1, indexEntry->tonie_model);
+        }
+        else
+        {
+            item = tonies_byModel(indexEntry->tonie_model);
+
+            if (indexEntry->has_cloud_auth)
+            {
+                cJSON_AddBoolToObject(jsonEntry, "has_cloud_auth", true);
             }
+        }
+        content_index_free(indexEntry);
+    }
+    if (item != NULL)
+    {
+        addToniesJsonInfoJson(item, jsonEntry);
+    }
+    tonies_read_end();
+
+    osFreeMem(filePathAbsolute);
+    return jsonEntry;
+}
+
+static cJSON *fileIndexV1Entry(FsDirEntry *entry, const char *pathAbsolute, client_ctx_t *client_ctx)
+{
+    bool isDir = (entry->attributes & FS_FILE_ATTR_DIRECTORY);
+    char dateString[64];
+
+    osSnprintf(dateString, sizeof(dateString), " %04" PRIu16 "-%02" PRIu8 "-%02" PRIu8 ",  %02" PRIu8 ":%02" PRIu8 ":%02" PRIu8,
+               entry->modified.year, entry->modified.month, entry->modified.day,
+               entry->modified.hours, entry->modified.minutes, entry->modified.seconds);
+
+    char *filePathAbsolute = custom_asprintf("%s%c%s", pathAbsolute, PATH_SEPARATOR, entry->name);
+    pathSafeCanonicalize(filePathAbsolute);
+
+    cJSON *jsonEntry = cJSON_CreateObject();
+    cJSON_AddStringToObject(jsonEntry, "name", entry->name);
+    cJSON_AddStringToObject(jsonEntry, "date", dateString);
+    cJSON_AddNumberToObject(jsonEntry, "size", entry->size);
+    cJSON_AddBoolToObject(jsonEntry, "isDirectory", isDir);
+
+    char desc[3 + 1 + 8 + 1 + 40 + 1 + 64 + 1 + 64];
+    desc[0] = 0;
+    tonies_read_begin();
+    toniesJson_item_t *item = NULL;
+    if (isDir)
+    {
+        char *filePathAbsoluteSub = NULL;
+        FsDir *subdir = fsOpenDir(filePathAbsolute);
+        FsDirEntry subentry;
+        if (subdir != NULL)
+        {
+            while (true)
+            {
+                if (fsReadDir(subdir, &subentry) != NO_ERROR || item != NULL)
+                {
+                    fsCloseDir(subdir);
+                    break;
+                }
+                filePathAbsoluteSub = custom_asprintf("%s%c%s", filePathAbsolute, PATH_SEPARATOR, subentry.name);
 
-            osFreeMem(filePathAbsolute);
-            cJSON_AddStringToObject(jsonEntry, "desc", desc);
+                char *json_extension = osStrstr(filePathAbsoluteSub, ".json");
+                if (json_extension != NULL)
+                {
+                    *json_extension = '\0';
+                }
 
-            cJSON_AddItemToArray(jsonArray, jsonEntry);
+                contentJson_t contentJson;
+                load_content_json(filePathAbsoluteSub, &contentJson, false);
+                item = tonies_byModel(contentJson.tonie_model);
+                free_content_json(&contentJson);
+                osFreeMem(filePathAbsoluteSub);
+            }
+        }
+    }
+    else
+    {
+        /* content json files are listed with the info of their content path */
+        char *json_extension = osStrstr(filePathAbsolute, ".json");
+        if (json_extension != NULL)
+        {
+            *json_extension = '\0';
+        }
+        content_index_entry_t *indexEntry = content_index_get(filePathAbsolute, client_ctx->settings);
+        if (indexEntry->valid && json_extension == NULL)
+        {
+            osSnprintf(desc, sizeof(desc), "TAF:%08X:", indexEntry->audio_id);
+            for (size_t pos = 0; pos < sizeof(indexEntry->sha1); pos++)
+            {
+                char tmp[3];
+                osSprintf(tmp, "%02X", indexEntry->sha1[pos]);
+                osStrcat(desc, tmp);
+            }
+            char extraDesc[1 + 64 + 1 + 64];
+            osSnprintf(extraDesc, sizeof(extraDesc), ":%" PRIu64 ":%" PRIuSIZE, indexEntry->num_bytes, indexEntry->n_tracks);
+            osStrcat(desc, extraDesc);
+            item = tonies_byAudioIdHashModel(indexEntry->audio_id, indexEntry->sha1, indexEntry->tonie_model);
+        }
+        else
+        {
+            item = tonies_byModel(indexEntry->tonie_model);
 
-            pos++;
+            if (indexEntry->has_cloud_auth)
+            {
+                cJSON_AddBoolToObject(jsonEntry, "has_cloud_auth", true);
+            }
         }
+        content_index_free(indexEntry);
+    }
+    if (item != NULL)
+    {
+        addToniesJsonInfoJson(item, jsonEntry);
+    }
+    tonies_read_end();
+
+    osFreeMem(filePathAbsolute);
+    cJSON_AddStringToObject(jsonEntry, "desc", desc);
+    return jsonEntry;
+}
+
+error_t handleApiFileIndexV2(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char overlay[16];
+    const char *rootPath = NULL;
+
+    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
+    {
+        return ERROR_FAILURE;
+    }
+
+    char path[128];
 
+    if (!queryGet(queryString, "path", path, sizeof(path)))
+    {
+        osStrcpy(path, "/");
+    }
+
+    /* first canonicalize path, then merge to prevent directory traversal bugs */
+    pathSafeCanonicalize(path);
+    char *pathAbsolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, path);
+    pathSafeCanonicalize(pathAbsolute);
+
+    file_index_t index;
+    if (fileIndexOpen(&index, pathAbsolute, queryString, path[0] == '\0') != NO_ERROR)
+    {
+        TRACE_ERROR("Failed to open dir '%s'\r\n", pathAbsolute);
+        fileIndexClose(&index);
         osFreeMem(pathAbsolute);
-        jsonString = cJSON_PrintUnformatted(json);
-        cJSON_Delete(json);
-    } while (0);
+        return ERROR_FAILURE;
+    }
 
     httpInitResponseHeader(connection);
-    connection->response.contentType = "text/json";
-    connection->response.contentLength = osStrlen(jsonString);
+    apiSetEtag(connection, fileIndexEtag(&index, pathAbsolute));
+    if (httpCheckNotModified(connection))
+    {
+        fileIndexClose(&index);
+        osFreeMem(pathAbsolute);
+        return httpSendNotModifiedResponse(connection);
+    }
 
-    return httpWriteResponse(connection, jsonString, connection->response.contentLength, true);
+    file_index_writer_t writer;
+    fileIndexWriterStart(&writer, connection);
+
+    FsDirEntry entry;
+    while (writer.error == NO_ERROR && fileIndexNext(&index, &entry))
+    {
+        fileIndexWriteEntry(&writer, fileIndexV2Entry(&entry, pathAbsolute, client_ctx), index.sent == 1);
+    }
+    error_t error = fileIndexWriterFinish(&writer, &index);
+
+    fileIndexClose(&index);
+    osFreeMem(pathAbsolute);
+
+    return error;
+}
+error_t handleApiFileIndex(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char overlay[16];
+    const char *rootPath = NULL;
+
+    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
+    {
+        return ERROR_FAILURE;
+    }
+
+    char path[128];
+
+    if (!queryGet(queryString, "path", path, sizeof(path)))
+    {
+        osStrcpy(path, "/");
+    }
+
+    /* first canonicalize path, then merge to prevent directory traversal bugs */
+    pathSafeCanonicalize(path);
+    char *pathAbsolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, path);
+    pathSafeCanonicalize(pathAbsolute);
+
+    file_index_t index;
+    bool_t opened = (fileIndexOpen(&index, pathAbsolute, queryString, true) == NO_ERROR);
+    httpInitResponseHeader(connection);
+    if (!opened)
+    {
+        TRACE_ERROR("Failed to open dir '%s'\r\n", pathAbsolute);
+    }
+    else
+    {
+        apiSetEtag(connection, fileIndexEtag(&index, pathAbsolute));
+        if (httpCheckNotModified(connection))
+        {
+            fileIndexClose(&index);
+            osFreeMem(pathAbsolute);
+            return httpSendNotModifiedResponse(connection);
+        }
+    }
+
+    file_index_writer_t writer;
+    fileIndexWriterStart(&writer, connection);
+
+    FsDirEntry entry;
+    while (opened && writer.error == NO_ERROR && fileIndexNext(&index, &entry))
+    {
+        fileIndexWriteEntry(&writer, fileIndexV1Entry(&entry, pathAbsolute, client_ctx), index.sent == 1);
+    }
+    error_t error = fileIndexWriterFinish(&writer, &index);
+
+    fileIndexClose(&index);
+    osFreeMem(pathAbsolute);
+
+    return error;
 }
 
 error_t handleApiStats(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
@@ -927,6 +1409,8 @@ error_t file_save_start(void *in_ctx, const char *name, const char *filename)
     if (fsFileExists(ctx->filename))
     {
         TRACE_INFO("Filename '%s' already exists, overwriting\r\n", ctx->filename);
+        /* replaced by a new file, the old one may be a hardlink of a library store blob */
+        fsDeleteFile(ctx->filename);
     }
     else
     {
@@ -1586,156 +2070,669 @@ error_t handleApiContentDownload(HttpConnection *connection, const char_t *uri,
 
     if (osStrlen(uri) < 34)
     {
-        return NO_ERROR;
+        return NO_ERROR;
+    }
+
+    char *json_extension = osStrstr(uri, ".json");
+    if (json_extension != NULL)
+    {
+        *json_extension = '\0';
+    }
+
+    char *path = (char *)uri + 1 + 7 + 1 + 8 + 1;
+    char *pathAbsolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, path);
+
+    char ruid[17];
+
+    contentJson_t contentJson;
+    load_content_json(pathAbsolute, &contentJson, false);
+    osFreeMem(pathAbsolute);
+
+    osStrncpy(ruid, path, 8);
+    osStrncpy(ruid + 8, path + 9, 8);
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        ruid[i] = osTolower(ruid[i]);
+    }
+    ruid[16] = '\0';
+
+    bool isSys = (ruid[0] == '0' && ruid[1] == '0' && ruid[2] == '0' && ruid[3] == '0' && ruid[4] == '0' && ruid[5] == '0' && ruid[6] == '0');
+    if (contentJson.cloud_auth_len != 32 && !isSys)
+    {
+        free_content_json(&contentJson);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    osMemcpy(connection->private.authentication_token, contentJson.cloud_auth, contentJson.cloud_auth_len);
+    free_content_json(&contentJson);
+    if (isSys)
+    {
+        osSprintf((char *)uri, "/v1/content/%s", ruid);
+        return handleCloudContent(connection, uri, queryString, client_ctx, true);
+    }
+    else
+    {
+        osSprintf((char *)uri, "/v2/content/%s", ruid);
+        return handleCloudContent(connection, uri, queryString, client_ctx, false);
+    }
+}
+
+error_t handleApiContentPrefetch(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char overlay[16];
+    char uid[17];
+    char force[8];
+    char message[64];
+    uint_t statusCode = 200;
+
+    osStrcpy(overlay, "");
+    osStrcpy(force, "");
+    queryGet(queryString, "overlay", overlay, sizeof(overlay));
+    queryGet(queryString, "force", force, sizeof(force));
+
+    if (!queryGet(queryString, "uid", uid, sizeof(uid)) || osStrlen(uid) != 16)
+    {
+        statusCode = 400;
+        osSnprintf(message, sizeof(message), "uid missing");
+    }
+    else
+    {
+        settings_t *settings = get_settings_ovl(overlay);
+        if (content_prefetch_enqueue(strtoull(uid, NULL, 16), settings, !osStrcmp(force, "1")))
+        {
+            osSnprintf(message, sizeof(message), "OK, %" PRIuSIZE " queued", content_prefetch_pending());
+        }
+        else
+        {
+            statusCode = 503;
+            osSnprintf(message, sizeof(message), "prefetch disabled or queue full");
+        }
+    }
+
+    httpPrepareHeader(connection, "text/plain; charset=utf-8", osStrlen(message));
+    connection->response.statusCode = statusCode;
+
+    return httpWriteResponseString(connection, message, false);
+}
+
+typedef struct
+{
+    const char *overlay;
+    const char *file_path;
+    toniefile_t *taf;
+    uint8_t remainder[4];
+    int remainder_avail;
+    uint32_t audio_id;
+} taf_encode_ctx;
+
+error_t taf_encode_start(void *in_ctx, const char *name, const char *filename)
+{
+    taf_encode_ctx *ctx = (taf_encode_ctx *)in_ctx;
+
+    if (!ctx->taf)
+    {
+        TRACE_INFO("[TAF] Start encoding to %s\r\n", ctx->file_path);
+        TRACE_INFO("[TAF]   first file: %s\r\n", name);
+
+        ctx->taf = toniefile_create(ctx->file_path, ctx->audio_id, false);
+
+        if (ctx->taf == NULL)
+        {
+            TRACE_INFO("[TAF]   Creating TAF failed\r\n");
+            return ERROR_FILE_OPENING_FAILED;
+        }
+    }
+    else
+    {
+        TRACE_INFO("[TAF]   new chapter for %s\r\n", name);
+        toniefile_new_chapter(ctx->taf);
+    }
+
+    return NO_ERROR;
+}
+
+error_t taf_encode_add(void *in_ctx, void *data, size_t length)
+{
+    taf_encode_ctx *ctx = (taf_encode_ctx *)in_ctx;
+    uint8_t *byte_data = (uint8_t *)data;
+    size_t byte_data_start = 0;
+    size_t byte_data_length = length;
+
+    /* we have to take into account that the packets are not 4 byte aligned */
+    if (ctx->remainder_avail)
+    {
+        /* there a a few bytes, so first fill the buffer */
+        int size = 4 - ctx->remainder_avail;
+        if (size > length)
+        {
+            size = length;
+        }
+        osMemcpy(&ctx->remainder[ctx->remainder_avail], byte_data, size);
+
+        byte_data_start += size;
+        byte_data_length -= size;
+        ctx->remainder_avail += size;
+    }
+
+    /* either we have a full buffer now or no more data */
+    if (ctx->remainder_avail == 4)
+    {
+        toniefile_encode(ctx->taf, (int16_t *)ctx->remainder, 1);
+        ctx->remainder_avail = 0;
+    }
+
+    int samples = byte_data_length / 4;
+    int remain = byte_data_length % 4;
+
+    if (samples)
+    {
+        toniefile_encode(ctx->taf, (int16_t *)&byte_data[byte_data_start], samples);
+    }
+
+    if (remain)
+    {
+        osMemcpy(ctx->remainder, &byte_data[byte_data_start + samples * 4], remain);
+        ctx->remainder_avail = remain;
+    }
+
+    return NO_ERROR;
+}
+
+error_t taf_encode_end(void *in_ctx)
+{
+    TRACE_INFO("[TAF]   end of file\r\n");
+    return NO_ERROR;
+}
+
+typedef struct
+{
+    const char *file_path;
+    uint32_t audio_id;
+    pcm_encode_t *encoder;
+} pcm_upload_ctx;
+
+static error_t pcm_upload_start(void *in_ctx, const char *name, const char *filename)
+{
+    pcm_upload_ctx *ctx = (pcm_upload_ctx *)in_ctx;
+
+    if (!ctx->encoder)
+    {
+        TRACE_INFO("[TAF] Start encoding to %s\r\n", ctx->file_path);
+        TRACE_INFO("[TAF]   first file: %s\r\n", name);
+
+        ctx->encoder = pcm_encode_start(ctx->file_path, ctx->audio_id);
+        if (ctx->encoder == NULL)
+        {
+            return ERROR_FILE_OPENING_FAILED;
+        }
+        return NO_ERROR;
+    }
+
+    TRACE_INFO("[TAF]   new chapter for %s\r\n", name);
+    return pcm_encode_chapter(ctx->encoder);
+}
+
+static error_t pcm_upload_add(void *in_ctx, void *data, size_t length)
+{
+    pcm_upload_ctx *ctx = (pcm_upload_ctx *)in_ctx;
+
+    return pcm_encode_write(ctx->encoder, data, length);
+}
+
+error_t handleApiPcmUpload(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char overlay[128];
+    char name[256];
+    char uid[32];
+    char path[128];
+    char audio_id_str[128];
+    uint32_t audio_id = 0;
+
+    osStrcpy(name, "unnamed");
+    osStrcpy(uid, "");
+    osStrcpy(path, "");
+    osStrcpy(audio_id_str, "");
+
+    const char *rootPath = NULL;
+
+    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
+    {
+        return ERROR_FAILURE;
+    }
+
+    if (queryGet(queryString, "name", name, sizeof(name)))
+    {
+        TRACE_INFO("got name '%s'\r\n", name);
+    }
+    if (queryGet(queryString, "uid", uid, sizeof(uid)))
+    {
+        TRACE_INFO("got uid '%s'\r\n", uid);
+    }
+    if (queryGet(queryString, "audioId", audio_id_str, sizeof(audio_id_str)))
+    {
+        TRACE_INFO("got audioId '%s'\r\n", audio_id_str);
+        audio_id = atol(audio_id_str);
+    }
+    if (!queryGet(queryString, "path", path, sizeof(path)))
+    {
+        osStrcpy(path, "/");
+    }
+
+    sanitizePath(name, false);
+
+    /* first canonicalize path, then merge to prevent directory traversal bugs */
+    sanitizePath(path, true);
+    char *pathAbsolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, path);
+    sanitizePath(pathAbsolute, true);
+
+    uint_t statusCode = 500;
+    char message[256];
+    osSnprintf(message, sizeof(message), "OK");
+
+    if (!fsDirExists(pathAbsolute))
+    {
+        statusCode = 500;
+        osSnprintf(message, sizeof(message), "invalid path: '%s'", path);
+        TRACE_ERROR("invalid path: '%s' -> '%s'\r\n", path, pathAbsolute);
+    }
+    else
+    {
+        char *filename = custom_asprintf("%s%c%s", pathAbsolute, PATH_SEPARATOR, name);
+
+        if (!filename)
+        {
+            TRACE_ERROR("Failed to build filename\r\n");
+            return ERROR_FAILURE;
+        }
+        sanitizePath(filename, false);
+
+        if (fsFileExists(filename))
+        {
+            TRACE_INFO("Filename '%s' already exists, overwriting\r\n", filename);
+        }
+
+        multipart_cbr_t cbr;
+        pcm_upload_ctx ctx;
+
+        osMemset(&cbr, 0x00, sizeof(cbr));
+        osMemset(&ctx, 0x00, sizeof(ctx));
+
+        cbr.multipart_start = &pcm_upload_start;
+        cbr.multipart_add = &pcm_upload_add;
+        cbr.multipart_end = &taf_encode_end;
+
+        ctx.file_path = filename;
+        ctx.audio_id = audio_id;
+
+        /* the encoder runs on its own task, so the socket keeps draining while frames encode */
+        error_t error = multipart_handle(connection, &cbr, &ctx);
+        if (ctx.encoder)
+        {
+            if (error == NO_ERROR)
+            {
+                error = pcm_encode_finish(ctx.encoder);
+                TRACE_INFO("[TAF] Ended encoding\r\n");
+            }
+            else
+            {
+                /* client went away or sent garbage, don't leave a truncated TAF behind */
+                pcm_encode_abort(ctx.encoder);
+            }
+        }
+
+        if (error == NO_ERROR)
+        {
+            statusCode = 200;
+            osSnprintf(message, sizeof(message), "OK");
+        }
+        else
+        {
+            statusCode = 500;
+            osSnprintf(message, sizeof(message), "encoding failed: %s", error2text(error));
+        }
+        osFreeMem(filename);
+    }
+
+    osFreeMem(pathAbsolute);
+
+    httpPrepareHeader(connection, "text/plain; charset=utf-8", osStrlen(message));
+    connection->response.statusCode = statusCode;
+
+    return httpWriteResponseString(connection, message, false);
+}
+
+static error_t uploadSendResponse(HttpConnection *connection, uint_t statusCode, const char *contentType, char *data, bool_t freeMemory)
+{
+    httpPrepareHeader(connection, contentType, osStrlen(data));
+    connection->response.statusCode = statusCode;
+
+    return httpWriteResponseString(connection, data, freeMemory);
+}
+
+static uint_t uploadStatusCode(error_t error)
+{
+    switch (error)
+    {
+    case NO_ERROR:
+        return 200;
+    case ERROR_NOT_FOUND:
+        return 404;
+    case ERROR_INVALID_PARAMETER:
+        return 400;
+    case ERROR_ALREADY_RUNNING:
+    case ERROR_WRONG_STATE:
+        return 409;
+    default:
+        return 500;
+    }
+}
+
+static error_t uploadSendStatus(HttpConnection *connection, const char *id)
+{
+    char *json = upload_session_status(id);
+    if (json == NULL)
+    {
+        return uploadSendResponse(connection, 404, "text/plain; charset=utf-8", "unknown upload", false);
+    }
+    return uploadSendResponse(connection, 200, "text/json", json, true);
+}
+
+error_t handleApiUploadCreate(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char overlay[128];
+    char path[128];
+    char filename[256];
+    char value[32];
+    const char *rootPath = NULL;
+
+    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
+    {
+        return ERROR_FAILURE;
+    }
+    if (!queryGet(queryString, "path", path, sizeof(path)))
+    {
+        osStrcpy(path, "/");
+    }
+    if (!queryGet(queryString, "filename", filename, sizeof(filename)) || !queryGet(queryString, "size", value, sizeof(value)))
+    {
+        return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", "filename and size required", false);
+    }
+    uint64_t size = strtoull(value, NULL, 10);
+    /* chunks are written with a signed 32 bit seek */
+    if (size > INT32_MAX)
+    {
+        return uploadSendResponse(connection, 413, "text/plain; charset=utf-8", "uploads must be below 2GB", false);
+    }
+
+    bool_t pcm = queryGet(queryString, "pcm", value, sizeof(value)) && !osStrcmp(value, "1");
+    uint32_t audio_id = 0;
+    if (queryGet(queryString, "audioId", value, sizeof(value)))
+    {
+        audio_id = atol(value);
+    }
+
+    if (strchr(filename, '\\') || strchr(filename, '/'))
+    {
+        TRACE_ERROR("Filename '%s' contains directory separators!\r\n", filename);
+        return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", "invalid filename", false);
+    }
+
+    /* first canonicalize path, then merge to prevent directory traversal bugs */
+    sanitizePath(path, true);
+    char *pathAbsolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, path);
+    sanitizePath(pathAbsolute, true);
+
+    if (!fsDirExists(pathAbsolute))
+    {
+        TRACE_ERROR("invalid path: '%s' -> '%s'\r\n", path, pathAbsolute);
+        osFreeMem(pathAbsolute);
+        return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", "invalid path", false);
+    }
+
+    char *target = custom_asprintf("%s%c%s", pathAbsolute, PATH_SEPARATOR, filename);
+    sanitizePath(target, false);
+    osFreeMem(pathAbsolute);
+
+    char id[UPLOAD_SESSION_ID_LEN + 1];
+    error_t error = upload_session_create(target, size, pcm, audio_id, id);
+    osFreeMem(target);
+    if (error != NO_ERROR)
+    {
+        return uploadSendResponse(connection, uploadStatusCode(error), "text/plain; charset=utf-8", (char *)error2text(error), false);
+    }
+
+    return uploadSendStatus(connection, id);
+}
+
+error_t handleApiUploadChunk(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char id[UPLOAD_SESSION_ID_LEN + 1];
+    char value[32];
+    char sha1Expected[2 * SHA1_DIGEST_SIZE + 1];
+
+    if (!queryGet(queryString, "id", id, sizeof(id)) || !queryGet(queryString, "offset", value, sizeof(value)))
+    {
+        return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", "id and offset required", false);
+    }
+    uint64_t offset = strtoull(value, NULL, 10);
+    uint64_t length = connection->request.byteCount;
+    bool_t checkSha1 = queryGet(queryString, "sha1", sha1Expected, sizeof(sha1Expected));
+
+    /* the chunk is written with a single seek, which takes a signed 32 bit offset */
+    if (connection->request.chunkedEncoding || offset + length > INT32_MAX)
+    {
+        return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", "chunk needs a content length and must be below 2GB", false);
+    }
+
+    char *staging = NULL;
+    error_t error = upload_session_chunk_begin(id, offset, length, &staging);
+    if (error != NO_ERROR)
+    {
+        return uploadSendResponse(connection, uploadStatusCode(error), "text/plain; charset=utf-8", (char *)error2text(error), false);
+    }
+
+    FsFile *file = fsOpenFileEx(staging, "r+");
+    uint8_t *buffer = osAllocMem(UPLOAD_SESSION_BUFFER_SIZE);
+    if (file == NULL || buffer == NULL)
+    {
+        error = ERROR_FILE_OPENING_FAILED;
+    }
+    else
+    {
+        error = fsSeekFile(file, (int_t)offset, FS_SEEK_SET);
     }
 
-    char *json_extension = osStrstr(uri, ".json");
-    if (json_extension != NULL)
+    Sha1Context sha1;
+    sha1Init(&sha1);
+    uint64_t remaining = length;
+    while (error == NO_ERROR && remaining > 0)
     {
-        *json_extension = '\0';
+        size_t received = 0;
+        error = httpReceive(connection, buffer, MIN(remaining, UPLOAD_SESSION_BUFFER_SIZE), &received, 0x00);
+        if (error == NO_ERROR && received == 0)
+        {
+            error = ERROR_END_OF_STREAM;
+        }
+        if (error == NO_ERROR)
+        {
+            sha1Update(&sha1, buffer, received);
+            error = fsWriteFile(file, buffer, received);
+            remaining -= received;
+        }
     }
-
-    char *path = (char *)uri + 1 + 7 + 1 + 8 + 1;
-    char *pathAbsolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, path);
-
-    char ruid[17];
-
-    contentJson_t contentJson;
-    load_content_json(pathAbsolute, &contentJson, false);
-    osFreeMem(pathAbsolute);
-
-    osStrncpy(ruid, path, 8);
-    osStrncpy(ruid + 8, path + 9, 8);
-    for (uint8_t i = 0; i < 16; i++)
+    if (file != NULL)
     {
-        ruid[i] = osTolower(ruid[i]);
+        fsCloseFile(file);
     }
-    ruid[16] = '\0';
+    osFreeMem(buffer);
+    osFreeMem(staging);
 
-    bool isSys = (ruid[0] == '0' && ruid[1] == '0' && ruid[2] == '0' && ruid[3] == '0' && ruid[4] == '0' && ruid[5] == '0' && ruid[6] == '0');
-    if (contentJson.cloud_auth_len != 32 && !isSys)
+    bool_t valid = (error == NO_ERROR);
+    if (valid && checkSha1)
     {
-        free_content_json(&contentJson);
-        return ERROR_FILE_NOT_FOUND;
+        uint8_t digest[SHA1_DIGEST_SIZE];
+        char digestHex[2 * SHA1_DIGEST_SIZE + 1];
+        sha1Final(&sha1, digest);
+        for (size_t i = 0; i < SHA1_DIGEST_SIZE; i++)
+        {
+            osSprintf(&digestHex[2 * i], "%02x", digest[i]);
+        }
+        valid = !osStrcasecmp(digestHex, sha1Expected);
+        if (!valid)
+        {
+            TRACE_WARNING("Chunk %" PRIu64 "+%" PRIu64 " of upload %s has a wrong checksum\r\n", offset, length, id);
+        }
     }
+    upload_session_chunk_end(id, offset, length, valid);
 
-    osMemcpy(connection->private.authentication_token, contentJson.cloud_auth, contentJson.cloud_auth_len);
-    free_content_json(&contentJson);
-    if (isSys)
+    if (error != NO_ERROR)
     {
-        osSprintf((char *)uri, "/v1/content/%s", ruid);
-        return handleCloudContent(connection, uri, queryString, client_ctx, true);
+        TRACE_ERROR("Chunk %" PRIu64 "+%" PRIu64 " of upload %s failed: %s\r\n", offset, length, id, error2text(error));
+        return error;
     }
-    else
+    if (!valid)
     {
-        osSprintf((char *)uri, "/v2/content/%s", ruid);
-        return handleCloudContent(connection, uri, queryString, client_ctx, false);
+        return uploadSendResponse(connection, 422, "text/plain; charset=utf-8", "checksum mismatch", false);
     }
+
+    return uploadSendStatus(connection, id);
 }
 
-typedef struct
+error_t handleApiUploadStatus(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
-    const char *overlay;
-    const char *file_path;
-    toniefile_t *taf;
-    uint8_t remainder[4];
-    int remainder_avail;
-    uint32_t audio_id;
-} taf_encode_ctx;
+    char id[UPLOAD_SESSION_ID_LEN + 1];
 
-error_t taf_encode_start(void *in_ctx, const char *name, const char *filename)
+    if (!queryGet(queryString, "id", id, sizeof(id)))
+    {
+        return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", "id required", false);
+    }
+    return uploadSendStatus(connection, id);
+}
+
+error_t handleApiUploadCommit(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
-    taf_encode_ctx *ctx = (taf_encode_ctx *)in_ctx;
+    char id[UPLOAD_SESSION_ID_LEN + 1];
 
-    if (!ctx->taf)
+    if (!queryGet(queryString, "id", id, sizeof(id)))
     {
-        TRACE_INFO("[TAF] Start encoding to %s\r\n", ctx->file_path);
-        TRACE_INFO("[TAF]   first file: %s\r\n", name);
-
-        ctx->taf = toniefile_create(ctx->file_path, ctx->audio_id, false);
+        return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", "id required", false);
+    }
 
-        if (ctx->taf == NULL)
+    upload_session_t session;
+    error_t error = upload_session_take(id, &session);
+    if (error == ERROR_WRONG_STATE)
+    {
+        /* chunks missing, tell the client which */
+        char *json = upload_session_status(id);
+        if (json != NULL)
         {
-            TRACE_INFO("[TAF]   Creating TAF failed\r\n");
-            return ERROR_FILE_OPENING_FAILED;
+            return uploadSendResponse(connection, 409, "text/json", json, true);
         }
     }
+    if (error != NO_ERROR)
+    {
+        return uploadSendResponse(connection, uploadStatusCode(error), "text/plain; charset=utf-8", (char *)error2text(error), false);
+    }
+
+    /* encoded or moved by a transcoding worker, which now owns the staging file */
+    uint32_t jobId = 0;
+    if (session.pcm)
+    {
+        TRACE_INFO("Upload %s complete, queueing encoding to '%s'\r\n", session.id, session.target);
+        error = transcode_job_add_pcm(session.target, session.staging, session.audio_id, &jobId);
+    }
     else
     {
-        TRACE_INFO("[TAF]   new chapter for %s\r\n", name);
-        toniefile_new_chapter(ctx->taf);
+        TRACE_INFO("Upload %s complete, queueing move to '%s'\r\n", session.id, session.target);
+        error = transcode_job_add_move(session.target, session.staging, &jobId);
+    }
+    if (error != NO_ERROR)
+    {
+        fsDeleteFile(session.staging);
+    }
+    upload_session_free(&session);
+    if (error != NO_ERROR)
+    {
+        return uploadSendResponse(connection, error == ERROR_OUT_OF_RESOURCES ? 503 : uploadStatusCode(error), "text/plain; charset=utf-8", (char *)error2text(error), false);
     }
 
-    return NO_ERROR;
+    cJSON *jsonResult = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jsonResult, "job", jobId);
+    char *jsonString = cJSON_PrintUnformatted(jsonResult);
+    cJSON_Delete(jsonResult);
+    return uploadSendResponse(connection, 202, "text/json", jsonString, true);
 }
 
-error_t taf_encode_add(void *in_ctx, void *data, size_t length)
+error_t handleApiUploadAbort(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
-    taf_encode_ctx *ctx = (taf_encode_ctx *)in_ctx;
-    uint8_t *byte_data = (uint8_t *)data;
-    size_t byte_data_start = 0;
-    size_t byte_data_length = length;
+    char id[UPLOAD_SESSION_ID_LEN + 1];
 
-    /* we have to take into account that the packets are not 4 byte aligned */
-    if (ctx->remainder_avail)
+    if (!queryGet(queryString, "id", id, sizeof(id)))
     {
-        /* there a a few bytes, so first fill the buffer */
-        int size = 4 - ctx->remainder_avail;
-        if (size > length)
-        {
-            size = length;
-        }
-        osMemcpy(&ctx->remainder[ctx->remainder_avail], byte_data, size);
-
-        byte_data_start += size;
-        byte_data_length -= size;
-        ctx->remainder_avail += size;
+        return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", "id required", false);
     }
 
-    /* either we have a full buffer now or no more data */
-    if (ctx->remainder_avail == 4)
+    error_t error = upload_session_abort(id);
+    return uploadSendResponse(connection, uploadStatusCode(error), "text/plain; charset=utf-8", error == NO_ERROR ? "OK" : (char *)error2text(error), false);
+}
+
+/* absolute path below rootPath, http(s) sources are passed to ffmpeg as they are */
+static char *jobResolvePath(const char *rootPath, const char *path, bool_t allowUrl)
+{
+    if (allowUrl && (!osStrncmp(path, "http://", 7) || !osStrncmp(path, "https://", 8)))
     {
-        toniefile_encode(ctx->taf, (int16_t *)ctx->remainder, 1);
-        ctx->remainder_avail = 0;
+        return strdup(path);
     }
 
-    int samples = byte_data_length / 4;
-    int remain = byte_data_length % 4;
+    /* first canonicalize path, then merge to prevent directory traversal bugs */
+    char *relative = strdup(path);
+    sanitizePath(relative, false);
+    char *absolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, relative);
+    sanitizePath(absolute, false);
+    osFreeMem(relative);
 
-    if (samples)
-    {
-        toniefile_encode(ctx->taf, (int16_t *)&byte_data[byte_data_start], samples);
-    }
+    return absolute;
+}
 
-    if (remain)
+static bool_t jobTargetDirExists(const char *target)
+{
+    char *dir = strdup(target);
+    char *separator = strrchr(dir, PATH_SEPARATOR);
+    if (separator != NULL)
     {
-        osMemcpy(ctx->remainder, &byte_data[byte_data_start + samples * 4], remain);
-        ctx->remainder_avail = remain;
+        *separator = '\0';
     }
+    bool_t exists = separator != NULL && fsDirExists(dir);
+    osFreeMem(dir);
 
-    return NO_ERROR;
+    return exists;
 }
 
-error_t taf_encode_end(void *in_ctx)
+error_t handleApiJobs(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
-    TRACE_INFO("[TAF]   end of file\r\n");
-    return NO_ERROR;
+    char value[16];
+    uint32_t id = 0;
+
+    if (queryGet(queryString, "id", value, sizeof(value)))
+    {
+        id = atol(value);
+        if (id == 0)
+        {
+            return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", "invalid id", false);
+        }
+    }
+
+    char *json = transcode_job_json(id);
+    if (json == NULL)
+    {
+        return uploadSendResponse(connection, 404, "text/plain; charset=utf-8", "unknown job", false);
+    }
+    return uploadSendResponse(connection, 200, "text/json", json, true);
 }
 
-error_t handleApiPcmUpload(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+error_t handleApiJobsAdd(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
     char overlay[128];
-    char name[256];
-    char uid[32];
-    char path[128];
-    char audio_id_str[128];
-    uint32_t audio_id = 0;
-
-    osStrcpy(name, "unnamed");
-    osStrcpy(uid, "");
-    osStrcpy(path, "");
-    osStrcpy(audio_id_str, "");
-
     const char *rootPath = NULL;
 
     if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
@@ -1743,96 +2740,146 @@ error_t handleApiPcmUpload(HttpConnection *connection, const char_t *uri, const
         return ERROR_FAILURE;
     }
 
-    if (queryGet(queryString, "name", name, sizeof(name)))
-    {
-        TRACE_INFO("got name '%s'\r\n", name);
-    }
-    if (queryGet(queryString, "uid", uid, sizeof(uid)))
+    char_t *post_data = osAllocMem(TRANSCODE_JOB_BODY_SIZE);
+    if (post_data == NULL)
     {
-        TRACE_INFO("got uid '%s'\r\n", uid);
+        return ERROR_OUT_OF_MEMORY;
     }
-    if (queryGet(queryString, "audioId", audio_id_str, sizeof(audio_id_str)))
+    error_t error = parsePostData(connection, post_data, TRANSCODE_JOB_BODY_SIZE);
+    if (error != NO_ERROR)
     {
-        TRACE_INFO("got audioId '%s'\r\n", audio_id_str);
-        audio_id = atol(audio_id_str);
+        osFreeMem(post_data);
+        return error;
     }
-    if (!queryGet(queryString, "path", path, sizeof(path)))
+    cJSON *json = cJSON_Parse(post_data);
+    osFreeMem(post_data);
+    if (json == NULL)
     {
-        osStrcpy(path, "/");
+        return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", "invalid json", false);
     }
 
-    sanitizePath(name, false);
-
-    /* first canonicalize path, then merge to prevent directory traversal bugs */
-    sanitizePath(path, true);
-    char *pathAbsolute = custom_asprintf("%s%c%s", rootPath, PATH_SEPARATOR, path);
-    sanitizePath(pathAbsolute, true);
+    const char *message = NULL;
+    char *target = NULL;
+    char *sources[TRANSCODE_JOB_SOURCES_MAX];
+    size_t source_count = 0;
+    uint32_t id = 0;
 
-    uint_t statusCode = 500;
-    char message[256];
-    osSnprintf(message, sizeof(message), "OK");
+    cJSON *jsonType = cJSON_GetObjectItemCaseSensitive(json, "type");
+    bool_t tap = cJSON_IsString(jsonType) && !osStrcmp(jsonType->valuestring, "tap");
+    bool_t force = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "force"));
+    cJSON *jsonSkip = cJSON_GetObjectItemCaseSensitive(json, "skipSeconds");
+    uint32_t skip_seconds = cJSON_IsNumber(jsonSkip) && jsonSkip->valuedouble > 0 ? (uint32_t)jsonSkip->valuedouble : 0;
+    cJSON *jsonTarget = cJSON_GetObjectItemCaseSensitive(json, tap ? "tap" : "target");
 
-    if (!fsDirExists(pathAbsolute))
+    if (!cJSON_IsString(jsonType) || (!tap && osStrcmp(jsonType->valuestring, "encode")))
     {
-        statusCode = 500;
-        osSnprintf(message, sizeof(message), "invalid path: '%s'", path);
-        TRACE_ERROR("invalid path: '%s' -> '%s'\r\n", path, pathAbsolute);
+        message = "type must be encode or tap";
+    }
+    else if (!cJSON_IsString(jsonTarget))
+    {
+        message = tap ? "tap required" : "target required";
     }
     else
     {
-        char *filename = custom_asprintf("%s%c%s", pathAbsolute, PATH_SEPARATOR, name);
-
-        if (!filename)
+        target = jobResolvePath(rootPath, jsonTarget->valuestring, false);
+        if (tap ? !fsFileExists(target) : !jobTargetDirExists(target))
         {
-            TRACE_ERROR("Failed to build filename\r\n");
-            return ERROR_FAILURE;
+            message = "invalid path";
         }
-        sanitizePath(filename, false);
+    }
 
-        if (fsFileExists(filename))
+    if (message == NULL && !tap)
+    {
+        cJSON *jsonSource;
+        cJSON_ArrayForEach(jsonSource, cJSON_GetObjectItemCaseSensitive(json, "sources"))
         {
-            TRACE_INFO("Filename '%s' already exists, overwriting\r\n", filename);
+            if (!cJSON_IsString(jsonSource) || source_count >= TRANSCODE_JOB_SOURCES_MAX)
+            {
+                message = "invalid sources";
+                break;
+            }
+            sources[source_count] = jobResolvePath(rootPath, jsonSource->valuestring, true);
+            if (osStrstr(sources[source_count], "://") == NULL && !fsFileExists(sources[source_count]))
+            {
+                TRACE_ERROR("Source '%s' not found\r\n", sources[source_count]);
+                message = "source not found";
+            }
+            source_count++;
+            if (message != NULL)
+            {
+                break;
+            }
+        }
+        if (message == NULL && source_count == 0)
+        {
+            message = "sources required";
         }
+    }
+    cJSON_Delete(json);
 
-        multipart_cbr_t cbr;
-        taf_encode_ctx ctx;
+    if (message == NULL)
+    {
+        error = transcode_job_add(tap ? TRANSCODE_JOB_TAP : TRANSCODE_JOB_ENCODE, target, (const char **)sources, source_count, skip_seconds, force, &id);
+    }
+    for (size_t i = 0; i < source_count; i++)
+    {
+        osFreeMem(sources[i]);
+    }
+    osFreeMem(target);
 
-        osMemset(&cbr, 0x00, sizeof(cbr));
-        osMemset(&ctx, 0x00, sizeof(ctx));
+    if (message != NULL)
+    {
+        return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", (char *)message, false);
+    }
+    if (error != NO_ERROR)
+    {
+        return uploadSendResponse(connection, error == ERROR_OUT_OF_RESOURCES ? 503 : uploadStatusCode(error), "text/plain; charset=utf-8", (char *)error2text(error), false);
+    }
 
-        cbr.multipart_start = &taf_encode_start;
-        cbr.multipart_add = &taf_encode_add;
-        cbr.multipart_end = &taf_encode_end;
+    cJSON *jsonResult = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jsonResult, "id", id);
+    char *jsonString = cJSON_PrintUnformatted(jsonResult);
+    cJSON_Delete(jsonResult);
 
-        ctx.file_path = filename;
-        ctx.overlay = overlay;
-        ctx.audio_id = audio_id;
+    return uploadSendResponse(connection, 200, "text/json", jsonString, true);
+}
 
-        switch (multipart_handle(connection, &cbr, &ctx))
-        {
-        case NO_ERROR:
-            statusCode = 200;
-            osSnprintf(message, sizeof(message), "OK");
-            break;
-        default:
-            statusCode = 500;
-            break;
-        }
+error_t handleApiJobsCancel(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char value[16];
 
-        if (ctx.taf)
-        {
-            TRACE_INFO("[TAF] Ended encoding\r\n");
-            toniefile_close(ctx.taf);
-        }
-        osFreeMem(filename);
+    if (!queryGet(queryString, "id", value, sizeof(value)))
+    {
+        return uploadSendResponse(connection, 400, "text/plain; charset=utf-8", "id required", false);
     }
 
-    osFreeMem(pathAbsolute);
+    error_t error = transcode_job_cancel(atol(value));
+    return uploadSendResponse(connection, uploadStatusCode(error), "text/plain; charset=utf-8", error == NO_ERROR ? "OK" : (char *)error2text(error), false);
+}
 
-    httpPrepareHeader(connection, "text/plain; charset=utf-8", osStrlen(message));
-    connection->response.statusCode = statusCode;
+error_t handleApiContentStore(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    return uploadSendResponse(connection, 200, "text/json", content_store_json(), true);
+}
 
-    return httpWriteResponseString(connection, message, false);
+error_t handleApiContentStoreGc(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    uint32_t removed = 0;
+    uint64_t removedBytes = 0;
+
+    error_t error = content_store_gc(&removed, &removedBytes);
+    if (error != NO_ERROR)
+    {
+        return uploadSendResponse(connection, uploadStatusCode(error), "text/plain; charset=utf-8", (char *)error2text(error), false);
+    }
+
+    cJSON *jsonResult = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jsonResult, "removed", removed);
+    cJSON_AddNumberToObject(jsonResult, "removedBytes", (double)removedBytes);
+    char *jsonString = cJSON_PrintUnformatted(jsonResult);
+    cJSON_Delete(jsonResult);
+
+    return uploadSendResponse(connection, 200, "text/json", jsonString, true);
 }
 
 error_t handleApiDirectoryCreate(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
@@ -1966,6 +3013,10 @@ error_t handleApiFileDelete(HttpConnection *connection, const char_t *uri, const
     osSnprintf(message, sizeof(message), "OK");
 
     error_t err = fsDeleteFile(pathAbsolute);
+    if (err == NO_ERROR)
+    {
+        content_index_invalidate(pathAbsolute);
+    }
 
     if (err != NO_ERROR)
     {
@@ -1991,10 +3042,19 @@ error_t handleApiToniesJson(HttpConnection *connection, const char_t *uri, const
 }
 error_t handleApiToniesJsonUpdate(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
+    /* progress and result are reported as ToniesJsonUpdate events */
     char *message = "Triggered tonies.json update";
+    error_t error = tonies_update_start();
+    if (error == ERROR_ALREADY_RUNNING)
+    {
+        message = "tonies.json update already running";
+    }
+    else if (error != NO_ERROR)
+    {
+        message = "Failed to start tonies.json update";
+    }
     httpPrepareHeader(connection, "text/plain; charset=utf-8", osStrlen(message));
-    httpWriteResponseString(connection, message, false);
-    return tonies_update();
+    return httpWriteResponseString(connection, message, false);
 }
 
 error_t handleApiToniesCustomJson(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
@@ -2020,6 +3080,16 @@ error_t handleApiToniesJsonSearch(HttpConnection *connection, const char_t *uri,
     queryGet(queryString, "searchSeries", searchSeries, sizeof(searchSeries));
     queryGet(queryString, "searchEpisode", searchEpisode, sizeof(searchEpisode));
 
+    /* results only change when tonies.json is reloaded, the query is part of the URL */
+    httpInitResponseHeader(connection);
+    uint32_t version = tonies_version();
+    apiSetEtag(connection, apiHash(API_HASH_INIT, &version, sizeof(version)));
+    if (httpCheckNotModified(connection))
+    {
+        return httpSendNotModifiedResponse(connection);
+    }
+
+    tonies_read_begin();
     tonies_byModelSeriesEpisode(searchModel, searchSeries, searchEpisode, result, &result_size);
 
     cJSON *jsonArray = cJSON_CreateArray();
@@ -2027,10 +3097,10 @@ error_t handleApiToniesJsonSearch(HttpConnection *connection, const char_t *uri,
     {
         addToniesJsonInfoJson(result[i], jsonArray);
     }
+    tonies_read_end();
 
     char *jsonString = cJSON_PrintUnformatted(jsonArray);
     cJSON_Delete(jsonArray);
-    httpInitResponseHeader(connection);
     connection->response.contentType = "text/json";
     connection->response.contentLength = osStrlen(jsonString);
 
@@ -2282,12 +3352,9 @@ error_t handleApiTagIndex(HttpConnection *connection, const char_t *uri, const c
             }
             char *tagPath = custom_asprintf("%s%c%s", subDirPath, PATH_SEPARATOR, subEntry.name);
             tagPath[osStrlen(tagPath) - 5] = '\0';
-            tonie_info_t *tafInfo = getTonieInfo(tagPath, client_ctx->settings);
-
-            contentJson_t contentJson;
-            load_content_json(tagPath, &contentJson, false);
+            content_index_entry_t *indexEntry = content_index_get(tagPath, client_ctx->settings);
 
-            if (contentJson._valid)
+            if (indexEntry->json_valid)
             {
                 cJSON *jsonEntry = cJSON_CreateObject();
                 cJSON_AddStringToObject(jsonEntry, "ruid", ruid);
@@ -2313,18 +3380,18 @@ error_t handleApiTagIndex(HttpConnection *connection, const char_t *uri, const c
                 {
                     cJSON_AddStringToObject(jsonEntry, "type", "tag");
                 }
-                cJSON_AddBoolToObject(jsonEntry, "valid", tafInfo->valid);
-                cJSON_AddBoolToObject(jsonEntry, "exists", tafInfo->exists);
-                cJSON_AddBoolToObject(jsonEntry, "live", tafInfo->json.live);
-                cJSON_AddBoolToObject(jsonEntry, "nocloud", tafInfo->json.nocloud);
-                cJSON_AddStringToObject(jsonEntry, "source", tafInfo->json.source);
+                cJSON_AddBoolToObject(jsonEntry, "valid", indexEntry->valid);
+                cJSON_AddBoolToObject(jsonEntry, "exists", indexEntry->exists);
+                cJSON_AddBoolToObject(jsonEntry, "live", indexEntry->live);
+                cJSON_AddBoolToObject(jsonEntry, "nocloud", indexEntry->nocloud);
+                cJSON_AddStringToObject(jsonEntry, "source", indexEntry->source);
 
                 char *audioUrl = custom_asprintf("/v1/content/%s?skip_header=true", ruid);
                 cJSON_AddStringToObject(jsonEntry, "audioUrl", audioUrl);
                 osFreeMem(audioUrl);
-                if (!tafInfo->exists)
+                if (!indexEntry->exists)
                 {
-                    if (contentJson._has_cloud_auth || isSys)
+                    if (indexEntry->has_cloud_auth || isSys)
                     {
                         char *downloadTriggerUrl = custom_asprintf("/content/download%s", &tagPath[osStrlen(rootPath)]);
                         cJSON_AddStringToObject(jsonEntry, "downloadTriggerUrl", downloadTriggerUrl);
@@ -2336,14 +3403,15 @@ error_t handleApiTagIndex(HttpConnection *connection, const char_t *uri, const c
                     }
                 }
 
-                toniesJson_item_t *item = tonies_byModel(contentJson.tonie_model);
+                tonies_read_begin();
+                toniesJson_item_t *item = tonies_byModel(indexEntry->tonie_model);
                 addToniesJsonInfoJson(item, jsonEntry);
+                tonies_read_end();
 
                 cJSON_AddItemToArray(jsonArray, jsonEntry);
             }
 
-            freeTonieInfo(tafInfo);
-            free_content_json(&contentJson);
+            content_index_free(indexEntry);
             osFreeMem(tagPath);
         }
         osFreeMem(subDirPath);
@@ -2352,7 +3420,14 @@ error_t handleApiTagIndex(HttpConnection *connection, const char_t *uri, const c
     char *jsonString = cJSON_PrintUnformatted(json);
     cJSON_Delete(json);
 
+    /* tags are polled, only the body itself tells whether anything changed */
     httpInitResponseHeader(connection);
+    apiSetEtag(connection, apiHash(API_HASH_INIT, jsonString, osStrlen(jsonString)));
+    if (httpCheckNotModified(connection))
+    {
+        osFreeMem(jsonString);
+        return httpSendNotModifiedResponse(connection);
+    }
     connection->response.contentType = "text/json";
     connection->response.contentLength = osStrlen(jsonString);
 
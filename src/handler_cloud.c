@@ -12,10 +12,14 @@
 
 #include "mqtt.h"
 #include "server_helpers.h"
+#include "stats.h"
+#include "content_prefetch.h"
+#include "content_store.h"
 
 #include "toniefile.h"
 #include "toniesJson.h"
 #include "tonie_audio_playlist.h"
+#include "transcode_job.h"
 
 #include <byteswap.h>
 
@@ -404,6 +408,163 @@ error_t handleCloudClaim(HttpConnection *connection, const char_t *uri, const ch
     return ret;
 }
 
+/* waits until the stream task produces data, ends early or the box stops the playback */
+static error_t stream_wait_active(stream_ctx_t *stream_ctx)
+{
+    if (stream_ctx->taskId == OS_INVALID_TASK_ID)
+    {
+        stream_ctx->error = ERROR_OUT_OF_RESOURCES;
+        stream_ctx->quit = true;
+        completion_complete(&stream_ctx->completion, stream_ctx->error);
+        return stream_ctx->error;
+    }
+
+    systime_t start = osGetSystemTime();
+    while (!stream_ctx->active && !stream_ctx->quit)
+    {
+        systime_t elapsed = osGetSystemTime() - start;
+        if (elapsed >= STREAM_START_TIMEOUT)
+        {
+            return ERROR_TIMEOUT;
+        }
+        error_t error = completion_wait(&stream_ctx->completion, STREAM_START_TIMEOUT - elapsed);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+    }
+    return NO_ERROR;
+}
+
+/* asks the stream task to stop and waits for it to exit */
+static void stream_ctx_stop(stream_ctx_t *stream_ctx)
+{
+    stream_ctx->active = false;
+    completion_join(&stream_ctx->completion, INFINITE_DELAY);
+}
+
+#define STREAM_RING_IDLE_FLUSH 1000
+
+/* sends the TAF from the encoder ring, falls back to the spill file for data the ring no longer holds */
+static error_t stream_ring_send_response(stream_ring_t *ring, HttpConnection *connection, const char *spillPath, completion_t *wake)
+{
+    client_ctx_t *client_ctx = &connection->private.client_ctx;
+    bool_t skip_header = client_ctx->skip_taf_header;
+    uint32_t file_length = CONTENT_LENGTH_MAX;
+    FsFile *spill = NULL;
+    error_t error = NO_ERROR;
+
+    if (client_ctx->settings->encode.ffmpeg_stream_restart)
+    {
+        file_length = (uint32_t)stream_ring_end(ring);
+        if (skip_header && file_length >= STREAM_RING_PAGE_SIZE)
+        {
+            file_length -= STREAM_RING_PAGE_SIZE;
+        }
+    }
+
+    connection->response.contentType = "application/octet-stream";
+    connection->response.chunkedEncoding = FALSE;
+    if (connection->request.Range.start > 0)
+    {
+        connection->request.Range.size = file_length;
+        if (connection->request.Range.end >= connection->request.Range.size || connection->request.Range.end == 0)
+        {
+            connection->request.Range.end = connection->request.Range.size - 1;
+        }
+        if (connection->response.contentRange == NULL)
+        {
+            connection->response.contentRange = osAllocMem(255);
+        }
+        osSprintf((char *)connection->response.contentRange, "bytes %" PRIu32 "-%" PRIu32 "/%" PRIu32, connection->request.Range.start, connection->request.Range.end, connection->request.Range.size);
+        connection->response.statusCode = 206;
+        connection->response.contentLength = connection->request.Range.end - connection->request.Range.start + 1;
+    }
+    else
+    {
+        connection->response.statusCode = 200;
+        connection->response.contentLength = CONTENT_LENGTH_MAX;
+    }
+
+    error = httpWriteHeader(connection);
+    if (error)
+    {
+        return error;
+    }
+
+    size_t offset = connection->request.Range.start;
+    if (skip_header)
+    {
+        offset += STREAM_RING_PAGE_SIZE;
+    }
+    size_t remaining = connection->response.contentLength;
+
+    while (remaining > 0)
+    {
+        size_t read = 0;
+        size_t n = MIN(remaining, HTTP_SERVER_BUFFER_SIZE);
+
+        error = stream_ring_read(ring, offset, (uint8_t *)connection->buffer, n, &read);
+        if (error == ERROR_NOT_FOUND && spillPath)
+        {
+            /* fell behind the ring or resumed before it, read back from disk */
+            if (!spill)
+            {
+                spill = fsOpenFile(spillPath, FS_FILE_MODE_READ);
+            }
+            if (spill && fsSeekFile(spill, offset, FS_SEEK_SET) == NO_ERROR)
+            {
+                error = fsReadFile(spill, connection->buffer, n, &read);
+            }
+        }
+        if (error == ERROR_WOULD_BLOCK)
+        {
+            if (completion_is_done(wake))
+            {
+                /* encoder quit without closing the ring */
+                error = ERROR_END_OF_STREAM;
+                break;
+            }
+            error = completion_wait(wake, STREAM_RING_IDLE_FLUSH);
+            if (error == ERROR_ABORTED)
+            {
+                break;
+            }
+            /* keeps the connection alive and detects a disconnected client */
+            error = httpFlushStream(connection);
+            if (error)
+            {
+                break;
+            }
+            continue;
+        }
+        if (error != NO_ERROR || read == 0)
+        {
+            break;
+        }
+
+        error = httpWriteStream(connection, connection->buffer, read);
+        if (error)
+        {
+            break;
+        }
+        offset += read;
+        remaining -= read;
+    }
+
+    if (spill)
+    {
+        fsCloseFile(spill);
+    }
+
+    if (error == NO_ERROR || error == ERROR_END_OF_STREAM)
+    {
+        error = httpFlushStream(connection);
+    }
+
+    return error;
+}
+
 error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx, bool_t noPassword)
 {
 #define RUID_URI_CONTENT_BEGIN 12
@@ -531,7 +692,7 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
             fsCreateDir(dir);
             osFreeMem(dir);
 
-            error = fsCopyFile(assignFile, tonieInfo->contentPath, true);
+            error = content_store_copy(assignFile, tonieInfo->contentPath);
             if (error != NO_ERROR)
             {
                 freeTonieInfo(tonieInfoAssign);
@@ -577,6 +738,25 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
         ffmpeg_ctx.source = tonieInfo->json._source_resolved;
         ffmpeg_ctx.skip_seconds = tonieInfo->json.skip_seconds;
         ffmpeg_ctx.targetFile = tonieInfo->json._streamFile;
+        ffmpeg_ctx.ring = NULL;
+        /* resuming appends to the file on disk, so it has to be written */
+        ffmpeg_ctx.spill = client_ctx->settings->encode.ffmpeg_stream_spill || ffmpeg_ctx.append;
+
+        uint32_t ring_pages = client_ctx->settings->encode.ffmpeg_stream_ring_pages;
+        if (ring_pages > 0)
+        {
+            ffmpeg_ctx.ring = osAllocMem(sizeof(stream_ring_t));
+            if (ffmpeg_ctx.ring && stream_ring_init(ffmpeg_ctx.ring, ring_pages, !ffmpeg_ctx.spill) != NO_ERROR)
+            {
+                osFreeMem(ffmpeg_ctx.ring);
+                ffmpeg_ctx.ring = NULL;
+            }
+            if (!ffmpeg_ctx.ring)
+            {
+                TRACE_WARNING("Could not allocate stream ring, streaming from disk\r\n");
+                ffmpeg_ctx.spill = true;
+            }
+        }
 
         stream_ctx_t *stream_ctx = &client_ctx->state->box.stream_ctx;
         stream_ctx->active = false;
@@ -584,46 +764,54 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
         stream_ctx->error = NO_ERROR;
         stream_ctx->stop_on_playback_stop = true;
         stream_ctx->ctx = &ffmpeg_ctx;
+        completion_reset(&stream_ctx->completion);
         stream_ctx->taskId = osCreateTask(streamFileRel, &ffmpeg_stream_task, stream_ctx, 10 * 1024, 0);
 
-        while (!stream_ctx->active && stream_ctx->error == NO_ERROR)
-        {
-            osDelayTask(100);
-        }
-        if (stream_ctx->error == NO_ERROR)
+        error_t wait_error = stream_wait_active(stream_ctx);
+        if (wait_error == NO_ERROR && stream_ctx->error == NO_ERROR)
         {
             if (client_ctx->settings->encode.ffmpeg_sweep_startup_buffer)
             {
                 osDelayTask(client_ctx->settings->encode.ffmpeg_sweep_delay_ms);
             }
 
-            uint32_t delay = client_ctx->settings->encode.ffmpeg_stream_buffer_ms;
-            TRACE_INFO("Serve streaming content from %s, delay %" PRIu32 "ms\r\n", tonieInfo->json.source, delay);
+            uint32_t buffer_ms = client_ctx->settings->encode.ffmpeg_stream_buffer_ms;
+            TRACE_INFO("Serve streaming content from %s, buffer %" PRIu32 "ms\r\n", tonieInfo->json.source, buffer_ms);
             ffmpeg_ctx.sweep = false;
-            if (!ffmpeg_ctx.append)
+
+            error_t error;
+            if (ffmpeg_ctx.ring)
             {
-                osDelayTask(delay);
+                /* send as soon as enough audio is encoded instead of waiting the full buffer time */
+                uint64_t buffer_bytes = (uint64_t)buffer_ms * client_ctx->settings->encode.bitrate / 8;
+                size_t buffer_pages = (size_t)MIN((buffer_bytes + STREAM_RING_PAGE_SIZE - 1) / STREAM_RING_PAGE_SIZE, ring_pages);
+                stream_ring_wait_ready(ffmpeg_ctx.ring, buffer_pages * STREAM_RING_PAGE_SIZE, &stream_ctx->completion, STREAM_START_TIMEOUT);
+                error = stream_ring_send_response(ffmpeg_ctx.ring, connection, ffmpeg_ctx.spill ? ffmpeg_ctx.targetFile : NULL, &stream_ctx->completion);
             }
             else
             {
-                osDelayTask(delay);
+                osDelayTask(buffer_ms);
+                error = httpSendResponseStream(connection, streamFileRel, true);
             }
-            error_t error = httpSendResponseStream(connection, streamFileRel, true);
             if (error)
             {
                 TRACE_ERROR(" >> file %s not available or not send, error=%s...\r\n", tonieInfo->contentPath, error2text(error));
             }
         }
-        stream_ctx->active = false;
-        while (!stream_ctx->quit)
+        if (ffmpeg_ctx.ring)
+        {
+            /* the encoder may be waiting for the reader */
+            stream_ring_leave(ffmpeg_ctx.ring);
+        }
+        stream_ctx_stop(stream_ctx);
+        if (ffmpeg_ctx.ring)
         {
-            osDelayTask(100);
+            stream_ring_deinit(ffmpeg_ctx.ring);
+            osFreeMem(ffmpeg_ctx.ring);
         }
     }
     else if (tonieInfo->json._source_type == CT_SOURCE_TAP_STREAM)
     {
-        // TODO: Add MUTEX on tonieInfo->json._tap._filepath_resolved
-
         TRACE_INFO("Serve streaming TAP %s from %s\r\n", tonieInfo->contentPath, tonieInfo->json._source_resolved);
         char *streamFileRel = &tonieInfo->contentPath[osStrlen(client_ctx->settings->internal.datadirfull)];
         connection->response.keepAlive = true;
@@ -639,14 +827,18 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
         stream_ctx->error = NO_ERROR;
         stream_ctx->stop_on_playback_stop = true;
         stream_ctx->ctx = &tap_param;
-        stream_ctx->taskId = osCreateTask(streamFileRel, &tap_generate_task, stream_ctx, 10 * 1024, 0);
+        completion_reset(&stream_ctx->completion);
 
-        while (!stream_ctx->active && stream_ctx->error == NO_ERROR)
+        /* shares the TAF with TAP jobs, only one of them may write it and it takes a worker slot */
+        uint32_t jobId = 0;
+        error_t claim_error = transcode_job_claim(TRANSCODE_JOB_TAP, tap_param.tap->_filepath_tap, STREAM_START_TIMEOUT, &jobId);
+        error_t wait_error = claim_error;
+        if (claim_error == NO_ERROR)
         {
-            osDelayTask(100);
+            stream_ctx->taskId = osCreateTask(streamFileRel, &tap_generate_task, stream_ctx, 10 * 1024, 0);
+            wait_error = stream_wait_active(stream_ctx);
         }
-
-        if (stream_ctx->error == NO_ERROR)
+        if (wait_error == NO_ERROR && stream_ctx->error == NO_ERROR)
         {
             error_t error = httpSendResponseStream(connection, streamFileRel, true);
             if (error)
@@ -656,14 +848,13 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
         }
         else
         {
-            TRACE_ERROR(" >> TAP stream not available, error=%s...\r\n", error2text(stream_ctx->error));
+            TRACE_ERROR(" >> TAP stream not available, error=%s...\r\n", error2text(wait_error != NO_ERROR ? wait_error : stream_ctx->error));
         }
 
-        stream_ctx->active = false;
-        ;
-        while (!stream_ctx->quit)
+        if (claim_error == NO_ERROR)
         {
-            osDelayTask(100);
+            stream_ctx_stop(stream_ctx);
+            transcode_job_release(jobId, stream_ctx->error);
         }
     }
     else if (tonieInfo->exists && tonieInfo->valid && (!tonie_marked || !can_use_cloud))
@@ -719,10 +910,40 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
             }
 
             connection->response.keepAlive = true;
-            cbr_ctx_t ctx;
-            req_cbr_t cbr = getCloudCbr(connection, uri, queryString, V2_CONTENT, &ctx, client_ctx);
-            ctx.tonieInfo = tonieInfo;
-            cloud_request_get(NULL, 0, uri, queryString, token, &cbr);
+
+            /* coalesce concurrent downloads of the same content into one cloud request */
+            completion_t wake;
+            content_flight_t *flight = NULL;
+            osMemset(&wake, 0x00, sizeof(completion_t));
+            bool_t leader = TRUE;
+            if (client_ctx->settings->cloud.cacheContent && connection->request.Range.start == 0 && completion_init(&wake) == NO_ERROR)
+            {
+                flight = content_flight_join(tonieInfo->contentPath, &wake, &leader);
+            }
+
+            error = ERROR_ABORTED;
+            if (!leader)
+            {
+                TRACE_INFO("Download of %s already running, following it\r\n", tonieInfo->contentPath);
+                stats_update("cloud_content_coalesced", 1);
+                error = content_flight_follow(flight, &wake, connection);
+                content_flight_release(flight, &wake);
+                flight = NULL;
+                if (error == ERROR_ABORTED)
+                {
+                    TRACE_WARNING("Followed download failed, requesting content itself\r\n");
+                }
+            }
+            if (error == ERROR_ABORTED)
+            {
+                cbr_ctx_t ctx;
+                req_cbr_t cbr = getCloudCbr(connection, uri, queryString, V2_CONTENT, &ctx, client_ctx);
+                ctx.tonieInfo = tonieInfo;
+                ctx.flight = flight;
+                cloud_request_get(NULL, 0, uri, queryString, token, &cbr);
+                content_flight_release(flight, NULL);
+            }
+            completion_deinit(&wake);
             error = NO_ERROR;
         }
     }
@@ -889,6 +1110,10 @@ error_t handleCloudFreshnessCheck(HttpConnection *connection, const char_t *uri,
                 if (!tonieInfo->valid)
                 {
                     content_json_update_model(&tonieInfo->json, freshReq->tonie_infos[i]->audio_id, NULL);
+                    if (!tonieInfo->json.nocloud || tonieInfo->json.cloud_override)
+                    {
+                        content_prefetch_enqueue(freshReq->tonie_infos[i]->uid, client_ctx->settings, FALSE);
+                    }
                 }
 
                 if (tonieInfo->json.live || tonieInfo->updated || (tonieInfo->json._source_type == CT_SOURCE_STREAM) || (tonieInfo->json._source_type == CT_SOURCE_TAP_STREAM) || isFlex)
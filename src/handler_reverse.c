@@ -20,25 +20,37 @@
 error_t handleReverse(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
     cbr_ctx_t cbr_ctx;
+    completion_t done;
     req_cbr_t cbr = getCloudCbr(connection, uri, queryString, API_NONE, &cbr_ctx, client_ctx);
 
+    error_t error = completion_init(&done);
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+    cbr_ctx.completion = &done;
+
     stats_update("reverse_requests", 1);
 
     /* here call cloud request, which has to get extended for cbr for header fields and content packets */
     uint8_t *token = connection->private.authentication_token;
 
     // TODO POST
-    error_t error = cloud_request_get(NULL, 0, &uri[8], queryString, token, &cbr);
+    error = cloud_request_get(NULL, 0, &uri[8], queryString, token, &cbr);
     if (error != NO_ERROR)
     {
         TRACE_ERROR("cloud_request_get() failed\r\n");
+        completion_deinit(&done);
         return error;
     }
 
     TRACE_INFO("httpServerRequestCallback: (waiting)\r\n");
-    while (cbr_ctx.status != PROX_STATUS_DONE)
+    error = completion_wait_done(&done, REVERSE_PROXY_TIMEOUT);
+    completion_deinit(&done);
+    if (error != NO_ERROR)
     {
-        osDelayTask(50);
+        TRACE_ERROR("httpServerRequestCallback: request did not complete, error=%s\r\n", error2text(error));
+        return error;
     }
     error = httpFlushStream(connection);
 
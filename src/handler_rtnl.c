@@ -7,6 +7,7 @@
 #include <time.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "mutex_manager.h"
 #include "handler_sse.h"
@@ -20,9 +21,20 @@
 #include "toniesJson.h"
 #include "server_helpers.h"
 #include "toniebox_state.h"
+#include "rtnl_log.h"
+#include "cJSON.h"
 
 #include "proto/toniebox.pb.rtnl.pb-c.h"
 
+#ifdef _MSC_VER
+#define RTNL_THREAD_LOCAL __declspec(thread)
+#else
+#define RTNL_THREAD_LOCAL __thread
+#endif
+
+/* formatting scratch space, reused for every packet handled by this connection task */
+static RTNL_THREAD_LOCAL char_t rtnlFormatBuffer[4096];
+
 static void escapeString(const char_t *input, size_t size, char_t *output);
 static void escapeString(const char_t *input, size_t size, char_t *output)
 {
@@ -129,12 +141,18 @@ error_t handleRtnl(HttpConnection *connection, const char_t *uri, const char_t *
             mutex_unlock(MUTEX_RTNL_FILE);
         }
 
+        const uint8_t *record = (const uint8_t *)&buffer[pos];
         pos += 4;
         TonieRtnlRPC *rpc = tonie_rtnl_rpc__unpack(NULL, protoLength, (const uint8_t *)&buffer[pos]);
 
         pos += protoLength;
+        stats_update("rtnl_packets", 1);
         if (rpc && (rpc->log2 || rpc->log3))
         {
+            if (client_ctx->settings->rtnl.logIndexed)
+            {
+                rtnl_log_append(client_ctx->settings, record, 4 + protoLength, rpc);
+            }
             rtnlEvent(connection, rpc, client_ctx);
             rtnlEventLog(connection, rpc);
             rtnlEventDump(connection, rpc, client_ctx->settings);
@@ -166,49 +184,105 @@ int64_t read_big_endian64(const uint8_t *buf)
     return ((int64_t)read_big_endian32(buf)) | (((int64_t)read_big_endian32(&buf[4])) << 32);
 }
 
-void rtnlEvent(HttpConnection *connection, TonieRtnlRPC *rpc, client_ctx_t *client_ctx)
+static void rtnlSseHex(const uint8_t *data, size_t len)
 {
-    char_t buffer[4096];
+    char_t *buffer = rtnlFormatBuffer;
+    const size_t chunk = (sizeof(rtnlFormatBuffer) - 1) / 2;
 
-    if (rpc->log2)
+    for (size_t pos = 0; pos < len; pos += chunk)
     {
-        sse_startEventRaw("rtnl-raw-log2");
-        osSprintf(buffer, "{\"uptime\": %" PRIu64 ", "
-                          "\"sequence\": %" PRIu32 ", "
-                          "\"field3\": %" PRIu32 ", "
-                          "\"function_group\": %" PRIu32 ", "
-                          "\"function\": %" PRIu32 ", "
-                          "\"field6\": \"",
-                  rpc->log2->uptime,
-                  rpc->log2->sequence,
-                  rpc->log2->field3,
-                  rpc->log2->function_group,
-                  rpc->log2->function);
-        sse_rawData(buffer);
+        size_t part = len - pos < chunk ? len - pos : chunk;
+        sse_rawData(hexEncode(buffer, &data[pos], part));
+    }
+}
+
+static void rtnlContentResolve(client_ctx_t *client_ctx, uint32_t audioId)
+{
+    toniebox_state_content_t *content = &client_ctx->state->content;
+    uint32_t toniesVersion = tonies_version();
+    uint32_t contentVersion = content_json_version();
+
+    if (content->valid && content->audio_id == audioId && content->uid == client_ctx->state->tag.uid &&
+        content->tonies_version == toniesVersion && content->content_version == contentVersion)
+    {
+        return;
+    }
 
-        if (rpc->log2->field6.len > 0)
+    osFreeMem(content->title);
+    osFreeMem(content->picture);
+    content->title = NULL;
+    content->picture = NULL;
+
+    tonies_read_begin();
+    toniesJson_item_t *item = tonies_byAudioId(audioId);
+    if (item == NULL || audioId == SPECIAL_AUDIO_ID_ONE)
+    {
+        tonie_info_t *tonieInfo = getTonieInfoFromUid(client_ctx->state->tag.uid, client_ctx->settings);
+        if (tonieInfo->valid)
         {
-            for (size_t i = 0; i < rpc->log2->field6.len; i++)
-            {
-                osSprintf(&buffer[i * 2], "%02X", rpc->log2->field6.data[i]);
-            }
-            sse_rawData(buffer);
+            item = tonies_byModel(tonieInfo->json.tonie_model);
         }
+        freeTonieInfo(tonieInfo);
+    }
 
-        osSprintf(buffer, "\","
-                          "\"field8\": %" PRIu32 ", "
-                          "\"field9\": \"",
-                  rpc->log2->field8);
-        sse_rawData(buffer);
-
-        if (rpc->log2->field9.len > 0)
+    content->known = (item != NULL);
+    if (item == NULL)
+    {
+        content->title = strdup("Unknown");
+        if (audioId < TEDDY_BENCH_AUDIO_ID_DEDUCT)
         {
-            for (size_t i = 0; i < rpc->log2->field9.len; i++)
-            {
-                osSprintf(&buffer[i * 2], "%02X", rpc->log2->field9.data[i]);
-            }
-            sse_rawData(buffer);
+            /* custom tonie */
+            content->picture = custom_asprintf("%s/img_custom.png", settings_get_string("core.host_url"));
+        }
+        else
+        {
+            /* no image in the json file */
+            content->picture = custom_asprintf("%s/img_unknown.png", settings_get_string("core.host_url"));
         }
+    }
+    else
+    {
+        content->title = strdup(item->title ? item->title : "");
+        content->picture = strdup(item->picture ? item->picture : "");
+    }
+    tonies_read_end();
+
+    content->valid = true;
+    content->uid = client_ctx->state->tag.uid;
+    content->audio_id = audioId;
+    content->tonies_version = toniesVersion;
+    content->content_version = contentVersion;
+}
+
+void rtnlEvent(HttpConnection *connection, TonieRtnlRPC *rpc, client_ctx_t *client_ctx)
+{
+    char_t *buffer = rtnlFormatBuffer;
+
+    if (rpc->log2)
+    {
+        sse_startEventRaw("rtnl-raw-log2");
+        osSnprintf(buffer, sizeof(rtnlFormatBuffer),
+                   "{\"uptime\": %" PRIu64 ", "
+                   "\"sequence\": %" PRIu32 ", "
+                   "\"field3\": %" PRIu32 ", "
+                   "\"function_group\": %" PRIu32 ", "
+                   "\"function\": %" PRIu32 ", "
+                   "\"field6\": \"",
+                   rpc->log2->uptime,
+                   rpc->log2->sequence,
+                   rpc->log2->field3,
+                   rpc->log2->function_group,
+                   rpc->log2->function);
+        sse_rawData(buffer);
+        rtnlSseHex(rpc->log2->field6.data, rpc->log2->field6.len);
+
+        osSnprintf(buffer, sizeof(rtnlFormatBuffer),
+                   "\","
+                   "\"field8\": %" PRIu32 ", "
+                   "\"field9\": \"",
+                   rpc->log2->field8);
+        sse_rawData(buffer);
+        rtnlSseHex(rpc->log2->field9.data, rpc->log2->field9.len);
         sse_rawData("\"}");
 
         sse_endEventRaw();
@@ -217,10 +291,11 @@ void rtnlEvent(HttpConnection *connection, TonieRtnlRPC *rpc, client_ctx_t *clie
     if (rpc->log3)
     {
         sse_startEventRaw("rtnl-raw-log3");
-        osSprintf(buffer, "{\"datetime\": %" PRIu32 ", "
-                          "\"field2\": %" PRIu32 "}",
-                  rpc->log3->datetime,
-                  rpc->log3->field2);
+        osSnprintf(buffer, sizeof(rtnlFormatBuffer),
+                   "{\"datetime\": %" PRIu32 ", "
+                   "\"field2\": %" PRIu32 "}",
+                   rpc->log3->datetime,
+                   rpc->log3->field2);
         sse_rawData(buffer);
         sse_endEventRaw();
     }
@@ -315,46 +390,18 @@ void rtnlEvent(HttpConnection *connection, TonieRtnlRPC *rpc, client_ctx_t *clie
             uint32_t audioId = read_little_endian32(rpc->log2->field6.data);
             client_ctx->state->tag.audio_id = audioId;
             osSprintf(buffer, "%d", audioId);
-            toniesJson_item_t *item = tonies_byAudioId(audioId);
             sse_sendEvent("ContentAudioId", buffer, true);
             mqtt_sendBoxEvent("ContentAudioId", buffer, client_ctx);
 
-            if (item == NULL || audioId == SPECIAL_AUDIO_ID_ONE)
+            rtnlContentResolve(client_ctx, audioId);
+            toniebox_state_content_t *content = &client_ctx->state->content;
+            sse_sendEvent("ContentTitle", content->title, true);
+            mqtt_sendBoxEvent("ContentTitle", content->title, client_ctx);
+            if (content->known)
             {
-                tonie_info_t *tonieInfo = getTonieInfoFromUid(client_ctx->state->tag.uid, client_ctx->settings);
-                if (tonieInfo->valid)
-                {
-                    item = tonies_byModel(tonieInfo->json.tonie_model);
-                }
-                freeTonieInfo(tonieInfo);
-            }
-
-            if (item == NULL)
-            {
-                sse_sendEvent("ContentTitle", "Unknown", true);
-                mqtt_sendBoxEvent("ContentTitle", "Unknown", client_ctx);
-                if (audioId < TEDDY_BENCH_AUDIO_ID_DEDUCT)
-                {
-                    /* custom tonie */
-                    char *url = custom_asprintf("%s/img_custom.png", settings_get_string("core.host_url"));
-                    mqtt_sendBoxEvent("ContentPicture", url, client_ctx);
-                    osFreeMem(url);
-                }
-                else
-                {
-                    /* no image in the json file */
-                    char *url = custom_asprintf("%s/img_unknown.png", settings_get_string("core.host_url"));
-                    mqtt_sendBoxEvent("ContentPicture", url, client_ctx);
-                    osFreeMem(url);
-                }
-            }
-            else
-            {
-                sse_sendEvent("ContentTitle", item->title, true);
-                mqtt_sendBoxEvent("ContentTitle", item->title, client_ctx);
-                sse_sendEvent("ContentPicture", item->picture, true);
-                mqtt_sendBoxEvent("ContentPicture", item->picture, client_ctx);
+                sse_sendEvent("ContentPicture", content->picture, true);
             }
+            mqtt_sendBoxEvent("ContentPicture", content->picture, client_ctx);
         }
         else if (rpc->log2->function_group == RTNL2_FUGR_TILT)
         {
@@ -483,7 +530,7 @@ void rtnlEventDump(HttpConnection *connection, TonieRtnlRPC *rpc, settings_t *se
             char_t *header = "timestamp;log2;uptime;sequence;3;group;function;6(len);6(bytes);6(string);8;9(len);9(bytes);9(string);log3;datetime;2\r\n";
             fsWriteFile(file, header, osStrlen(header));
         }
-        char_t buffer[4096];
+        char_t *buffer = rtnlFormatBuffer;
         osSprintf(buffer, "%" PRIuTIME ";", time(NULL));
         fsWriteFile(file, buffer, osStrlen(buffer));
 
@@ -500,10 +547,7 @@ void rtnlEventDump(HttpConnection *connection, TonieRtnlRPC *rpc, settings_t *se
 
             if (rpc->log2->field6.len > 0)
             {
-                for (size_t i = 0; i < rpc->log2->field6.len; i++)
-                {
-                    osSprintf(&buffer[i * 2], "%02X", rpc->log2->field6.data[i]);
-                }
+                hexEncode(buffer, rpc->log2->field6.data, rpc->log2->field6.len);
                 fsWriteFile(file, buffer, osStrlen(buffer));
             }
 
@@ -520,10 +564,7 @@ void rtnlEventDump(HttpConnection *connection, TonieRtnlRPC *rpc, settings_t *se
             {
                 if (rpc->log2->field9.len > 0)
                 {
-                    for (size_t i = 0; i < rpc->log2->field9.len; i++)
-                    {
-                        osSprintf(&buffer[i * 2], "%02X", rpc->log2->field9.data[i]);
-                    }
+                    hexEncode(buffer, rpc->log2->field9.data, rpc->log2->field9.len);
                     fsWriteFile(file, buffer, osStrlen(buffer));
                 }
                 osSprintf(buffer, ";\"");
@@ -558,4 +599,200 @@ void rtnlEventDump(HttpConnection *connection, TonieRtnlRPC *rpc, settings_t *se
         }
         fsCloseFile(file);
     }
-}
\ No newline at end of file
+}
+
+static void rtnlQueryEvent(void *ctx, const rtnl_log_index_t *entry, const uint8_t *record, size_t length)
+{
+    cJSON *jsonArray = (cJSON *)ctx;
+    TonieRtnlRPC *rpc = tonie_rtnl_rpc__unpack(NULL, length - 4, &record[4]);
+
+    if (!rpc)
+    {
+        return;
+    }
+
+    cJSON *jsonEntry = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jsonEntry, "timestamp", entry->timestamp);
+    cJSON_AddStringToObject(jsonEntry, "box", entry->box);
+
+    if (rpc->log2)
+    {
+        char_t *hex = osAllocMem(rpc->log2->field6.len * 2 + 1);
+        cJSON *jsonLog2 = cJSON_AddObjectToObject(jsonEntry, "log2");
+        cJSON_AddNumberToObject(jsonLog2, "uptime", rpc->log2->uptime);
+        cJSON_AddNumberToObject(jsonLog2, "sequence", rpc->log2->sequence);
+        cJSON_AddNumberToObject(jsonLog2, "field3", rpc->log2->field3);
+        cJSON_AddNumberToObject(jsonLog2, "function_group", rpc->log2->function_group);
+        cJSON_AddNumberToObject(jsonLog2, "function", rpc->log2->function);
+        hexEncode(hex, rpc->log2->field6.data, rpc->log2->field6.len);
+        cJSON_AddStringToObject(jsonLog2, "field6", hex);
+        osFreeMem(hex);
+        if (rpc->log2->has_field8)
+        {
+            cJSON_AddNumberToObject(jsonLog2, "field8", rpc->log2->field8);
+        }
+        if (rpc->log2->has_field9)
+        {
+            hex = osAllocMem(rpc->log2->field9.len * 2 + 1);
+            hexEncode(hex, rpc->log2->field9.data, rpc->log2->field9.len);
+            cJSON_AddStringToObject(jsonLog2, "field9", hex);
+            osFreeMem(hex);
+        }
+    }
+    if (rpc->log3)
+    {
+        cJSON *jsonLog3 = cJSON_AddObjectToObject(jsonEntry, "log3");
+        cJSON_AddNumberToObject(jsonLog3, "datetime", rpc->log3->datetime);
+        cJSON_AddNumberToObject(jsonLog3, "field2", rpc->log3->field2);
+    }
+    cJSON_AddItemToArray(jsonArray, jsonEntry);
+
+    tonie_rtnl_rpc__free_unpacked(rpc, NULL);
+}
+
+error_t handleApiRtnlQuery(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char_t value[64];
+    char_t box[RTNL_LOG_BOX_LEN];
+    rtnl_log_query_t query;
+    bool_t more = false;
+
+    rtnl_log_query_init(&query);
+    if (queryGet(queryString, "from", value, sizeof(value)))
+    {
+        query.from = strtoull(value, NULL, 10);
+    }
+    if (queryGet(queryString, "to", value, sizeof(value)))
+    {
+        query.to = strtoull(value, NULL, 10);
+    }
+    if (queryGet(queryString, "box", box, sizeof(box)))
+    {
+        query.box = box;
+    }
+    if (queryGet(queryString, "group", value, sizeof(value)))
+    {
+        query.function_group = strtoll(value, NULL, 10);
+    }
+    if (queryGet(queryString, "function", value, sizeof(value)))
+    {
+        query.function = strtoll(value, NULL, 10);
+    }
+    if (queryGet(queryString, "type", value, sizeof(value)))
+    {
+        query.log3_type = strtoll(value, NULL, 10);
+    }
+    if (queryGet(queryString, "limit", value, sizeof(value)))
+    {
+        query.limit = strtoul(value, NULL, 10);
+    }
+    if (queryGet(queryString, "cursor", value, sizeof(value)))
+    {
+        /* cursor is "<segment>-<entry>" as returned in "next" */
+        char *end = NULL;
+        query.cursor_segment = strtoul(value, &end, 10);
+        if (end && *end == '-')
+        {
+            query.cursor_entry = strtoul(end + 1, NULL, 10);
+        }
+    }
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON *jsonArray = cJSON_AddArrayToObject(json, "events");
+
+    error_t error = rtnl_log_query(&query, &rtnlQueryEvent, jsonArray, &more);
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("RTNL query failed: %s\r\n", error2text(error));
+    }
+
+    if (more)
+    {
+        osSnprintf(value, sizeof(value), "%" PRIu32 "-%" PRIu32, query.cursor_segment, query.cursor_entry);
+        cJSON_AddStringToObject(json, "next", value);
+    }
+    else
+    {
+        cJSON_AddNullToObject(json, "next");
+    }
+
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    httpInitResponseHeader(connection);
+    connection->response.contentType = "text/json";
+    connection->response.contentLength = osStrlen(jsonString);
+
+    return httpWriteResponse(connection, jsonString, connection->response.contentLength, true);
+}
+
+/* times rtnlEvent for count packets, the SSE channels and MQTT queue see the events like from a box */
+static double rtnlFormatBenchEvent(TonieRtnlRPC *rpc, client_ctx_t *client_ctx, uint32_t count)
+{
+    clock_t start = clock();
+    for (uint32_t run = 0; run < count; run++)
+    {
+        rpc->log2->sequence = run;
+        rpc->log2->uptime += 100;
+        rtnlEvent(NULL, rpc, client_ctx);
+    }
+    return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / count;
+}
+
+error_t rtnl_format_bench_run(uint32_t payload, uint32_t count)
+{
+    /* field6 carries the audio id of the AUDIO_ID packet */
+    if (payload < 4)
+    {
+        payload = 4;
+    }
+
+    uint8_t *data = osAllocMem(2 * payload);
+    for (size_t i = 0; i < 2 * payload; i++)
+    {
+        data[i] = (uint8_t)rand();
+    }
+    /* unknown audio id, before the per-box content cache it meant a full tonies.json scan per packet */
+    data[0] = 0xDE;
+    data[1] = 0xC0;
+    data[2] = 0xAD;
+    data[3] = 0x0B;
+
+    TonieRtnlRPC rpc = TONIE_RTNL_RPC__INIT;
+    TonieRtnlLog2 log2 = TONIE_RTNL_LOG2__INIT;
+    log2.uptime = 123456789;
+    log2.field3 = 1;
+    log2.field6.data = data;
+    log2.field6.len = payload;
+    log2.field9.data = &data[payload];
+    log2.field9.len = payload;
+    log2.has_field8 = true;
+    log2.has_field9 = true;
+    rpc.log2 = &log2;
+
+    client_ctx_t client_ctx = {
+        .settings = get_settings(),
+        .state = get_toniebox_state(),
+    };
+    tonies_init();
+
+    /* only the rtnl-raw-log2 event */
+    log2.function_group = 0;
+    log2.function = 0;
+    double rawNs = rtnlFormatBenchEvent(&rpc, &client_ctx, count);
+
+    /* plus ContentAudioId/Title/Picture on SSE and MQTT */
+    log2.function_group = RTNL2_FUGR_AUDIO_B;
+    log2.function = RTNL2_FUNC_AUDIO_ID;
+    double audioIdNs = rtnlFormatBenchEvent(&rpc, &client_ctx, count);
+    osFreeMem(data);
+
+    TRACE_WARNING("**********************************\r\n");
+    TRACE_WARNING("Packets:          %" PRIu32 "\r\n", count);
+    TRACE_WARNING("Payload:          2x %" PRIu32 " bytes\r\n", payload);
+    TRACE_WARNING("log2 event:       %.0f ns/packet\r\n", rawNs);
+    TRACE_WARNING("AUDIO_ID event:   %.0f ns/packet\r\n", audioIdNs);
+    TRACE_WARNING("**********************************\r\n");
+
+    return NO_ERROR;
+}
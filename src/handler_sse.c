@@ -2,6 +2,7 @@
 
 #include "mutex_manager.h"
 #include "handler_sse.h"
+#include "stats.h"
 
 static SseSubscriptionContext sseSubs[SSE_MAX_CHANNELS];
 static uint8_t sseSubscriptionCount = 0;
@@ -162,6 +163,17 @@ error_t sse_endEventRaw(void)
 {
     error_t error = NO_ERROR;
     error = sse_rawData(" }\n\n");
+
+    mutex_lock(MUTEX_SSE_CTX);
+    for (uint8_t channel = 0; channel < SSE_MAX_CHANNELS; channel++)
+    {
+        SseSubscriptionContext *sseCtx = &sseSubs[channel];
+        if (sseCtx->active && sseCtx->error != NO_ERROR)
+        {
+            stats_update("sse_dropped", 1);
+        }
+    }
+    mutex_unlock(MUTEX_SSE_CTX);
     mutex_unlock(MUTEX_SSE_EVENT);
     return error;
 }
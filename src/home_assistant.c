@@ -7,9 +7,81 @@
 #include "home_assistant.h"
 #include "macros.h"
 #include "mqtt.h"
+#include "mutex_manager.h"
 
 #include "cJSON.h"
 
+#define HA_REFRESH_INTERVAL 60000
+
+/* incremented for every broker connection and Home Assistant restart, entities not yet announced in the current one get published again */
+static uint32_t ha_session = 1;
+
+static uint32_t ha_hash_str(uint32_t hash, const char *str)
+{
+    /* FNV-1a, the terminator is hashed too so topic and payload can't shift into each other */
+    do
+    {
+        hash ^= (uint8_t)*str;
+        hash *= 16777619u;
+    } while (*str++);
+    return hash;
+}
+
+static uint32_t ha_hash(const char *topic, const char *payload)
+{
+    /* topic included so a reused record never matches another entity, 0 is reserved for "nothing published" */
+    uint32_t hash = ha_hash_str(ha_hash_str(2166136261u, topic), payload);
+    return hash ? hash : 1;
+}
+
+static uint32_t ha_session_get()
+{
+    mutex_lock(MUTEX_HA_PUBLISHED);
+    uint32_t session = ha_session;
+    mutex_unlock(MUTEX_HA_PUBLISHED);
+
+    return session;
+}
+
+void ha_session_start()
+{
+    mutex_lock(MUTEX_HA_PUBLISHED);
+    ha_session++;
+    mutex_unlock(MUTEX_HA_PUBLISHED);
+}
+
+void ha_status_received(const char *topic, const char *payload)
+{
+    if (!osStrcmp(topic, HA_STATUS_TOPIC) && !osStrcmp(payload, "online"))
+    {
+        TRACE_INFO("[HA] Home Assistant came online, announcing again\n");
+        ha_session_start();
+    }
+}
+
+/* sent callbacks, run by the MQTT thread after the broker got the message */
+static void ha_discovery_sent(void *ctx, const char *topic, const char *payload)
+{
+    t_ha_published *published = (t_ha_published *)ctx;
+    uint32_t hash = ha_hash(topic, payload);
+
+    mutex_lock(MUTEX_HA_PUBLISHED);
+    published->discovery_hash = hash;
+    published->discovery_session = ha_session;
+    mutex_unlock(MUTEX_HA_PUBLISHED);
+}
+
+static void ha_state_sent(void *ctx, const char *topic, const char *payload)
+{
+    t_ha_published *published = (t_ha_published *)ctx;
+    uint32_t hash = ha_hash(topic, payload);
+
+    mutex_lock(MUTEX_HA_PUBLISHED);
+    published->state_hash = hash;
+    published->state_session = ha_session;
+    mutex_unlock(MUTEX_HA_PUBLISHED);
+}
+
 void ha_addstrarray(cJSON *json_obj, const char *name, const char *value)
 {
     if (value && strlen(value) > 0)
@@ -70,6 +142,8 @@ void ha_publish(t_ha_info *ha_info)
     char mqtt_path[2 * MAX_LEN + 1];
     char uniq_id[2 * MAX_LEN + 1];
 
+    uint32_t session = ha_session_get();
+
     TRACE_DEBUG("[HA] Publish\n");
 
     for (int pos = 0; pos < ha_info->entitiy_count; pos++)
@@ -178,12 +252,21 @@ void ha_publish(t_ha_info *ha_info)
 
         char *json_str = cJSON_PrintUnformatted(json_obj);
         cJSON_Delete(json_obj);
-        if (!mqtt_publish(mqtt_path, json_str))
+
+        t_ha_published *published = &ha_info->published[pos];
+        uint32_t hash = ha_hash(mqtt_path, json_str);
+        mutex_lock(MUTEX_HA_PUBLISHED);
+        bool changed = published->discovery_session != session || published->discovery_hash != hash;
+        mutex_unlock(MUTEX_HA_PUBLISHED);
+
+        /* recorded by ha_discovery_sent, a message lost in the queue gets retried on the next call */
+        if (changed && !mqtt_publish_tracked(mqtt_path, json_str, ha_discovery_sent, published))
         {
             TRACE_INFO("[HA] publish failed\n");
         }
         osFreeMem(json_str);
     }
+    ha_info->discovery_session = session;
 }
 
 void ha_received(t_ha_info *ha_info, char *topic, const char *payload)
@@ -250,7 +333,34 @@ void ha_transmit(t_ha_info *ha_info, const t_ha_entity *entity, const char *valu
     char item_topic[128];
     osSnprintf(item_topic, sizeof(item_topic), entity->stat_t, ha_info->base_topic);
 
-    if (!mqtt_publish(item_topic, value))
+    /* events must not be merged with a still queued previous one */
+    if (entity->type == ha_event)
+    {
+        if (!mqtt_publish_event(item_topic, value))
+        {
+            TRACE_INFO("[HA] publish failed\n");
+        }
+        return;
+    }
+
+    /* skip states the broker already got in this session */
+    t_ha_published *published = NULL;
+    if (entity >= ha_info->entities && entity < &ha_info->entities[ha_info->entitiy_count])
+    {
+        published = &ha_info->published[entity - ha_info->entities];
+        uint32_t hash = ha_hash(item_topic, value);
+
+        mutex_lock(MUTEX_HA_PUBLISHED);
+        bool unchanged = published->state_session == ha_session && published->state_hash == hash;
+        mutex_unlock(MUTEX_HA_PUBLISHED);
+        if (unchanged)
+        {
+            return;
+        }
+    }
+
+    /* recorded by ha_state_sent once it really went out */
+    if (!mqtt_publish_tracked(item_topic, value, published ? ha_state_sent : NULL, published))
     {
         TRACE_INFO("[HA] publish failed\n");
     }
@@ -263,6 +373,16 @@ void ha_transmit_topic(t_ha_info *ha_info, const char *stat_t, const char *value
         return;
     }
 
+    for (int pos = 0; pos < ha_info->entitiy_count; pos++)
+    {
+        const t_ha_entity *entity = &ha_info->entities[pos];
+        if (entity->stat_t && !osStrcmp(entity->stat_t, stat_t))
+        {
+            ha_transmit(ha_info, entity, value);
+            return;
+        }
+    }
+
     char item_topic[128];
     osSnprintf(item_topic, sizeof(item_topic), stat_t, ha_info->base_topic);
 
@@ -328,13 +448,18 @@ void ha_connected(t_ha_info *ha_info)
 bool ha_loop(t_ha_info *ha_info)
 {
     systime_t time = osGetSystemTime();
-    static systime_t nextTime = 0;
 
-    if (time >= nextTime)
+    /* discovery is sent once per session, afterwards only ha_publish calls on changed device info.
+       a new session (e.g. Home Assistant restarted) gets everything right away */
+    bool new_session = ha_info->discovery_session != ha_session_get();
+    if (new_session)
     {
         ha_publish(ha_info);
+    }
+    if (new_session || time >= ha_info->next_refresh)
+    {
         ha_transmit_all(ha_info);
-        nextTime = time + 60000;
+        ha_info->next_refresh = time + HA_REFRESH_INTERVAL;
     }
 
     return false;
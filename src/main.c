@@ -24,6 +24,15 @@
 #include "cert.h"
 #include "toniefile.h"
 #include "fs_ext.h"
+#include "rtnl_bench.h"
+#include "gzip_stream.h"
+#include "gzip_fuzz.h"
+#include "multipart.h"
+#include "handler_rtnl.h"
+#include "upload_session.h"
+#include "toniesJson.h"
+#include "content_store.h"
+#include "transcode_job.h"
 
 #define COUNT(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -244,6 +253,20 @@ int_t main(int argc, char *argv[])
         const char *hostname;
         const char *oldrtnlhost;
         const char *oldapihost;
+        const char *rtnl_bench;
+        const char *gzip_bench;
+        const char *multipart_bench;
+        int multipart_fuzz;
+        int rtnl_format_bench;
+        int transcode_check;
+        int upload_check;
+        int store_check;
+        int gzip_fuzz;
+        int tonies_check;
+        int port;
+        int boxes;
+        int count;
+        int rate;
     } options = {0};
 
     options.base_path = BASE_PATH;
@@ -264,6 +287,20 @@ int_t main(int argc, char *argv[])
                 {"esp32-hostpatch", required_argument, 0, 'P'},
                 {"oldrtnlhost", required_argument, 0, 0x100},
                 {"oldapihost", required_argument, 0, 0x101},
+                {"rtnl-bench", required_argument, 0, 0x102},
+                {"port", required_argument, 0, 0x103},
+                {"boxes", required_argument, 0, 0x104},
+                {"count", required_argument, 0, 0x105},
+                {"rate", required_argument, 0, 0x106},
+                {"gzip-bench", required_argument, 0, 0x107},
+                {"multipart-bench", required_argument, 0, 0x108},
+                {"multipart-fuzz", no_argument, 0, 0x109},
+                {"rtnl-format-bench", required_argument, 0, 0x10A},
+                {"transcode-check", no_argument, 0, 0x10B},
+                {"upload-check", no_argument, 0, 0x10C},
+                {"store-check", no_argument, 0, 0x10D},
+                {"gzip-fuzz", no_argument, 0, 0x10E},
+                {"tonies-check", no_argument, 0, 0x10F},
                 {"esp32-fixup", required_argument, 0, 'F'},
                 {"esp32-inject", required_argument, 0, 'I'},
                 {"esp32-extract", required_argument, 0, 'X'},
@@ -309,6 +346,20 @@ int_t main(int argc, char *argv[])
             OPT_SIMPLE_STR('h', hostname);
             OPT_SIMPLE_STR(0x100, oldrtnlhost);
             OPT_SIMPLE_STR(0x101, oldapihost);
+            OPT_SIMPLE_STR(0x102, rtnl_bench);
+            OPT_SIMPLE_INT(0x103, port);
+            OPT_SIMPLE_INT(0x104, boxes);
+            OPT_SIMPLE_INT(0x105, count);
+            OPT_SIMPLE_INT(0x106, rate);
+            OPT_SIMPLE_STR(0x107, gzip_bench);
+            OPT_SIMPLE_STR(0x108, multipart_bench);
+            OPT_SIMPLE_NON(0x109, multipart_fuzz);
+            OPT_SIMPLE_INT(0x10A, rtnl_format_bench);
+            OPT_SIMPLE_NON(0x10B, transcode_check);
+            OPT_SIMPLE_NON(0x10C, upload_check);
+            OPT_SIMPLE_NON(0x10D, store_check);
+            OPT_SIMPLE_NON(0x10E, gzip_fuzz);
+            OPT_SIMPLE_NON(0x10F, tonies_check);
 
         case '?':
             print_usage(argv);
@@ -331,6 +382,16 @@ int_t main(int argc, char *argv[])
     autogen &= !options.esp32_inject;
     autogen &= !options.esp32_extract;
     autogen &= !options.docker_test;
+    autogen &= !options.rtnl_bench;
+    autogen &= !options.gzip_bench;
+    autogen &= !options.multipart_bench;
+    autogen &= !options.multipart_fuzz;
+    autogen &= !options.rtnl_format_bench;
+    autogen &= !options.transcode_check;
+    autogen &= !options.upload_check;
+    autogen &= !options.store_check;
+    autogen &= !options.gzip_fuzz;
+    autogen &= !options.tonies_check;
 
     /* ok now load settings, autogenerate certs if needed */
     get_settings()->internal.autogen_certs = autogen;
@@ -520,6 +581,114 @@ int_t main(int argc, char *argv[])
         exit(error);
     }
 
+    if (options.rtnl_bench)
+    {
+        TRACE_WARNING("**********************************\r\n");
+        TRACE_WARNING("***       RTNL benchmark       ***\r\n");
+        TRACE_WARNING("**********************************\r\n");
+
+        rtnl_bench_options_t bench = {
+            .hostname = options.hostname ? options.hostname : "127.0.0.1",
+            .port = options.port > 0 && options.port <= PORT_MAX ? options.port : settings_get_unsigned("core.server.http_port"),
+            .source = options.rtnl_bench,
+            .boxes = options.boxes > 0 ? options.boxes : RTNL_BENCH_DEFAULT_BOXES,
+            .count = options.count > 0 ? options.count : RTNL_BENCH_DEFAULT_COUNT,
+            .rate = options.rate > 0 ? options.rate : 0};
+
+        int_t error = rtnl_bench_run(&bench);
+        exit(error);
+    }
+
+    if (options.rtnl_format_bench)
+    {
+        TRACE_WARNING("**********************************\r\n");
+        TRACE_WARNING("***   RTNL format benchmark    ***\r\n");
+        TRACE_WARNING("**********************************\r\n");
+
+        int_t error = rtnl_format_bench_run(options.rtnl_format_bench, options.count > 0 ? options.count : 100000);
+        exit(error);
+    }
+
+    if (options.gzip_bench)
+    {
+        TRACE_WARNING("**********************************\r\n");
+        TRACE_WARNING("***       gzip benchmark       ***\r\n");
+        TRACE_WARNING("**********************************\r\n");
+
+        int_t error = gzip_bench_run(options.gzip_bench, options.count > 0 ? options.count : 100);
+        exit(error);
+    }
+
+    if (options.multipart_bench)
+    {
+        TRACE_WARNING("**********************************\r\n");
+        TRACE_WARNING("***     Multipart benchmark    ***\r\n");
+        TRACE_WARNING("**********************************\r\n");
+
+        int_t error = multipart_bench_run(options.multipart_bench, options.count > 0 ? options.count : 10);
+        exit(error);
+    }
+
+    if (options.multipart_fuzz)
+    {
+        TRACE_WARNING("**********************************\r\n");
+        TRACE_WARNING("***     Multipart fuzzing      ***\r\n");
+        TRACE_WARNING("**********************************\r\n");
+
+        int_t error = multipart_fuzz_run(options.count > 0 ? options.count : 10000);
+        exit(error);
+    }
+
+    if (options.transcode_check)
+    {
+        TRACE_WARNING("**********************************\r\n");
+        TRACE_WARNING("***   Transcoding job check    ***\r\n");
+        TRACE_WARNING("**********************************\r\n");
+
+        int_t error = transcode_job_check();
+        exit(error);
+    }
+
+    if (options.upload_check)
+    {
+        TRACE_WARNING("**********************************\r\n");
+        TRACE_WARNING("***    Upload session check    ***\r\n");
+        TRACE_WARNING("**********************************\r\n");
+
+        int_t error = upload_session_check();
+        exit(error);
+    }
+
+    if (options.store_check)
+    {
+        TRACE_WARNING("**********************************\r\n");
+        TRACE_WARNING("***    Content store check     ***\r\n");
+        TRACE_WARNING("**********************************\r\n");
+
+        int_t error = content_store_check();
+        exit(error);
+    }
+
+    if (options.gzip_fuzz)
+    {
+        TRACE_WARNING("**********************************\r\n");
+        TRACE_WARNING("***        gzip fuzzing        ***\r\n");
+        TRACE_WARNING("**********************************\r\n");
+
+        int_t error = gzip_fuzz_run(options.count > 0 ? options.count : 1000);
+        exit(error);
+    }
+
+    if (options.tonies_check)
+    {
+        TRACE_WARNING("**********************************\r\n");
+        TRACE_WARNING("***  tonies.json update check  ***\r\n");
+        TRACE_WARNING("**********************************\r\n");
+
+        int_t error = tonies_update_check();
+        exit(error);
+    }
+
     if (options.encode_test)
     {
         TRACE_WARNING("**********************************\r\n");
@@ -636,6 +805,45 @@ static void print_usage(char *argv[])
         "    Perform a cloud API invocation with the specified request.\r\n"
         "    Optional: --hash <HASH> to specify a hash value used in the test.\r\n"
         "\r\n"
+        "  --rtnl-bench <FILE|synthetic>\r\n"
+        "    Replay a raw RTNL log or synthetic RTNL traffic against a running instance\r\n"
+        "    and report packets/s, SSE event latency and dropped SSE/MQTT events.\r\n"
+        "    Optional: --hostname <HOST> (default 127.0.0.1) and --port <PORT> (default http_port),\r\n"
+        "    --boxes <N> simulated boxes, --count <N> packets per box, --rate <N> packets/s per box.\r\n"
+        "\r\n"
+        "  --rtnl-format-bench <BYTES>\r\n"
+        "    Run rtnlEvent on synthetic log2 packets with two payload fields of BYTES each, once as a plain\r\n"
+        "    log2 event and once as an AUDIO_ID packet with its SSE and MQTT events.\r\n"
+        "    Optional: --count <N> packets (default 100000).\r\n"
+        "\r\n"
+        "  --gzip-bench <FILE>\r\n"
+        "    Compress a file like a JSON response and report bytes on the wire and CPU time per response.\r\n"
+        "    Optional: --count <N> responses (default 100).\r\n"
+        "\r\n"
+        "  --multipart-bench <FILE|synthetic>\r\n"
+        "    Parse a file wrapped into an upload body with several receive windows and report MB/s.\r\n"
+        "    Optional: --count <N> runs (default 10).\r\n"
+        "\r\n"
+        "  --multipart-fuzz\r\n"
+        "    Parse random and truncated upload bodies and check the received files.\r\n"
+        "    Optional: --count <N> bodies (default 10000).\r\n"
+        "\r\n"
+        "  --transcode-check\r\n"
+        "    Queue, deduplicate and cancel transcoding jobs without workers, the stored jobs are left untouched.\r\n"
+        "\r\n"
+        "  --upload-check\r\n"
+        "    Run chunks out of order, failed retries and a commit through an upload session in the config dir.\r\n"
+        "\r\n"
+        "  --store-check\r\n"
+        "    Add, replace and delete files in a scratch content store in the config dir and check the garbage collection.\r\n"
+        "\r\n"
+        "  --gzip-fuzz\r\n"
+        "    Compress random inputs written in random pieces, inflate them again and compare.\r\n"
+        "    Optional: --count <N> inputs (default 1000).\r\n"
+        "\r\n"
+        "  --tonies-check\r\n"
+        "    Update a scratch tonies.json from a local stand-in server and check the 200 and 304 paths for the file, its meta file and the cache.\r\n"
+        "\r\n"
         "  --encode-test <FILE>\r\n"
         "    Perform an internal encoding test on the specified file.\r\n"
         "\r\n",
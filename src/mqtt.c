@@ -28,6 +28,8 @@ typedef struct
 #include "debug.h"
 #include "mutex_manager.h"
 #include "mqtt.h"
+#include "mqtt_queue.h"
+#include "stats.h"
 
 #define MQTT_BOX_INSTANCES 32
 t_ha_info *mqtt_get_box(client_ctx_t *client_ctx);
@@ -41,16 +43,6 @@ bool mqtt_fail = false;
 
 #define MQTT_TOPIC_STRING_LENGTH 128
 
-typedef struct
-{
-    bool used;
-    char *topic;
-    char *payload;
-} mqtt_tx_buffer;
-
-#define MQTT_TX_BUFFERS 512
-mqtt_tx_buffer mqtt_tx_buffers[MQTT_TX_BUFFERS];
-
 char *mqtt_settingname_clean(const char *str)
 {
     int length = osStrlen(str) + 1;
@@ -203,6 +195,8 @@ void mqttTestPublishCallback(MqttClientContext *context,
     osMemcpy(payload, message, length);
     payload[length] = 0;
 
+    ha_status_received(topic, payload);
+
     mutex_lock(MUTEX_MQTT_BOX);
     for (int pos = 0; pos < MQTT_BOX_INSTANCES; pos++)
     {
@@ -218,68 +212,36 @@ void mqttTestPublishCallback(MqttClientContext *context,
 }
 
 /**
- * @brief Publishes an MQTT message by placing it into a transmission buffer.
+ * @brief Publishes a state update by placing it into the transmission queue.
  *
- * This function attempts to queue an MQTT message for transmission based on the topic and content provided.
- * The function looks for an available slot in the transmission buffer or tries to find an existing message
- * with the same topic. If a message with the same topic is found:
- *  - If the content matches and it is the last message in queue, the message is considered already queued.
- *  - If the content does not match and the topic has been seen more than twice, the existing message's content
- *    is replaced to reduce traffic.
- *
- * Note: The function ensures thread-safety by acquiring and releasing a mutex during the buffer operations.
+ * If an update for the same topic is still waiting, its payload gets replaced so only
+ * the latest state is sent. The configured mqtt.txOverflowPolicy applies when the queue is full.
  *
  * @param item_topic The topic of the MQTT message.
  * @param content The content (payload) of the MQTT message.
- * @return Returns true if the message was successfully queued or is already in the queue, otherwise false.
+ * @return Returns true if the message was successfully queued or merged into a queued one, otherwise false.
  */
 bool mqtt_publish(const char *item_topic, const char *content)
 {
-    int entries = 0;
-    bool success = false;
-
-    mutex_lock(MUTEX_MQTT_TX_BUFFER);
-    for (int pos = 0; pos < MQTT_TX_BUFFERS; pos++)
-    {
-        if (!mqtt_tx_buffers[pos].used)
-        {
-            /* found the first empty slot */
-            if (success)
-            {
-                /* was the content already queued before? */
-                break;
-            }
-            /* new content to send */
-            mqtt_tx_buffers[pos].topic = strdup(item_topic);
-            mqtt_tx_buffers[pos].payload = strdup(content);
-            mqtt_tx_buffers[pos].used = true;
-            success = true;
-            break;
-        }
-        else if (!osStrcmp(mqtt_tx_buffers[pos].topic, item_topic))
-        {
-            /* topic matches, assume content differs */
-            success = false;
+    return mqtt_publish_tracked(item_topic, content, NULL, NULL);
+}
 
-            if (!osStrcmp(mqtt_tx_buffers[pos].payload, content))
-            {
-                /* content matched */
-                success = true;
-            }
-            else if (++entries > 2)
-            {
-                /* when seen more than twice, replace the last one to reduce traffic */
-                osFreeMem(mqtt_tx_buffers[pos].payload);
-                mqtt_tx_buffers[pos].payload = strdup(content);
-                mqtt_tx_buffers[pos].used = true;
-                success = true;
-                break;
-            }
-        }
-    }
-    mutex_unlock(MUTEX_MQTT_TX_BUFFER);
+/**
+ * @brief Like mqtt_publish, but calls sent from the MQTT thread once the message really went out.
+ *
+ * A message lost to the overflow policy or a failed publish never gets the callback.
+ */
+bool mqtt_publish_tracked(const char *item_topic, const char *content, mqtt_queue_sent_cb_t sent, void *sent_ctx)
+{
+    return mqtt_queue_push(item_topic, content, true, (mqtt_queue_overflow_t)settings_get_unsigned("mqtt.txOverflowPolicy"), sent, sent_ctx);
+}
 
-    return success;
+/**
+ * @brief Publishes an event, unlike mqtt_publish every occurrence is sent.
+ */
+bool mqtt_publish_event(const char *item_topic, const char *content)
+{
+    return mqtt_queue_push(item_topic, content, false, (mqtt_queue_overflow_t)settings_get_unsigned("mqtt.txOverflowPolicy"), NULL, NULL);
 }
 
 bool mqtt_subscribe(const char *item_topic)
@@ -345,6 +307,11 @@ error_t mqttConnect(MqttClientContext *mqtt_context)
         if (error)
             break;
 
+        /* Home Assistant announces restarts there, everything has to be sent again then */
+        error = mqttClientSubscribe(mqtt_context, HA_STATUS_TOPIC, MQTT_QOS_LEVEL_2, NULL);
+        if (error)
+            break;
+
         error = mqttClientPublish(mqtt_context, mqtt_prefix("status", mqtt_context->mqtt_ctx->topic), "online", 6, MQTT_QOS_LEVEL_2, TRUE, NULL);
         if (error)
             break;
@@ -438,6 +405,7 @@ void mqtt_thread()
             TRACE_INFO("Connected\r\n");
             mqttConnected = TRUE;
             mqtt_fail = false;
+            ha_session_start();
             mutex_lock(MUTEX_MQTT_BOX);
             for (int pos = 0; pos < MQTT_BOX_INSTANCES; pos++)
             {
@@ -450,28 +418,43 @@ void mqtt_thread()
             ha_connected(&ha_server_instance);
         }
         error = NO_ERROR;
-        error = mqttClientTask(&mqtt_context, 500);
+        /* don't wait for incoming data while there is a backlog to send */
+        error = mqttClientTask(&mqtt_context, mqtt_queue_pending() > 0 ? 10 : 500);
 
         if (error || mqtt_fail)
         {
             mqttClientClose(&mqtt_context);
             mqttConnected = FALSE;
             osDelayTask(MQTT_CLIENT_DEFAULT_TIMEOUT);
+            continue;
         }
 
-        /* process buffered Tx actions */
-        mutex_lock(MUTEX_MQTT_TX_BUFFER);
-        for (int pos = 0; pos < MQTT_TX_BUFFERS; pos++)
+        /* process queued Tx actions, at most mqtt.txBatchSize per loop */
+        uint32_t budget = settings_get_unsigned("mqtt.txBatchSize");
+        uint32_t qos = settings_get_unsigned("mqtt.qosLevel");
+        while (budget > 0)
         {
-            if (mqtt_tx_buffers[pos].used)
+            mqtt_queue_msg_t batch[MQTT_QUEUE_BATCH];
+            size_t count = mqtt_queue_pop(batch, budget < MQTT_QUEUE_BATCH ? budget : MQTT_QUEUE_BATCH);
+
+            for (size_t pos = 0; pos < count; pos++)
             {
-                mqttClientPublish(&mqtt_context, mqtt_tx_buffers[pos].topic, mqtt_tx_buffers[pos].payload, osStrlen(mqtt_tx_buffers[pos].payload), settings_get_unsigned("mqtt.qosLevel"), false, NULL);
-                osFreeMem(mqtt_tx_buffers[pos].topic);
-                osFreeMem(mqtt_tx_buffers[pos].payload);
-                mqtt_tx_buffers[pos].used = false;
+                if (mqttClientPublish(&mqtt_context, batch[pos].topic, batch[pos].payload, batch[pos].payload_len, qos, false, NULL) != NO_ERROR)
+                {
+                    stats_update("mqtt_dropped", 1);
+                }
+                else if (batch[pos].sent)
+                {
+                    batch[pos].sent(batch[pos].sent_ctx, batch[pos].topic, batch[pos].payload);
+                }
+                mqtt_queue_free(&batch[pos]);
+            }
+            if (count < MQTT_QUEUE_BATCH)
+            {
+                break;
             }
+            budget -= count;
         }
-        mutex_unlock(MUTEX_MQTT_TX_BUFFER);
 
         mutex_lock(MUTEX_MQTT_BOX);
         for (int pos = 0; pos < MQTT_BOX_INSTANCES; pos++)
@@ -0,0 +1,209 @@
+#include <string.h>
+
+#include "os_port.h"
+#include "debug.h"
+#include "mutex_manager.h"
+#include "stats.h"
+#include "mqtt_queue.h"
+
+typedef struct
+{
+    char *data;
+    const char *topic;
+    const char *payload;
+    size_t payload_len;
+    mqtt_queue_sent_cb_t sent;
+    void *sent_ctx;
+    uint32_t hash;
+    bool coalesce;
+    /* next slot + 1 in the same hash bucket, 0 ends the chain */
+    uint16_t next;
+} mqtt_queue_slot_t;
+
+/* ring of pending messages, only the head is ever removed */
+static mqtt_queue_slot_t mqtt_queue_slots[MQTT_QUEUE_SIZE];
+static size_t mqtt_queue_head = 0;
+static size_t mqtt_queue_count = 0;
+/* coalescable slots by topic hash, slot + 1 so zeroed memory is an empty table */
+static uint16_t mqtt_queue_buckets[MQTT_QUEUE_BUCKETS];
+
+static uint32_t mqtt_queue_hash(const char *str)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    while (*str)
+    {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool mqtt_queue_set(mqtt_queue_slot_t *slot, const char *topic, const char *payload)
+{
+    size_t topic_len = osStrlen(topic);
+    size_t payload_len = osStrlen(payload);
+    char *data = osAllocMem(topic_len + 1 + payload_len + 1);
+
+    if (!data)
+    {
+        return false;
+    }
+    osMemcpy(data, topic, topic_len + 1);
+    osMemcpy(&data[topic_len + 1], payload, payload_len + 1);
+
+    osFreeMem(slot->data);
+    slot->data = data;
+    slot->topic = data;
+    slot->payload = &data[topic_len + 1];
+    slot->payload_len = payload_len;
+
+    return true;
+}
+
+static void mqtt_queue_unlink(size_t pos)
+{
+    mqtt_queue_slot_t *slot = &mqtt_queue_slots[pos];
+    uint16_t *link = &mqtt_queue_buckets[slot->hash % MQTT_QUEUE_BUCKETS];
+
+    if (!slot->coalesce)
+    {
+        return;
+    }
+
+    while (*link)
+    {
+        if (*link - 1 == pos)
+        {
+            *link = slot->next;
+            break;
+        }
+        link = &mqtt_queue_slots[*link - 1].next;
+    }
+    slot->next = 0;
+}
+
+/* removes the head slot and hands its allocation over to msg */
+static void mqtt_queue_take(mqtt_queue_msg_t *msg)
+{
+    mqtt_queue_slot_t *slot = &mqtt_queue_slots[mqtt_queue_head];
+
+    mqtt_queue_unlink(mqtt_queue_head);
+    msg->data = slot->data;
+    msg->topic = slot->topic;
+    msg->payload = slot->payload;
+    msg->payload_len = slot->payload_len;
+    msg->sent = slot->sent;
+    msg->sent_ctx = slot->sent_ctx;
+    osMemset(slot, 0x00, sizeof(mqtt_queue_slot_t));
+
+    mqtt_queue_head = (mqtt_queue_head + 1) % MQTT_QUEUE_SIZE;
+    mqtt_queue_count--;
+}
+
+bool mqtt_queue_push(const char *topic, const char *payload, bool coalesce, mqtt_queue_overflow_t overflow, mqtt_queue_sent_cb_t sent, void *sent_ctx)
+{
+    uint32_t hash = mqtt_queue_hash(topic);
+    bool success = false;
+    bool coalesced = false;
+    bool dropped_oldest = false;
+
+    mutex_lock(MUTEX_MQTT_TX_BUFFER);
+    if (coalesce)
+    {
+        for (uint16_t link = mqtt_queue_buckets[hash % MQTT_QUEUE_BUCKETS]; link; link = mqtt_queue_slots[link - 1].next)
+        {
+            mqtt_queue_slot_t *slot = &mqtt_queue_slots[link - 1];
+            if (slot->hash == hash && !osStrcmp(slot->topic, topic))
+            {
+                success = !osStrcmp(slot->payload, payload) || mqtt_queue_set(slot, topic, payload);
+                if (success)
+                {
+                    slot->sent = sent;
+                    slot->sent_ctx = sent_ctx;
+                }
+                coalesced = true;
+                break;
+            }
+        }
+    }
+
+    if (!coalesced)
+    {
+        if (mqtt_queue_count == MQTT_QUEUE_SIZE && overflow == MQTT_QUEUE_OVERFLOW_DROP_OLDEST)
+        {
+            mqtt_queue_msg_t oldest;
+            mqtt_queue_take(&oldest);
+            mqtt_queue_free(&oldest);
+            dropped_oldest = true;
+        }
+
+        if (mqtt_queue_count < MQTT_QUEUE_SIZE)
+        {
+            size_t pos = (mqtt_queue_head + mqtt_queue_count) % MQTT_QUEUE_SIZE;
+            mqtt_queue_slot_t *slot = &mqtt_queue_slots[pos];
+
+            if (mqtt_queue_set(slot, topic, payload))
+            {
+                slot->sent = sent;
+                slot->sent_ctx = sent_ctx;
+                slot->hash = hash;
+                slot->coalesce = coalesce;
+                slot->next = 0;
+                if (coalesce)
+                {
+                    uint16_t *bucket = &mqtt_queue_buckets[hash % MQTT_QUEUE_BUCKETS];
+                    slot->next = *bucket;
+                    *bucket = (uint16_t)(pos + 1);
+                }
+                mqtt_queue_count++;
+                success = true;
+            }
+        }
+    }
+    mutex_unlock(MUTEX_MQTT_TX_BUFFER);
+
+    if (coalesced)
+    {
+        stats_update("mqtt_coalesced", 1);
+    }
+    if (!success || dropped_oldest)
+    {
+        stats_update("mqtt_dropped", 1);
+    }
+
+    return success;
+}
+
+size_t mqtt_queue_pop(mqtt_queue_msg_t *msgs, size_t max)
+{
+    size_t count = 0;
+
+    mutex_lock(MUTEX_MQTT_TX_BUFFER);
+    while (count < max && mqtt_queue_count > 0)
+    {
+        mqtt_queue_take(&msgs[count++]);
+    }
+    mutex_unlock(MUTEX_MQTT_TX_BUFFER);
+
+    return count;
+}
+
+void mqtt_queue_free(mqtt_queue_msg_t *msg)
+{
+    osFreeMem(msg->data);
+    msg->data = NULL;
+    msg->topic = NULL;
+    msg->payload = NULL;
+    msg->sent = NULL;
+    msg->sent_ctx = NULL;
+}
+
+size_t mqtt_queue_pending()
+{
+    mutex_lock(MUTEX_MQTT_TX_BUFFER);
+    size_t count = mqtt_queue_count;
+    mutex_unlock(MUTEX_MQTT_TX_BUFFER);
+
+    return count;
+}
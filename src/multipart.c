@@ -0,0 +1,790 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "multipart.h"
+
+#include "fs_ext.h"
+#include "fs_port.h"
+#include "os_port.h"
+#include "debug.h"
+
+static bool_t multipart_find_string(const uint8_t *data, size_t length, size_t from, const char *str, size_t *found)
+{
+    size_t str_len = osStrlen(str);
+
+    while (from + str_len <= length)
+    {
+        const uint8_t *hit = osMemchr(&data[from], str[0], length - from - str_len + 1);
+        if (hit == NULL)
+        {
+            return false;
+        }
+        from = hit - data;
+        if (!osMemcmp(hit, str, str_len))
+        {
+            *found = from;
+            return true;
+        }
+        from++;
+    }
+
+    return false;
+}
+
+/* Boyer-Moore-Horspool, skips by the distance of the window's last byte from the end of the delimiter */
+static bool_t multipart_find_delimiter(multipart_parser_t *parser, const uint8_t *data, size_t length, size_t from, size_t *found)
+{
+    size_t delimiter_len = parser->delimiter_len;
+    uint8_t last = parser->delimiter[delimiter_len - 1];
+
+    for (size_t pos = from; pos + delimiter_len <= length;)
+    {
+        uint8_t c = data[pos + delimiter_len - 1];
+        if (c == last && !osMemcmp(&data[pos], parser->delimiter, delimiter_len - 1))
+        {
+            *found = pos;
+            return true;
+        }
+        pos += parser->skip[c];
+    }
+
+    return false;
+}
+
+static bool_t multipart_get_field(const char *headers, size_t length, const char *field, char *result, size_t result_max)
+{
+    size_t field_len = osStrlen(field);
+
+    for (size_t pos = 0; pos + field_len + 2 <= length; pos++)
+    {
+        /* must not match the end of a longer parameter, "name" is part of "filename" */
+        if (pos > 0 && headers[pos - 1] != ' ' && headers[pos - 1] != ';')
+        {
+            continue;
+        }
+        if (osStrncasecmp(&headers[pos], field, field_len) || headers[pos + field_len] != '=' || headers[pos + field_len + 1] != '"')
+        {
+            continue;
+        }
+
+        size_t start = pos + field_len + 2;
+        const char *end = osMemchr(&headers[start], '"', length - start);
+        if (end == NULL)
+        {
+            return false;
+        }
+        size_t len = MIN((size_t)(end - &headers[start]), result_max - 1);
+        osMemcpy(result, &headers[start], len);
+        result[len] = '\0';
+
+        return true;
+    }
+
+    return false;
+}
+
+error_t multipart_parser_init(multipart_parser_t *parser, const char *boundary, size_t buffer_size, multipart_cbr_t *cbr, void *ctx)
+{
+    size_t boundary_len = osStrlen(boundary);
+
+    osMemset(parser, 0x00, sizeof(multipart_parser_t));
+    if (boundary_len == 0 || boundary_len > MULTIPART_BOUNDARY_MAX_LEN)
+    {
+        TRACE_ERROR("Invalid multipart boundary length %" PRIuSIZE "\r\n", boundary_len);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    parser->cbr = cbr;
+    parser->ctx = ctx;
+    parser->state = MULTIPART_PREAMBLE;
+    parser->size = MAX(buffer_size, MULTIPART_BUFFER_SIZE_MIN);
+    parser->buffer = osAllocMem(parser->size);
+    if (parser->buffer == NULL)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+
+    osMemcpy(parser->delimiter, "\r\n--", 4);
+    osMemcpy(&parser->delimiter[4], boundary, boundary_len);
+    parser->delimiter_len = boundary_len + 4;
+
+    for (size_t i = 0; i < 256; i++)
+    {
+        parser->skip[i] = parser->delimiter_len;
+    }
+    for (size_t i = 0; i < parser->delimiter_len - 1; i++)
+    {
+        parser->skip[parser->delimiter[i]] = parser->delimiter_len - 1 - i;
+    }
+
+    /* a body may start with the delimiter right away, without the CRLF in front */
+    osMemcpy(parser->buffer, "\r\n", 2);
+    parser->used = 2;
+
+    return NO_ERROR;
+}
+
+void multipart_parser_free(multipart_parser_t *parser)
+{
+    osFreeMem(parser->buffer);
+    parser->buffer = NULL;
+}
+
+static void multipart_parse_headers(multipart_parser_t *parser, const char *headers, size_t length)
+{
+    if (!multipart_get_field(headers, length, "name", parser->name, sizeof(parser->name)))
+    {
+        osStrcpy(parser->name, "");
+    }
+    if (!multipart_get_field(headers, length, "filename", parser->filename, sizeof(parser->filename)))
+    {
+        TRACE_DEBUG("Skipping part '%s' without filename\r\n", parser->name);
+        return;
+    }
+
+    if (parser->cbr->multipart_start(parser->ctx, parser->name, parser->filename) != NO_ERROR)
+    {
+        TRACE_ERROR("multipart_start failed\r\n");
+        parser->error = ERROR_INVALID_PATH;
+        return;
+    }
+    parser->in_file = true;
+}
+
+static error_t multipart_parser_add(multipart_parser_t *parser, uint8_t *data, size_t length)
+{
+    if (!parser->in_file || length == 0)
+    {
+        return NO_ERROR;
+    }
+    if (parser->cbr->multipart_add(parser->ctx, data, length) != NO_ERROR)
+    {
+        TRACE_ERROR("multipart_add failed\r\n");
+        parser->in_file = false;
+        return ERROR_FAILURE;
+    }
+    return NO_ERROR;
+}
+
+static error_t multipart_parser_process(multipart_parser_t *parser)
+{
+    size_t pos = 0;
+    bool_t more = true;
+
+    while (more && parser->error == NO_ERROR)
+    {
+        uint8_t *data = &parser->buffer[pos];
+        size_t avail = parser->used - pos;
+        size_t found = 0;
+
+        switch (parser->state)
+        {
+        case MULTIPART_PREAMBLE:
+        {
+            if (multipart_find_delimiter(parser, data, avail, parser->searched, &found))
+            {
+                pos += found + parser->delimiter_len;
+                parser->state = MULTIPART_DELIMITER;
+            }
+            else
+            {
+                /* drop all but what could be the start of a delimiter */
+                pos += (avail >= parser->delimiter_len) ? avail - (parser->delimiter_len - 1) : 0;
+                more = false;
+            }
+            parser->searched = 0;
+            break;
+        }
+
+        case MULTIPART_DELIMITER:
+        {
+            if (avail < 2)
+            {
+                more = false;
+                break;
+            }
+            if (data[0] == '-' && data[1] == '-')
+            {
+                TRACE_DEBUG("Received multipart end\r\n");
+                parser->state = MULTIPART_DONE;
+                break;
+            }
+
+            /* skip transport padding up to the end of the line */
+            const uint8_t *lf = osMemchr(data, '\n', avail);
+            if (lf == NULL)
+            {
+                if (avail > MULTIPART_PADDING_MAX)
+                {
+                    TRACE_ERROR("No newline after multipart delimiter\r\n");
+                    parser->error = ERROR_INVALID_SYNTAX;
+                }
+                more = false;
+                break;
+            }
+            pos += lf - data + 1;
+            parser->state = MULTIPART_HEADERS;
+            break;
+        }
+
+        case MULTIPART_HEADERS:
+        {
+            size_t headers_len = 0;
+            if (avail >= 2 && data[0] == '\r' && data[1] == '\n')
+            {
+                /* no headers at all */
+                pos += 2;
+            }
+            else if (multipart_find_string(data, avail, parser->searched, "\r\n\r\n", &found))
+            {
+                headers_len = found + 2;
+                pos += found + 4;
+            }
+            else
+            {
+                if (avail == parser->size)
+                {
+                    TRACE_ERROR("Multipart headers exceed %" PRIuSIZE " bytes\r\n", parser->size);
+                    parser->error = ERROR_BUFFER_OVERFLOW;
+                }
+                parser->searched = (avail > 3) ? avail - 3 : 0;
+                more = false;
+                break;
+            }
+            parser->searched = 0;
+            parser->state = MULTIPART_BODY;
+            multipart_parse_headers(parser, (const char *)data, headers_len);
+            break;
+        }
+
+        case MULTIPART_BODY:
+        {
+            if (multipart_find_delimiter(parser, data, avail, parser->searched, &found))
+            {
+                parser->error = multipart_parser_add(parser, data, found);
+                if (parser->in_file)
+                {
+                    parser->cbr->multipart_end(parser->ctx);
+                    parser->in_file = false;
+                    TRACE_INFO("Received file '%s'\r\n", parser->filename);
+                }
+                pos += found + parser->delimiter_len;
+                parser->searched = 0;
+                parser->state = MULTIPART_DELIMITER;
+                break;
+            }
+
+            /* everything before the last delimiter_len - 1 bytes is data, pass it on in large blocks only */
+            size_t safe = (avail >= parser->delimiter_len) ? avail - (parser->delimiter_len - 1) : 0;
+            if (safe < parser->size / 2)
+            {
+                parser->searched = safe;
+                more = false;
+                break;
+            }
+            parser->error = multipart_parser_add(parser, data, safe);
+            pos += safe;
+            parser->searched = 0;
+            break;
+        }
+
+        case MULTIPART_DONE:
+            /* ignore the epilogue */
+            pos = parser->used;
+            more = false;
+            break;
+        }
+    }
+
+    if (pos > 0)
+    {
+        osMemmove(parser->buffer, &parser->buffer[pos], parser->used - pos);
+        parser->used -= pos;
+    }
+
+    return parser->error;
+}
+
+uint8_t *multipart_parser_space(multipart_parser_t *parser, size_t *length)
+{
+    *length = parser->size - parser->used;
+    return &parser->buffer[parser->used];
+}
+
+error_t multipart_parser_commit(multipart_parser_t *parser, size_t length)
+{
+    if (parser->error != NO_ERROR)
+    {
+        return parser->error;
+    }
+    parser->used += length;
+
+    return multipart_parser_process(parser);
+}
+
+error_t multipart_parser_write(multipart_parser_t *parser, const void *data, size_t length)
+{
+    const uint8_t *src = (const uint8_t *)data;
+
+    while (length > 0 && parser->state != MULTIPART_DONE)
+    {
+        size_t space = 0;
+        uint8_t *dst = multipart_parser_space(parser, &space);
+        if (space == 0)
+        {
+            return ERROR_BUFFER_OVERFLOW;
+        }
+        size_t chunk = MIN(space, length);
+        osMemcpy(dst, src, chunk);
+
+        error_t error = multipart_parser_commit(parser, chunk);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+        src += chunk;
+        length -= chunk;
+    }
+
+    return NO_ERROR;
+}
+
+error_t multipart_parser_finish(multipart_parser_t *parser)
+{
+    if (parser->error != NO_ERROR)
+    {
+        return parser->error;
+    }
+
+    switch (parser->state)
+    {
+    case MULTIPART_PREAMBLE:
+        TRACE_DEBUG("No multipart delimiter found\r\n");
+        return NO_ERROR;
+    case MULTIPART_DONE:
+        return NO_ERROR;
+    default:
+        TRACE_ERROR("Multipart body ended within part '%s'\r\n", parser->name);
+        return ERROR_END_OF_STREAM;
+    }
+}
+
+bool_t multipart_parser_done(multipart_parser_t *parser)
+{
+    return parser->state == MULTIPART_DONE;
+}
+
+#define MULTIPART_TEST_BOUNDARY "----teddyCloudBoundary7MA4YWxkTrZu0gW"
+
+typedef struct
+{
+    size_t files;
+    size_t calls;
+    size_t bytes;
+} multipart_bench_ctx_t;
+
+static error_t multipart_bench_start(void *ctx, const char *name, const char *filename)
+{
+    ((multipart_bench_ctx_t *)ctx)->files++;
+    return NO_ERROR;
+}
+
+static error_t multipart_bench_add(void *ctx, void *data, size_t length)
+{
+    multipart_bench_ctx_t *bench = (multipart_bench_ctx_t *)ctx;
+    bench->calls++;
+    bench->bytes += length;
+    return NO_ERROR;
+}
+
+static error_t multipart_bench_end(void *ctx)
+{
+    return NO_ERROR;
+}
+
+static uint8_t *multipart_bench_body(const char *source, size_t *payload_size, size_t *body_size)
+{
+    const char *header = "--" MULTIPART_TEST_BOUNDARY "\r\n"
+                         "Content-Disposition: form-data; name=\"file\"; filename=\"bench.bin\"\r\n"
+                         "Content-Type: application/octet-stream\r\n\r\n";
+    const char *trailer = "\r\n--" MULTIPART_TEST_BOUNDARY "--\r\n";
+    size_t header_len = osStrlen(header);
+    size_t trailer_len = osStrlen(trailer);
+    bool_t synthetic = !osStrcmp(source, MULTIPART_BENCH_SYNTHETIC);
+
+    uint32_t size = MULTIPART_BENCH_SYNTHETIC_SIZE;
+    if (!synthetic && (fsGetFileSize(source, &size) != NO_ERROR || size == 0))
+    {
+        TRACE_ERROR("Cannot read '%s'\r\n", source);
+        return NULL;
+    }
+
+    uint8_t *body = osAllocMem(header_len + size + trailer_len);
+    if (body == NULL)
+    {
+        return NULL;
+    }
+    osMemcpy(body, header, header_len);
+    uint8_t *payload = &body[header_len];
+
+    if (synthetic)
+    {
+        /* random data with a partial delimiter every few KiB, like encoded audio has by chance */
+        uint32_t state = 0x12345678;
+        for (size_t i = 0; i < size; i++)
+        {
+            state = state * 1103515245 + 12345;
+            payload[i] = state >> 24;
+        }
+        for (size_t i = 0; i + 16 < size; i += 4093)
+        {
+            osMemcpy(&payload[i], "\r\n--" MULTIPART_TEST_BOUNDARY, 16);
+        }
+    }
+    else
+    {
+        FsFile *file = fsOpenFile(source, FS_FILE_MODE_READ);
+        size_t read = 0;
+        if (file == NULL || fsReadFile(file, payload, size, &read) != NO_ERROR || read != size)
+        {
+            TRACE_ERROR("Cannot read '%s'\r\n", source);
+            if (file != NULL)
+            {
+                fsCloseFile(file);
+            }
+            osFreeMem(body);
+            return NULL;
+        }
+        fsCloseFile(file);
+    }
+    osMemcpy(&payload[size], trailer, trailer_len);
+
+    *payload_size = size;
+    *body_size = header_len + size + trailer_len;
+
+    return body;
+}
+
+error_t multipart_bench_run(const char *source, uint32_t count)
+{
+    static const size_t windows[] = {MULTIPART_BUFFER_SIZE_MIN, MULTIPART_BUFFER_SIZE_DEFAULT, 1024 * 1024};
+    multipart_cbr_t cbr = {
+        .multipart_start = &multipart_bench_start,
+        .multipart_add = &multipart_bench_add,
+        .multipart_end = &multipart_bench_end};
+
+    size_t payload_size = 0;
+    size_t body_size = 0;
+    uint8_t *body = multipart_bench_body(source, &payload_size, &body_size);
+    if (body == NULL)
+    {
+        return ERROR_READ_FAILED;
+    }
+
+    TRACE_WARNING("**********************************\r\n");
+    TRACE_WARNING("Source:           %s\r\n", source);
+    TRACE_WARNING("Runs:             %" PRIu32 "\r\n", count);
+    TRACE_WARNING("Body:             %" PRIuSIZE " bytes in %d byte fragments\r\n", body_size, MULTIPART_BENCH_FRAGMENT);
+
+    error_t error = NO_ERROR;
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]) && error == NO_ERROR; w++)
+    {
+        multipart_bench_ctx_t bench;
+        clock_t start = clock();
+        for (uint32_t run = 0; run < count && error == NO_ERROR; run++)
+        {
+            multipart_parser_t parser;
+            osMemset(&bench, 0x00, sizeof(bench));
+            error = multipart_parser_init(&parser, MULTIPART_TEST_BOUNDARY, windows[w], &cbr, &bench);
+            for (size_t pos = 0; pos < body_size && error == NO_ERROR; pos += MULTIPART_BENCH_FRAGMENT)
+            {
+                error = multipart_parser_write(&parser, &body[pos], MIN(MULTIPART_BENCH_FRAGMENT, body_size - pos));
+            }
+            if (error == NO_ERROR)
+            {
+                error = multipart_parser_finish(&parser);
+            }
+            multipart_parser_free(&parser);
+
+            if (error == NO_ERROR && (bench.files != 1 || bench.bytes != payload_size))
+            {
+                TRACE_ERROR("Parsed %" PRIuSIZE " files with %" PRIuSIZE " bytes, expected one with %" PRIuSIZE "\r\n", bench.files, bench.bytes, payload_size);
+                error = ERROR_FAILURE;
+            }
+        }
+        double cpu_ms = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC / count;
+
+        TRACE_WARNING("Window %7" PRIuSIZE ":   %.3f ms per body (%.1f MB/s), %" PRIuSIZE " callbacks of %" PRIuSIZE " bytes\r\n",
+                      windows[w], cpu_ms, cpu_ms > 0 ? body_size / cpu_ms / 1000.0 : 0, bench.calls, bench.calls ? bench.bytes / bench.calls : 0);
+    }
+    TRACE_WARNING("**********************************\r\n");
+    osFreeMem(body);
+
+    return error;
+}
+
+#define MULTIPART_FUZZ_PARTS_MAX 4
+#define MULTIPART_FUZZ_PART_MAX 20000
+#define MULTIPART_FUZZ_BODY_MAX (MULTIPART_FUZZ_PARTS_MAX * (MULTIPART_FUZZ_PART_MAX + 512) + 1024)
+
+typedef struct
+{
+    char name[32];
+    char filename[32];
+    bool_t ended;
+    uint8_t data[MULTIPART_FUZZ_PART_MAX];
+    size_t length;
+} multipart_fuzz_part_t;
+
+typedef struct
+{
+    multipart_fuzz_part_t parts[MULTIPART_FUZZ_PARTS_MAX];
+    size_t count;
+} multipart_fuzz_ctx_t;
+
+static error_t multipart_fuzz_start(void *ctx, const char *name, const char *filename)
+{
+    multipart_fuzz_ctx_t *fuzz = (multipart_fuzz_ctx_t *)ctx;
+    if (fuzz->count == MULTIPART_FUZZ_PARTS_MAX)
+    {
+        return ERROR_FAILURE;
+    }
+    multipart_fuzz_part_t *part = &fuzz->parts[fuzz->count++];
+    osStrncpy(part->name, name, sizeof(part->name) - 1);
+    osStrncpy(part->filename, filename, sizeof(part->filename) - 1);
+    return NO_ERROR;
+}
+
+static error_t multipart_fuzz_add(void *ctx, void *data, size_t length)
+{
+    multipart_fuzz_ctx_t *fuzz = (multipart_fuzz_ctx_t *)ctx;
+    multipart_fuzz_part_t *part = &fuzz->parts[fuzz->count - 1];
+    if (part->ended || length == 0 || part->length + length > MULTIPART_FUZZ_PART_MAX)
+    {
+        return ERROR_FAILURE;
+    }
+    osMemcpy(&part->data[part->length], data, length);
+    part->length += length;
+    return NO_ERROR;
+}
+
+static error_t multipart_fuzz_end(void *ctx)
+{
+    multipart_fuzz_ctx_t *fuzz = (multipart_fuzz_ctx_t *)ctx;
+    fuzz->parts[fuzz->count - 1].ended = true;
+    return NO_ERROR;
+}
+
+/* mostly bytes that make up delimiters, so near misses are frequent */
+static void multipart_fuzz_fill(uint8_t *data, size_t length, const char *delimiter)
+{
+    size_t delimiter_len = osStrlen(delimiter);
+
+    for (size_t i = 0; i < length; i++)
+    {
+        switch (rand() % 4)
+        {
+        case 0:
+            data[i] = "\r\n-"[rand() % 3];
+            break;
+        case 1:
+            data[i] = delimiter[rand() % delimiter_len];
+            break;
+        default:
+            data[i] = rand() & 0xFF;
+            break;
+        }
+        if (rand() % 512 == 0)
+        {
+            /* a delimiter cut short by at least one byte */
+            size_t partial = MIN((size_t)(rand() % delimiter_len), length - i);
+            if (partial > 0)
+            {
+                osMemcpy(&data[i], delimiter, partial);
+                i += partial - 1;
+            }
+        }
+    }
+
+    /* break real delimiters up again */
+    size_t found = 0;
+    while (multipart_find_string(data, length, 0, delimiter, &found))
+    {
+        data[found] = 'x';
+    }
+}
+
+static size_t multipart_fuzz_body(uint8_t *body, multipart_fuzz_ctx_t *expected, const char *boundary)
+{
+    char delimiter[MULTIPART_DELIMITER_MAX_LEN + 1];
+    osSnprintf(delimiter, sizeof(delimiter), "\r\n--%s", boundary);
+    size_t length = 0;
+
+    osMemset(expected, 0x00, sizeof(multipart_fuzz_ctx_t));
+
+    if (rand() % 2)
+    {
+        length = rand() % 200;
+        multipart_fuzz_fill(body, length, delimiter);
+        /* the parser puts a CRLF in front, so the preamble must not start the delimiter either */
+        if (length >= 2 + osStrlen(boundary) && !osMemcmp(body, &delimiter[2], 2 + osStrlen(boundary)))
+        {
+            body[0] = 'x';
+        }
+        length += osSprintf((char *)&body[length], "\r\n");
+    }
+
+    size_t parts = rand() % (MULTIPART_FUZZ_PARTS_MAX + 1);
+    for (size_t p = 0; p < parts; p++)
+    {
+        char name[32];
+        char filename[32];
+        bool_t file = rand() % 4 != 0;
+        osSnprintf(name, sizeof(name), "field%d", rand() % 100);
+        osSnprintf(filename, sizeof(filename), "file%d.bin", rand() % 100);
+
+        length += osSprintf((char *)&body[length], "--%s%s\r\n", boundary, (rand() % 4) ? "" : " \t ");
+        length += osSprintf((char *)&body[length], "Content-Disposition: form-data; name=\"%s\"", name);
+        if (file)
+        {
+            length += osSprintf((char *)&body[length], "; filename=\"%s\"", filename);
+        }
+        length += osSprintf((char *)&body[length], "\r\n%s\r\n", (rand() % 2) ? "Content-Type: application/octet-stream\r\n" : "");
+
+        size_t data_len = (rand() % 8 == 0) ? 0 : rand() % MULTIPART_FUZZ_PART_MAX;
+        multipart_fuzz_fill(&body[length], data_len, delimiter);
+        if (file)
+        {
+            multipart_fuzz_part_t *part = &expected->parts[expected->count++];
+            osStrcpy(part->name, name);
+            osStrcpy(part->filename, filename);
+            osMemcpy(part->data, &body[length], data_len);
+            part->length = data_len;
+            part->ended = true;
+        }
+        length += data_len;
+        length += osSprintf((char *)&body[length], "\r\n");
+    }
+    length += osSprintf((char *)&body[length], "--%s--%s", boundary, (rand() % 2) ? "\r\nepilogue\r\n" : "");
+
+    return length;
+}
+
+static error_t multipart_fuzz_parse(const uint8_t *body, size_t length, const char *boundary, multipart_fuzz_ctx_t *result)
+{
+    multipart_cbr_t cbr = {
+        .multipart_start = &multipart_fuzz_start,
+        .multipart_add = &multipart_fuzz_add,
+        .multipart_end = &multipart_fuzz_end};
+    multipart_parser_t parser;
+
+    osMemset(result, 0x00, sizeof(multipart_fuzz_ctx_t));
+    size_t window = MULTIPART_BUFFER_SIZE_MIN + rand() % MULTIPART_BUFFER_SIZE_DEFAULT;
+    error_t error = multipart_parser_init(&parser, boundary, window, &cbr, result);
+    size_t fragment_max = (rand() % 2) ? 16 : 8192;
+
+    for (size_t pos = 0; pos < length && error == NO_ERROR;)
+    {
+        size_t fragment = MIN(1 + rand() % fragment_max, length - pos);
+        error = multipart_parser_write(&parser, &body[pos], fragment);
+        pos += fragment;
+    }
+    if (error == NO_ERROR)
+    {
+        error = multipart_parser_finish(&parser);
+    }
+    multipart_parser_free(&parser);
+
+    return error;
+}
+
+/* truncated bodies may stop early, but what was received must match */
+static bool_t multipart_fuzz_check(multipart_fuzz_ctx_t *expected, multipart_fuzz_ctx_t *result, bool_t complete)
+{
+    if (complete && result->count != expected->count)
+    {
+        return false;
+    }
+    for (size_t p = 0; p < result->count; p++)
+    {
+        multipart_fuzz_part_t *want = &expected->parts[p];
+        multipart_fuzz_part_t *got = &result->parts[p];
+        if (p >= expected->count || osStrcmp(want->name, got->name) || osStrcmp(want->filename, got->filename))
+        {
+            return false;
+        }
+        if (got->length > want->length || osMemcmp(want->data, got->data, got->length))
+        {
+            return false;
+        }
+        if ((complete || got->ended) && (!got->ended || got->length != want->length))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+error_t multipart_fuzz_run(uint32_t count)
+{
+    static const char bchars[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ'()+_,-./:=?";
+    uint32_t seed = (uint32_t)time(NULL);
+    uint32_t failures = 0;
+
+    uint8_t *body = osAllocMem(MULTIPART_FUZZ_BODY_MAX);
+    multipart_fuzz_ctx_t *expected = osAllocMem(sizeof(multipart_fuzz_ctx_t));
+    multipart_fuzz_ctx_t *result = osAllocMem(sizeof(multipart_fuzz_ctx_t));
+    if (body == NULL || expected == NULL || result == NULL)
+    {
+        osFreeMem(body);
+        osFreeMem(expected);
+        osFreeMem(result);
+        return ERROR_OUT_OF_MEMORY;
+    }
+
+    TRACE_WARNING("**********************************\r\n");
+    TRACE_WARNING("Seed:             %" PRIu32 "\r\n", seed);
+    srand(seed);
+
+    for (uint32_t run = 0; run < count; run++)
+    {
+        char boundary[MULTIPART_BOUNDARY_MAX_LEN + 1];
+        size_t boundary_len = 1 + rand() % MULTIPART_BOUNDARY_MAX_LEN;
+        for (size_t i = 0; i < boundary_len; i++)
+        {
+            boundary[i] = bchars[rand() % (sizeof(bchars) - 1)];
+        }
+        boundary[boundary_len] = '\0';
+
+        size_t length = multipart_fuzz_body(body, expected, boundary);
+
+        error_t error = multipart_fuzz_parse(body, length, boundary, result);
+        if (error != NO_ERROR || !multipart_fuzz_check(expected, result, true))
+        {
+            TRACE_ERROR("Run %" PRIu32 ": body of %" PRIuSIZE " bytes with boundary '%s' parsed wrong (%s)\r\n", run, length, boundary, error2text(error));
+            failures++;
+            continue;
+        }
+
+        size_t truncated = rand() % (length + 1);
+        error = multipart_fuzz_parse(body, truncated, boundary, result);
+        if (!multipart_fuzz_check(expected, result, false))
+        {
+            TRACE_ERROR("Run %" PRIu32 ": body truncated to %" PRIuSIZE " of %" PRIuSIZE " bytes parsed wrong (%s)\r\n", run, truncated, length, error2text(error));
+            failures++;
+        }
+    }
+
+    TRACE_WARNING("Runs:             %" PRIu32 "\r\n", count);
+    TRACE_WARNING("Failures:         %" PRIu32 "\r\n", failures);
+    TRACE_WARNING("**********************************\r\n");
+
+    osFreeMem(body);
+    osFreeMem(expected);
+    osFreeMem(result);
+
+    return failures ? ERROR_FAILURE : NO_ERROR;
+}
@@ -1,5 +1,13 @@
 #include "os_ext.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 FILE *osPopen(const char *command, const char *type)
 {
 #ifdef _WIN32
@@ -16,4 +24,14 @@ int osPclose(FILE *stream)
 #else
     return pclose(stream);
 #endif
-}
\ No newline at end of file
+}
+
+void osSetTaskNice(uint32_t niceness)
+{
+#ifdef _WIN32
+    SetThreadPriority(GetCurrentThread(), niceness > 0 ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_NORMAL);
+#else
+    /* linux applies the niceness per thread */
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), (int)niceness);
+#endif
+}
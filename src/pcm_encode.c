@@ -0,0 +1,248 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pcm_encode.h"
+
+#include "fs_port.h"
+#include "os_port.h"
+#include "debug.h"
+#include "handler_sse.h"
+#include "server_helpers.h"
+#include "cJSON.h"
+
+static void pcm_encode_progress(pcm_encode_t *encoder, const char *state, bool_t force)
+{
+    systime_t now = osGetSystemTime();
+    if (!force && now - encoder->last_progress < PCM_ENCODE_PROGRESS_INTERVAL)
+    {
+        return;
+    }
+    encoder->last_progress = now;
+
+    osAcquireMutex(&encoder->mutex);
+    uint64_t received = encoder->head;
+    uint64_t encoded = encoder->tail;
+    osReleaseMutex(&encoder->mutex);
+
+    const char *name = strrchr(encoder->file_path, PATH_SEPARATOR);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "file", name ? name + 1 : encoder->file_path);
+    cJSON_AddStringToObject(json, "state", state);
+    cJSON_AddNumberToObject(json, "received", received);
+    cJSON_AddNumberToObject(json, "encoded", encoded);
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    sse_sendEvent("PcmEncodeProgress", jsonString, false);
+    osFreeMem(jsonString);
+}
+
+static void pcm_encode_task(void *param)
+{
+    pcm_encode_t *encoder = (pcm_encode_t *)param;
+    error_t error = NO_ERROR;
+    size_t chapter = 0;
+
+    while (error == NO_ERROR && !encoder->aborting)
+    {
+        osAcquireMutex(&encoder->mutex);
+        bool_t has_chapter = chapter < encoder->chapter_count;
+        uint64_t tail = encoder->tail;
+        uint64_t end = has_chapter ? encoder->chapters[chapter] : encoder->head;
+        bool_t closing = encoder->closing;
+        osReleaseMutex(&encoder->mutex);
+
+        if (has_chapter && tail == end)
+        {
+            error = toniefile_new_chapter(encoder->taf);
+            chapter++;
+            continue;
+        }
+
+        /* whole frames only, up to the end of the queue memory */
+        size_t offset = tail % PCM_ENCODE_QUEUE_SIZE;
+        size_t length = MIN(end - tail, PCM_ENCODE_QUEUE_SIZE - offset);
+        length = MIN(length, PCM_ENCODE_BLOCK_SIZE);
+        length -= length % PCM_ENCODE_FRAME_SIZE;
+
+        if (length == 0)
+        {
+            if (closing)
+            {
+                /* a trailing partial frame is dropped */
+                break;
+            }
+            completion_wait(&encoder->data, PCM_ENCODE_PROGRESS_INTERVAL);
+            continue;
+        }
+
+        error = toniefile_encode(encoder->taf, (int16_t *)&encoder->queue[offset], length / PCM_ENCODE_FRAME_SIZE);
+
+        osAcquireMutex(&encoder->mutex);
+        encoder->tail += length;
+        osReleaseMutex(&encoder->mutex);
+        completion_signal(&encoder->space);
+
+        pcm_encode_progress(encoder, "encoding", false);
+    }
+
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Encoding '%s' failed: %s\r\n", encoder->file_path, error2text(error));
+    }
+    pcm_encode_progress(encoder, encoder->aborting ? "aborted" : (error != NO_ERROR ? "failed" : "done"), true);
+
+    /* the writer may wait for space that will never come, the encoder is freed once done completes */
+    completion_signal(&encoder->space);
+    completion_complete(&encoder->done, error);
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+static void pcm_encode_free(pcm_encode_t *encoder)
+{
+    completion_deinit(&encoder->data);
+    completion_deinit(&encoder->space);
+    completion_deinit(&encoder->done);
+    osDeleteMutex(&encoder->mutex);
+    osFreeMem(encoder->queue);
+    osFreeMem(encoder->file_path);
+    osFreeMem(encoder);
+}
+
+pcm_encode_t *pcm_encode_start(const char *file_path, uint32_t audio_id)
+{
+    pcm_encode_t *encoder = osAllocMem(sizeof(pcm_encode_t));
+    if (encoder == NULL)
+    {
+        return NULL;
+    }
+    osMemset(encoder, 0x00, sizeof(pcm_encode_t));
+    osCreateMutex(&encoder->mutex);
+    encoder->file_path = strdup(file_path);
+    encoder->queue = osAllocMem(PCM_ENCODE_QUEUE_SIZE);
+
+    if (encoder->file_path == NULL || encoder->queue == NULL ||
+        completion_init(&encoder->data) != NO_ERROR ||
+        completion_init(&encoder->space) != NO_ERROR ||
+        completion_init(&encoder->done) != NO_ERROR)
+    {
+        pcm_encode_free(encoder);
+        return NULL;
+    }
+
+    encoder->taf = toniefile_create(file_path, audio_id, false);
+    if (encoder->taf == NULL)
+    {
+        TRACE_ERROR("Creating TAF '%s' failed\r\n", file_path);
+        pcm_encode_free(encoder);
+        return NULL;
+    }
+
+    if (osCreateTask("PcmEncode", &pcm_encode_task, encoder, 16 * 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Failed to start encoder task\r\n");
+        toniefile_close(encoder->taf);
+        fsDeleteFile(file_path);
+        pcm_encode_free(encoder);
+        return NULL;
+    }
+
+    return encoder;
+}
+
+error_t pcm_encode_write(pcm_encode_t *encoder, const void *data, size_t length)
+{
+    const uint8_t *src = (const uint8_t *)data;
+
+    while (length > 0)
+    {
+        if (completion_is_done(&encoder->done))
+        {
+            /* the worker only exits early on errors */
+            return (encoder->done.error != NO_ERROR) ? encoder->done.error : ERROR_WRONG_STATE;
+        }
+
+        osAcquireMutex(&encoder->mutex);
+        size_t space = PCM_ENCODE_QUEUE_SIZE - (size_t)(encoder->head - encoder->tail);
+        size_t offset = encoder->head % PCM_ENCODE_QUEUE_SIZE;
+        osReleaseMutex(&encoder->mutex);
+
+        size_t chunk = MIN(length, MIN(space, PCM_ENCODE_QUEUE_SIZE - offset));
+        if (chunk == 0)
+        {
+            completion_wait(&encoder->space, PCM_ENCODE_PROGRESS_INTERVAL);
+            continue;
+        }
+        osMemcpy(&encoder->queue[offset], src, chunk);
+
+        osAcquireMutex(&encoder->mutex);
+        encoder->head += chunk;
+        osReleaseMutex(&encoder->mutex);
+        completion_signal(&encoder->data);
+
+        src += chunk;
+        length -= chunk;
+    }
+
+    return NO_ERROR;
+}
+
+error_t pcm_encode_chapter(pcm_encode_t *encoder)
+{
+    /* pad the previous file to whole frames, so the next one starts aligned */
+    static const uint8_t padding[PCM_ENCODE_FRAME_SIZE] = {0};
+    size_t partial = encoder->head % PCM_ENCODE_FRAME_SIZE;
+    if (partial > 0)
+    {
+        error_t error = pcm_encode_write(encoder, padding, PCM_ENCODE_FRAME_SIZE - partial);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+    }
+
+    osAcquireMutex(&encoder->mutex);
+    if (encoder->chapter_count >= TONIEFILE_MAX_CHAPTERS - 1)
+    {
+        osReleaseMutex(&encoder->mutex);
+        TRACE_ERROR("Too many chapters for '%s'\r\n", encoder->file_path);
+        return ERROR_FAILURE;
+    }
+    encoder->chapters[encoder->chapter_count++] = encoder->head;
+    osReleaseMutex(&encoder->mutex);
+    completion_signal(&encoder->data);
+
+    return NO_ERROR;
+}
+
+error_t pcm_encode_finish(pcm_encode_t *encoder)
+{
+    osAcquireMutex(&encoder->mutex);
+    encoder->closing = true;
+    osReleaseMutex(&encoder->mutex);
+    completion_signal(&encoder->data);
+
+    error_t error = completion_join(&encoder->done, INFINITE_DELAY);
+    error_t close_error = toniefile_close(encoder->taf);
+    if (error == NO_ERROR)
+    {
+        error = close_error;
+    }
+    pcm_encode_free(encoder);
+
+    return error;
+}
+
+void pcm_encode_abort(pcm_encode_t *encoder)
+{
+    TRACE_WARNING("Aborting encoding of '%s'\r\n", encoder->file_path);
+    encoder->aborting = true;
+    completion_signal(&encoder->data);
+
+    completion_join(&encoder->done, INFINITE_DELAY);
+    toniefile_close(encoder->taf);
+
+    fsDeleteFile(encoder->file_path);
+    pcm_encode_free(encoder);
+}
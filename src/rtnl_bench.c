@@ -0,0 +1,668 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtnl_bench.h"
+
+#include "core/net.h"
+#include "debug.h"
+#include "cJSON.h"
+#include "fs_ext.h"
+#include "platform.h"
+#include "server_helpers.h"
+#include "handler_rtnl.h"
+#include "proto/toniebox.pb.rtnl.pb-c.h"
+
+#define RTNL_BENCH_PACKET_MAX 4096
+#define RTNL_BENCH_RECV_SIZE 1024
+#define RTNL_BENCH_LINE_MAX 4096
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t length;
+} rtnl_bench_record_t;
+
+typedef struct
+{
+    const rtnl_bench_options_t *options;
+    IpAddr ipAddr;
+    uint8_t *file;
+    rtnl_bench_record_t *records;
+    size_t recordCount;
+
+    OsMutex mutex;
+    systime_t *sentAt;
+    int32_t *latency;
+    uint32_t finished;
+    uint64_t log2Sent;
+    uint64_t log3Sent;
+    uint64_t log3Received;
+    uint64_t unmatched;
+    uint64_t sendErrors;
+    bool_t sseConnected;
+    bool_t sseDone;
+    bool_t stop;
+} rtnl_bench_ctx_t;
+
+typedef struct
+{
+    rtnl_bench_ctx_t *ctx;
+    uint32_t box;
+} rtnl_bench_box_t;
+
+static Socket *rtnl_bench_connect(rtnl_bench_ctx_t *ctx)
+{
+    Socket *socket = socketOpen(SOCKET_TYPE_STREAM, SOCKET_IP_PROTO_TCP);
+
+    if (!socket)
+    {
+        return NULL;
+    }
+    if (socketConnect(socket, &ctx->ipAddr, ctx->options->port) != NO_ERROR)
+    {
+        socketClose(socket);
+        return NULL;
+    }
+    return socket;
+}
+
+static error_t rtnl_bench_send(Socket *socket, const void *data, size_t length)
+{
+    size_t pos = 0;
+
+    while (pos < length)
+    {
+        size_t written = 0;
+        error_t error = socketSend(socket, &((const uint8_t *)data)[pos], length - pos, &written, 0);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+        pos += written;
+    }
+    return NO_ERROR;
+}
+
+static char *rtnl_bench_http_get(rtnl_bench_ctx_t *ctx, const char *uri)
+{
+    Socket *socket = rtnl_bench_connect(ctx);
+    size_t size = 0;
+    size_t used = 0;
+    char *response = NULL;
+
+    if (!socket)
+    {
+        return NULL;
+    }
+    socketSetTimeout(socket, 5000);
+
+    char *request = custom_asprintf("GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", uri, ctx->options->hostname);
+    error_t error = rtnl_bench_send(socket, request, osStrlen(request));
+    osFreeMem(request);
+
+    while (error == NO_ERROR)
+    {
+        if (size - used < RTNL_BENCH_RECV_SIZE + 1)
+        {
+            size += 4 * RTNL_BENCH_RECV_SIZE;
+            char *grown = osAllocMem(size);
+            if (response)
+            {
+                osMemcpy(grown, response, used);
+                osFreeMem(response);
+            }
+            response = grown;
+        }
+        size_t received = 0;
+        error = socketReceive(socket, &response[used], RTNL_BENCH_RECV_SIZE, &received, 0);
+        used += received;
+    }
+    socketClose(socket);
+
+    if (!response)
+    {
+        return NULL;
+    }
+    response[used] = '\0';
+
+    char *body = osStrstr(response, "\r\n\r\n");
+    char *result = body ? strdup(body + 4) : NULL;
+    osFreeMem(response);
+
+    return result;
+}
+
+static bool_t rtnl_bench_get_stats(rtnl_bench_ctx_t *ctx, cJSON **stats)
+{
+    char *body = rtnl_bench_http_get(ctx, "/api/stats");
+
+    *stats = NULL;
+    if (body)
+    {
+        *stats = cJSON_Parse(body);
+        osFreeMem(body);
+    }
+    return *stats != NULL;
+}
+
+static double rtnl_bench_stat(cJSON *stats, const char *name)
+{
+    cJSON *entry = NULL;
+
+    cJSON_ArrayForEach(entry, cJSON_GetObjectItem(stats, "stats"))
+    {
+        cJSON *id = cJSON_GetObjectItem(entry, "ID");
+        if (cJSON_IsString(id) && !osStrcmp(id->valuestring, name))
+        {
+            return cJSON_GetNumberValue(cJSON_GetObjectItem(entry, "value"));
+        }
+    }
+    return 0;
+}
+
+static error_t rtnl_bench_load(rtnl_bench_ctx_t *ctx, const char *path)
+{
+    uint32_t fileSize = 0;
+    size_t read = 0;
+
+    if (fsGetFileSize(path, &fileSize) != NO_ERROR || fileSize < 4)
+    {
+        TRACE_ERROR("Cannot read RTNL log '%s'\r\n", path);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+    if (!file)
+    {
+        return ERROR_FILE_OPENING_FAILED;
+    }
+    ctx->file = osAllocMem(fileSize);
+    error_t error = fsReadFile(file, ctx->file, fileSize, &read);
+    fsCloseFile(file);
+    if (error != NO_ERROR || read != fileSize)
+    {
+        return ERROR_READ_FAILED;
+    }
+
+    /* first pass counts, second pass fills the record table */
+    for (int pass = 0; pass < 2; pass++)
+    {
+        size_t pos = 0;
+        size_t count = 0;
+
+        while (pos + 4 <= fileSize)
+        {
+            const uint8_t *data = &ctx->file[pos];
+            uint32_t protoLength = (uint32_t)((data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3]);
+
+            if (protoLength == 0 || data[0] != 0 || data[1] != 0 || pos + 4 + protoLength > fileSize || 4 + protoLength > RTNL_BENCH_PACKET_MAX)
+            {
+                TRACE_WARNING("Invalid RTNL record at offset %" PRIuSIZE ", stopping\r\n", pos);
+                break;
+            }
+            if (pass == 1)
+            {
+                ctx->records[count].data = data;
+                ctx->records[count].length = 4 + protoLength;
+            }
+            count++;
+            pos += 4 + protoLength;
+        }
+
+        if (pass == 0)
+        {
+            if (count == 0)
+            {
+                return ERROR_INVALID_FILE;
+            }
+            ctx->recordCount = count;
+            ctx->records = osAllocMem(count * sizeof(rtnl_bench_record_t));
+        }
+    }
+
+    TRACE_WARNING("Loaded %" PRIuSIZE " RTNL records from '%s'\r\n", ctx->recordCount, path);
+    return NO_ERROR;
+}
+
+/* builds the packet including the length header, returns 0 on failure */
+static size_t rtnl_bench_build(rtnl_bench_ctx_t *ctx, uint32_t box, uint32_t packet, uint8_t *buffer, bool_t *hasLog2, bool_t *hasLog3)
+{
+    TonieRtnlRPC synthetic = TONIE_RTNL_RPC__INIT;
+    TonieRtnlLog2 log2 = TONIE_RTNL_LOG2__INIT;
+    TonieRtnlRPC *rpc = &synthetic;
+    uint8_t angle[4] = {0};
+    size_t length = 0;
+
+    if (ctx->records)
+    {
+        const rtnl_bench_record_t *record = &ctx->records[packet % ctx->recordCount];
+        rpc = tonie_rtnl_rpc__unpack(NULL, record->length - 4, &record->data[4]);
+        if (!rpc)
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        /* tilt events run through the SSE and MQTT path without touching any file */
+        angle[0] = packet % 90;
+        log2.function_group = RTNL2_FUGR_TILT;
+        log2.function = RTNL2_FUNC_TILT_A_ESP32;
+        log2.field6.data = angle;
+        log2.field6.len = sizeof(angle);
+        rpc->log2 = &log2;
+    }
+
+    /* tag the packet so the SSE event can be matched */
+    if (rpc->log2)
+    {
+        rpc->log2->uptime = box;
+        rpc->log2->sequence = packet;
+    }
+    *hasLog2 = rpc->log2 != NULL;
+    *hasLog3 = rpc->log3 != NULL;
+
+    size_t protoLength = tonie_rtnl_rpc__get_packed_size(rpc);
+    if (protoLength > 0 && 4 + protoLength <= RTNL_BENCH_PACKET_MAX)
+    {
+        buffer[0] = 0;
+        buffer[1] = 0;
+        buffer[2] = (protoLength >> 8) & 0xFF;
+        buffer[3] = protoLength & 0xFF;
+        tonie_rtnl_rpc__pack(rpc, &buffer[4]);
+        length = 4 + protoLength;
+    }
+
+    if (rpc != &synthetic)
+    {
+        tonie_rtnl_rpc__free_unpacked(rpc, NULL);
+    }
+    return length;
+}
+
+static void rtnl_bench_box_task(void *param)
+{
+    rtnl_bench_box_t *box = (rtnl_bench_box_t *)param;
+    rtnl_bench_ctx_t *ctx = box->ctx;
+    const rtnl_bench_options_t *options = ctx->options;
+    uint8_t *buffer = osAllocMem(RTNL_BENCH_PACKET_MAX);
+    Socket *socket = rtnl_bench_connect(ctx);
+
+    if (!socket)
+    {
+        TRACE_ERROR("Box %" PRIu32 ": connection failed\r\n", box->box);
+    }
+    else
+    {
+        systime_t start = osGetSystemTime();
+
+        for (uint32_t packet = 0; packet < options->count && !ctx->stop; packet++)
+        {
+            size_t index = (size_t)box->box * options->count + packet;
+            bool_t hasLog2 = false;
+            bool_t hasLog3 = false;
+
+            if (options->rate)
+            {
+                systime_t due = start + (systime_t)((uint64_t)packet * 1000 / options->rate);
+                systime_t now = osGetSystemTime();
+                if (due > now)
+                {
+                    osDelayTask(due - now);
+                }
+            }
+
+            size_t length = rtnl_bench_build(ctx, box->box, packet, buffer, &hasLog2, &hasLog3);
+            if (!length)
+            {
+                continue;
+            }
+
+            if (hasLog2)
+            {
+                osAcquireMutex(&ctx->mutex);
+                ctx->sentAt[index] = osGetSystemTime();
+                osReleaseMutex(&ctx->mutex);
+            }
+
+            error_t error = rtnl_bench_send(socket, buffer, length);
+
+            osAcquireMutex(&ctx->mutex);
+            if (error != NO_ERROR)
+            {
+                ctx->sentAt[index] = 0;
+                ctx->sendErrors++;
+            }
+            else
+            {
+                ctx->log2Sent += hasLog2 ? 1 : 0;
+                ctx->log3Sent += hasLog3 ? 1 : 0;
+            }
+            osReleaseMutex(&ctx->mutex);
+
+            if (error != NO_ERROR)
+            {
+                TRACE_ERROR("Box %" PRIu32 ": send failed with %s\r\n", box->box, error2text(error));
+                break;
+            }
+        }
+        socketClose(socket);
+    }
+    osFreeMem(buffer);
+
+    osAcquireMutex(&ctx->mutex);
+    ctx->finished++;
+    osReleaseMutex(&ctx->mutex);
+
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+static void rtnl_bench_sse_line(rtnl_bench_ctx_t *ctx, const char *line)
+{
+    systime_t now = osGetSystemTime();
+
+    if (osStrstr(line, "\"rtnl-raw-log3\""))
+    {
+        osAcquireMutex(&ctx->mutex);
+        ctx->log3Received++;
+        osReleaseMutex(&ctx->mutex);
+        return;
+    }
+    if (!osStrstr(line, "\"rtnl-raw-log2\""))
+    {
+        return;
+    }
+
+    const char *uptime = osStrstr(line, "\"uptime\": ");
+    const char *sequence = osStrstr(line, "\"sequence\": ");
+    if (!uptime || !sequence)
+    {
+        return;
+    }
+    uint64_t box = strtoull(uptime + osStrlen("\"uptime\": "), NULL, 10);
+    uint32_t packet = strtoul(sequence + osStrlen("\"sequence\": "), NULL, 10);
+
+    osAcquireMutex(&ctx->mutex);
+    if (box < ctx->options->boxes && packet < ctx->options->count)
+    {
+        size_t index = (size_t)box * ctx->options->count + packet;
+        if (ctx->sentAt[index] && ctx->latency[index] < 0)
+        {
+            ctx->latency[index] = (int32_t)(now - ctx->sentAt[index]);
+        }
+        else
+        {
+            ctx->unmatched++;
+        }
+    }
+    else
+    {
+        ctx->unmatched++;
+    }
+    osReleaseMutex(&ctx->mutex);
+}
+
+static void rtnl_bench_sse_task(void *param)
+{
+    rtnl_bench_ctx_t *ctx = (rtnl_bench_ctx_t *)param;
+    char *line = osAllocMem(RTNL_BENCH_LINE_MAX);
+    size_t linePos = 0;
+    Socket *socket = rtnl_bench_connect(ctx);
+
+    if (socket)
+    {
+        char *request = custom_asprintf("GET /api/sse HTTP/1.0\r\nHost: %s\r\n\r\n", ctx->options->hostname);
+        error_t error = rtnl_bench_send(socket, request, osStrlen(request));
+        osFreeMem(request);
+
+        /* short timeout so the stop flag gets checked regularly */
+        socketSetTimeout(socket, 250);
+
+        osAcquireMutex(&ctx->mutex);
+        ctx->sseConnected = (error == NO_ERROR);
+        osReleaseMutex(&ctx->mutex);
+
+        while (error == NO_ERROR && !ctx->stop)
+        {
+            char chunk[RTNL_BENCH_RECV_SIZE];
+            size_t received = 0;
+
+            error = socketReceive(socket, chunk, sizeof(chunk), &received, 0);
+            if (error == ERROR_TIMEOUT)
+            {
+                error = NO_ERROR;
+                continue;
+            }
+            for (size_t pos = 0; pos < received; pos++)
+            {
+                if (chunk[pos] == '\n')
+                {
+                    line[linePos] = '\0';
+                    rtnl_bench_sse_line(ctx, line);
+                    linePos = 0;
+                }
+                else if (linePos < RTNL_BENCH_LINE_MAX - 1)
+                {
+                    line[linePos++] = chunk[pos];
+                }
+            }
+        }
+        if (error != NO_ERROR && !ctx->stop)
+        {
+            TRACE_ERROR("SSE connection lost: %s\r\n", error2text(error));
+        }
+        socketClose(socket);
+    }
+    else
+    {
+        TRACE_ERROR("SSE connection failed\r\n");
+    }
+    osFreeMem(line);
+
+    osAcquireMutex(&ctx->mutex);
+    ctx->sseDone = true;
+    osReleaseMutex(&ctx->mutex);
+
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+static int rtnl_bench_compare(const void *a, const void *b)
+{
+    return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+static void rtnl_bench_report(rtnl_bench_ctx_t *ctx, systime_t elapsed, cJSON *statsBefore, cJSON *statsAfter)
+{
+    size_t total = (size_t)ctx->options->boxes * ctx->options->count;
+    int32_t *latencies = osAllocMem(total * sizeof(int32_t) + 1);
+    size_t received = 0;
+    size_t delayed = 0;
+    uint64_t sum = 0;
+
+    for (size_t pos = 0; pos < total; pos++)
+    {
+        if (ctx->latency[pos] >= 0)
+        {
+            latencies[received++] = ctx->latency[pos];
+            sum += ctx->latency[pos];
+            if (ctx->latency[pos] > RTNL_BENCH_DELAYED_MS)
+            {
+                delayed++;
+            }
+        }
+    }
+    qsort(latencies, received, sizeof(int32_t), &rtnl_bench_compare);
+
+    uint64_t sent = ctx->log2Sent + ctx->log3Sent;
+    TRACE_WARNING("**********************************\r\n");
+    TRACE_WARNING("Boxes:            %" PRIu32 "\r\n", ctx->options->boxes);
+    TRACE_WARNING("Packets sent:     %" PRIu64 " (%" PRIu64 " send errors)\r\n", sent, ctx->sendErrors);
+    TRACE_WARNING("Duration:         %" PRIu32 " ms\r\n", (uint32_t)elapsed);
+    TRACE_WARNING("Throughput:       %" PRIu64 " packets/s\r\n", elapsed ? sent * 1000 / elapsed : sent);
+    TRACE_WARNING("SSE log2 events:  %" PRIuSIZE "/%" PRIu64 " received, %" PRIu64 " missing, %" PRIuSIZE " delayed >%d ms, %" PRIu64 " unmatched\r\n",
+                  received, ctx->log2Sent, ctx->log2Sent - received, delayed, RTNL_BENCH_DELAYED_MS, ctx->unmatched);
+    TRACE_WARNING("SSE log3 events:  %" PRIu64 "/%" PRIu64 " received\r\n", ctx->log3Received, ctx->log3Sent);
+    if (received > 0)
+    {
+        TRACE_WARNING("Latency (ms):     min %" PRId32 ", avg %" PRIu64 ", p50 %" PRId32 ", p90 %" PRId32 ", p99 %" PRId32 ", max %" PRId32 "\r\n",
+                      latencies[0], sum / received, latencies[received / 2], latencies[received * 90 / 100], latencies[received * 99 / 100], latencies[received - 1]);
+    }
+    if (statsBefore && statsAfter)
+    {
+        const char *names[] = {"rtnl_packets", "sse_dropped", "mqtt_dropped"};
+        for (size_t pos = 0; pos < sizeof(names) / sizeof(names[0]); pos++)
+        {
+            TRACE_WARNING("Server %-12s %.0f\r\n", names[pos], rtnl_bench_stat(statsAfter, names[pos]) - rtnl_bench_stat(statsBefore, names[pos]));
+        }
+    }
+    TRACE_WARNING("**********************************\r\n");
+
+    osFreeMem(latencies);
+}
+
+error_t rtnl_bench_run(const rtnl_bench_options_t *options)
+{
+    rtnl_bench_ctx_t ctx;
+    cJSON *statsBefore = NULL;
+    cJSON *statsAfter = NULL;
+    error_t error = NO_ERROR;
+
+    osMemset(&ctx, 0, sizeof(ctx));
+    ctx.options = options;
+
+    if (options->boxes == 0 || options->count == 0)
+    {
+        TRACE_ERROR("Box and packet count must not be zero\r\n");
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    void *resolve_ctx = resolve_host(options->hostname);
+    if (!resolve_ctx || !resolve_get_ip(resolve_ctx, 0, &ctx.ipAddr))
+    {
+        TRACE_ERROR("Failed to resolve '%s'\r\n", options->hostname);
+        if (resolve_ctx)
+        {
+            resolve_free(resolve_ctx);
+        }
+        return ERROR_ADDRESS_NOT_FOUND;
+    }
+    resolve_free(resolve_ctx);
+
+    if (osStrcmp(options->source, RTNL_BENCH_SYNTHETIC))
+    {
+        error = rtnl_bench_load(&ctx, options->source);
+        if (error != NO_ERROR)
+        {
+            osFreeMem(ctx.file);
+            osFreeMem(ctx.records);
+            return error;
+        }
+    }
+
+    size_t total = (size_t)options->boxes * options->count;
+    ctx.sentAt = osAllocMem(total * sizeof(systime_t));
+    ctx.latency = osAllocMem(total * sizeof(int32_t));
+    rtnl_bench_box_t *boxes = osAllocMem(options->boxes * sizeof(rtnl_bench_box_t));
+    if (!ctx.sentAt || !ctx.latency || !boxes)
+    {
+        TRACE_ERROR("Not enough memory for %" PRIuSIZE " packets\r\n", total);
+        osFreeMem(ctx.sentAt);
+        osFreeMem(ctx.latency);
+        osFreeMem(boxes);
+        osFreeMem(ctx.file);
+        osFreeMem(ctx.records);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    osMemset(ctx.sentAt, 0, total * sizeof(systime_t));
+    for (size_t pos = 0; pos < total; pos++)
+    {
+        ctx.latency[pos] = -1;
+    }
+    osCreateMutex(&ctx.mutex);
+
+    if (!rtnl_bench_get_stats(&ctx, &statsBefore))
+    {
+        TRACE_WARNING("Could not read /api/stats, server side counters will be missing\r\n");
+    }
+
+    if (osCreateTask("RTNL bench SSE", &rtnl_bench_sse_task, &ctx, 16 * 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        ctx.sseDone = true;
+    }
+    for (int wait = 0; wait < 50 && !ctx.sseConnected && !ctx.sseDone; wait++)
+    {
+        osDelayTask(100);
+    }
+    /* give the server some time to register the subscriber */
+    osDelayTask(500);
+
+    TRACE_WARNING("Sending %" PRIu32 " packets from %" PRIu32 " boxes to %s:%" PRIu16 "\r\n", options->count, options->boxes, options->hostname, options->port);
+    systime_t start = osGetSystemTime();
+    for (uint32_t box = 0; box < options->boxes; box++)
+    {
+        boxes[box].ctx = &ctx;
+        boxes[box].box = box;
+        if (osCreateTask("RTNL bench box", &rtnl_bench_box_task, &boxes[box], 16 * 1024, 0) == OS_INVALID_TASK_ID)
+        {
+            TRACE_ERROR("Failed to start box %" PRIu32 "\r\n", box);
+            osAcquireMutex(&ctx.mutex);
+            ctx.finished++;
+            osReleaseMutex(&ctx.mutex);
+        }
+    }
+    while (ctx.finished < options->boxes)
+    {
+        osDelayTask(10);
+    }
+    systime_t elapsed = osGetSystemTime() - start;
+
+    /* wait for outstanding events, stop early once everything arrived */
+    for (systime_t waited = 0; waited < RTNL_BENCH_GRACE_MS; waited += 100)
+    {
+        size_t received = 0;
+        osAcquireMutex(&ctx.mutex);
+        for (size_t pos = 0; pos < total; pos++)
+        {
+            received += (ctx.latency[pos] >= 0) ? 1 : 0;
+        }
+        bool_t complete = received >= ctx.log2Sent && ctx.log3Received >= ctx.log3Sent;
+        osReleaseMutex(&ctx.mutex);
+        if (complete)
+        {
+            break;
+        }
+        osDelayTask(100);
+    }
+    ctx.stop = true;
+    while (!ctx.sseDone)
+    {
+        osDelayTask(10);
+    }
+
+    rtnl_bench_get_stats(&ctx, &statsAfter);
+    rtnl_bench_report(&ctx, elapsed, statsBefore, statsAfter);
+
+    for (size_t pos = 0; pos < total; pos++)
+    {
+        if (ctx.sentAt[pos] && ctx.latency[pos] < 0)
+        {
+            error = ERROR_FAILURE;
+            break;
+        }
+    }
+    if (ctx.sendErrors)
+    {
+        error = ERROR_FAILURE;
+    }
+
+    cJSON_Delete(statsBefore);
+    cJSON_Delete(statsAfter);
+    osDeleteMutex(&ctx.mutex);
+    osFreeMem(boxes);
+    osFreeMem(ctx.sentAt);
+    osFreeMem(ctx.latency);
+    osFreeMem(ctx.records);
+    osFreeMem(ctx.file);
+
+    return error;
+}
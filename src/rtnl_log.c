@@ -0,0 +1,1018 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "rtnl_log.h"
+
+#include "debug.h"
+#include "fs_ext.h"
+#include "mutex_manager.h"
+#include "server_helpers.h"
+
+#define RTNL_LOG_PREFIX "rtnl_"
+#define RTNL_LOG_SEGMENT_EXT ".seg"
+#define RTNL_LOG_INDEX_EXT ".idx"
+#define RTNL_LOG_KEYS_EXT ".keys"
+#define RTNL_LOG_READ_ENTRIES 64
+
+typedef struct
+{
+    bool_t initialized;
+    char *dir;
+    uint32_t segment;
+    uint32_t segmentSize;
+    uint64_t lastTimestamp;
+} rtnl_log_state_t;
+
+static rtnl_log_state_t rtnl_log_state;
+
+static char *rtnl_log_path(const char *dir, uint32_t segment, const char *ext)
+{
+    return custom_asprintf("%s%c" RTNL_LOG_PREFIX "%08" PRIu32 "%s", dir, PATH_SEPARATOR, segment, ext);
+}
+
+static bool_t rtnl_log_parse_segment(const char *name, uint32_t *segment)
+{
+    size_t prefixLen = osStrlen(RTNL_LOG_PREFIX);
+    size_t nameLen = osStrlen(name);
+
+    if (nameLen <= prefixLen + osStrlen(RTNL_LOG_INDEX_EXT) || osStrncmp(name, RTNL_LOG_PREFIX, prefixLen))
+    {
+        return false;
+    }
+    if (osStrcmp(&name[nameLen - osStrlen(RTNL_LOG_INDEX_EXT)], RTNL_LOG_INDEX_EXT))
+    {
+        return false;
+    }
+
+    char *end = NULL;
+    *segment = (uint32_t)strtoul(&name[prefixLen], &end, 10);
+
+    return end == &name[nameLen - osStrlen(RTNL_LOG_INDEX_EXT)];
+}
+
+static bool_t rtnl_log_scan(const char *dir, uint32_t *first, uint32_t *last)
+{
+    FsDir *fsDir = fsOpenDir(dir);
+    bool_t found = false;
+
+    if (!fsDir)
+    {
+        return false;
+    }
+
+    while (true)
+    {
+        FsDirEntry entry;
+        uint32_t segment;
+
+        if (fsReadDir(fsDir, &entry) != NO_ERROR)
+        {
+            break;
+        }
+        if ((entry.attributes & FS_FILE_ATTR_DIRECTORY) || !rtnl_log_parse_segment(entry.name, &segment))
+        {
+            continue;
+        }
+        if (!found || segment < *first)
+        {
+            *first = segment;
+        }
+        if (!found || segment > *last)
+        {
+            *last = segment;
+        }
+        found = true;
+    }
+    fsCloseDir(fsDir);
+
+    return found;
+}
+
+static uint32_t rtnl_log_entry_count(const char *indexPath)
+{
+    uint32_t size = 0;
+
+    if (fsGetFileSize(indexPath, &size) != NO_ERROR || size < sizeof(rtnl_log_header_t))
+    {
+        return 0;
+    }
+    return (size - sizeof(rtnl_log_header_t)) / sizeof(rtnl_log_index_t);
+}
+
+static error_t rtnl_log_read_entries(FsFile *file, uint32_t pos, rtnl_log_index_t *entries, uint32_t count)
+{
+    size_t read = 0;
+    error_t error = fsSeekFile(file, sizeof(rtnl_log_header_t) + pos * sizeof(rtnl_log_index_t), FS_SEEK_SET);
+
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+    error = fsReadFile(file, entries, count * sizeof(rtnl_log_index_t), &read);
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+    if (read != count * sizeof(rtnl_log_index_t))
+    {
+        return ERROR_END_OF_FILE;
+    }
+    return NO_ERROR;
+}
+
+static error_t rtnl_log_write_header(const char *path, const char *magic, uint32_t segment)
+{
+    rtnl_log_header_t header;
+
+    osMemset(&header, 0, sizeof(header));
+    osMemcpy(header.magic, magic, sizeof(header.magic));
+    header.version = RTNL_LOG_VERSION;
+    header.segment = segment;
+    header.created = (uint64_t)time(NULL);
+
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    if (!file)
+    {
+        TRACE_ERROR("Could not create RTNL log file '%s'\r\n", path);
+        return ERROR_FILE_OPENING_FAILED;
+    }
+    error_t error = fsWriteFile(file, &header, sizeof(header));
+    fsCloseFile(file);
+
+    return error;
+}
+
+/* keys of a sealed segment with the position table, see rtnl_log_key_t */
+typedef struct
+{
+    rtnl_log_key_t *keys;
+    size_t keyCount;
+    uint32_t *positions;
+    size_t positionCount;
+} rtnl_log_keys_t;
+
+/* one occurrence of a key while building, in index order */
+typedef struct
+{
+    uint32_t key;
+    uint32_t pos;
+} rtnl_log_key_ref_t;
+
+static void rtnl_log_keys_free(rtnl_log_keys_t *table)
+{
+    osFreeMem(table->keys);
+    osFreeMem(table->positions);
+    osMemset(table, 0, sizeof(*table));
+}
+
+/* makes room for one more item, doubling the capacity */
+static error_t rtnl_log_grow(void **items, size_t *capacity, size_t count, size_t size)
+{
+    if (count < *capacity)
+    {
+        return NO_ERROR;
+    }
+
+    size_t grownCapacity = *capacity ? *capacity * 2 : 16;
+    void *grown = osAllocMem(grownCapacity * size);
+    if (!grown)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+    if (count > 0)
+    {
+        osMemcpy(grown, *items, count * size);
+    }
+    osFreeMem(*items);
+    *items = grown;
+    *capacity = grownCapacity;
+
+    return NO_ERROR;
+}
+
+static bool_t rtnl_log_key_equal(const rtnl_log_key_t *key, const rtnl_log_key_t *other)
+{
+    if (key->kind != other->kind)
+    {
+        return false;
+    }
+    switch (key->kind)
+    {
+    case RTNL_LOG_KEY_BOX:
+        return !osStrncmp(key->box, other->box, sizeof(key->box));
+    case RTNL_LOG_KEY_LOG2:
+        return key->function_group == other->function_group && key->function == other->function;
+    default:
+        return key->log3_type == other->log3_type;
+    }
+}
+
+static error_t rtnl_log_keys_add(rtnl_log_keys_t *table, size_t *keyCapacity, rtnl_log_key_ref_t **refs, size_t *refCount, size_t *refCapacity, const rtnl_log_key_t *key, uint32_t pos)
+{
+    size_t index = 0;
+    while (index < table->keyCount && !rtnl_log_key_equal(&table->keys[index], key))
+    {
+        index++;
+    }
+
+    if (index == table->keyCount)
+    {
+        error_t error = rtnl_log_grow((void **)&table->keys, keyCapacity, table->keyCount, sizeof(rtnl_log_key_t));
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+        table->keys[index] = *key;
+        table->keys[index].count = 0;
+        table->keyCount++;
+    }
+
+    error_t error = rtnl_log_grow((void **)refs, refCapacity, *refCount, sizeof(rtnl_log_key_ref_t));
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+    (*refs)[*refCount].key = index;
+    (*refs)[*refCount].pos = pos;
+    (*refCount)++;
+    table->keys[index].count++;
+
+    return NO_ERROR;
+}
+
+/* lays out the collected occurrences per key, each list stays in index order */
+static error_t rtnl_log_keys_place(rtnl_log_keys_t *table, const rtnl_log_key_ref_t *refs, size_t refCount)
+{
+    uint32_t offset = 0;
+    for (size_t i = 0; i < table->keyCount; i++)
+    {
+        table->keys[i].offset = offset;
+        offset += table->keys[i].count;
+    }
+
+    table->positions = osAllocMem(refCount * sizeof(uint32_t) + 1);
+    if (!table->positions)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < table->keyCount; i++)
+    {
+        /* used as fill cursor, restored below */
+        table->keys[i].count = 0;
+    }
+    for (size_t i = 0; i < refCount; i++)
+    {
+        rtnl_log_key_t *key = &table->keys[refs[i].key];
+        table->positions[key->offset + key->count++] = refs[i].pos;
+    }
+    table->positionCount = refCount;
+
+    return NO_ERROR;
+}
+
+/* collects the keys and their positions of all entries of a segment index */
+static error_t rtnl_log_keys_build(const char *indexPath, rtnl_log_keys_t *table)
+{
+    uint32_t count = rtnl_log_entry_count(indexPath);
+    FsFile *file = fsOpenFile(indexPath, FS_FILE_MODE_READ);
+    rtnl_log_index_t *entries = osAllocMem(RTNL_LOG_READ_ENTRIES * sizeof(rtnl_log_index_t));
+    rtnl_log_key_ref_t *refs = NULL;
+    size_t refCount = 0;
+    size_t refCapacity = 0;
+    size_t keyCapacity = 0;
+    error_t error = (file && entries) ? NO_ERROR : ERROR_FILE_OPENING_FAILED;
+
+    osMemset(table, 0, sizeof(*table));
+    for (uint32_t pos = 0; pos < count && error == NO_ERROR;)
+    {
+        uint32_t chunk = count - pos;
+        if (chunk > RTNL_LOG_READ_ENTRIES)
+        {
+            chunk = RTNL_LOG_READ_ENTRIES;
+        }
+        error = rtnl_log_read_entries(file, pos, entries, chunk);
+
+        for (uint32_t i = 0; i < chunk && error == NO_ERROR; i++, pos++)
+        {
+            rtnl_log_key_t key;
+
+            osMemset(&key, 0, sizeof(key));
+            key.kind = RTNL_LOG_KEY_BOX;
+            osMemcpy(key.box, entries[i].box, sizeof(key.box));
+            error = rtnl_log_keys_add(table, &keyCapacity, &refs, &refCount, &refCapacity, &key, pos);
+
+            if (error == NO_ERROR && (entries[i].flags & RTNL_LOG_FLAG_LOG2))
+            {
+                osMemset(&key, 0, sizeof(key));
+                key.kind = RTNL_LOG_KEY_LOG2;
+                key.function_group = entries[i].function_group;
+                key.function = entries[i].function;
+                error = rtnl_log_keys_add(table, &keyCapacity, &refs, &refCount, &refCapacity, &key, pos);
+            }
+            if (error == NO_ERROR && (entries[i].flags & RTNL_LOG_FLAG_LOG3))
+            {
+                osMemset(&key, 0, sizeof(key));
+                key.kind = RTNL_LOG_KEY_LOG3;
+                key.log3_type = entries[i].log3_type;
+                error = rtnl_log_keys_add(table, &keyCapacity, &refs, &refCount, &refCapacity, &key, pos);
+            }
+        }
+    }
+    if (error == NO_ERROR)
+    {
+        error = rtnl_log_keys_place(table, refs, refCount);
+    }
+    if (file)
+    {
+        fsCloseFile(file);
+    }
+    osFreeMem(entries);
+    osFreeMem(refs);
+    if (error != NO_ERROR)
+    {
+        rtnl_log_keys_free(table);
+    }
+
+    return error;
+}
+
+/* builds and stores the keys of a sealed segment, written to a temporary file so readers never see a partial table */
+static error_t rtnl_log_keys_seal(const char *dir, uint32_t segment, rtnl_log_keys_t *table)
+{
+    char *indexPath = rtnl_log_path(dir, segment, RTNL_LOG_INDEX_EXT);
+    char *keysPath = rtnl_log_path(dir, segment, RTNL_LOG_KEYS_EXT);
+    char *tmpPath = custom_asprintf("%s.tmp", keysPath);
+
+    error_t error = rtnl_log_keys_build(indexPath, table);
+    if (error == NO_ERROR)
+    {
+        rtnl_log_keys_header_t header;
+
+        osMemset(&header, 0, sizeof(header));
+        osMemcpy(header.header.magic, RTNL_LOG_KEYS_MAGIC, sizeof(header.header.magic));
+        header.header.version = RTNL_LOG_KEYS_VERSION;
+        header.header.segment = segment;
+        header.header.created = (uint64_t)time(NULL);
+        header.keyCount = table->keyCount;
+        header.positionCount = table->positionCount;
+
+        FsFile *file = fsOpenFile(tmpPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+        error = file ? fsWriteFile(file, &header, sizeof(header)) : ERROR_FILE_OPENING_FAILED;
+        if (error == NO_ERROR && table->keyCount > 0)
+        {
+            error = fsWriteFile(file, table->keys, table->keyCount * sizeof(rtnl_log_key_t));
+        }
+        if (error == NO_ERROR && table->positionCount > 0)
+        {
+            error = fsWriteFile(file, table->positions, table->positionCount * sizeof(uint32_t));
+        }
+        if (file)
+        {
+            fsCloseFile(file);
+        }
+    }
+    if (error == NO_ERROR)
+    {
+        error = fsMoveFile(tmpPath, keysPath, true);
+    }
+    if (error != NO_ERROR)
+    {
+        fsDeleteFile(tmpPath);
+    }
+
+    osFreeMem(indexPath);
+    osFreeMem(keysPath);
+    osFreeMem(tmpPath);
+
+    return error;
+}
+
+static bool_t rtnl_log_keys_load(const char *dir, uint32_t segment, rtnl_log_keys_t *table)
+{
+    char *keysPath = rtnl_log_path(dir, segment, RTNL_LOG_KEYS_EXT);
+    uint32_t size = 0;
+    bool_t loaded = false;
+
+    osMemset(table, 0, sizeof(*table));
+    if (fsGetFileSize(keysPath, &size) == NO_ERROR && size >= sizeof(rtnl_log_keys_header_t))
+    {
+        FsFile *file = fsOpenFile(keysPath, FS_FILE_MODE_READ);
+        rtnl_log_keys_header_t header;
+        size_t read = 0;
+
+        /* tables of an older version are rebuilt by the caller */
+        if (file && fsReadFile(file, &header, sizeof(header), &read) == NO_ERROR && read == sizeof(header) &&
+            !osMemcmp(header.header.magic, RTNL_LOG_KEYS_MAGIC, sizeof(header.header.magic)) && header.header.version == RTNL_LOG_KEYS_VERSION &&
+            size == sizeof(header) + (uint64_t)header.keyCount * sizeof(rtnl_log_key_t) + (uint64_t)header.positionCount * sizeof(uint32_t))
+        {
+            table->keys = osAllocMem(header.keyCount * sizeof(rtnl_log_key_t) + 1);
+            table->positions = osAllocMem(header.positionCount * sizeof(uint32_t) + 1);
+            loaded = table->keys && table->positions;
+            if (loaded && header.keyCount > 0)
+            {
+                loaded = fsReadFile(file, table->keys, header.keyCount * sizeof(rtnl_log_key_t), &read) == NO_ERROR && read == header.keyCount * sizeof(rtnl_log_key_t);
+            }
+            if (loaded && header.positionCount > 0)
+            {
+                loaded = fsReadFile(file, table->positions, header.positionCount * sizeof(uint32_t), &read) == NO_ERROR && read == header.positionCount * sizeof(uint32_t);
+            }
+            table->keyCount = header.keyCount;
+            table->positionCount = header.positionCount;
+            for (size_t i = 0; loaded && i < table->keyCount; i++)
+            {
+                loaded = (uint64_t)table->keys[i].offset + table->keys[i].count <= table->positionCount;
+            }
+        }
+        if (file)
+        {
+            fsCloseFile(file);
+        }
+    }
+    osFreeMem(keysPath);
+
+    if (!loaded)
+    {
+        rtnl_log_keys_free(table);
+    }
+    return loaded;
+}
+
+static bool_t rtnl_log_key_wanted(const rtnl_log_query_t *query, const rtnl_log_key_t *key, uint32_t kind)
+{
+    if (key->kind != kind)
+    {
+        return false;
+    }
+    switch (kind)
+    {
+    case RTNL_LOG_KEY_BOX:
+        return !osStrncmp(key->box, query->box, sizeof(key->box));
+    case RTNL_LOG_KEY_LOG2:
+        return (query->function_group < 0 || key->function_group == query->function_group) &&
+               (query->function < 0 || key->function == query->function);
+    default:
+        return key->log3_type == query->log3_type;
+    }
+}
+
+static int rtnl_log_position_compare(const void *a, const void *b)
+{
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+
+    return (left > right) - (left < right);
+}
+
+/**
+ * Candidate index positions of a sealed segment for the box and event type filters,
+ * taken from the key of the filtered kind with the fewest entries. False if the
+ * segment has to be scanned completely, because nothing is filtered or it has no key table.
+ */
+static bool_t rtnl_log_keys_positions(const rtnl_log_query_t *query, const char *dir, uint32_t segment, uint32_t **positions, size_t *positionCount)
+{
+    rtnl_log_keys_t table;
+    bool_t filterBox = query->box && query->box[0];
+    bool_t filterLog2 = query->function_group >= 0 || query->function >= 0;
+    bool_t filterLog3 = query->log3_type >= 0;
+
+    *positions = NULL;
+    *positionCount = 0;
+    if (!filterBox && !filterLog2 && !filterLog3)
+    {
+        return false;
+    }
+    if (!rtnl_log_keys_load(dir, segment, &table))
+    {
+        /* segments sealed before keys existed get them on first use */
+        mutex_lock(MUTEX_RTNL_FILE);
+        error_t error = rtnl_log_keys_seal(dir, segment, &table);
+        mutex_unlock(MUTEX_RTNL_FILE);
+        if (error != NO_ERROR)
+        {
+            rtnl_log_keys_free(&table);
+            return false;
+        }
+    }
+
+    uint32_t kinds[3] = {filterBox ? RTNL_LOG_KEY_BOX : 0, filterLog2 ? RTNL_LOG_KEY_LOG2 : 0, filterLog3 ? RTNL_LOG_KEY_LOG3 : 0};
+    uint32_t best = 0;
+    size_t bestCount = 0;
+    for (size_t i = 0; i < 3; i++)
+    {
+        size_t count = 0;
+        if (kinds[i] == 0)
+        {
+            continue;
+        }
+        for (size_t k = 0; k < table.keyCount; k++)
+        {
+            if (rtnl_log_key_wanted(query, &table.keys[k], kinds[i]))
+            {
+                count += table.keys[k].count;
+            }
+        }
+        if (best == 0 || count < bestCount)
+        {
+            best = kinds[i];
+            bestCount = count;
+        }
+    }
+
+    /* an empty list skips the segment */
+    if (bestCount > 0)
+    {
+        *positions = osAllocMem(bestCount * sizeof(uint32_t));
+    }
+    if (*positions)
+    {
+        size_t keys = 0;
+        for (size_t k = 0; k < table.keyCount; k++)
+        {
+            const rtnl_log_key_t *key = &table.keys[k];
+            if (rtnl_log_key_wanted(query, key, best))
+            {
+                osMemcpy(&(*positions)[*positionCount], &table.positions[key->offset], key->count * sizeof(uint32_t));
+                *positionCount += key->count;
+                keys++;
+            }
+        }
+        /* a log2 filter on only the group or function can match several keys */
+        if (keys > 1)
+        {
+            qsort(*positions, *positionCount, sizeof(uint32_t), &rtnl_log_position_compare);
+        }
+    }
+    rtnl_log_keys_free(&table);
+
+    /* without memory for the list the segment is scanned */
+    return bestCount == 0 || *positions != NULL;
+}
+
+static error_t rtnl_log_start_segment(uint32_t segment)
+{
+    char *segmentPath = rtnl_log_path(rtnl_log_state.dir, segment, RTNL_LOG_SEGMENT_EXT);
+    char *indexPath = rtnl_log_path(rtnl_log_state.dir, segment, RTNL_LOG_INDEX_EXT);
+    char *keysPath = rtnl_log_path(rtnl_log_state.dir, segment, RTNL_LOG_KEYS_EXT);
+
+    /* keys of an earlier run of this segment would hide the new entries */
+    fsDeleteFile(keysPath);
+    error_t error = rtnl_log_write_header(segmentPath, RTNL_LOG_SEGMENT_MAGIC, segment);
+    if (error == NO_ERROR)
+    {
+        error = rtnl_log_write_header(indexPath, RTNL_LOG_INDEX_MAGIC, segment);
+    }
+    if (error == NO_ERROR)
+    {
+        TRACE_INFO("Started RTNL log segment %" PRIu32 "\r\n", segment);
+        rtnl_log_state.segment = segment;
+        rtnl_log_state.segmentSize = sizeof(rtnl_log_header_t);
+    }
+
+    osFreeMem(segmentPath);
+    osFreeMem(indexPath);
+    osFreeMem(keysPath);
+
+    return error;
+}
+
+static error_t rtnl_log_open(const char *dir)
+{
+    uint32_t first = 0;
+    uint32_t last = 0;
+
+    if (rtnl_log_state.initialized && !osStrcmp(rtnl_log_state.dir, dir))
+    {
+        return NO_ERROR;
+    }
+
+    osFreeMem(rtnl_log_state.dir);
+    osMemset(&rtnl_log_state, 0, sizeof(rtnl_log_state));
+    rtnl_log_state.dir = strdup(dir);
+
+    if (!fsDirExists(dir))
+    {
+        fsCreateDirEx(dir, true);
+    }
+
+    if (!rtnl_log_scan(dir, &first, &last))
+    {
+        error_t error = rtnl_log_start_segment(0);
+        rtnl_log_state.initialized = (error == NO_ERROR);
+        return error;
+    }
+
+    /* continue the newest segment */
+    char *segmentPath = rtnl_log_path(dir, last, RTNL_LOG_SEGMENT_EXT);
+    char *indexPath = rtnl_log_path(dir, last, RTNL_LOG_INDEX_EXT);
+    uint32_t size = 0;
+    uint32_t count = rtnl_log_entry_count(indexPath);
+
+    rtnl_log_state.segment = last;
+    if (fsGetFileSize(segmentPath, &size) != NO_ERROR || count == 0)
+    {
+        size = 0;
+    }
+    else
+    {
+        FsFile *file = fsOpenFile(indexPath, FS_FILE_MODE_READ);
+        rtnl_log_index_t entry;
+        if (file && rtnl_log_read_entries(file, count - 1, &entry, 1) == NO_ERROR)
+        {
+            rtnl_log_state.lastTimestamp = entry.timestamp;
+        }
+        if (file)
+        {
+            fsCloseFile(file);
+        }
+    }
+    rtnl_log_state.segmentSize = size;
+
+    osFreeMem(segmentPath);
+    osFreeMem(indexPath);
+
+    /* a segment without valid header gets replaced by a fresh one */
+    if (size < sizeof(rtnl_log_header_t))
+    {
+        error_t error = rtnl_log_start_segment(last + 1);
+        rtnl_log_state.initialized = (error == NO_ERROR);
+        return error;
+    }
+
+    rtnl_log_state.initialized = true;
+    return NO_ERROR;
+}
+
+void rtnl_log_query_init(rtnl_log_query_t *query)
+{
+    osMemset(query, 0, sizeof(*query));
+    query->function_group = -1;
+    query->function = -1;
+    query->log3_type = -1;
+    query->limit = RTNL_LOG_QUERY_LIMIT_DEFAULT;
+}
+
+error_t rtnl_log_append(settings_t *settings, const uint8_t *record, size_t length, const TonieRtnlRPC *rpc)
+{
+    settings_t *settings_global = get_settings();
+    rtnl_log_index_t entry;
+    error_t error = NO_ERROR;
+
+    osMemset(&entry, 0, sizeof(entry));
+    if (rpc->log2)
+    {
+        entry.flags |= RTNL_LOG_FLAG_LOG2;
+        entry.function_group = rpc->log2->function_group;
+        entry.function = rpc->log2->function;
+    }
+    if (rpc->log3)
+    {
+        entry.flags |= RTNL_LOG_FLAG_LOG3;
+        entry.log3_type = rpc->log3->field2;
+    }
+    osStrncpy(entry.box, settings->internal.overlayUniqueId, sizeof(entry.box) - 1);
+
+    mutex_lock(MUTEX_RTNL_FILE);
+    do
+    {
+        error = rtnl_log_open(settings_global->rtnl.logIndexDir);
+        if (error != NO_ERROR)
+        {
+            break;
+        }
+
+        if (rtnl_log_state.segmentSize + length > settings_global->rtnl.logIndexSegmentSize && rtnl_log_state.segmentSize > sizeof(rtnl_log_header_t))
+        {
+            rtnl_log_keys_t table;
+            /* a missing key table is built by the first query that needs it */
+            rtnl_log_keys_seal(rtnl_log_state.dir, rtnl_log_state.segment, &table);
+            rtnl_log_keys_free(&table);
+
+            error = rtnl_log_start_segment(rtnl_log_state.segment + 1);
+            if (error != NO_ERROR)
+            {
+                break;
+            }
+        }
+
+        /* keep the index sorted even if the clock jumps backwards */
+        entry.timestamp = (uint64_t)time(NULL);
+        if (entry.timestamp < rtnl_log_state.lastTimestamp)
+        {
+            entry.timestamp = rtnl_log_state.lastTimestamp;
+        }
+        entry.offset = rtnl_log_state.segmentSize;
+        entry.length = length;
+
+        char *segmentPath = rtnl_log_path(rtnl_log_state.dir, rtnl_log_state.segment, RTNL_LOG_SEGMENT_EXT);
+        char *indexPath = rtnl_log_path(rtnl_log_state.dir, rtnl_log_state.segment, RTNL_LOG_INDEX_EXT);
+
+        FsFile *file = fsOpenFileEx(segmentPath, "ab");
+        if (file)
+        {
+            error = fsWriteFile(file, (void *)record, length);
+            fsCloseFile(file);
+
+            if (error == NO_ERROR)
+            {
+                file = fsOpenFileEx(indexPath, "ab");
+                if (file)
+                {
+                    error = fsWriteFile(file, &entry, sizeof(entry));
+                    fsCloseFile(file);
+                }
+                else
+                {
+                    error = ERROR_FILE_OPENING_FAILED;
+                }
+            }
+        }
+        else
+        {
+            error = ERROR_FILE_OPENING_FAILED;
+        }
+
+        osFreeMem(segmentPath);
+        osFreeMem(indexPath);
+
+        if (error == NO_ERROR)
+        {
+            rtnl_log_state.segmentSize += length;
+            rtnl_log_state.lastTimestamp = entry.timestamp;
+        }
+        else
+        {
+            /* rescan on next write */
+            rtnl_log_state.initialized = false;
+        }
+    } while (0);
+    mutex_unlock(MUTEX_RTNL_FILE);
+
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Failed to append to indexed RTNL log: %s\r\n", error2text(error));
+    }
+
+    return error;
+}
+
+static bool_t rtnl_log_matches(const rtnl_log_query_t *query, const rtnl_log_index_t *entry)
+{
+    if (query->from && entry->timestamp < query->from)
+    {
+        return false;
+    }
+    if (query->box && query->box[0] && osStrncmp(entry->box, query->box, sizeof(entry->box)))
+    {
+        return false;
+    }
+    if (query->function_group >= 0 && (!(entry->flags & RTNL_LOG_FLAG_LOG2) || entry->function_group != query->function_group))
+    {
+        return false;
+    }
+    if (query->function >= 0 && (!(entry->flags & RTNL_LOG_FLAG_LOG2) || entry->function != query->function))
+    {
+        return false;
+    }
+    if (query->log3_type >= 0 && (!(entry->flags & RTNL_LOG_FLAG_LOG3) || entry->log3_type != query->log3_type))
+    {
+        return false;
+    }
+    return true;
+}
+
+/* first entry in [lo, hi) with timestamp >= from */
+static uint32_t rtnl_log_lower_bound(FsFile *file, uint32_t lo, uint32_t hi, uint64_t from)
+{
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        rtnl_log_index_t entry;
+
+        if (rtnl_log_read_entries(file, mid, &entry, 1) != NO_ERROR)
+        {
+            return hi;
+        }
+        if (entry.timestamp < from)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static error_t rtnl_log_emit(FsFile **segmentFile, const char *dir, uint32_t segment, const rtnl_log_index_t *entry, rtnl_log_query_cbr cbr, void *ctx)
+{
+    size_t read = 0;
+
+    if (!*segmentFile)
+    {
+        char *segmentPath = rtnl_log_path(dir, segment, RTNL_LOG_SEGMENT_EXT);
+        *segmentFile = fsOpenFile(segmentPath, FS_FILE_MODE_READ);
+        osFreeMem(segmentPath);
+        if (!*segmentFile)
+        {
+            return ERROR_FILE_OPENING_FAILED;
+        }
+    }
+
+    uint8_t *record = osAllocMem(entry->length);
+    if (!record)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+
+    error_t error = fsSeekFile(*segmentFile, entry->offset, FS_SEEK_SET);
+    if (error == NO_ERROR)
+    {
+        error = fsReadFile(*segmentFile, record, entry->length, &read);
+    }
+    if (error == NO_ERROR && read == entry->length)
+    {
+        cbr(ctx, entry, record, entry->length);
+    }
+    osFreeMem(record);
+
+    return error;
+}
+
+/* handles one index entry of the scan, done is set when the query stops before this entry */
+static error_t rtnl_log_visit(rtnl_log_query_t *query, FsFile **segmentFile, const char *dir, uint32_t segment, const rtnl_log_index_t *entry,
+                              rtnl_log_query_cbr cbr, void *ctx, size_t *found, bool_t *more, bool_t *done)
+{
+    if (query->to && entry->timestamp > query->to)
+    {
+        *done = true;
+        return NO_ERROR;
+    }
+    if (*found == query->limit)
+    {
+        *more = true;
+        *done = true;
+        return NO_ERROR;
+    }
+    if (!rtnl_log_matches(query, entry))
+    {
+        return NO_ERROR;
+    }
+
+    error_t error = rtnl_log_emit(segmentFile, dir, segment, entry, cbr, ctx);
+    if (error != NO_ERROR)
+    {
+        *done = true;
+        return error;
+    }
+    (*found)++;
+
+    return NO_ERROR;
+}
+
+error_t rtnl_log_query(rtnl_log_query_t *query, rtnl_log_query_cbr cbr, void *ctx, bool_t *more)
+{
+    settings_t *settings = get_settings();
+    const char *dir = settings->rtnl.logIndexDir;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    size_t found = 0;
+    rtnl_log_index_t *entries = NULL;
+    error_t error = NO_ERROR;
+
+    *more = false;
+    if (!rtnl_log_scan(dir, &first, &last))
+    {
+        return NO_ERROR;
+    }
+    if (query->limit == 0 || query->limit > RTNL_LOG_QUERY_LIMIT_MAX)
+    {
+        query->limit = RTNL_LOG_QUERY_LIMIT_MAX;
+    }
+    if (query->cursor_segment < first)
+    {
+        query->cursor_segment = first;
+        query->cursor_entry = 0;
+    }
+
+    entries = osAllocMem(RTNL_LOG_READ_ENTRIES * sizeof(rtnl_log_index_t));
+    if (!entries)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+
+    for (uint32_t segment = query->cursor_segment; segment <= last && error == NO_ERROR; segment++)
+    {
+        uint32_t pos = (segment == query->cursor_segment) ? query->cursor_entry : 0;
+        char *indexPath = rtnl_log_path(dir, segment, RTNL_LOG_INDEX_EXT);
+        uint32_t count = rtnl_log_entry_count(indexPath);
+        FsFile *indexFile = NULL;
+        FsFile *segmentFile = NULL;
+        uint32_t *positions = NULL;
+        size_t positionCount = 0;
+        bool_t keyed = false;
+        bool_t done = false;
+
+        if (pos < count)
+        {
+            indexFile = fsOpenFile(indexPath, FS_FILE_MODE_READ);
+        }
+        osFreeMem(indexPath);
+
+        if (!indexFile)
+        {
+            continue;
+        }
+
+        /* the newest segment is still written and has no keys yet */
+        if (segment < last)
+        {
+            keyed = rtnl_log_keys_positions(query, dir, segment, &positions, &positionCount);
+        }
+        if (keyed && positionCount == 0)
+        {
+            pos = count;
+        }
+
+        /* segments are chronological, so check the boundaries before touching any record */
+        if (pos < count)
+        {
+            if (query->to && rtnl_log_read_entries(indexFile, pos, entries, 1) == NO_ERROR && entries[0].timestamp > query->to)
+            {
+                done = true;
+            }
+            else if (query->from && rtnl_log_read_entries(indexFile, count - 1, entries, 1) == NO_ERROR && entries[0].timestamp < query->from)
+            {
+                pos = count;
+            }
+            else if (query->from)
+            {
+                pos = rtnl_log_lower_bound(indexFile, pos, count, query->from);
+            }
+        }
+
+        if (keyed)
+        {
+            /* seek to the listed entries only, the cursor may point between them */
+            size_t i = 0;
+            while (i < positionCount && positions[i] < pos)
+            {
+                i++;
+            }
+            for (; !done && i < positionCount && positions[i] < count; i++)
+            {
+                pos = positions[i];
+                error = rtnl_log_read_entries(indexFile, pos, entries, 1);
+                if (error != NO_ERROR)
+                {
+                    break;
+                }
+                error = rtnl_log_visit(query, &segmentFile, dir, segment, &entries[0], cbr, ctx, &found, more, &done);
+            }
+            if (!done && error == NO_ERROR)
+            {
+                pos = count;
+            }
+        }
+
+        while (!keyed && !done && pos < count)
+        {
+            uint32_t chunk = count - pos;
+            if (chunk > RTNL_LOG_READ_ENTRIES)
+            {
+                chunk = RTNL_LOG_READ_ENTRIES;
+            }
+            error = rtnl_log_read_entries(indexFile, pos, entries, chunk);
+            if (error != NO_ERROR)
+            {
+                break;
+            }
+
+            for (uint32_t i = 0; i < chunk && !done; i++)
+            {
+                error = rtnl_log_visit(query, &segmentFile, dir, segment, &entries[i], cbr, ctx, &found, more, &done);
+                if (!done)
+                {
+                    pos++;
+                }
+            }
+        }
+
+        osFreeMem(positions);
+        fsCloseFile(indexFile);
+        if (segmentFile)
+        {
+            fsCloseFile(segmentFile);
+        }
+
+        query->cursor_segment = segment;
+        query->cursor_entry = pos;
+        if (done)
+        {
+            break;
+        }
+    }
+    osFreeMem(entries);
+
+    return error;
+}
@@ -23,6 +23,13 @@
 
 #include "server_helpers.h"
 #include "toniesJson.h"
+#include "content_prefetch.h"
+#include "transcode_job.h"
+#include "upload_session.h"
+#include "content_index.h"
+#include "content_store.h"
+#include "tonie_audio_playlist.h"
+#include "gzip_stream.h"
 
 #include "path.h"
 #include "debug.h"
@@ -93,9 +100,20 @@ request_type_t request_paths[] = {
     {REQ_GET, "/api/patchFirmware", SERTY_HTTP, &handleApiPatchFirmware},
     {REQ_POST, "/api/fileUpload", SERTY_HTTP, &handleApiFileUpload},
     {REQ_POST, "/api/pcmUpload", SERTY_HTTP, &handleApiPcmUpload},
+    {REQ_POST, "/api/upload/create", SERTY_HTTP, &handleApiUploadCreate},
+    {REQ_POST, "/api/upload/chunk", SERTY_HTTP, &handleApiUploadChunk},
+    {REQ_GET, "/api/upload/status", SERTY_HTTP, &handleApiUploadStatus},
+    {REQ_POST, "/api/upload/commit", SERTY_HTTP, &handleApiUploadCommit},
+    {REQ_POST, "/api/upload/abort", SERTY_HTTP, &handleApiUploadAbort},
+    {REQ_POST, "/api/jobs/add", SERTY_HTTP, &handleApiJobsAdd},
+    {REQ_POST, "/api/jobs/cancel", SERTY_HTTP, &handleApiJobsCancel},
+    {REQ_GET, "/api/jobs", SERTY_HTTP, &handleApiJobs},
+    {REQ_POST, "/api/contentStore/gc", SERTY_HTTP, &handleApiContentStoreGc},
+    {REQ_GET, "/api/contentStore", SERTY_HTTP, &handleApiContentStore},
     {REQ_GET, "/api/fileIndexV2", SERTY_HTTP, &handleApiFileIndexV2},
     {REQ_GET, "/api/fileIndex", SERTY_HTTP, &handleApiFileIndex},
     {REQ_GET, "/api/stats", SERTY_HTTP, &handleApiStats},
+    {REQ_GET, "/api/rtnl/query", SERTY_HTTP, &handleApiRtnlQuery},
     {REQ_GET, "/api/toniesJsonSearch", SERTY_HTTP, &handleApiToniesJsonSearch},
     {REQ_GET, "/api/toniesJsonUpdate", SERTY_HTTP, &handleApiToniesJsonUpdate},
     {REQ_GET, "/api/toniesJson", SERTY_HTTP, &handleApiToniesJson},
@@ -104,6 +122,7 @@ request_type_t request_paths[] = {
     {REQ_GET, "/api/getTagIndex", SERTY_HTTP, &handleApiTagIndex},
     {REQ_GET, "/api/getBoxes", SERTY_HTTP, &handleApiGetBoxes},
     {REQ_POST, "/api/assignUnknown", SERTY_HTTP, &handleApiAssignUnknown},
+    {REQ_POST, "/api/contentPrefetch", SERTY_HTTP, &handleApiContentPrefetch},
     {REQ_GET, "/api/settings/getIndex", SERTY_HTTP, &handleApiGetIndex},
     {REQ_GET, "/api/settings/get/", SERTY_HTTP, &handleApiSettingsGet},
     {REQ_POST, "/api/settings/set/", SERTY_HTTP, &handleApiSettingsSet},
@@ -608,10 +627,21 @@ void server_init(bool test)
     }
 
     tonies_init();
-    if (get_settings()->core.tonies_json_auto_update || test)
+    content_prefetch_init();
+    transcode_job_init();
+    upload_session_init();
+    content_store_init();
+    tap_chapter_cache_prune();
+    content_index_init();
+    gzip_precompress_start();
+    if (test)
     {
         tonies_update();
     }
+    else if (get_settings()->core.tonies_json_auto_update)
+    {
+        tonies_update_start();
+    }
 
     systime_t last = osGetSystemTime();
     size_t openConnectionsLast = 0;
@@ -7,18 +7,6 @@
 #include "server_helpers.h"
 #include "http/http_server_misc.h"
 
-typedef enum
-{
-    PARSE_HEADER,
-    PARSE_FILENAME,
-    PARSE_BODY
-} eMultipartState;
-
-/* multipart receive buffer */
-#define DATA_SIZE 1024
-#define SAVE_SIZE 80
-#define BUFFER_SIZE (DATA_SIZE + SAVE_SIZE)
-
 char *custom_asprintf(const char *fmt, ...)
 {
     va_list args;
@@ -266,246 +254,48 @@ void time_format_current(char_t *buffer)
     time_format(time, buffer);
 }
 
-static int find_string(const void *haystack, size_t haystack_len, size_t haystack_start, const char *str)
-{
-    size_t str_len = osStrlen(str);
-
-    if (str_len > haystack_len)
-    {
-        return -1;
-    }
-
-    for (size_t i = haystack_start; i <= haystack_len - str_len; i++)
-    {
-        if (osMemcmp((uint8_t *)haystack + i, str, str_len) == 0)
-        {
-            return i;
-        }
-    }
-
-    return -1;
-}
-
-error_t multipart_get_field(const char *buffer, size_t buffer_size, const char *field, char *result, size_t result_max)
+char_t *hexEncode(char_t *output, const uint8_t *data, size_t len)
 {
-    char *start_match = custom_asprintf("%s=\"", field);
-
-    int fn_start = find_string(buffer, buffer_size, 0, start_match);
-    if (fn_start < 0)
-    {
-        osFreeMem(start_match);
-        return ERROR_FAILURE;
-    }
+    static const char_t hexDigits[] = "0123456789ABCDEF";
 
-    fn_start += osStrlen(start_match);
-    osFreeMem(start_match);
-
-    int fn_end = find_string(buffer, buffer_size, fn_start, "\"");
-    if (fn_end < 0)
+    for (size_t i = 0; i < len; i++)
     {
-        return ERROR_FAILURE;
+        output[i * 2] = hexDigits[data[i] >> 4];
+        output[i * 2 + 1] = hexDigits[data[i] & 0x0F];
     }
+    output[len * 2] = '\0';
 
-    int inLen = fn_end - fn_start;
-    int len = (inLen < result_max) ? inLen : (result_max - 1);
-    osStrncpy(result, &buffer[fn_start], len);
-    result[len] = '\0';
-
-    return NO_ERROR;
+    return output;
 }
 
 error_t multipart_handle(HttpConnection *connection, multipart_cbr_t *cbr, void *multipart_ctx)
 {
-    char buffer[2 * BUFFER_SIZE];
-    char form_name[256];
-    char form_filename[256];
-    eMultipartState state = PARSE_HEADER;
-    char *boundary = connection->request.boundary;
-
-    size_t leftover = 0;
-    bool fetch = true;
-    int save_start = 0;
-    int save_end = 0;
-    int payload_size = 0;
-
-    do
-    {
-        if (!payload_size)
-        {
-            fetch = true;
-        }
+    multipart_parser_t parser;
+    error_t error = multipart_parser_init(&parser, connection->request.boundary, settings_get_unsigned("core.multipart_buffer_size"), cbr, multipart_ctx);
 
-        payload_size = leftover;
-        if (fetch)
-        {
-            size_t packet_size;
-            error_t error = httpReceive(connection, &buffer[leftover], DATA_SIZE - leftover, &packet_size, SOCKET_FLAG_DONT_WAIT);
-            if (error != NO_ERROR)
-            {
-                TRACE_ERROR("httpReceive failed with error %s\r\n", error2text(error));
-                return error;
-            }
-
-            save_start = 0;
-            payload_size = leftover + packet_size;
-            save_end = payload_size;
-
-            fetch = false;
-        }
+    while (error == NO_ERROR && !multipart_parser_done(&parser))
+    {
+        /* receive straight into the parser's window */
+        size_t space = 0;
+        uint8_t *buffer = multipart_parser_space(&parser, &space);
+        size_t packet_size = 0;
 
-        switch (state)
+        error = httpReceive(connection, buffer, space, &packet_size, SOCKET_FLAG_DONT_WAIT);
+        if (error == ERROR_END_OF_STREAM || (error == NO_ERROR && packet_size == 0))
         {
-        case PARSE_HEADER:
-        {
-            /* when the payload starts with boundary, its a valid payload */
-            int boundary_start = find_string(buffer, payload_size, 0, boundary);
-            if (boundary_start < 0)
-            {
-                /* if not, check for newlines that preceed */
-                int data_end = find_string(buffer, payload_size, 0, "\r\n");
-                if (data_end >= 0)
-                {
-                    /* when found, start from there, after the newline */
-                    save_start = data_end + 2;
-                    save_end = payload_size;
-                }
-                else
-                {
-                    /* if not, drop most of the buffer, keeping the last few bytes */
-                    save_start = (payload_size > SAVE_SIZE) ? payload_size - SAVE_SIZE : 0;
-                    save_end = payload_size;
-                }
-            }
-            else
-            {
-                save_start = boundary_start + osStrlen(boundary);
-                save_end = payload_size;
-                state = PARSE_FILENAME;
-            }
+            error = multipart_parser_finish(&parser);
             break;
         }
-
-        case PARSE_FILENAME:
+        if (error != NO_ERROR)
         {
-            if (payload_size < 3)
-            {
-                save_start = 0;
-                save_end = payload_size;
-                fetch = true;
-                break;
-            }
-
-            /* when the payload starts with --, then leave */
-            if (!osMemcmp(buffer, "--", 2))
-            {
-                TRACE_DEBUG("Received multipart end\r\n");
-                return NO_ERROR;
-            }
-            if (osMemcmp(buffer, "\r\n", 2))
-            {
-                TRACE_DEBUG("No valid multipart\r\n");
-                return NO_ERROR;
-            }
-
-            if (multipart_get_field(buffer, payload_size, "name", form_name, sizeof(form_name)) != NO_ERROR)
-            {
-                TRACE_DEBUG("No name found, retrying\r\n");
-                save_start = 0;
-                save_end = payload_size;
-                fetch = true;
-                break;
-            }
-            if (multipart_get_field(buffer, payload_size, "filename", form_filename, sizeof(form_filename)) != NO_ERROR)
-            {
-                TRACE_DEBUG("No filename found, retrying\r\n");
-                save_start = 0;
-                save_end = payload_size;
-                fetch = true;
-                break;
-            }
-
-            save_start = find_string(buffer, payload_size, 0, "\r\n\r\n");
-            if (save_start < 0)
-            {
-                TRACE_DEBUG("no newlines found, reading next block\r\n");
-                save_start = 0;
-                save_end = payload_size;
-                fetch = true;
-                break;
-            }
-
-            if (cbr->multipart_start(multipart_ctx, form_name, form_filename) != NO_ERROR)
-            {
-                TRACE_ERROR("multipart_start failed\r\n");
-                return ERROR_INVALID_PATH;
-            }
-
-            state = PARSE_BODY;
-            save_start += 4;
-            save_end = payload_size;
+            TRACE_ERROR("httpReceive failed with error %s\r\n", error2text(error));
             break;
         }
+        error = multipart_parser_commit(&parser, packet_size);
+    }
+    multipart_parser_free(&parser);
 
-        case PARSE_BODY:
-        {
-            if (!payload_size)
-            {
-                fetch = true;
-                break;
-            }
-
-            int data_end = find_string(buffer, payload_size, 0, boundary);
-
-            if (data_end >= 0)
-            {
-                /* We've found a boundary, let's finish up the current file, but skip the "--\r\n" */
-                if (cbr->multipart_add(multipart_ctx, (uint8_t *)buffer, data_end - 4) != NO_ERROR)
-                {
-                    TRACE_ERROR("multipart_add failed\r\n");
-                    return ERROR_FAILURE;
-                }
-                cbr->multipart_end(multipart_ctx);
-
-                TRACE_INFO("Received file '%s'\r\n", form_filename);
-
-                /* Prepare for next file */
-                state = PARSE_HEADER;
-                save_start = data_end;
-                save_end = payload_size;
-            }
-            else
-            {
-                /* there is no full bounday end in this block, save the end and fetch next */
-                fetch = true;
-
-                if (payload_size <= SAVE_SIZE)
-                {
-                    save_start = 0;
-                    save_end = payload_size;
-                }
-                else
-                {
-                    save_start = payload_size - SAVE_SIZE;
-                    save_end = payload_size;
-                    if (cbr->multipart_add(multipart_ctx, buffer, payload_size - SAVE_SIZE) != NO_ERROR)
-                    {
-                        TRACE_ERROR("multipart_add failed\r\n");
-                        return ERROR_FAILURE;
-                    }
-                }
-            }
-        }
-        break;
-        }
-
-        leftover = save_end - save_start;
-        if (leftover > 0)
-        {
-            memmove(buffer, &buffer[save_start], leftover);
-        }
-    } while (payload_size > 0);
-
-    return NO_ERROR;
+    return error;
 }
 
 /**
@@ -32,6 +32,7 @@ static setting_item_t *Option_Map_Overlay[MAX_OVERLAYS];
 static uint16_t settings_size = 0;
 static char *config_file_path = NULL;
 static char *config_overlay_file_path = NULL;
+static uint32_t settings_version = 0;
 DateTime settings_last_load;
 DateTime settings_last_load_ovl;
 
@@ -94,6 +95,10 @@ static void option_map_init(uint8_t settingsId)
 
     OPTION_STRING("core.allowOrigin", &settings->core.allowOrigin, "", "CORS Allow-Origin", "Set CORS Access-Control-Allow-Origin header")
     OPTION_BOOL("core.webHttpOnly", &settings->core.webHttpOnly, TRUE, "Webinterface HTTP only", "Allows access to the webinterface via HTTP only (so HTTPS can be exposed for the Toniebox without webinterface access)")
+    OPTION_UNSIGNED("core.gzip_min_size", &settings->core.gzip_min_size, 2048, 0, 1024 * 1024, "Compress responses from", "JSON API responses of at least this many bytes are sent gzip compressed to browsers that accept it. 0 disables compression.")
+    OPTION_BOOL("core.gzip_precompress", &settings->core.gzip_precompress, TRUE, "Precompress web files", "Create and refresh .gz variants of the webinterface files and tonies.json, which are then sent instead of the uncompressed files.")
+    OPTION_UNSIGNED("core.multipart_buffer_size", &settings->core.multipart_buffer_size, MULTIPART_BUFFER_SIZE_DEFAULT, MULTIPART_BUFFER_SIZE_MIN, 16 * 1024 * 1024, "Upload buffer size", "Receive window for file uploads in bytes. Uploaded data is handed on in blocks of at least half this size.")
+    OPTION_BOOL("core.content_store", &settings->core.content_store, FALSE, "Deduplicate audio files", "Keep every audio once in library/by/sha1 and place cached and assigned files as reflinks or hardlinks of it, copies only where the filesystem supports neither. Unused audio is removed on startup. With hardlinks, editing such a file outside of teddyCloud changes all its links.")
 
     OPTION_BOOL("core.flex_enabled", &settings->core.flex_enabled, TRUE, "Enable Flex-Tonie", "When enabled this UID always gets assigned the audio selected from web interface")
     OPTION_STRING("core.flex_uid", &settings->core.flex_uid, "", "Flex-Tonie UID", "UID which shall get selected audio files assigned")
@@ -203,13 +208,23 @@ static void option_map_init(uint8_t settingsId)
     OPTION_BOOL("cloud.prioCustomContent", &settings->cloud.prioCustomContent, TRUE, "Prioritize custom content", "Prioritize custom content over tonies content (force update)")
     OPTION_BOOL("cloud.updateOnLowerAudioId", &settings->cloud.updateOnLowerAudioId, TRUE, "Update content on lower audio id", "Update content on a lower audio id")
     OPTION_BOOL("cloud.dumpRuidAuthContentJson", &settings->cloud.dumpRuidAuthContentJson, TRUE, "Dump rUID/auth", "Dump the rUID and authentication into the content JSON.")
+    OPTION_BOOL("cloud.prefetch", &settings->cloud.prefetch, FALSE, "Prefetch content", "Download missing or updated content in the background when a tonie shows up in a freshness check or RTNL. Needs the dumped rUID/auth of the tonie.")
+    OPTION_UNSIGNED("cloud.prefetchWorkers", &settings->cloud.prefetchWorkers, 1, 1, 4, "Prefetch workers", "Number of parallel prefetch downloads")
+    OPTION_UNSIGNED("cloud.prefetchBandwidth", &settings->cloud.prefetchBandwidth, 1024, 0, 1048576, "Prefetch bandwidth", "Bandwidth budget in KiB/s shared by all prefetch downloads, 0=unlimited")
 
     OPTION_TREE_DESC("encode", "TAF encoding")
     OPTION_UNSIGNED("encode.bitrate", &settings->encode.bitrate, 96, 0, 256, "Opus bitrate", "Opus bitrate, tested 64, 96(default), 128, 192, 256 - be aware that this increases the TAF size!")
-    OPTION_UNSIGNED("encode.ffmpeg_stream_buffer_ms", &settings->encode.ffmpeg_stream_buffer_ms, 2000, 0, 60000, "Stream buffer ms", "Stream buffer for ffmpeg based streaming.")
+    OPTION_UNSIGNED("encode.ffmpeg_stream_buffer_ms", &settings->encode.ffmpeg_stream_buffer_ms, 2000, 0, 60000, "Stream buffer ms", "Minimum audio buffered by ffmpeg based streaming before it is sent to the box.")
+    OPTION_UNSIGNED("encode.ffmpeg_stream_ring_pages", &settings->encode.ffmpeg_stream_ring_pages, 64, 0, 4096, "Stream ring pages", "4k pages of the encoded stream kept in memory and sent directly to the box. 0 streams through the file on disk.")
+    OPTION_UNSIGNED("encode.ffmpeg_decoders_max", &settings->encode.ffmpeg_decoders_max, 4, 1, 32, "Max. ffmpeg decoders", "Running ffmpeg decoders at most. Further sources wait for a free one, the next source of a playlist is only decoded in advance while one is free.")
+    OPTION_BOOL("encode.ffmpeg_stream_spill", &settings->encode.ffmpeg_stream_spill, TRUE, "Stream spill to disk", "Also write the encoded stream to disk, needed to resume beyond the memory ring.")
     OPTION_BOOL("encode.ffmpeg_stream_restart", &settings->encode.ffmpeg_stream_restart, FALSE, "Stream force restart", "If a stream is continued by the box, a new file is forced. This has the cost of a slower restart, but does not play the old buffered content and deletes the previous stream data on the box.")
     OPTION_BOOL("encode.ffmpeg_sweep_startup_buffer", &settings->encode.ffmpeg_sweep_startup_buffer, TRUE, "Sweep stream prebuffer", "Webradio streams often send several seconds as a buffer immediately. This may contain ads and will add up if you disalbe 'Stream force restart'.")
     OPTION_UNSIGNED("encode.ffmpeg_sweep_delay_ms", &settings->encode.ffmpeg_sweep_delay_ms, 2000, 0, 10000, "Sweep delay ms", "Wait x ms until sweeping is stopped and stream is started. Delays stream start, but may increase success.")
+    OPTION_BOOL("encode.tap_chapter_cache", &settings->encode.tap_chapter_cache, TRUE, "Cache TAP chapters", "Keep every encoded playlist file as a chapter in the data dir, so regenerating a TAP only encodes new or changed files.")
+    OPTION_UNSIGNED("encode.tap_chapter_cache_days", &settings->encode.tap_chapter_cache_days, 30, 1, 3650, "TAP chapter cache days", "Cached chapters not used by any TAP generation for this many days are deleted, e.g. those of edited or removed files.")
+    OPTION_UNSIGNED("encode.job_workers", &settings->encode.job_workers, 1, 1, 8, "Transcoding workers", "Number of transcoding jobs run in parallel, including TAPs generated while a box streams them")
+    OPTION_UNSIGNED("encode.job_nice", &settings->encode.job_nice, 10, 0, 19, "Transcoding niceness", "CPU niceness of transcoding jobs, so they do not slow down streaming to the box")
 
     OPTION_TREE_DESC("toniebox", "Toniebox")
     OPTION_BOOL("toniebox.overrideCloud", &settings->toniebox.overrideCloud, TRUE, "Override cloud settings", "Override tonies cloud settings for the toniebox with those set here")
@@ -224,6 +239,9 @@ static void option_map_init(uint8_t settingsId)
     OPTION_BOOL("rtnl.logHuman", &settings->rtnl.logHuman, FALSE, "Log RTNL (csv)", "Enable logging for human-readable RTNL data")
     OPTION_STRING("rtnl.logRawFile", &settings->rtnl.logRawFile, "config/rtnl.bin", "RTNL bin file", "Specify the filepath for raw RTNL log")
     OPTION_STRING("rtnl.logHumanFile", &settings->rtnl.logHumanFile, "config/rtnl.csv", "RTNL csv file", "Specify the filepath for human-readable RTNL log")
+    OPTION_BOOL("rtnl.logIndexed", &settings->rtnl.logIndexed, FALSE, "Log RTNL (indexed)", "Enable the indexed and queryable RTNL log")
+    OPTION_STRING("rtnl.logIndexDir", &settings->rtnl.logIndexDir, "config/rtnl", "RTNL index dir", "Directory for the indexed RTNL log segments")
+    OPTION_UNSIGNED("rtnl.logIndexSegmentSize", &settings->rtnl.logIndexSegmentSize, 4194304, 65536, 1073741824, "RTNL segment size", "Maximum size of an indexed RTNL log segment in bytes")
 
     OPTION_TREE_DESC("mqtt", "MQTT")
     OPTION_BOOL("mqtt.enabled", &settings->mqtt.enabled, FALSE, "Enable MQTT", "Enable MQTT client")
@@ -234,6 +252,8 @@ static void option_map_init(uint8_t settingsId)
     OPTION_STRING("mqtt.identification", &settings->mqtt.identification, "", "Client identification", "Client identification")
     OPTION_STRING("mqtt.topic", &settings->mqtt.topic, "teddyCloud", "Topic prefix", "Topic prefix")
     OPTION_UNSIGNED("mqtt.qosLevel", &settings->mqtt.qosLevel, 0, 0, 2, "QoS level", "QoS level")
+    OPTION_UNSIGNED("mqtt.txBatchSize", &settings->mqtt.txBatchSize, 128, 1, 4096, "Tx batch size", "Maximum number of queued messages published per loop")
+    OPTION_UNSIGNED("mqtt.txOverflowPolicy", &settings->mqtt.txOverflowPolicy, 0, 0, 1, "Tx overflow policy", "When the Tx queue is full: 0=drop new messages, 1=drop oldest messages")
 
     OPTION_TREE_DESC("hass", "Home Assistant")
     OPTION_STRING("hass.name", &settings->hass.name, "teddyCloud - Server", "Home Assistant name", "Home Assistant name")
@@ -288,6 +308,7 @@ void overlay_settings_init_opt(setting_item_t *opt, setting_item_t *opt_src)
         }
         opt->overlayed = false;
     }
+    settings_version++;
 }
 void overlay_serttings_init_field(int field, uint8_t overlay)
 {
@@ -468,6 +489,7 @@ void settings_changed()
 void settings_changed_id(uint8_t settingsId)
 {
     mutex_lock(MUTEX_SETTINGS_CHANGED);
+    settings_version++;
     Settings_Overlay[settingsId].internal.config_changed = true;
     settings_generate_internal_dirs(get_settings_id((settingsId)));
     if (config_file_path != NULL)
@@ -519,6 +541,7 @@ void settings_deinit(uint8_t overlayNumber)
         pos++;
     }
     Settings_Overlay[overlayNumber].internal.config_init = false;
+    settings_version++;
 
     if (overlayNumber == 0)
     {
@@ -955,6 +978,7 @@ error_t settings_load_ovl(bool overlay)
         }
     }
 
+    settings_version++;
     mutex_unlock(MUTEX_SETTINGS_LOAD_OVL);
     return NO_ERROR;
 }
@@ -970,9 +994,14 @@ setting_item_t *settings_get(int index)
 }
 
 setting_item_t *settings_get_ovl(int index, const char *overlay_name)
+{
+    return settings_get_id(index, get_overlay_id(overlay_name));
+}
+
+setting_item_t *settings_get_id(int index, uint8_t settingsId)
 {
     if (index < settings_get_size())
-        return &get_option_map(overlay_name)[index];
+        return &Option_Map_Overlay[settingsId][index];
     TRACE_WARNING("Setting item #%d not found\r\n", index);
     return NULL;
 }
@@ -1050,6 +1079,7 @@ bool settings_set_bool_id(const char *item, bool value, uint8_t settingsId)
     if (settingsId > 0)
     {
         opt->overlayed = true;
+        settings_version++;
     }
     else if (!opt->internal)
     {
@@ -1111,6 +1141,7 @@ bool settings_set_signed_id(const char *item, int32_t value, uint8_t settingsId)
     if (settingsId > 0)
     {
         opt->overlayed = true;
+        settings_version++;
     }
     else if (!opt->internal)
     {
@@ -1171,6 +1202,7 @@ bool settings_set_unsigned_id(const char *item, uint32_t value, uint8_t settings
     if (settingsId > 0)
     {
         opt->overlayed = true;
+        settings_version++;
     }
     else if (!opt->internal)
     {
@@ -1232,6 +1264,7 @@ bool settings_set_float_id(const char *item, float value, uint8_t settingsId)
     if (settingsId > 0)
     {
         opt->overlayed = true;
+        settings_version++;
     }
     else if (!opt->internal)
     {
@@ -1297,6 +1330,7 @@ bool settings_set_string_id(const char *item, const char *value, uint8_t setting
     if (settingsId > 0)
     {
         opt->overlayed = true;
+        settings_version++;
     }
     else if (!opt->internal)
     {
@@ -1371,6 +1405,7 @@ bool settings_set_u64_array_id(const char *item, const uint64_t *value, size_t l
     if (settingsId > 0)
     {
         opt->overlayed = true;
+        settings_version++;
     }
     else if (!opt->internal)
     {
@@ -1379,6 +1414,11 @@ bool settings_set_u64_array_id(const char *item, const uint64_t *value, size_t l
     return true;
 }
 
+uint32_t settings_get_version()
+{
+    return settings_version;
+}
+
 void settings_loop()
 {
     FsFileStat stat;
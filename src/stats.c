@@ -8,6 +8,12 @@ STATS_ENTRY("reverse_requests", "Reverse proxy calls made by clients")
 STATS_ENTRY("cloud_requests", "Cloud requests executed")
 STATS_ENTRY("cloud_blocked", "Blocked cloud requests")
 STATS_ENTRY("cloud_failed", "Failed cloud requests")
+STATS_ENTRY("cloud_content_coalesced", "Content requests served from a download already running")
+STATS_ENTRY("content_prefetched", "Content files downloaded by the background prefetch")
+STATS_ENTRY("rtnl_packets", "RTNL packets received")
+STATS_ENTRY("sse_dropped", "SSE events not delivered to a client")
+STATS_ENTRY("mqtt_dropped", "MQTT messages dropped due to a full queue")
+STATS_ENTRY("mqtt_coalesced", "MQTT state updates merged into an already queued message")
 STATS_END()
 
 void stats_update(const char *item, int count)
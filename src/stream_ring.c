@@ -0,0 +1,204 @@
+#include <string.h>
+
+#include "os_port.h"
+#include "debug.h"
+#include "stream_ring.h"
+
+/* a blocked writer re-checks the reader at least this often */
+#define STREAM_RING_WRITE_WAIT 1000
+
+error_t stream_ring_init(stream_ring_t *ring, size_t pages, bool_t blocking)
+{
+    osMemset(ring, 0x00, sizeof(stream_ring_t));
+    ring->capacity = pages * STREAM_RING_PAGE_SIZE;
+    ring->blocking = blocking;
+    ring->data = osAllocMem(ring->capacity);
+    if (ring->data == NULL)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+    if (!osCreateMutex(&ring->lock))
+    {
+        osFreeMem(ring->data);
+        ring->data = NULL;
+        return ERROR_OUT_OF_RESOURCES;
+    }
+    error_t error = completion_init(&ring->space);
+    if (error != NO_ERROR)
+    {
+        osDeleteMutex(&ring->lock);
+        osFreeMem(ring->data);
+        ring->data = NULL;
+    }
+    return error;
+}
+
+void stream_ring_deinit(stream_ring_t *ring)
+{
+    completion_deinit(&ring->space);
+    osDeleteMutex(&ring->lock);
+    osFreeMem(ring->data);
+    ring->data = NULL;
+}
+
+void stream_ring_reset(stream_ring_t *ring, size_t start)
+{
+    if (!ring)
+    {
+        return;
+    }
+    osAcquireMutex(&ring->lock);
+    ring->start = start;
+    ring->end = start;
+    ring->read_pos = start;
+    ring->closed = FALSE;
+    osReleaseMutex(&ring->lock);
+}
+
+void stream_ring_set_header(stream_ring_t *ring, const uint8_t *page)
+{
+    if (!ring)
+    {
+        return;
+    }
+    osAcquireMutex(&ring->lock);
+    osMemcpy(ring->header, page, STREAM_RING_PAGE_SIZE);
+    ring->header_valid = TRUE;
+    osReleaseMutex(&ring->lock);
+}
+
+void stream_ring_write(stream_ring_t *ring, const uint8_t *data, size_t length)
+{
+    if (!ring)
+    {
+        return;
+    }
+    osAcquireMutex(&ring->lock);
+    while (length > 0)
+    {
+        size_t pos = ring->end % ring->capacity;
+        size_t chunk = MIN(length, ring->capacity - pos);
+
+        if (ring->blocking && !ring->reader_gone)
+        {
+            size_t space = ring->capacity - (ring->end - ring->read_pos);
+            if (space == 0)
+            {
+                /* the reader is a full ring behind, wait until it sent some */
+                osReleaseMutex(&ring->lock);
+                completion_wait(&ring->space, STREAM_RING_WRITE_WAIT);
+                osAcquireMutex(&ring->lock);
+                continue;
+            }
+            chunk = MIN(chunk, space);
+        }
+
+        osMemcpy(&ring->data[pos], data, chunk);
+        ring->end += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+    osReleaseMutex(&ring->lock);
+}
+
+void stream_ring_close(stream_ring_t *ring)
+{
+    if (!ring)
+    {
+        return;
+    }
+    osAcquireMutex(&ring->lock);
+    ring->closed = TRUE;
+    osReleaseMutex(&ring->lock);
+}
+
+void stream_ring_leave(stream_ring_t *ring)
+{
+    osAcquireMutex(&ring->lock);
+    ring->reader_gone = TRUE;
+    osReleaseMutex(&ring->lock);
+    completion_signal(&ring->space);
+}
+
+size_t stream_ring_end(stream_ring_t *ring)
+{
+    osAcquireMutex(&ring->lock);
+    size_t end = ring->end;
+    osReleaseMutex(&ring->lock);
+    return end;
+}
+
+error_t stream_ring_read(stream_ring_t *ring, size_t offset, uint8_t *buffer, size_t length, size_t *read)
+{
+    error_t error = NO_ERROR;
+
+    *read = 0;
+
+    osAcquireMutex(&ring->lock);
+    if (offset < STREAM_RING_PAGE_SIZE)
+    {
+        if (ring->header_valid)
+        {
+            *read = MIN(length, STREAM_RING_PAGE_SIZE - offset);
+            osMemcpy(buffer, &ring->header[offset], *read);
+        }
+        else
+        {
+            error = ring->closed ? ERROR_END_OF_STREAM : ERROR_WOULD_BLOCK;
+        }
+    }
+    else if (offset >= ring->end)
+    {
+        error = ring->closed ? ERROR_END_OF_STREAM : ERROR_WOULD_BLOCK;
+    }
+    else if (offset < ring->start || ring->end - offset > ring->capacity)
+    {
+        error = ERROR_NOT_FOUND;
+    }
+    else
+    {
+        size_t pos = offset % ring->capacity;
+        *read = MIN(MIN(length, ring->end - offset), ring->capacity - pos);
+        osMemcpy(buffer, &ring->data[pos], *read);
+        if (offset + *read > ring->read_pos)
+        {
+            ring->read_pos = offset + *read;
+        }
+    }
+    osReleaseMutex(&ring->lock);
+
+    if (*read > 0)
+    {
+        completion_signal(&ring->space);
+    }
+
+    return error;
+}
+
+error_t stream_ring_wait_ready(stream_ring_t *ring, size_t audio_bytes, completion_t *wake, systime_t timeout)
+{
+    systime_t start = osGetSystemTime();
+
+    while (true)
+    {
+        osAcquireMutex(&ring->lock);
+        bool_t ready = ring->closed || (ring->header_valid && ring->end - ring->start >= audio_bytes);
+        osReleaseMutex(&ring->lock);
+
+        if (ready || completion_is_done(wake))
+        {
+            return NO_ERROR;
+        }
+
+        systime_t elapsed = osGetSystemTime() - start;
+        if (elapsed >= timeout)
+        {
+            return ERROR_TIMEOUT;
+        }
+        error_t error = completion_wait(wake, timeout - elapsed);
+        if (error == ERROR_ABORTED)
+        {
+            return error;
+        }
+    }
+}
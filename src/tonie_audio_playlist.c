@@ -6,6 +6,10 @@
 #include "cJSON.h"
 #include "json_helper.h"
 #include "handler.h"
+#include "settings.h"
+#include "hash/sha1.h"
+#include "date_time.h"
+#include "fs_ext.h"
 
 bool_t is_valid_tap_file(char *filename)
 {
@@ -68,6 +72,7 @@ error_t tap_load(char *filename, tonie_audio_playlist_t *tap)
 
             tap->_filepath_resolved = strdup(tap->filepath);
             resolveSpecialPathPrefix(&tap->_filepath_resolved, get_settings());
+            tap->_filepath_tap = strdup(filename);
 
             tap->name = jsonGetString(tapJson, "name");
             const cJSON *filesJson = cJSON_GetObjectItemCaseSensitive(tapJson, "files");
@@ -168,6 +173,10 @@ void tap_free(tonie_audio_playlist_t *tap)
     {
         osFreeMem(tap->_filepath_resolved);
     }
+    if (tap->_filepath_tap != NULL)
+    {
+        osFreeMem(tap->_filepath_tap);
+    }
     if (tap->name != NULL)
     {
         osFreeMem(tap->name);
@@ -176,7 +185,75 @@ void tap_free(tonie_audio_playlist_t *tap)
     osMemset(tap, 0, sizeof(tonie_audio_playlist_t));
 }
 
-error_t tap_generate_taf(tonie_audio_playlist_t *tap, size_t *current_source, bool_t *active, bool_t force)
+/* cached chapter of a local source, keyed by its path, size and mtime and the encoder bitrate */
+static char *tap_chapter_cache_path(const char *source)
+{
+    FsFileStat stat;
+    if (!settings_get_bool("encode.tap_chapter_cache") || fsGetFileStat(source, &stat) != NO_ERROR)
+    {
+        return NULL;
+    }
+
+    char *key = custom_asprintf("%s\n%" PRIu32 "\n%" PRIu64 "\n%" PRIu32, source, stat.size, (uint64_t)convertDateToUnixTime(&stat.modified), settings_get_unsigned("encode.bitrate"));
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    Sha1Context sha1;
+    sha1Init(&sha1);
+    sha1Update(&sha1, key, osStrlen(key));
+    sha1Final(&sha1, digest);
+    osFreeMem(key);
+
+    char name[2 * SHA1_DIGEST_SIZE + 1];
+    for (size_t i = 0; i < SHA1_DIGEST_SIZE; i++)
+    {
+        osSprintf(&name[2 * i], "%02x", digest[i]);
+    }
+
+    char *dir = custom_asprintf("%s%c%s", settings_get_string("internal.datadirfull"), PATH_SEPARATOR, TAP_CHAPTER_CACHE_DIR);
+    if (!fsDirExists(dir))
+    {
+        fsCreateDir(dir);
+    }
+    char *path = custom_asprintf("%s%c%s.taf", dir, PATH_SEPARATOR, name);
+    osFreeMem(dir);
+
+    return path;
+}
+
+void tap_chapter_cache_prune()
+{
+    char *dir = custom_asprintf("%s%c%s", settings_get_string("internal.datadirfull"), PATH_SEPARATOR, TAP_CHAPTER_CACHE_DIR);
+    /* also when the cache got disabled, so its files don't stay forever */
+    time_t expiry = time(NULL) - (time_t)settings_get_unsigned("encode.tap_chapter_cache_days") * 24 * 60 * 60;
+    size_t removed = 0;
+
+    FsDir *fsDir = fsOpenDir(dir);
+    FsDirEntry entry;
+    while (fsDir != NULL && fsReadDir(fsDir, &entry) == NO_ERROR)
+    {
+        if ((entry.attributes & FS_FILE_ATTR_DIRECTORY) || convertDateToUnixTime(&entry.modified) > expiry)
+        {
+            continue;
+        }
+        char *path = custom_asprintf("%s%c%s", dir, PATH_SEPARATOR, entry.name);
+        if (fsDeleteFile(path) == NO_ERROR)
+        {
+            removed++;
+        }
+        osFreeMem(path);
+    }
+    if (fsDir != NULL)
+    {
+        fsCloseDir(fsDir);
+    }
+    osFreeMem(dir);
+
+    if (removed > 0)
+    {
+        TRACE_INFO("Removed %" PRIuSIZE " unused TAP chapters from the cache\r\n", removed);
+    }
+}
+
+error_t tap_generate_taf(tonie_audio_playlist_t *tap, size_t *current_source, bool_t *active, bool_t force, completion_t *progress, volatile uint64_t *encoded)
 {
     error_t error = NO_ERROR;
     bool_t sweep = false;
@@ -185,20 +262,47 @@ error_t tap_generate_taf(tonie_audio_playlist_t *tap, size_t *current_source, bo
     // TODO custom audio id resolving
     if (force || !tonieInfo->valid || tonieInfo->tafHeader->audio_id != tap->audio_id)
     {
-        char *tmp_taf = custom_asprintf("%s.tmp", tap->_filepath_resolved);
-        char source[99][PATH_LEN];
         if (tap->filesCount == 0)
         {
+            freeTonieInfo(tonieInfo);
             return ERROR_INVALID_FILE;
         }
+        char *tmp_taf = custom_asprintf("%s.tmp", tap->_filepath_resolved);
+        char source[99][PATH_LEN];
 
+        /* unchanged sources are copied from their cached chapter, the others get cached while encoding */
+        char *chapter_cache[99];
+        size_t cached = 0;
         for (size_t i = 0; i < tap->filesCount; i++)
         {
-            osStrcpy(source[i], tap->files[i]._filepath_resolved);
+            chapter_cache[i] = tap_chapter_cache_path(tap->files[i]._filepath_resolved);
+            if (chapter_cache[i] != NULL && fsFileExists(chapter_cache[i]))
+            {
+                /* the mtime marks the last use, for tap_chapter_cache_prune */
+                fsTouchFile(chapter_cache[i]);
+                osStrcpy(source[i], chapter_cache[i]);
+                osFreeMem(chapter_cache[i]);
+                chapter_cache[i] = NULL;
+                cached++;
+            }
+            else
+            {
+                osStrcpy(source[i], tap->files[i]._filepath_resolved);
+            }
         }
+        TRACE_INFO("Generating TAP %s, %" PRIuSIZE " of %" PRIuSIZE " chapters cached\r\n", tap->_filepath_resolved, cached, tap->filesCount);
         // toniefile_t *taf = toniefile_create(tmp_taf, tap->audio_id, false);
-        error = ffmpeg_stream(source, tap->filesCount, current_source, tmp_taf, 0, active, &sweep, false);
+        ffmpeg_stream_opts_t opts = {
+            .progress = progress,
+            .encoded = encoded,
+            .chapter_cache = chapter_cache,
+        };
+        error = ffmpeg_stream(source, tap->filesCount, current_source, tmp_taf, 0, active, &sweep, false, &opts);
         // toniefile_close(taf);
+        for (size_t i = 0; i < tap->filesCount; i++)
+        {
+            osFreeMem(chapter_cache[i]);
+        }
         if (error != NO_ERROR)
         {
             fsDeleteFile(tmp_taf);
@@ -208,8 +312,10 @@ error_t tap_generate_taf(tonie_audio_playlist_t *tap, size_t *current_source, bo
             error = fsMoveFile(tmp_taf, tap->_filepath_resolved, true);
         }
         osFreeMem(tmp_taf);
-        freeTonieInfo(tonieInfo);
+
+        tap_chapter_cache_prune();
     }
+    freeTonieInfo(tonieInfo);
     return error;
 }
 
@@ -218,7 +324,8 @@ void tap_generate_task(void *param)
     stream_ctx_t *stream_ctx = (stream_ctx_t *)param;
     tap_generate_param_t *tap_ctx = (tap_generate_param_t *)stream_ctx->ctx;
 
-    stream_ctx->error = tap_generate_taf(tap_ctx->tap, &stream_ctx->current_source, &stream_ctx->active, tap_ctx->force);
+    stream_ctx->error = tap_generate_taf(tap_ctx->tap, &stream_ctx->current_source, &stream_ctx->active, tap_ctx->force, &stream_ctx->completion, NULL);
     stream_ctx->quit = true;
+    completion_complete(&stream_ctx->completion, stream_ctx->error);
     osDeleteTask(OS_SELF_TASK_ID);
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "toniebox_state.h"
 #include "settings.h"
 #include "server_helpers.h"
+#include "content_prefetch.h"
 
 static toniebox_state_t Box_State_Overlay[MAX_OVERLAYS];
 
@@ -9,6 +10,7 @@ void toniebox_state_init()
     for (size_t i = 0; i < MAX_OVERLAYS; i++)
     {
         osMemset(&Box_State_Overlay[i], 0, sizeof(toniebox_state_t));
+        completion_init(&Box_State_Overlay[i].box.stream_ctx.completion);
     }
 }
 
@@ -28,6 +30,7 @@ void tbs_tag_placed(client_ctx_t *client_ctx, uint64_t uid, bool valid)
     if (valid)
     {
         setLastUid(client_ctx->state->tag.uid, client_ctx->settings);
+        content_prefetch_enqueue(uid, client_ctx->settings, FALSE);
     }
 
     char cuid[16 + 1];
@@ -65,6 +68,7 @@ void tbs_playback(client_ctx_t *client_ctx, toniebox_state_playback_t playback)
         if (client_ctx->state->box.stream_ctx.stop_on_playback_stop && !client_ctx->state->box.stream_ctx.quit && client_ctx->state->tag.valid)
         {
             client_ctx->state->box.stream_ctx.active = false;
+            completion_cancel(&client_ctx->state->box.stream_ctx.completion);
         }
         client_ctx->state->tag.audio_id = 0;
         client_ctx->state->tag.valid = false;
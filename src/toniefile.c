@@ -14,12 +14,13 @@
 #include "fs_port.h"
 #include "fs_ext.h"
 #include "os_port.h"
-#include "os_ext.h"
+#include "ffmpeg_decoder.h"
 #include "debug.h"
 #include "opus.h"
 #include "ogg/ogg.h"
 #include "server_helpers.h"
 #include "version.h"
+#include "date_time.h"
 #include "proto/toniebox.pb.taf-header.pb-c.h"
 
 struct toniefile_s
@@ -43,8 +44,75 @@ struct toniefile_s
     TonieboxAudioFileHeader taf;
     Sha1Context sha1;
     size_t taf_block_num;
+
+    /* opus packet copied from the source, held back until the next one shows if it has to be padded */
+    uint8_t remux_packet[TONIEFILE_FRAME_SIZE];
+    size_t remux_length;
+
+    /* optional consumers of the encoded data */
+    stream_ring_t *ring;
+    completion_t *progress;
+    toniefile_t *tee;
 };
 
+static error_t toniefile_remux_commit(toniefile_t *ctx, bool_t fill);
+
+/* SHA1 over the audio of a TAF, kept in the fill bytes of its header so an append does not have to rehash.
+   valid as long as the file has the recorded size and finalizing it gives the hash of the header */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t context_size;
+    uint64_t file_size;
+    Sha1Context sha1;
+} toniefile_sha1_state_t;
+
+#define TONIEFILE_SHA1_STATE_MAGIC 0x54534854 /* "THST" */
+
+static bool_t toniefile_sha1_state_load(const TonieboxAudioFileHeader *tafHeader, size_t file_size, Sha1Context *sha1)
+{
+    toniefile_sha1_state_t state;
+    uint8_t digest[SHA1_DIGEST_SIZE];
+
+    if (tafHeader->_fill.len < sizeof(state) || tafHeader->sha1_hash.len != SHA1_DIGEST_SIZE)
+    {
+        return false;
+    }
+    osMemcpy(&state, tafHeader->_fill.data, sizeof(state));
+
+    if (state.magic != TONIEFILE_SHA1_STATE_MAGIC || state.context_size != sizeof(Sha1Context) ||
+        state.file_size != file_size || state.file_size < TONIEFILE_FRAME_SIZE || (state.file_size % TONIEFILE_FRAME_SIZE) != 0)
+    {
+        return false;
+    }
+
+    Sha1Context check = state.sha1;
+    sha1Final(&check, digest);
+    if (osMemcmp(digest, tafHeader->sha1_hash.data, SHA1_DIGEST_SIZE))
+    {
+        TRACE_INFO("SHA1 state outdated, rehashing\r\n");
+        return false;
+    }
+
+    *sha1 = state.sha1;
+    return true;
+}
+
+/* writes encoded data to the file and publishes it to a stream reader */
+static error_t toniefile_emit(toniefile_t *ctx, const uint8_t *data, size_t length)
+{
+    if (ctx->file && fsWriteFile(ctx->file, (void *)data, length) != NO_ERROR)
+    {
+        return ERROR_WRITE_FAILED;
+    }
+    stream_ring_write(ctx->ring, data, length);
+    if (ctx->progress)
+    {
+        completion_signal(ctx->progress);
+    }
+    return NO_ERROR;
+}
+
 static void toniefile_comment_add(uint8_t *buffer, size_t *length, const char *str)
 {
     uint32_t value = strlen(str);
@@ -54,7 +122,7 @@ static void toniefile_comment_add(uint8_t *buffer, size_t *length, const char *s
     *length += strlen(str);
 }
 
-static size_t toniefile_header(uint8_t *buffer, size_t length, TonieboxAudioFileHeader *tafHeader)
+static size_t toniefile_header(uint8_t *buffer, size_t length, TonieboxAudioFileHeader *tafHeader, const toniefile_sha1_state_t *state)
 {
     uint16_t proto_frame_size = TONIEFILE_FRAME_SIZE - 4;
 
@@ -71,6 +139,10 @@ static size_t toniefile_header(uint8_t *buffer, size_t length, TonieboxAudioFile
     {
         tafHeader->_fill.len--;
     }
+    if (state && tafHeader->_fill.len >= sizeof(*state))
+    {
+        osMemcpy(tafHeader->_fill.data, state, sizeof(*state));
+    }
     size_t size = 0;
 
     if (dataLength != proto_frame_size && dataLength != proto_frame_size - 1)
@@ -92,6 +164,11 @@ static size_t toniefile_header(uint8_t *buffer, size_t length, TonieboxAudioFile
 }
 
 toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool append)
+{
+    return toniefile_create_stream(fullPath, audio_id, append, NULL, NULL);
+}
+
+toniefile_t *toniefile_create_stream(const char *fullPath, uint32_t audio_id, bool append, stream_ring_t *ring, completion_t *progress)
 {
     int err;
     TonieboxAudioFileHeader *tafHeader = NULL;
@@ -100,21 +177,37 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
     osMemset(ctx, 0x00, sizeof(toniefile_t));
 
     /* init TAF header */
+    bool_t sha1_resumed = false;
+    size_t sha1_resumed_size = 0;
+
     toniebox_audio_file_header__init(&ctx->taf);
     ctx->taf.audio_id = audio_id;
     ctx->taf.num_bytes = TONIE_LENGTH_MAX;
     ctx->taf.n_track_page_nums = 0;
     ctx->taf.track_page_nums = osAllocMem(sizeof(uint32_t) * TONIEFILE_MAX_CHAPTERS);
     sha1Init(&ctx->sha1);
+    ctx->ring = ring;
+    ctx->progress = progress;
 
     /* open file */
     ctx->fullPath = fullPath;
-    if (!fsFileExists(fullPath))
+    if (!fullPath || !fsFileExists(fullPath))
     {
         append = false;
     }
-    if (append)
+    if (!fullPath)
     {
+        TRACE_INFO("Create TAF in memory\n");
+    }
+    else if (append)
+    {
+        FsFileStat stat;
+        if (fsGetFileStat(fullPath, &stat) == NO_ERROR)
+        {
+            sha1_resumed_size = stat.size;
+        }
+        /* the file may be a hardlink of a library store blob */
+        fsUnshareFile(fullPath);
         ctx->file = fsOpenFileEx(fullPath, "r+");
         TRACE_INFO("Append to TAF: %s\n", fullPath);
 
@@ -123,16 +216,20 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
         fsSeekFile(ctx->file, 4, SEEK_SET);
         fsReadFile(ctx->file, buffer, TONIEFILE_FRAME_SIZE - 4, &read_length);
         tafHeader = toniebox_audio_file_header__unpack(NULL, read_length, (uint8_t *)buffer);
+        /* must be taken before the header is rewritten, which clears the state until the next close */
+        sha1_resumed = sha1_resumed_size > 0 && toniefile_sha1_state_load(tafHeader, sha1_resumed_size, &ctx->sha1);
         audio_id = tafHeader->audio_id;
         ctx->taf.audio_id = audio_id;
     }
     else
     {
+        /* a new inode, truncating would also empty other hardlinks of the file */
+        fsDeleteFile(fullPath);
         ctx->file = fsOpenFile(fullPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
         TRACE_INFO("Create TAF: %s\n", fullPath)
     }
 
-    if (ctx->file == NULL)
+    if (fullPath && ctx->file == NULL)
     {
         TRACE_ERROR("Cannot create / open file: %s\n", fullPath);
         fsCloseFile(ctx->file);
@@ -141,14 +238,20 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
         return NULL;
     }
     toniefile_write_header(ctx);
-    fsSeekFile(ctx->file, TONIEFILE_FRAME_SIZE, SEEK_SET);
+    if (ctx->file)
+    {
+        fsSeekFile(ctx->file, TONIEFILE_FRAME_SIZE, SEEK_SET);
+    }
 
     /* init OPUS */
     ctx->enc = opus_encoder_create(OPUS_SAMPLING_RATE, OPUS_CHANNELS, OPUS_APPLICATION_AUDIO, &err);
     if (err != OPUS_OK)
     {
         TRACE_ERROR("Cannot create opus encoder: %s\n", opus_strerror(err));
-        fsCloseFile(ctx->file);
+        if (ctx->file)
+        {
+            fsCloseFile(ctx->file);
+        }
         osFreeMem(ctx->taf.track_page_nums);
         osFreeMem(ctx);
         return NULL;
@@ -166,7 +269,7 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
         'O', 'p', 'u', 's', 'H', 'e', 'a', 'd',                         // "OpusHead" string
         1,                                                              // Version
         OPUS_CHANNELS,                                                  // Channel count
-        0x38, 0x01,                                                     // Pre-skip
+        OPUS_PRE_SKIP & 0xFF, OPUS_PRE_SKIP >> 8,                       // Pre-skip
         OPUS_SAMPLING_RATE & 0xFF, OPUS_SAMPLING_RATE >> 8, 0x00, 0x00, // Original sample rate; 0xFFFFFFF implies unknown
         0, 0,                                                           // Output gain
         0                                                               // Channel mapping family
@@ -233,15 +336,16 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
     ogg_page og;
     if (!append)
     {
+        stream_ring_reset(ctx->ring, TONIEFILE_FRAME_SIZE);
         while (ogg_stream_flush(&ctx->os, &og))
         {
             /* write the freshly padded block of frames*/
-            if (fsWriteFile(ctx->file, og.header, og.header_len) != NO_ERROR)
+            if (toniefile_emit(ctx, og.header, og.header_len) != NO_ERROR)
             {
                 return NULL;
             }
             /* write the freshly padded block of frames*/
-            if (fsWriteFile(ctx->file, og.body, og.body_len) != NO_ERROR)
+            if (toniefile_emit(ctx, og.body, og.body_len) != NO_ERROR)
             {
                 return NULL;
             }
@@ -262,7 +366,12 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
         ctx->file_pos = TONIEFILE_FRAME_SIZE;
         fsSeekFile(ctx->file, ctx->file_pos, SEEK_SET);
         size_t read_length = 0;
-        while (true)
+        if (sha1_resumed)
+        {
+            ctx->file_pos = sha1_resumed_size;
+            ctx->audio_length = sha1_resumed_size - TONIEFILE_FRAME_SIZE;
+        }
+        while (!sha1_resumed)
         {
             error_t error = fsReadFile(ctx->file, buffer, TONIEFILE_FRAME_SIZE, &read_length);
             if (error != NO_ERROR && error != ERROR_END_OF_FILE)
@@ -293,6 +402,7 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
         ctx->taf_block_num = tafHeader->taf_block_num;
         ctx->os.pageno = tafHeader->pageno;
         toniebox_audio_file_header__free_unpacked(tafHeader, NULL);
+        stream_ring_reset(ctx->ring, ctx->file_pos);
         // fsSeekFile(ctx->file, ctx->file_pos, SEEK_SET);
         //  TRACE_WARNING("Seek file to %" PRIuSIZE ", blockrest=%" PRIuSIZE "\r\n", ctx->file_pos, block_rest);
     }
@@ -301,9 +411,11 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id, bool appe
     return ctx;
 }
 
-error_t toniefile_write_header(toniefile_t *ctx)
+/* the SHA1 state is only written with the final header, an interrupted append leaves none and rehashes */
+static error_t toniefile_write_header_state(toniefile_t *ctx, const toniefile_sha1_state_t *state)
 {
     uint8_t buffer[TONIEFILE_FRAME_SIZE];
+    uint8_t page[TONIEFILE_FRAME_SIZE];
     uint8_t sha1[SHA1_DIGEST_SIZE];
 
     if (ctx->taf.sha1_hash.data == NULL)
@@ -323,14 +435,25 @@ error_t toniefile_write_header(toniefile_t *ctx)
     ctx->taf.has_pageno = true;
 
     osMemset(buffer, 0x00, sizeof(buffer));
-    uint32_t proto_size = (uint32_t)toniefile_header(buffer, sizeof(buffer), &ctx->taf);
+    uint32_t proto_size = (uint32_t)toniefile_header(buffer, sizeof(buffer), &ctx->taf, state);
 
-    fsSeekFile(ctx->file, 0, SEEK_SET);
     uint8_t proto_be[4];
     proto_be[0] = proto_size >> 24;
     proto_be[1] = proto_size >> 16;
     proto_be[2] = proto_size >> 8;
     proto_be[3] = proto_size;
+
+    osMemset(page, 0x00, sizeof(page));
+    osMemcpy(page, proto_be, sizeof(proto_be));
+    osMemcpy(&page[sizeof(proto_be)], buffer, MIN(proto_size, sizeof(page) - sizeof(proto_be)));
+    stream_ring_set_header(ctx->ring, page);
+
+    if (!ctx->file)
+    {
+        return NO_ERROR;
+    }
+
+    fsSeekFile(ctx->file, 0, SEEK_SET);
     if (fsWriteFile(ctx->file, proto_be, sizeof(proto_be)) != NO_ERROR)
     {
         return ERROR_WRITE_FAILED;
@@ -344,16 +467,36 @@ error_t toniefile_write_header(toniefile_t *ctx)
     return NO_ERROR;
 }
 
+error_t toniefile_write_header(toniefile_t *ctx)
+{
+    return toniefile_write_header_state(ctx, NULL);
+}
+
 error_t toniefile_close(toniefile_t *ctx)
 {
+    if (ctx->remux_length > 0)
+    {
+        toniefile_remux_commit(ctx, true);
+    }
+
     ctx->taf.sha1_hash.data = osAllocMem(SHA1_DIGEST_SIZE);
     ctx->taf.sha1_hash.len = SHA1_DIGEST_SIZE;
     ctx->taf.num_bytes = ctx->audio_length;
+
+    toniefile_sha1_state_t state;
+    osMemset(&state, 0x00, sizeof(state));
+    state.magic = TONIEFILE_SHA1_STATE_MAGIC;
+    state.context_size = sizeof(Sha1Context);
+    state.file_size = TONIEFILE_FRAME_SIZE + ctx->audio_length;
+    state.sha1 = ctx->sha1;
     sha1Final(&ctx->sha1, ctx->taf.sha1_hash.data);
 
-    error_t error = toniefile_write_header(ctx);
+    error_t error = toniefile_write_header_state(ctx, &state);
 
-    fsCloseFile(ctx->file);
+    if (ctx->file)
+    {
+        fsCloseFile(ctx->file);
+    }
 
     osFreeMem(ctx->taf.sha1_hash.data);
     osFreeMem(ctx->taf.track_page_nums);
@@ -384,250 +527,276 @@ error_t toniefile_new_chapter(toniefile_t *ctx)
     return NO_ERROR;
 }
 
-error_t toniefile_encode(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available)
+/* largest packet that exactly fills the rest of the current page when extra_used more bytes are already taken */
+static int toniefile_frame_payload(toniefile_t *ctx, int extra_used)
 {
-    int samples_processed = 0;
-    uint8_t output_frame[TONIEFILE_FRAME_SIZE];
+    int page_used = (ctx->file_pos % TONIEFILE_FRAME_SIZE) + OGG_HEADER_LENGTH + ctx->os.lacing_fill - ctx->os.lacing_returned + ctx->os.body_fill - ctx->os.body_returned + extra_used;
+    int page_remain = TONIEFILE_FRAME_SIZE - page_used;
 
-    // TRACE_INFO("samples_available: %" PRIuSIZE "\n", samples_available);
-    while (samples_processed < samples_available)
+    int frame_payload = (page_remain / 256) * 255 + (page_remain % 256) - 1;
+    int reconstructed = (frame_payload / 255) + 1 + frame_payload;
+
+    /* when due to segment sizes we would end up with a 1 byte gap, make sure that the next run will have at least 64 byte.
+     * reason why this could happen is that "adding one byte" would require one segment more and thus occupies two byte more.
+     * if this would happen, just reduce the calculated free space such that there is room for another segment.
+     */
+    if (page_remain != reconstructed && frame_payload > OPUS_PACKET_MINSIZE)
     {
-        /* get the maximum copyable number of samples */
-        size_t samples = OPUS_FRAME_SIZE - ctx->audio_frame_used;
-        size_t samples_remaining = samples_available - samples_processed;
-        if (samples > samples_remaining)
+        frame_payload -= OPUS_PACKET_MINSIZE;
+    }
+    return frame_payload;
+}
+
+/* adds a 60ms packet to the ogg stream and writes the page once it is full */
+static error_t toniefile_packet_write(toniefile_t *ctx, uint8_t *packet, int frame_len)
+{
+    if (ctx->tee != NULL)
+    {
+        /* the padding only fits the page layout of this file */
+        uint8_t unpadded[TONIEFILE_FRAME_SIZE];
+        osMemcpy(unpadded, packet, frame_len);
+        int length = opus_packet_unpad(unpadded, frame_len);
+        if (length <= 0 || toniefile_remux(ctx->tee, unpadded, length) != NO_ERROR)
         {
-            samples = samples_remaining;
+            TRACE_ERROR("Could not copy packet to tee\r\n");
+            return ERROR_FAILURE;
         }
-        // TRACE_INFO("  samples: %lu (%u/%" PRIuSIZE ")\n", samples, samples_processed, samples_available);
+    }
 
-        toniefile_samples_copy(ctx->audio_frame, &ctx->audio_frame_used, sample_buffer, &samples_processed, samples);
+    /* we have to retrieve the actually encoded samples in this frame */
+    int frames = opus_packet_get_samples_per_frame(packet, OPUS_SAMPLING_RATE) * opus_packet_get_nb_frames(packet, frame_len);
+    if (frames != OPUS_FRAME_SIZE)
+    {
+        TRACE_ERROR("frame count unexpected: %d instead of %d\r\n", frames, OPUS_FRAME_SIZE);
+    }
+    ctx->ogg_granule_position += frames;
 
-        /* buffer full? */
-        if (ctx->audio_frame_used >= OPUS_FRAME_SIZE)
+    /* now fill output page */
+    ogg_packet op;
+    op.packet = packet;
+    op.bytes = frame_len;
+    op.b_o_s = 0;
+    op.e_o_s = 0;
+    op.granulepos = ctx->ogg_granule_position;
+    op.packetno = ctx->ogg_packet_count;
+
+    ctx->ogg_packet_count++;
+
+    ogg_stream_packetin(&ctx->os, &op);
+
+    int page_used = (ctx->file_pos % TONIEFILE_FRAME_SIZE) + OGG_HEADER_LENGTH + ctx->os.lacing_fill + ctx->os.body_fill;
+    int page_remain = TONIEFILE_FRAME_SIZE - page_used;
+
+    // TRACE_INFO("(%" PRIuSIZE " MOD 4096) + 27 + %li + %li;\r\n", ctx->file_pos, ctx->os.lacing_fill, ctx->os.body_fill)
+
+    if (page_remain < TONIEFILE_PAD_END)
+    {
+        if (page_remain)
         {
-            int page_used = (ctx->file_pos % TONIEFILE_FRAME_SIZE) + OGG_HEADER_LENGTH + ctx->os.lacing_fill - ctx->os.lacing_returned + ctx->os.body_fill - ctx->os.body_returned;
-            int page_remain = TONIEFILE_FRAME_SIZE - page_used;
-
-            int frame_payload = (page_remain / 256) * 255 + (page_remain % 256) - 1;
-            int reconstructed = (frame_payload / 255) + 1 + frame_payload;
-
-            /* when due to segment sizes we would end up with a 1 byte gap, make sure that the next run will have at least 64 byte.
-             * reason why this could happen is that "adding one byte" would require one segment more and thus occupies two byte more.
-             * if this would happen, just reduce the calculated free space such that there is room for another segment.
-             */
-            bool frame_payload_minified = false;
-            if (page_remain != reconstructed && frame_payload > OPUS_PACKET_MINSIZE)
-            {
-                frame_payload -= OPUS_PACKET_MINSIZE;
-                frame_payload_minified = true;
-            }
-            if (frame_payload < OPUS_PACKET_MINSIZE - 1)
+            TRACE_INFO("unexpected small padding at %" PRIu64 " (%" PRIu64 " s)\r\n", ctx->ogg_granule_position, ctx->ogg_granule_position / OPUS_FRAME_SIZE * 60 / 1000)
+            return ERROR_FAILURE;
+        }
+
+        ogg_page og;
+        while (ogg_stream_flush(&ctx->os, &og))
+        {
+            if (toniefile_emit(ctx, og.header, og.header_len) != NO_ERROR)
             {
-                TRACE_ERROR("Not enough space in this block, mini=%X, frame_payload=%i, page_remain=%i, reconstructed=%i\r\n", frame_payload_minified, frame_payload, page_remain, reconstructed);
                 return ERROR_FAILURE;
             }
-
-            int frame_len = opus_encode(ctx->enc, ctx->audio_frame, OPUS_FRAME_SIZE, output_frame, frame_payload);
-            // TRACE_INFO("opus_encode: %d/%d\r\n", frame_len, frame_payload);
-
-            if (frame_len <= 0)
+            if (toniefile_emit(ctx, og.body, og.body_len) != NO_ERROR)
             {
-                TRACE_ERROR("Cannot encode: %s\r\n", opus_strerror(frame_len));
                 return ERROR_FAILURE;
             }
+            size_t prev = ctx->file_pos;
+            ctx->file_pos += og.header_len + og.body_len;
+            ctx->audio_length += og.header_len + og.body_len;
+            // TRACE_INFO("Header_len %" PRIuSIZE " Body_len %" PRIuSIZE " prev %" PRIuSIZE " File_pos %" PRIuSIZE "\r\n", og.header_len, og.body_len, prev, ctx->file_pos);
 
-            /* we did not exactly hit the destination size and are close to block size. pad packet */
-            if (frame_payload - frame_len < OPUS_PACKET_PAD)
-            {
-                int target_length = frame_payload;
+            sha1Update(&ctx->sha1, og.header, og.header_len);
+            sha1Update(&ctx->sha1, og.body, og.body_len);
 
-                int ret = opus_packet_pad(output_frame, frame_len, target_length);
-                // TRACE_INFO("opus_packet_pad: %d -> %d\r\n", frame_len, target_length);
-                if (ret < 0)
+            if ((prev / TONIEFILE_FRAME_SIZE) != (ctx->file_pos / TONIEFILE_FRAME_SIZE))
+            {
+                ctx->taf_block_num++;
+                if (ctx->file_pos % TONIEFILE_FRAME_SIZE)
                 {
-                    TRACE_ERROR("Cannot pad: %s\r\n", opus_strerror(ret));
+                    TRACE_ERROR("Block alignment mismatch 0x%08" PRIXSIZE "\r\n", ctx->file_pos)
                     return ERROR_FAILURE;
                 }
-                frame_len = target_length;
             }
+        }
+    }
 
-            /* we have to retrieve the actually encoded samples in this frame */
-            int frames = opus_packet_get_samples_per_frame(output_frame, OPUS_SAMPLING_RATE) * opus_packet_get_nb_frames(output_frame, frame_len);
-            if (frames != OPUS_FRAME_SIZE)
-            {
-                TRACE_ERROR("frame count unexpected: %d instead of %d\r\n", frames, OPUS_FRAME_SIZE);
-            }
-            ctx->ogg_granule_position += frames;
-
-            /* now fill output page */
-            ogg_packet op;
-            op.packet = output_frame;
-            op.bytes = frame_len;
-            op.b_o_s = 0;
-            op.e_o_s = 0;
-            op.granulepos = ctx->ogg_granule_position;
-            op.packetno = ctx->ogg_packet_count;
-
-            ctx->ogg_packet_count++;
-
-            ogg_stream_packetin(&ctx->os, &op);
+    return NO_ERROR;
+}
 
-            page_used = (ctx->file_pos % TONIEFILE_FRAME_SIZE) + OGG_HEADER_LENGTH + ctx->os.lacing_fill + ctx->os.body_fill;
-            page_remain = TONIEFILE_FRAME_SIZE - page_used;
+/* encodes the buffered audio frame, fill pads the packet up to the end of the page */
+static error_t toniefile_encode_frame(toniefile_t *ctx, bool_t fill)
+{
+    uint8_t output_frame[TONIEFILE_FRAME_SIZE];
 
-            // TRACE_INFO("(%" PRIuSIZE " MOD 4096) + 27 + %li + %li;\r\n", ctx->file_pos, ctx->os.lacing_fill, ctx->os.body_fill)
+    int frame_payload = toniefile_frame_payload(ctx, 0);
+    if (frame_payload < OPUS_PACKET_MINSIZE - 1)
+    {
+        TRACE_ERROR("Not enough space in this block, frame_payload=%i\r\n", frame_payload);
+        return ERROR_FAILURE;
+    }
 
-            if (page_remain < TONIEFILE_PAD_END)
-            {
-                if (page_remain)
-                {
-                    TRACE_INFO("unexpected small padding at %" PRIu64 " (%" PRIu64 " s)\r\n", ctx->ogg_granule_position, ctx->ogg_granule_position / OPUS_FRAME_SIZE * 60 / 1000)
-                    return ERROR_FAILURE;
-                }
+    int frame_len = opus_encode(ctx->enc, ctx->audio_frame, OPUS_FRAME_SIZE, output_frame, frame_payload);
+    // TRACE_INFO("opus_encode: %d/%d\r\n", frame_len, frame_payload);
 
-                ogg_page og;
-                while (ogg_stream_flush(&ctx->os, &og))
-                {
-                    if (fsWriteFile(ctx->file, og.header, og.header_len) != NO_ERROR)
-                    {
-                        return ERROR_FAILURE;
-                    }
-                    if (fsWriteFile(ctx->file, og.body, og.body_len) != NO_ERROR)
-                    {
-                        return ERROR_FAILURE;
-                    }
-                    size_t prev = ctx->file_pos;
-                    ctx->file_pos += og.header_len + og.body_len;
-                    ctx->audio_length += og.header_len + og.body_len;
-                    // TRACE_INFO("Header_len %" PRIuSIZE " Body_len %" PRIuSIZE " prev %" PRIuSIZE " File_pos %" PRIuSIZE "\r\n", og.header_len, og.body_len, prev, ctx->file_pos);
+    if (frame_len <= 0)
+    {
+        TRACE_ERROR("Cannot encode: %s\r\n", opus_strerror(frame_len));
+        return ERROR_FAILURE;
+    }
 
-                    sha1Update(&ctx->sha1, og.header, og.header_len);
-                    sha1Update(&ctx->sha1, og.body, og.body_len);
+    /* we did not exactly hit the destination size and are close to block size. pad packet */
+    if (fill || frame_payload - frame_len < OPUS_PACKET_PAD)
+    {
+        int target_length = frame_payload;
 
-                    if ((prev / TONIEFILE_FRAME_SIZE) != (ctx->file_pos / TONIEFILE_FRAME_SIZE))
-                    {
-                        ctx->taf_block_num++;
-                        if (ctx->file_pos % TONIEFILE_FRAME_SIZE)
-                        {
-                            TRACE_ERROR("Block alignment mismatch 0x%08" PRIXSIZE "\r\n", ctx->file_pos)
-                            return ERROR_FAILURE;
-                        }
-                    }
-                }
-            }
-            /* fill again */
-            ctx->audio_frame_used = 0;
+        int ret = opus_packet_pad(output_frame, frame_len, target_length);
+        // TRACE_INFO("opus_packet_pad: %d -> %d\r\n", frame_len, target_length);
+        if (ret < 0)
+        {
+            TRACE_ERROR("Cannot pad: %s\r\n", opus_strerror(ret));
+            return ERROR_FAILURE;
         }
+        frame_len = target_length;
     }
 
-    return NO_ERROR;
+    /* fill again */
+    ctx->audio_frame_used = 0;
+
+    return toniefile_packet_write(ctx, output_frame, frame_len);
 }
 
-// Function to decode audio from FFmpeg's standard output
-FILE *ffmpeg_decode_audio_start(const char *input_source)
+/* encodes the buffered samples, padded with silence, into a packet that fills the page */
+static error_t toniefile_encode_fill(toniefile_t *ctx)
 {
-    return ffmpeg_decode_audio_start_skip(input_source, 0);
+    osMemset(&ctx->audio_frame[ctx->audio_frame_used * OPUS_CHANNELS], 0x00, (OPUS_FRAME_SIZE - ctx->audio_frame_used) * OPUS_CHANNELS * sizeof(opus_int16));
+    return toniefile_encode_frame(ctx, true);
 }
 
-FILE *ffmpeg_decode_audio_start_skip(const char *input_source, size_t skip_seconds)
+/* writes the held back remux packet, fill pads it up to the end of the page */
+static error_t toniefile_remux_commit(toniefile_t *ctx, bool_t fill)
 {
-#ifdef FFMPEG_DECODING
-    TRACE_INFO("Start ffmpeg for decoding...\r\n");
-
-    // Construct the FFmpeg command based on the input source
-    char ffmpeg_command[1024]; // Adjust the buffer size as needed
-    snprintf(ffmpeg_command, sizeof(ffmpeg_command), "ffmpeg -i \"%s\" -f s16le -acodec pcm_s16le -ar 48000 -ac 2 -ss %" PRIuSIZE " -", input_source, skip_seconds);
+    int frame_len = (int)ctx->remux_length;
+    int frame_payload = toniefile_frame_payload(ctx, 0);
 
-    FILE *ffmpeg_pipe = NULL;
+    ctx->remux_length = 0;
+    if (frame_payload < frame_len)
+    {
+        TRACE_ERROR("Remuxed packet does not fit, frame_payload=%i, frame_len=%i\r\n", frame_payload, frame_len);
+        return ERROR_FAILURE;
+    }
 
-    // Open a pipe to execute the FFmpeg command
-    ffmpeg_pipe = osPopen(ffmpeg_command, "r");
-    if (ffmpeg_pipe == NULL)
+    /* same rule as for encoded packets, never leave less than a minimal packet behind */
+    if (fill || frame_payload - frame_len < OPUS_PACKET_PAD)
     {
-        TRACE_ERROR("Could not open FFmpeg pipe\n");
-        return ffmpeg_pipe;
+        int ret = opus_packet_pad(ctx->remux_packet, frame_len, frame_payload);
+        if (ret < 0)
+        {
+            TRACE_ERROR("Cannot pad: %s\r\n", opus_strerror(ret));
+            return ERROR_FAILURE;
+        }
+        frame_len = frame_payload;
     }
-    return ffmpeg_pipe;
-#else
-    return NULL;
-#endif
+
+    return toniefile_packet_write(ctx, ctx->remux_packet, frame_len);
 }
 
-error_t ffmpeg_decode_audio_end(FILE *ffmpeg_pipe, error_t error)
+error_t toniefile_remux(toniefile_t *ctx, const uint8_t *packet, size_t length)
 {
-#ifdef FFMPEG_DECODING
-    if (ffmpeg_pipe == NULL)
-        return ERROR_ABORTED;
-    /*
-    char line[1024]; // Adjust the buffer size as needed
-    if (error == NO_ERROR)
+    if (length == 0 || length > TONIEFILE_REMUX_PACKET_MAX)
     {
-        TRACE_INFO("%s", "");
+        return ERROR_INVALID_LENGTH;
     }
-    else
+
+    error_t error = NO_ERROR;
+    if (ctx->remux_length > 0)
     {
-        TRACE_ERROR("%s", "");
+        /* the held back packet gets padded to the end of the page if this one would not fit behind it */
+        int pending_used = ctx->remux_length / 255 + 1 + ctx->remux_length;
+        int lacing = ctx->os.lacing_fill - ctx->os.lacing_returned + ctx->remux_length / 255 + 1 + length / 255 + 1;
+        bool_t fill = toniefile_frame_payload(ctx, pending_used) < (int)length || lacing > TONIEFILE_REMUX_LACING_MAX;
+
+        error = toniefile_remux_commit(ctx, fill);
     }
-    while (fgets(line, sizeof(line), ffmpeg_pipe) != NULL)
+    else if (ctx->audio_frame_used > 0 || toniefile_frame_payload(ctx, 0) < (int)length)
     {
-        if (error == NO_ERROR)
-        {
-            TRACE_INFO_RESUME("%s", (const char *)line);
-        }
-        else
-        {
-            TRACE_ERROR_RESUME("%s", (const char *)line);
-        }
+        /* switching from encoding, finish the page with the remaining (or silent) samples */
+        error = toniefile_encode_fill(ctx);
     }
-    if (error == NO_ERROR)
+    if (error != NO_ERROR)
     {
-        TRACE_INFO_RESUME("%s", "\r\n");
+        return error;
     }
-    else
-    {
-        TRACE_ERROR_RESUME("%s", "\r\n");
-    }*/
-    // Close the FFmpeg pipe
-    int error_code = osPclose(ffmpeg_pipe);
 
-    TRACE_INFO("Stopped ffmpeg with error code=%i...\r\n", error_code);
+    osMemcpy(ctx->remux_packet, packet, length);
+    ctx->remux_length = length;
+
     return NO_ERROR;
-#else
-    return ERROR_NOT_IMPLEMENTED;
-#endif
 }
 
-error_t ffmpeg_decode_audio(FILE *ffmpeg_pipe, int16_t *buffer, size_t size, size_t *blocks_read)
+error_t toniefile_flush(toniefile_t *ctx)
 {
-    if (ffmpeg_pipe == NULL)
-        return ERROR_ABORTED;
+    if (ctx->remux_length > 0)
+    {
+        return toniefile_remux_commit(ctx, true);
+    }
+    if (ctx->audio_frame_used > 0 || ctx->os.lacing_fill > ctx->os.lacing_returned)
+    {
+        return toniefile_encode_fill(ctx);
+    }
+    return NO_ERROR;
+}
 
-    *blocks_read = 0;
-    size_t chunk_size = 4096; // Adjust the chunk size as needed
-    // Read and process audio data from the FFmpeg pipe
-    while (*blocks_read < size)
+void toniefile_set_tee(toniefile_t *ctx, toniefile_t *tee)
+{
+    ctx->tee = tee;
+}
+
+error_t toniefile_encode(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available)
+{
+    int samples_processed = 0;
+
+    if (ctx->remux_length > 0)
     {
-        // Determine how many samples to read in the current iteration
-        size_t remaining_samples = size - *blocks_read;
-        size_t samples_to_read = (remaining_samples < chunk_size) ? remaining_samples : chunk_size;
+        error_t error = toniefile_remux_commit(ctx, false);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+    }
 
-        // Read a chunk of audio data from the pipe
-        size_t read = fread(&buffer[*blocks_read], sizeof(int16_t), samples_to_read, ffmpeg_pipe);
+    // TRACE_INFO("samples_available: %" PRIuSIZE "\n", samples_available);
+    while (samples_processed < samples_available)
+    {
+        /* get the maximum copyable number of samples */
+        size_t samples = OPUS_FRAME_SIZE - ctx->audio_frame_used;
+        size_t samples_remaining = samples_available - samples_processed;
+        if (samples > samples_remaining)
+        {
+            samples = samples_remaining;
+        }
+        // TRACE_INFO("  samples: %lu (%u/%" PRIuSIZE ")\n", samples, samples_processed, samples_available);
+
+        toniefile_samples_copy(ctx->audio_frame, &ctx->audio_frame_used, sample_buffer, &samples_processed, samples);
 
-        if (read == 0)
+        /* buffer full? */
+        if (ctx->audio_frame_used >= OPUS_FRAME_SIZE)
         {
-            if (*blocks_read > 0)
-            {
-                return NO_ERROR;
-            }
-            else
+            error_t error = toniefile_encode_frame(ctx, false);
+            if (error != NO_ERROR)
             {
-                return ERROR_END_OF_STREAM; // End of audio data
+                return error;
             }
         }
-        *blocks_read += read;
     }
+
     return NO_ERROR;
 }
 
@@ -635,23 +804,86 @@ error_t ffmpeg_convert(char source[99][PATH_LEN], size_t source_len, size_t *cur
 {
     bool_t active = true;
     bool_t sweep = false;
-    return ffmpeg_stream(source, source_len, current_source, target_taf, skip_seconds, &active, &sweep, false);
+    return ffmpeg_stream(source, source_len, current_source, target_taf, skip_seconds, &active, &sweep, false, NULL);
 }
 
-error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds, bool_t *active, bool_t *sweep, bool_t append)
+/* a decoded source is encoded into its chapter TAF, which copies every packet into the target */
+static toniefile_t *ffmpeg_stream_chapter_open(char *const *chapter_cache, size_t source, ffmpeg_decoder_t *decoder, toniefile_t *taf, char **chapter_tmp)
 {
+    if (chapter_cache == NULL || chapter_cache[source] == NULL || ffmpeg_decoder_can_remux(decoder))
+    {
+        return NULL;
+    }
+
+    /* playlists sharing a source may encode it at the same time */
+    *chapter_tmp = custom_asprintf("%s.%p.tmp", chapter_cache[source], (void *)taf);
+    toniefile_t *chapter = toniefile_create(*chapter_tmp, 0, false);
+    if (chapter == NULL)
+    {
+        TRACE_WARNING("Could not create chapter cache %s\r\n", *chapter_tmp);
+        osFreeMem(*chapter_tmp);
+        *chapter_tmp = NULL;
+        return NULL;
+    }
+    toniefile_set_tee(chapter, taf);
+
+    return chapter;
+}
+
+static error_t ffmpeg_stream_chapter_close(toniefile_t **chapter, char **chapter_tmp, const char *chapter_path, bool_t keep)
+{
+    if (*chapter == NULL)
+    {
+        return NO_ERROR;
+    }
+
+    /* the rest of the chapter goes to the target as well */
+    error_t error = keep ? toniefile_flush(*chapter) : NO_ERROR;
+    if (toniefile_close(*chapter) != NO_ERROR && error == NO_ERROR)
+    {
+        error = ERROR_WRITE_FAILED;
+    }
+
+    if (keep && error == NO_ERROR)
+    {
+        fsMoveFile(*chapter_tmp, chapter_path, true);
+    }
+    else
+    {
+        fsDeleteFile(*chapter_tmp);
+    }
+    osFreeMem(*chapter_tmp);
+    *chapter_tmp = NULL;
+    *chapter = NULL;
+
+    return error;
+}
+
+error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *current_source, const char *target_taf, size_t skip_seconds, bool_t *active, bool_t *sweep, bool_t append, const ffmpeg_stream_opts_t *opts)
+{
+    static const ffmpeg_stream_opts_t no_opts = {0};
+    if (opts == NULL)
+    {
+        opts = &no_opts;
+    }
+    completion_t *progress = opts->progress;
+    stream_ring_t *ring = opts->ring;
+    volatile uint64_t *encoded = opts->encoded;
+    char *const *chapter_cache = opts->chapter_cache;
+
     TRACE_INFO("Encode %" PRIuSIZE " sources: \r\n", source_len);
     for (size_t i = 0; i < source_len; i++)
     {
         TRACE_INFO(" %s\r\n", source[i]);
     }
-    TRACE_INFO("as TAF to %s\r\n", target_taf);
+    TRACE_INFO("as TAF to %s\r\n", target_taf ? target_taf : "memory");
     if (skip_seconds > 0)
     {
         TRACE_INFO(" and skip %" PRIuSIZE " seconds\r\n", skip_seconds);
     }
 
-    FILE *ffmpeg_pipe = NULL;
+    ffmpeg_decoder_t *decoder = NULL;
+    ffmpeg_decoder_t *next_decoder = NULL;
     error_t error = NO_ERROR;
     size_t cs;
     if (current_source == NULL)
@@ -659,17 +891,19 @@ error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *curr
         current_source = &cs;
     }
     *current_source = 0;
-    ffmpeg_pipe = ffmpeg_decode_audio_start_skip(source[*current_source], skip_seconds);
-    if (ffmpeg_pipe == NULL)
+    decoder = ffmpeg_decoder_start(source[*current_source], skip_seconds);
+    if (decoder == NULL)
     {
+        stream_ring_close(ring);
         return ERROR_ABORTED;
     }
 
-    toniefile_t *taf = toniefile_create(target_taf, time(NULL) - TEDDY_BENCH_AUDIO_ID_DEDUCT, append);
+    toniefile_t *taf = toniefile_create_stream(target_taf, time(NULL) - TEDDY_BENCH_AUDIO_ID_DEDUCT, append, ring, progress);
     if (!taf)
     {
         TRACE_ERROR("toniefile_create() failed, aborting\r\n");
-        ffmpeg_decode_audio_end(ffmpeg_pipe, error);
+        ffmpeg_decoder_end(decoder);
+        stream_ring_close(ring);
         return ERROR_ABORTED;
     }
 
@@ -677,10 +911,59 @@ error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *curr
     size_t samples = sizeof(sample_buffer) / sizeof(uint16_t);
     size_t blocks_read = 0;
 
+    /* decode the next source while the current one is encoded */
+    if (*current_source + 1 < source_len)
+    {
+        next_decoder = ffmpeg_decoder_prefetch(source[*current_source + 1]);
+    }
+    char *chapter_tmp = NULL;
+    toniefile_t *chapter = ffmpeg_stream_chapter_open(chapter_cache, *current_source, decoder, taf, &chapter_tmp);
+
     *active = true;
+    if (progress)
+    {
+        completion_signal(progress);
+    }
     while (*active)
     {
-        error = ffmpeg_decode_audio(ffmpeg_pipe, sample_buffer, samples, &blocks_read);
+        if (ffmpeg_decoder_can_remux(decoder))
+        {
+            /* opus sources in the TAF format are copied without re-encoding */
+            const uint8_t *packet = NULL;
+            size_t packet_length = 0;
+            error = ffmpeg_decoder_read_packet(decoder, &packet, &packet_length);
+            if (error == NO_ERROR)
+            {
+                if (*sweep == false)
+                {
+                    error = toniefile_remux(taf, packet, packet_length);
+                    if (error != NO_ERROR)
+                    {
+                        TRACE_ERROR("Could not remux packet error=%s\r\n", error2text(error));
+                        break;
+                    }
+                    if (encoded)
+                    {
+                        *encoded += OPUS_FRAME_SIZE;
+                    }
+                }
+                continue;
+            }
+            if (error != ERROR_END_OF_STREAM)
+            {
+                /* decode from here on */
+                continue;
+            }
+        }
+        else
+        {
+            error = ffmpeg_decoder_read(decoder, sample_buffer, samples, &blocks_read);
+        }
+        if (error == ERROR_WOULD_BLOCK)
+        {
+            /* source stalled, check the active flag again */
+            continue;
+        }
         if (error != NO_ERROR && error != ERROR_END_OF_STREAM)
         {
             TRACE_ERROR("Could not decode sample error=%s read=%" PRIuSIZE "\r\n", error2text(error), blocks_read);
@@ -688,19 +971,30 @@ error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *curr
         }
         else if (error == ERROR_END_OF_STREAM)
         {
-            error = NO_ERROR;
+            error = ffmpeg_stream_chapter_close(&chapter, &chapter_tmp, chapter_cache ? chapter_cache[*current_source] : NULL, true);
+            if (error != NO_ERROR)
+            {
+                TRACE_ERROR("Could not finish chapter error=%s\r\n", error2text(error));
+                break;
+            }
             (*current_source)++;
             if (*current_source < source_len)
             {
-                ffmpeg_decode_audio_end(ffmpeg_pipe, error);
+                ffmpeg_decoder_end(decoder);
                 TRACE_INFO("Decode next source: %s\r\n", source[*current_source]);
-                ffmpeg_pipe = ffmpeg_decode_audio_start(source[*current_source]);
-                if (ffmpeg_pipe == NULL)
+                decoder = next_decoder ? next_decoder : ffmpeg_decoder_start(source[*current_source], 0);
+                next_decoder = NULL;
+                if (decoder == NULL)
                 {
                     error = ERROR_ABORTED;
                     break;
                 }
+                if (*current_source + 1 < source_len)
+                {
+                    next_decoder = ffmpeg_decoder_prefetch(source[*current_source + 1]);
+                }
                 toniefile_new_chapter(taf);
+                chapter = ffmpeg_stream_chapter_open(chapter_cache, *current_source, decoder, taf, &chapter_tmp);
                 continue;
             }
             else
@@ -711,7 +1005,11 @@ error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *curr
         }
         if (*sweep == false)
         {
-            error = toniefile_encode(taf, sample_buffer, blocks_read / OPUS_CHANNELS);
+            error = toniefile_encode(chapter ? chapter : taf, sample_buffer, blocks_read / OPUS_CHANNELS);
+            if (encoded)
+            {
+                *encoded += blocks_read / OPUS_CHANNELS;
+            }
         }
         if (error != NO_ERROR && error != ERROR_END_OF_STREAM)
         {
@@ -722,14 +1020,22 @@ error_t ffmpeg_stream(char source[99][PATH_LEN], size_t source_len, size_t *curr
     if (!(*active))
     {
         TRACE_INFO("Encoding aborted, active flag set to false\r\n");
+        /* the TAF is incomplete, callers must not keep it */
+        if (error == NO_ERROR)
+        {
+            error = ERROR_ABORTED;
+        }
     }
     else
     {
         *active = false;
     }
 
-    ffmpeg_decode_audio_end(ffmpeg_pipe, error);
+    ffmpeg_stream_chapter_close(&chapter, &chapter_tmp, NULL, false);
+    ffmpeg_decoder_end(next_decoder);
+    ffmpeg_decoder_end(decoder);
     toniefile_close(taf);
+    stream_ring_close(ring);
 
     TRACE_INFO("TAF encoding successful\r\n");
 
@@ -743,7 +1049,13 @@ void ffmpeg_stream_task(void *param)
 
     char source[99][PATH_LEN]; // waste memory, but warning otherwise
     strncpy(source[0], ffmpeg_ctx->source, PATH_LEN - 1);
-    stream_ctx->error = ffmpeg_stream(source, 1, &stream_ctx->current_source, ffmpeg_ctx->targetFile, ffmpeg_ctx->skip_seconds, &stream_ctx->active, &ffmpeg_ctx->sweep, ffmpeg_ctx->append);
+    const char *targetFile = (!ffmpeg_ctx->ring || ffmpeg_ctx->spill) ? ffmpeg_ctx->targetFile : NULL;
+    ffmpeg_stream_opts_t opts = {
+        .progress = &stream_ctx->completion,
+        .ring = ffmpeg_ctx->ring,
+    };
+    stream_ctx->error = ffmpeg_stream(source, 1, &stream_ctx->current_source, targetFile, ffmpeg_ctx->skip_seconds, &stream_ctx->active, &ffmpeg_ctx->sweep, ffmpeg_ctx->append, &opts);
     stream_ctx->quit = true;
+    completion_complete(&stream_ctx->completion, stream_ctx->error);
     osDeleteTask(OS_SELF_TASK_ID);
 }
\ No newline at end of file
@@ -6,10 +6,15 @@
 #include "handler.h"
 #include "cloud_request.h"
 #include "server_helpers.h"
+#include "gzip_stream.h"
+#include "handler_sse.h"
+#include "mutex_manager.h"
+#include "hash/sha1.h"
 
 #define TONIES_JSON_CACHED 1
 #if TONIES_JSON_CACHED == 1
 static bool toniesJsonInitialized = false;
+static uint32_t toniesJsonVersion = 0;
 static size_t toniesJsonCount = 0;
 static toniesJson_item_t *toniesJsonCache;
 static size_t toniesCustomJsonCount = 0;
@@ -17,6 +22,18 @@ static toniesJson_item_t *toniesCustomJsonCache;
 static char *tonies_json_path;
 static char *tonies_custom_json_path;
 static char *tonies_json_tmp_path;
+static char *tonies_json_meta_path;
+static bool toniesUpdateRunning = false;
+
+/* caches replaced while readers held items from them */
+typedef struct tonies_retired_s
+{
+    toniesJson_item_t *cache;
+    size_t count;
+    struct tonies_retired_s *next;
+} tonies_retired_t;
+static uint32_t toniesJsonReaders = 0;
+static tonies_retired_t *toniesJsonRetired = NULL;
 
 static bool toniesV2JsonInitialized = false;
 static size_t toniesV2JsonCount = 0;
@@ -36,10 +53,12 @@ void tonies_init()
         tonies_json_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIES_JSON_FILE);
         tonies_custom_json_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIES_CUSTOM_JSON_FILE);
         tonies_json_tmp_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIES_JSON_TMP_FILE);
+        tonies_json_meta_path = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TONIES_JSON_META_FILE);
 
         tonies_readJson(tonies_custom_json_path, &toniesCustomJsonCache, &toniesCustomJsonCount);
         tonies_readJson(tonies_json_path, &toniesJsonCache, &toniesJsonCount);
         toniesJsonInitialized = true;
+        toniesJsonVersion++;
     }
 
     if (!toniesV2JsonInitialized)
@@ -89,43 +108,592 @@ void tonies_downloadBody(void *src_ctx, HttpClientContext *cloud_ctx, const char
     }
 }
 
-error_t tonies_update()
+/* state of a tonies.json download, base must stay first as web_request reads it */
+typedef struct
+{
+    cbr_ctx_t base;
+    uint_t status;
+    bool complete;
+    error_t error;
+    char etag[128];
+    char lastModified[64];
+    size_t received;
+    size_t size;
+    size_t reported;
+    Sha1Context sha1;
+} tonies_update_ctx_t;
+
+#define TONIES_UPDATE_REPORT_BYTES (64 * 1024)
+
+static void tonies_updateProgress(const char *state, size_t received, size_t size)
+{
+    char buffer[128];
+    osSnprintf(buffer, sizeof(buffer), "{\"state\":\"%s\",\"received\":%" PRIuSIZE ",\"size\":%" PRIuSIZE "}", state, received, size);
+    sse_sendEvent("ToniesJsonUpdate", buffer, false);
+}
+
+/* validators of the last download, stored as "ETag\nLast-Modified\n" */
+static void tonies_readMeta(char *etag, size_t etagSize, char *lastModified, size_t lastModifiedSize)
+{
+    etag[0] = '\0';
+    lastModified[0] = '\0';
+    if (!fsFileExists(tonies_json_path))
+    {
+        return;
+    }
+
+    char buffer[256];
+    size_t length = 0;
+    FsFile *file = fsOpenFile(tonies_json_meta_path, FS_FILE_MODE_READ);
+    if (file == NULL)
+    {
+        return;
+    }
+    fsReadFile(file, buffer, sizeof(buffer) - 1, &length);
+    fsCloseFile(file);
+    buffer[length] = '\0';
+
+    char *lineEnd = strchr(buffer, '\n');
+    if (lineEnd == NULL)
+    {
+        return;
+    }
+    *lineEnd = '\0';
+    osStrncpy(etag, buffer, etagSize - 1);
+    etag[etagSize - 1] = '\0';
+
+    char *second = lineEnd + 1;
+    lineEnd = strchr(second, '\n');
+    if (lineEnd != NULL)
+    {
+        *lineEnd = '\0';
+    }
+    osStrncpy(lastModified, second, lastModifiedSize - 1);
+    lastModified[lastModifiedSize - 1] = '\0';
+}
+
+static void tonies_writeMeta(const char *etag, const char *lastModified)
+{
+    FsFile *file = fsOpenFile(tonies_json_meta_path, FS_FILE_MODE_WRITE | FS_FILE_MODE_TRUNC);
+    if (file == NULL)
+    {
+        return;
+    }
+    fsWriteFile(file, (void *)etag, osStrlen(etag));
+    fsWriteFile(file, "\n", 1);
+    fsWriteFile(file, (void *)lastModified, osStrlen(lastModified));
+    fsWriteFile(file, "\n", 1);
+    fsCloseFile(file);
+}
+
+static bool tonies_fileSha1(const char *path, uint8_t digest[SHA1_DIGEST_SIZE])
+{
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    Sha1Context sha1;
+    sha1Init(&sha1);
+    uint8_t *buffer = osAllocMem(4096);
+    size_t length = 0;
+    while (buffer != NULL && fsReadFile(file, buffer, 4096, &length) == NO_ERROR && length > 0)
+    {
+        sha1Update(&sha1, buffer, length);
+    }
+    fsCloseFile(file);
+    if (buffer == NULL)
+    {
+        return false;
+    }
+    osFreeMem(buffer);
+    sha1Final(&sha1, digest);
+    return true;
+}
+
+static void tonies_updateRequest(void *src_ctx, HttpClientContext *cloud_ctx)
+{
+    tonies_update_ctx_t *ctx = (tonies_update_ctx_t *)src_ctx;
+
+    if (ctx->etag[0] != '\0')
+    {
+        httpClientAddHeaderField(cloud_ctx, "If-None-Match", ctx->etag);
+    }
+    if (ctx->lastModified[0] != '\0')
+    {
+        httpClientAddHeaderField(cloud_ctx, "If-Modified-Since", ctx->lastModified);
+    }
+}
+
+static void tonies_updateResponse(void *src_ctx, HttpClientContext *cloud_ctx)
+{
+    tonies_update_ctx_t *ctx = (tonies_update_ctx_t *)src_ctx;
+
+    ctx->status = httpClientGetStatus(cloud_ctx);
+    if (ctx->status == 200)
+    {
+        /* the validators are replaced by the ones of the new file, if any */
+        ctx->etag[0] = '\0';
+        ctx->lastModified[0] = '\0';
+    }
+}
+
+static void tonies_updateHeader(void *src_ctx, HttpClientContext *cloud_ctx, const char *header, const char *value)
+{
+    tonies_update_ctx_t *ctx = (tonies_update_ctx_t *)src_ctx;
+
+    if (header == NULL || value == NULL || ctx->status != 200)
+    {
+        return;
+    }
+    if (!osStrcasecmp(header, "ETag"))
+    {
+        osStrncpy(ctx->etag, value, sizeof(ctx->etag) - 1);
+        ctx->etag[sizeof(ctx->etag) - 1] = '\0';
+    }
+    else if (!osStrcasecmp(header, "Last-Modified"))
+    {
+        osStrncpy(ctx->lastModified, value, sizeof(ctx->lastModified) - 1);
+        ctx->lastModified[sizeof(ctx->lastModified) - 1] = '\0';
+    }
+    else if (!osStrcasecmp(header, "Content-Length"))
+    {
+        ctx->size = strtoul(value, NULL, 10);
+    }
+}
+
+static void tonies_updateBody(void *src_ctx, HttpClientContext *cloud_ctx, const char *payload, size_t length, error_t error)
+{
+    tonies_update_ctx_t *ctx = (tonies_update_ctx_t *)src_ctx;
+
+    if (ctx->status != 200 || ctx->error != NO_ERROR)
+    {
+        return;
+    }
+    if (ctx->base.file == NULL)
+    {
+        ctx->base.file = fsOpenFile(tonies_json_tmp_path, FS_FILE_MODE_WRITE | FS_FILE_MODE_TRUNC);
+        if (ctx->base.file == NULL)
+        {
+            TRACE_ERROR("tonies.json (%s) could not be created\r\n", tonies_json_tmp_path);
+            ctx->error = ERROR_FILE_OPENING_FAILED;
+            return;
+        }
+    }
+    if (length > 0)
+    {
+        sha1Update(&ctx->sha1, payload, length);
+        ctx->received += length;
+        ctx->error = fsWriteFile(ctx->base.file, (void *)payload, length);
+        if (ctx->error != NO_ERROR)
+        {
+            TRACE_ERROR("tonies.json (%s) write error=%s\r\n", tonies_json_tmp_path, error2text(ctx->error));
+        }
+    }
+    if (ctx->received - ctx->reported >= TONIES_UPDATE_REPORT_BYTES)
+    {
+        ctx->reported = ctx->received;
+        tonies_updateProgress("downloading", ctx->received, ctx->size);
+    }
+
+    if (error == ERROR_END_OF_STREAM)
+    {
+        ctx->complete = (ctx->error == NO_ERROR);
+    }
+    else if (error != NO_ERROR)
+    {
+        TRACE_ERROR("tonies.json download body error=%s\r\n", error2text(error));
+        ctx->error = error;
+    }
+    if (error != NO_ERROR || ctx->error != NO_ERROR)
+    {
+        fsCloseFile(ctx->base.file);
+        ctx->base.file = NULL;
+    }
+}
+
+static void tonies_cacheAcquire(toniesJson_item_t **cache, size_t *count)
+{
+    mutex_lock(MUTEX_TONIES_CACHE);
+    toniesJsonReaders++;
+    *cache = toniesJsonCache;
+    *count = toniesJsonCount;
+    mutex_unlock(MUTEX_TONIES_CACHE);
+}
+
+static void tonies_freeRetired(tonies_retired_t *retired)
+{
+    while (retired)
+    {
+        tonies_retired_t *next = retired->next;
+        tonies_deinit_base(retired->cache, &retired->count);
+        osFreeMem(retired);
+        retired = next;
+    }
+}
+
+void tonies_read_begin()
+{
+    toniesJson_item_t *cache;
+    size_t count;
+    tonies_cacheAcquire(&cache, &count);
+}
+
+void tonies_read_end()
+{
+    tonies_retired_t *retired = NULL;
+
+    mutex_lock(MUTEX_TONIES_CACHE);
+    if (--toniesJsonReaders == 0)
+    {
+        retired = toniesJsonRetired;
+        toniesJsonRetired = NULL;
+    }
+    mutex_unlock(MUTEX_TONIES_CACHE);
+
+    tonies_freeRetired(retired);
+}
+
+/* replaces the cache with the parsed file, lookups keep working until the swap */
+static void tonies_reload()
+{
+    toniesJson_item_t *cache = NULL;
+    size_t count = 0;
+    tonies_readJson(tonies_json_path, &cache, &count);
+
+    mutex_lock(MUTEX_TONIES_CACHE);
+    toniesJson_item_t *oldCache = toniesJsonCache;
+    size_t oldCount = toniesJsonCount;
+    toniesJsonCache = cache;
+    toniesJsonCount = count;
+    toniesJsonVersion++;
+    if (toniesJsonReaders > 0)
+    {
+        /* freed by the last reader */
+        tonies_retired_t *retired = osAllocMem(sizeof(tonies_retired_t));
+        retired->cache = oldCache;
+        retired->count = oldCount;
+        retired->next = toniesJsonRetired;
+        toniesJsonRetired = retired;
+        oldCache = NULL;
+    }
+    mutex_unlock(MUTEX_TONIES_CACHE);
+
+    if (oldCache)
+    {
+        tonies_deinit_base(oldCache, &oldCount);
+    }
+}
+
+/* performs the GET of uri_path, replaced by a stand-in server in tonies_update_check */
+typedef error_t (*tonies_fetch_t)(const char *uri_path, req_cbr_t *cbr);
+
+static error_t tonies_fetchWeb(const char *uri_path, req_cbr_t *cbr)
+{
+    // TODO: Be sure HTTPS CA is checked!
+    return web_request("api.revvox.de", 443, true, uri_path, NULL, "GET", NULL, 0, NULL, cbr, false, false);
+}
+
+static error_t tonies_updateRun(tonies_fetch_t fetch)
 {
     TRACE_INFO("Updating tonies.json from api.revvox.de...\r\n");
-    cbr_ctx_t ctx;
+    tonies_update_ctx_t ctx;
+    osMemset(&ctx, 0, sizeof(ctx));
     client_ctx_t client_ctx = {
         .settings = get_settings(),
     };
 
-    const char *uri_base = "api.revvox.de";
     const char *uri_path = "/tonies.json?source=teddyCloud&version=" BUILD_GIT_SHORT_SHA;
-    const char *queryString = NULL;
-    fillBaseCtx(NULL, uri_path, queryString, V1_LOG, &ctx, &client_ctx);
+    fillBaseCtx(NULL, uri_path, NULL, V1_LOG, &ctx.base, &client_ctx);
     req_cbr_t cbr = {
         .ctx = &ctx,
-        .body = &tonies_downloadBody,
+        .request = &tonies_updateRequest,
+        .response = &tonies_updateResponse,
+        .header = &tonies_updateHeader,
+        .body = &tonies_updateBody,
     };
 
-    ctx.file = NULL;
+    ctx.base.file = NULL;
+    sha1Init(&ctx.sha1);
+    tonies_readMeta(ctx.etag, sizeof(ctx.etag), ctx.lastModified, sizeof(ctx.lastModified));
+    tonies_updateProgress("started", 0, 0);
+
     fsDeleteFile(tonies_json_tmp_path);
-    // TODO: Be sure HTTPS CA is checked!
-    error_t error = web_request(uri_base, 443, true, uri_path, queryString, "GET", NULL, 0, NULL, &cbr, false, false);
+    error_t error = fetch(uri_path, &cbr);
+    if (ctx.base.file != NULL)
+    {
+        fsCloseFile(ctx.base.file);
+    }
 
-    if (error == NO_ERROR && fsFileExists(tonies_json_tmp_path))
+    if (error == NO_ERROR && ctx.status == 304)
     {
-        fsDeleteFile(tonies_json_path);
-        fsRenameFile(tonies_json_tmp_path, tonies_json_path);
-        TRACE_INFO("... success updating tonies.json from api.revvox.de, reloading\r\n");
-        tonies_deinit();
-        tonies_init();
+        TRACE_INFO("... tonies.json not modified\r\n");
+        tonies_updateProgress("not_modified", 0, 0);
+        return NO_ERROR;
     }
-    else
+    if (error == NO_ERROR && (!ctx.complete || ctx.status != 200))
     {
+        error = ctx.error != NO_ERROR ? ctx.error : ERROR_UNEXPECTED_STATUS;
+    }
+    if (error != NO_ERROR)
+    {
+        fsDeleteFile(tonies_json_tmp_path);
         TRACE_ERROR("... failed updating tonies.json error=%s\r\n", error2text(error));
+        tonies_updateProgress("failed", ctx.received, ctx.size);
+        return error;
     }
+
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    uint8_t digestCurrent[SHA1_DIGEST_SIZE];
+    sha1Final(&ctx.sha1, digest);
+    tonies_writeMeta(ctx.etag, ctx.lastModified);
+
+    if (tonies_fileSha1(tonies_json_path, digestCurrent) && !osMemcmp(digest, digestCurrent, SHA1_DIGEST_SIZE))
+    {
+        fsDeleteFile(tonies_json_tmp_path);
+        TRACE_INFO("... tonies.json unchanged\r\n");
+        tonies_updateProgress("unchanged", ctx.received, ctx.size);
+        return NO_ERROR;
+    }
+
+    fsDeleteFile(tonies_json_path);
+    fsRenameFile(tonies_json_tmp_path, tonies_json_path);
+    TRACE_INFO("... success updating tonies.json from api.revvox.de, reloading\r\n");
+    tonies_updateProgress("parsing", ctx.received, ctx.size);
+    tonies_reload();
+    if (settings_get_bool("core.gzip_precompress"))
+    {
+        gzip_precompress_file(tonies_json_path);
+    }
+    tonies_updateProgress("done", ctx.received, ctx.size);
+
+    return NO_ERROR;
+}
+
+static bool tonies_updateAcquire()
+{
+    mutex_lock(MUTEX_TONIES_UPDATE);
+    bool acquired = !toniesUpdateRunning;
+    toniesUpdateRunning = true;
+    mutex_unlock(MUTEX_TONIES_UPDATE);
+    return acquired;
+}
+
+static void tonies_updateRelease()
+{
+    mutex_lock(MUTEX_TONIES_UPDATE);
+    toniesUpdateRunning = false;
+    mutex_unlock(MUTEX_TONIES_UPDATE);
+}
+
+error_t tonies_update()
+{
+    if (!tonies_updateAcquire())
+    {
+        return ERROR_ALREADY_RUNNING;
+    }
+    error_t error = tonies_updateRun(&tonies_fetchWeb);
+    tonies_updateRelease();
     return error;
 }
 
+static void tonies_updateTask(void *param)
+{
+    tonies_updateRun(&tonies_fetchWeb);
+    tonies_updateRelease();
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+error_t tonies_update_start()
+{
+    if (!tonies_updateAcquire())
+    {
+        return ERROR_ALREADY_RUNNING;
+    }
+    if (osCreateTask("ToniesUpdate", &tonies_updateTask, NULL, 16 * 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Failed to start tonies.json update task\r\n");
+        tonies_updateRelease();
+        return ERROR_OUT_OF_RESOURCES;
+    }
+    return NO_ERROR;
+}
+
+/* stand-in for api.revvox.de, answers 304 when the request carries the current ETag */
+typedef struct
+{
+    const char *etag;
+    const char *body;
+    /* If-None-Match of the last request, empty if it had none */
+    char ifNoneMatch[128];
+    uint_t status;
+} tonies_check_server_t;
+
+static tonies_check_server_t toniesCheckServer;
+
+static error_t tonies_fetchCheck(const char *uri_path, req_cbr_t *cbr)
+{
+    tonies_check_server_t *server = &toniesCheckServer;
+    HttpClientContext http;
+
+    httpClientInit(&http);
+    httpClientCreateRequest(&http);
+    httpClientSetUri(&http, uri_path);
+    if (cbr->request)
+    {
+        cbr->request(cbr->ctx, &http);
+    }
+
+    /* take the validator from the formatted request, as the server would see it */
+    server->ifNoneMatch[0] = '\0';
+    http.buffer[MIN(http.bufferLen, sizeof(http.buffer) - 1)] = '\0';
+    const char *field = osStrstr(http.buffer, "If-None-Match: ");
+    if (field != NULL)
+    {
+        field += osStrlen("If-None-Match: ");
+        const char *end = osStrstr(field, "\r\n");
+        size_t length = end != NULL ? (size_t)(end - field) : osStrlen(field);
+        length = MIN(length, sizeof(server->ifNoneMatch) - 1);
+        osMemcpy(server->ifNoneMatch, field, length);
+        server->ifNoneMatch[length] = '\0';
+    }
+
+    server->status = osStrcmp(server->ifNoneMatch, server->etag) ? 200 : 304;
+    http.statusCode = server->status;
+    cbr->response(cbr->ctx, &http);
+    if (server->status == 200)
+    {
+        char length[16];
+        osSnprintf(length, sizeof(length), "%" PRIuSIZE, osStrlen(server->body));
+        cbr->header(cbr->ctx, &http, "ETag", server->etag);
+        cbr->header(cbr->ctx, &http, "Content-Length", length);
+    }
+    cbr->header(cbr->ctx, &http, NULL, NULL);
+
+    if (server->status == 200)
+    {
+        /* in two pieces, like a body spread over several reads */
+        size_t half = osStrlen(server->body) / 2;
+        cbr->body(cbr->ctx, &http, server->body, half, NO_ERROR);
+        cbr->body(cbr->ctx, &http, &server->body[half], osStrlen(server->body) - half, NO_ERROR);
+    }
+    cbr->body(cbr->ctx, &http, NULL, 0, ERROR_END_OF_STREAM);
+    httpClientDeinit(&http);
+
+    return NO_ERROR;
+}
+
+static void tonies_checkExpect(bool ok, const char *what, uint32_t *checks, uint32_t *failures)
+{
+    (*checks)++;
+    if (!ok)
+    {
+        TRACE_ERROR("Check failed: %s\r\n", what);
+        (*failures)++;
+    }
+}
+
+static bool tonies_checkFile(const char *content)
+{
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    uint8_t expected[SHA1_DIGEST_SIZE];
+    sha1Compute(content, osStrlen(content), expected);
+    return tonies_fileSha1(tonies_json_path, digest) && !osMemcmp(digest, expected, SHA1_DIGEST_SIZE);
+}
+
+static bool tonies_checkMeta(const char *etag)
+{
+    char storedEtag[128];
+    char storedLastModified[64];
+    tonies_readMeta(storedEtag, sizeof(storedEtag), storedLastModified, sizeof(storedLastModified));
+    return !osStrcmp(storedEtag, etag);
+}
+
+static bool tonies_checkHasModel(const char *model)
+{
+    return tonies_byModel((char *)model) != NULL;
+}
+
+error_t tonies_update_check()
+{
+    const char *first = "[{\"no\":\"1\",\"model\":\"check-1\",\"audio_id\":[\"1\"],\"hash\":[],\"title\":\"First\"}]";
+    const char *second = "[{\"no\":\"2\",\"model\":\"check-2\",\"audio_id\":[\"2\"],\"hash\":[],\"title\":\"Second\"}]";
+    uint32_t checks = 0;
+    uint32_t failures = 0;
+
+    /* works on scratch paths, the real tonies.json and its meta file are not touched */
+    char *dir = custom_asprintf("%s%ctonies_check", settings_get_string("internal.configdirfull"), PATH_SEPARATOR);
+    char *jsonPath = tonies_json_path;
+    char *tmpPath = tonies_json_tmp_path;
+    char *metaPath = tonies_json_meta_path;
+    tonies_json_path = custom_asprintf("%s%c%s", dir, PATH_SEPARATOR, TONIES_JSON_FILE);
+    tonies_json_tmp_path = custom_asprintf("%s%c%s", dir, PATH_SEPARATOR, TONIES_JSON_TMP_FILE);
+    tonies_json_meta_path = custom_asprintf("%s%c%s", dir, PATH_SEPARATOR, TONIES_JSON_META_FILE);
+    fsCreateDir(dir);
+    fsDeleteFile(tonies_json_path);
+    fsDeleteFile(tonies_json_meta_path);
+
+    toniesCheckServer.etag = "\"check-1\"";
+    toniesCheckServer.body = first;
+    uint32_t version = tonies_version();
+    error_t error = tonies_updateRun(&tonies_fetchCheck);
+    tonies_checkExpect(error == NO_ERROR && toniesCheckServer.status == 200 && toniesCheckServer.ifNoneMatch[0] == '\0', "first request has no validator and gets 200", &checks, &failures);
+    tonies_checkExpect(tonies_checkFile(first) && tonies_checkMeta("\"check-1\""), "200 stores the file and its ETag", &checks, &failures);
+    tonies_checkExpect(tonies_version() != version && tonies_checkHasModel("check-1"), "200 swaps in the cache", &checks, &failures);
+
+    version = tonies_version();
+    toniesJson_item_t *cache = toniesJsonCache;
+    error = tonies_updateRun(&tonies_fetchCheck);
+    tonies_checkExpect(error == NO_ERROR && toniesCheckServer.status == 304 && !osStrcmp(toniesCheckServer.ifNoneMatch, "\"check-1\""), "second request sends the stored ETag and gets 304", &checks, &failures);
+    tonies_checkExpect(tonies_checkFile(first) && tonies_checkMeta("\"check-1\"") && !fsFileExists(tonies_json_tmp_path), "304 leaves the file and meta file unchanged", &checks, &failures);
+    tonies_checkExpect(tonies_version() == version && toniesJsonCache == cache && tonies_checkHasModel("check-1"), "304 keeps the cache", &checks, &failures);
+
+    toniesCheckServer.etag = "\"check-2\"";
+    toniesCheckServer.body = second;
+    error = tonies_updateRun(&tonies_fetchCheck);
+    tonies_checkExpect(error == NO_ERROR && toniesCheckServer.status == 200 && !osStrcmp(toniesCheckServer.ifNoneMatch, "\"check-1\""), "changed file gets 200", &checks, &failures);
+    tonies_checkExpect(tonies_checkFile(second) && tonies_checkMeta("\"check-2\""), "200 replaces the file and its ETag", &checks, &failures);
+    tonies_checkExpect(tonies_version() != version && tonies_checkHasModel("check-2") && !tonies_checkHasModel("check-1"), "200 swaps in the new cache", &checks, &failures);
+
+    /* a new ETag for identical content only updates the meta file */
+    version = tonies_version();
+    toniesCheckServer.etag = "\"check-3\"";
+    error = tonies_updateRun(&tonies_fetchCheck);
+    tonies_checkExpect(error == NO_ERROR && tonies_checkFile(second) && tonies_checkMeta("\"check-3\""), "identical body only updates the ETag", &checks, &failures);
+    tonies_checkExpect(tonies_version() == version && !fsFileExists(tonies_json_tmp_path), "identical body keeps the cache", &checks, &failures);
+
+    char *gzPath = custom_asprintf("%s.gz", tonies_json_path);
+    fsDeleteFile(gzPath);
+    osFreeMem(gzPath);
+    fsDeleteFile(tonies_json_path);
+    fsDeleteFile(tonies_json_meta_path);
+    fsRemoveDir(dir);
+    osFreeMem(dir);
+    osFreeMem(tonies_json_path);
+    osFreeMem(tonies_json_tmp_path);
+    osFreeMem(tonies_json_meta_path);
+    tonies_json_path = jsonPath;
+    tonies_json_tmp_path = tmpPath;
+    tonies_json_meta_path = metaPath;
+
+    /* the check items must not stay around as the catalog */
+    mutex_lock(MUTEX_TONIES_CACHE);
+    cache = toniesJsonCache;
+    size_t count = toniesJsonCount;
+    toniesJsonCache = NULL;
+    toniesJsonCount = 0;
+    toniesJsonVersion++;
+    mutex_unlock(MUTEX_TONIES_CACHE);
+    tonies_deinit_base(cache, &count);
+
+    TRACE_WARNING("Checks:           %" PRIu32 "\r\n", checks);
+    TRACE_WARNING("Failures:         %" PRIu32 "\r\n", failures);
+    TRACE_WARNING("**********************************\r\n");
+
+    return failures ? ERROR_FAILURE : NO_ERROR;
+}
+
 error_t toniesV2_update()
 {
     TRACE_INFO("Updating tonies.json from api.revvox.de...\r\n");
@@ -155,6 +723,10 @@ error_t toniesV2_update()
         TRACE_INFO("... success updating tonies.json from api.revvox.de, reloading\r\n");
         tonies_deinit();
         tonies_init();
+        if (settings_get_bool("core.gzip_precompress"))
+        {
+            gzip_precompress_file(tonies_json_path);
+        }
     }
     else
     {
@@ -337,12 +909,7 @@ toniesJson_item_t *tonies_byAudioIdHash_base(uint32_t audio_id, uint8_t *hash, t
 }
 toniesJson_item_t *tonies_byAudioId(uint32_t audio_id)
 {
-    toniesJson_item_t *item = tonies_byAudioIdHash_base(audio_id, NULL, toniesCustomJsonCache, toniesCustomJsonCount);
-    if (item)
-    {
-        return item;
-    }
-    return tonies_byAudioIdHash_base(audio_id, NULL, toniesJsonCache, toniesJsonCount);
+    return tonies_byAudioIdHash(audio_id, NULL);
 }
 toniesJson_item_t *tonies_byAudioIdHash(uint32_t audio_id, uint8_t *hash)
 {
@@ -351,7 +918,12 @@ toniesJson_item_t *tonies_byAudioIdHash(uint32_t audio_id, uint8_t *hash)
     {
         return item;
     }
-    return tonies_byAudioIdHash_base(audio_id, hash, toniesJsonCache, toniesJsonCount);
+    toniesJson_item_t *cache;
+    size_t count;
+    tonies_cacheAcquire(&cache, &count);
+    item = tonies_byAudioIdHash_base(audio_id, hash, cache, count);
+    tonies_read_end();
+    return item;
 }
 toniesJson_item_t *tonies_byModel_base(char *model, toniesJson_item_t *toniesCache, size_t toniesCount)
 {
@@ -375,7 +947,12 @@ toniesJson_item_t *tonies_byModel(char *model)
     {
         return item;
     }
-    return tonies_byModel_base(model, toniesJsonCache, toniesJsonCount);
+    toniesJson_item_t *cache;
+    size_t count;
+    tonies_cacheAcquire(&cache, &count);
+    item = tonies_byModel_base(model, cache, count);
+    tonies_read_end();
+    return item;
 }
 toniesJson_item_t *tonies_byAudioIdHashModel(uint32_t audio_id, uint8_t *hash, char *model)
 {
@@ -484,8 +1061,12 @@ bool tonies_byModelSeriesEpisode_base(char *model, char *series, char *episode,
 bool tonies_byModelSeriesEpisode(char *model, char *series, char *episode, toniesJson_item_t *result[18], size_t *result_size)
 {
     size_t count = 0;
+    toniesJson_item_t *cache;
+    size_t cacheCount;
     tonies_byModelSeriesEpisode_base(model, series, episode, result, &count, 9, toniesCustomJsonCache, toniesCustomJsonCount);
-    tonies_byModelSeriesEpisode_base(model, series, episode, result, &count, 18, toniesJsonCache, toniesJsonCount);
+    tonies_cacheAcquire(&cache, &cacheCount);
+    tonies_byModelSeriesEpisode_base(model, series, episode, result, &count, 18, cache, cacheCount);
+    tonies_read_end();
     *result_size = count;
     return *result_size > 0;
 }
@@ -522,10 +1103,19 @@ void tonies_deinit()
 {
     tonies_deinit_base(toniesJsonCache, &toniesJsonCount);
     tonies_deinit_base(toniesCustomJsonCache, &toniesCustomJsonCount);
+    tonies_freeRetired(toniesJsonRetired);
+    toniesJsonRetired = NULL;
 
     osFreeMem(tonies_json_path);
     osFreeMem(tonies_custom_json_path);
     osFreeMem(tonies_json_tmp_path);
+    osFreeMem(tonies_json_meta_path);
 
     toniesJsonInitialized = false;
+    toniesJsonVersion++;
+}
+
+uint32_t tonies_version()
+{
+    return toniesJsonVersion;
 }
\ No newline at end of file
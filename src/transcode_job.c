@@ -0,0 +1,1098 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "transcode_job.h"
+
+#include "fs_ext.h"
+#include "fs_port.h"
+#include "os_port.h"
+#include "os_ext.h"
+#include "debug.h"
+#include "mutex_manager.h"
+#include "completion.h"
+#include "settings.h"
+#include "server_helpers.h"
+#include "handler_sse.h"
+#include "toniefile.h"
+#include "tonie_audio_playlist.h"
+#include "cJSON.h"
+
+typedef struct
+{
+    transcode_job_t *job;
+    completion_t done;
+} transcode_job_run_t;
+
+static transcode_job_t transcode_jobs[TRANSCODE_JOB_MAX];
+static uint32_t transcode_next_id = 1;
+/* one per worker, so queuing a batch wakes all idle workers at once */
+static completion_t transcode_wake[TRANSCODE_JOB_WORKERS_MAX];
+/* the self check must not replace the stored jobs */
+static bool_t transcode_job_persist = true;
+
+static const char *transcode_job_type_name(transcode_job_type_t type)
+{
+    switch (type)
+    {
+    case TRANSCODE_JOB_TAP:
+        return "tap";
+    case TRANSCODE_JOB_PCM:
+        return "pcm";
+    case TRANSCODE_JOB_MOVE:
+        return "move";
+    default:
+        return "encode";
+    }
+}
+
+static const char *transcode_job_state_name(transcode_job_state_t state)
+{
+    switch (state)
+    {
+    case TRANSCODE_JOB_QUEUED:
+        return "queued";
+    case TRANSCODE_JOB_RUNNING:
+        return "running";
+    case TRANSCODE_JOB_DONE:
+        return "done";
+    case TRANSCODE_JOB_FAILED:
+        return "failed";
+    case TRANSCODE_JOB_CANCELLED:
+        return "cancelled";
+    default:
+        return "unused";
+    }
+}
+
+static bool_t transcode_job_pending(transcode_job_t *job)
+{
+    return job->state == TRANSCODE_JOB_QUEUED || job->state == TRANSCODE_JOB_RUNNING;
+}
+
+/* upload jobs delete their staging file when they end */
+static bool_t transcode_job_owns_source(transcode_job_t *job)
+{
+    return (job->type == TRANSCODE_JOB_PCM || job->type == TRANSCODE_JOB_MOVE) && job->source_count == 1;
+}
+
+/* running jobs take the worker slots, whether a worker or a claim runs them */
+static size_t transcode_job_running()
+{
+    size_t running = 0;
+    for (size_t i = 0; i < TRANSCODE_JOB_MAX; i++)
+    {
+        if (transcode_jobs[i].state == TRANSCODE_JOB_RUNNING)
+        {
+            running++;
+        }
+    }
+    return running;
+}
+
+/* the pending job that writes target */
+static transcode_job_t *transcode_job_find_target(const char *target)
+{
+    for (size_t i = 0; i < TRANSCODE_JOB_MAX; i++)
+    {
+        if (transcode_job_pending(&transcode_jobs[i]) && !osStrcmp(transcode_jobs[i].target, target))
+        {
+            return &transcode_jobs[i];
+        }
+    }
+    return NULL;
+}
+
+static void transcode_job_free(transcode_job_t *job)
+{
+    for (size_t i = 0; i < job->source_count; i++)
+    {
+        osFreeMem(job->sources[i]);
+    }
+    osFreeMem(job->sources);
+    osFreeMem(job->target);
+    osMemset(job, 0x00, sizeof(transcode_job_t));
+}
+
+static transcode_job_t *transcode_job_find(uint32_t id)
+{
+    for (size_t i = 0; i < TRANSCODE_JOB_MAX; i++)
+    {
+        if (transcode_jobs[i].state != TRANSCODE_JOB_UNUSED && transcode_jobs[i].id == id)
+        {
+            return &transcode_jobs[i];
+        }
+    }
+    return NULL;
+}
+
+static bool_t transcode_job_same(transcode_job_t *job, transcode_job_type_t type, const char **sources, size_t source_count, uint32_t skip_seconds, uint32_t audio_id)
+{
+    if (job->type != type || job->source_count != source_count || job->skip_seconds != skip_seconds || job->audio_id != audio_id)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < source_count; i++)
+    {
+        if (osStrcmp(job->sources[i], sources[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* a free slot, else the slot of the oldest finished job */
+static transcode_job_t *transcode_job_slot()
+{
+    transcode_job_t *oldest = NULL;
+    for (size_t i = 0; i < TRANSCODE_JOB_MAX; i++)
+    {
+        transcode_job_t *job = &transcode_jobs[i];
+        if (job->state == TRANSCODE_JOB_UNUSED)
+        {
+            return job;
+        }
+        if (!transcode_job_pending(job) && (oldest == NULL || job->id < oldest->id))
+        {
+            oldest = job;
+        }
+    }
+    if (oldest != NULL)
+    {
+        transcode_job_free(oldest);
+    }
+    return oldest;
+}
+
+static transcode_job_t *transcode_job_insert(transcode_job_type_t type, const char *target, const char **sources, size_t source_count, uint32_t skip_seconds, bool_t force, uint32_t audio_id)
+{
+    transcode_job_t *job = transcode_job_slot();
+    if (job == NULL)
+    {
+        return NULL;
+    }
+
+    job->type = type;
+    job->target = strdup(target);
+    job->skip_seconds = skip_seconds;
+    job->force = force;
+    job->audio_id = audio_id;
+    job->created = time(NULL);
+    if (source_count > 0)
+    {
+        job->sources = osAllocMem(source_count * sizeof(char *));
+        if (job->sources != NULL)
+        {
+            for (size_t i = 0; i < source_count; i++)
+            {
+                job->sources[i] = strdup(sources[i]);
+            }
+            job->source_count = source_count;
+        }
+    }
+    job->state = TRANSCODE_JOB_QUEUED;
+
+    return job;
+}
+
+static cJSON *transcode_job_to_json(transcode_job_t *job, bool_t progress)
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "id", job->id);
+    cJSON_AddStringToObject(json, "type", transcode_job_type_name(job->type));
+    cJSON_AddStringToObject(json, "state", transcode_job_state_name(job->state));
+    cJSON_AddNumberToObject(json, "created", job->created);
+    cJSON_AddStringToObject(json, "target", job->target);
+    cJSON *jsonSources = cJSON_AddArrayToObject(json, "sources");
+    for (size_t i = 0; i < job->source_count; i++)
+    {
+        cJSON_AddItemToArray(jsonSources, cJSON_CreateString(job->sources[i]));
+    }
+    cJSON_AddNumberToObject(json, "skipSeconds", job->skip_seconds);
+    cJSON_AddBoolToObject(json, "force", job->force);
+    if (job->type == TRANSCODE_JOB_PCM)
+    {
+        cJSON_AddNumberToObject(json, "audioId", job->audio_id);
+    }
+
+    if (progress)
+    {
+        systime_t elapsed = (job->state == TRANSCODE_JOB_RUNNING) ? osGetSystemTime() - job->started : job->elapsed;
+        double seconds = (double)job->samples / OPUS_SAMPLING_RATE;
+        cJSON_AddNumberToObject(json, "currentSource", job->current_source);
+        cJSON_AddNumberToObject(json, "samples", job->samples);
+        cJSON_AddNumberToObject(json, "seconds", seconds);
+        cJSON_AddNumberToObject(json, "elapsedMs", elapsed);
+        /* seconds of audio encoded per second */
+        cJSON_AddNumberToObject(json, "realtimeFactor", elapsed > 0 ? seconds * 1000 / elapsed : 0);
+        if (job->state == TRANSCODE_JOB_FAILED)
+        {
+            cJSON_AddStringToObject(json, "error", error2text(job->error));
+        }
+    }
+
+    return json;
+}
+
+static char *transcode_job_path()
+{
+    return custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, TRANSCODE_JOB_FILE);
+}
+
+/* stores the unfinished jobs, called with MUTEX_TRANSCODE_JOBS held */
+static void transcode_job_save()
+{
+    if (!transcode_job_persist)
+    {
+        return;
+    }
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "nextId", transcode_next_id);
+    cJSON *jsonJobs = cJSON_AddArrayToObject(json, "jobs");
+    for (size_t i = 0; i < TRANSCODE_JOB_MAX; i++)
+    {
+        if (transcode_job_pending(&transcode_jobs[i]) && !transcode_jobs[i].claimed)
+        {
+            cJSON_AddItemToArray(jsonJobs, transcode_job_to_json(&transcode_jobs[i], false));
+        }
+    }
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    char *path = transcode_job_path();
+    char *tmpPath = custom_asprintf("%s.tmp", path);
+    FsFile *file = fsOpenFile(tmpPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    if (file != NULL)
+    {
+        error_t error = fsWriteFile(file, jsonString, osStrlen(jsonString));
+        fsCloseFile(file);
+        if (error == NO_ERROR)
+        {
+            fsMoveFile(tmpPath, path, true);
+        }
+    }
+    else
+    {
+        TRACE_ERROR("Could not write '%s'\r\n", tmpPath);
+    }
+    osFreeMem(tmpPath);
+    osFreeMem(path);
+    osFreeMem(jsonString);
+}
+
+static void transcode_job_load()
+{
+    char *path = transcode_job_path();
+    uint32_t fileSize = 0;
+    if (fsGetFileSize(path, &fileSize) != NO_ERROR || fileSize == 0)
+    {
+        osFreeMem(path);
+        return;
+    }
+
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+    char *data = osAllocMem(fileSize);
+    size_t pos = 0;
+    size_t sizeRead = 0;
+    while (file != NULL && data != NULL && pos < fileSize && fsReadFile(file, &data[pos], fileSize - pos, &sizeRead) == NO_ERROR)
+    {
+        pos += sizeRead;
+    }
+    if (file != NULL)
+    {
+        fsCloseFile(file);
+    }
+    cJSON *json = (data != NULL && pos == fileSize) ? cJSON_ParseWithLengthOpts(data, fileSize, 0, 0) : NULL;
+    osFreeMem(data);
+    if (json == NULL)
+    {
+        TRACE_ERROR("Could not load transcoding jobs from '%s'\r\n", path);
+        osFreeMem(path);
+        return;
+    }
+    osFreeMem(path);
+
+    const char *sources[TRANSCODE_JOB_SOURCES_MAX];
+    cJSON *jsonJob;
+    mutex_lock(MUTEX_TRANSCODE_JOBS);
+    cJSON_ArrayForEach(jsonJob, cJSON_GetObjectItemCaseSensitive(json, "jobs"))
+    {
+        cJSON *jsonType = cJSON_GetObjectItemCaseSensitive(jsonJob, "type");
+        cJSON *jsonTarget = cJSON_GetObjectItemCaseSensitive(jsonJob, "target");
+        cJSON *jsonSources = cJSON_GetObjectItemCaseSensitive(jsonJob, "sources");
+        if (!cJSON_IsString(jsonType) || !cJSON_IsString(jsonTarget) || !cJSON_IsArray(jsonSources))
+        {
+            continue;
+        }
+
+        size_t source_count = 0;
+        cJSON *jsonSource;
+        cJSON_ArrayForEach(jsonSource, jsonSources)
+        {
+            if (cJSON_IsString(jsonSource) && source_count < TRANSCODE_JOB_SOURCES_MAX)
+            {
+                sources[source_count++] = jsonSource->valuestring;
+            }
+        }
+
+        transcode_job_type_t type = TRANSCODE_JOB_ENCODE;
+        if (!osStrcmp(jsonType->valuestring, "tap"))
+        {
+            type = TRANSCODE_JOB_TAP;
+        }
+        else if (!osStrcmp(jsonType->valuestring, "pcm"))
+        {
+            type = TRANSCODE_JOB_PCM;
+        }
+        else if (!osStrcmp(jsonType->valuestring, "move"))
+        {
+            type = TRANSCODE_JOB_MOVE;
+        }
+        cJSON *jsonSkip = cJSON_GetObjectItemCaseSensitive(jsonJob, "skipSeconds");
+        cJSON *jsonAudioId = cJSON_GetObjectItemCaseSensitive(jsonJob, "audioId");
+        cJSON *jsonId = cJSON_GetObjectItemCaseSensitive(jsonJob, "id");
+        transcode_job_t *job = transcode_job_insert(type, jsonTarget->valuestring, sources, source_count,
+                                                    cJSON_IsNumber(jsonSkip) ? (uint32_t)jsonSkip->valuedouble : 0,
+                                                    cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(jsonJob, "force")),
+                                                    cJSON_IsNumber(jsonAudioId) ? (uint32_t)jsonAudioId->valuedouble : 0);
+        if (job == NULL)
+        {
+            break;
+        }
+        /* jobs that were running when teddycloud stopped start over */
+        job->id = cJSON_IsNumber(jsonId) ? (uint32_t)jsonId->valuedouble : transcode_next_id;
+        transcode_next_id = MAX(transcode_next_id, job->id + 1);
+        TRACE_INFO("Requeued transcoding job %" PRIu32 " for '%s'\r\n", job->id, job->target);
+    }
+
+    cJSON *jsonNextId = cJSON_GetObjectItemCaseSensitive(json, "nextId");
+    if (cJSON_IsNumber(jsonNextId))
+    {
+        transcode_next_id = MAX(transcode_next_id, (uint32_t)jsonNextId->valuedouble);
+    }
+    mutex_unlock(MUTEX_TRANSCODE_JOBS);
+    cJSON_Delete(json);
+}
+
+/* called with MUTEX_TRANSCODE_JOBS held, a finished job may be replaced once it is released */
+static char *transcode_job_event_json(transcode_job_t *job)
+{
+    cJSON *json = transcode_job_to_json(job, true);
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    return jsonString;
+}
+
+static void transcode_job_event(char *jsonString)
+{
+    sse_sendEvent("TranscodeJob", jsonString, false);
+    osFreeMem(jsonString);
+}
+
+static error_t transcode_job_encode(transcode_job_t *job)
+{
+    char(*source)[PATH_LEN] = osAllocMem(TRANSCODE_JOB_SOURCES_MAX * PATH_LEN);
+    if (source == NULL)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < job->source_count; i++)
+    {
+        osStrncpy(source[i], job->sources[i], PATH_LEN - 1);
+        source[i][PATH_LEN - 1] = '\0';
+    }
+
+    bool_t sweep = false;
+    char *tmpTaf = custom_asprintf("%s.tmp", job->target);
+    ffmpeg_stream_opts_t opts = {
+        .encoded = &job->samples,
+    };
+    error_t error = ffmpeg_stream(source, job->source_count, &job->current_source, tmpTaf, job->skip_seconds, &job->active, &sweep, false, &opts);
+    if (error != NO_ERROR)
+    {
+        fsDeleteFile(tmpTaf);
+    }
+    else
+    {
+        error = fsMoveFile(tmpTaf, job->target, true);
+    }
+    osFreeMem(tmpTaf);
+    osFreeMem(source);
+
+    return error;
+}
+
+static error_t transcode_job_tap(transcode_job_t *job)
+{
+    tonie_audio_playlist_t tap;
+    osMemset(&tap, 0x00, sizeof(tap));
+
+    error_t error = tap_load(job->target, &tap);
+    if (error == NO_ERROR && (tap.filesCount == 0 || tap.filesCount > TRANSCODE_JOB_SOURCES_MAX))
+    {
+        TRACE_ERROR("TAP '%s' has %" PRIuSIZE " files\r\n", job->target, tap.filesCount);
+        error = ERROR_INVALID_FILE;
+    }
+    if (error == NO_ERROR)
+    {
+        error = tap_generate_taf(&tap, &job->current_source, &job->active, job->force, NULL, &job->samples);
+    }
+    tap_free(&tap);
+
+    return error;
+}
+
+static error_t transcode_job_pcm(transcode_job_t *job)
+{
+    if (job->source_count != 1)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    char *tmpTaf = custom_asprintf("%s.tmp", job->target);
+    FsFile *file = fsOpenFile(job->sources[0], FS_FILE_MODE_READ);
+    uint8_t *buffer = osAllocMem(TRANSCODE_JOB_PCM_BUFFER_SIZE);
+    toniefile_t *taf = NULL;
+    error_t error = ERROR_FILE_OPENING_FAILED;
+    if (file != NULL && buffer != NULL)
+    {
+        taf = toniefile_create(tmpTaf, job->audio_id, false);
+        error = (taf != NULL) ? NO_ERROR : ERROR_FILE_OPENING_FAILED;
+    }
+
+    /* bytes of an incomplete sample, kept at the start of the buffer for the next read */
+    size_t pending = 0;
+    job->active = true;
+    while (error == NO_ERROR && job->active)
+    {
+        size_t length = 0;
+        if (fsReadFile(file, &buffer[pending], TRANSCODE_JOB_PCM_BUFFER_SIZE - pending, &length) != NO_ERROR || length == 0)
+        {
+            break;
+        }
+        pending += length;
+        size_t samples = pending / (OPUS_CHANNELS * sizeof(int16_t));
+        error = toniefile_encode(taf, (int16_t *)buffer, samples);
+        job->samples += samples;
+        pending -= samples * OPUS_CHANNELS * sizeof(int16_t);
+        osMemmove(buffer, &buffer[samples * OPUS_CHANNELS * sizeof(int16_t)], pending);
+    }
+    if (error == NO_ERROR && !job->active)
+    {
+        error = ERROR_ABORTED;
+    }
+
+    if (taf != NULL && toniefile_close(taf) != NO_ERROR && error == NO_ERROR)
+    {
+        error = ERROR_WRITE_FAILED;
+    }
+    if (file != NULL)
+    {
+        fsCloseFile(file);
+    }
+    osFreeMem(buffer);
+
+    if (error == NO_ERROR)
+    {
+        error = fsMoveFile(tmpTaf, job->target, true);
+    }
+    else
+    {
+        fsDeleteFile(tmpTaf);
+    }
+    osFreeMem(tmpTaf);
+
+    /* a job interrupted by the shutdown starts over from the staging file */
+    if (!settings_get_bool("internal.exit"))
+    {
+        fsDeleteFile(job->sources[0]);
+    }
+
+    return error;
+}
+
+static error_t transcode_job_move(transcode_job_t *job)
+{
+    if (job->source_count != 1)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    /* the staging dir may be on another filesystem, only the final rename next to the target is atomic */
+    char *tmpPath = custom_asprintf("%s.tmp", job->target);
+    error_t error = fsMoveFile(job->sources[0], tmpPath, true);
+    if (error == NO_ERROR)
+    {
+        error = fsMoveFile(tmpPath, job->target, true);
+    }
+    if (error != NO_ERROR)
+    {
+        fsDeleteFile(tmpPath);
+    }
+    osFreeMem(tmpPath);
+
+    if (!settings_get_bool("internal.exit"))
+    {
+        fsDeleteFile(job->sources[0]);
+    }
+
+    return error;
+}
+
+static void transcode_job_encode_task(void *param)
+{
+    transcode_job_run_t *run = (transcode_job_run_t *)param;
+
+    osSetTaskNice(settings_get_unsigned("encode.job_nice"));
+    error_t error;
+    switch (run->job->type)
+    {
+    case TRANSCODE_JOB_TAP:
+        error = transcode_job_tap(run->job);
+        break;
+    case TRANSCODE_JOB_PCM:
+        error = transcode_job_pcm(run->job);
+        break;
+    case TRANSCODE_JOB_MOVE:
+        error = transcode_job_move(run->job);
+        break;
+    default:
+        error = transcode_job_encode(run->job);
+        break;
+    }
+
+    completion_complete(&run->done, error);
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+static void transcode_job_wake()
+{
+    for (size_t worker = 0; worker < TRANSCODE_JOB_WORKERS_MAX; worker++)
+    {
+        completion_signal(&transcode_wake[worker]);
+    }
+}
+
+/* marks a running job as ended and returns its event, called with MUTEX_TRANSCODE_JOBS held */
+static char *transcode_job_finish(transcode_job_t *job, error_t error)
+{
+    job->elapsed = osGetSystemTime() - job->started;
+    job->error = error;
+    /* a cancel that came after the encoder finished is too late */
+    if (error == NO_ERROR)
+    {
+        job->state = TRANSCODE_JOB_DONE;
+    }
+    else
+    {
+        job->state = job->cancelled ? TRANSCODE_JOB_CANCELLED : TRANSCODE_JOB_FAILED;
+    }
+    transcode_job_save();
+
+    if (job->state == TRANSCODE_JOB_FAILED)
+    {
+        TRACE_ERROR("Transcoding job %" PRIu32 " for '%s' failed: %s\r\n", job->id, job->target, error2text(error));
+    }
+    else
+    {
+        TRACE_INFO("Transcoding job %" PRIu32 " for '%s' %s\r\n", job->id, job->target, transcode_job_state_name(job->state));
+    }
+    return transcode_job_event_json(job);
+}
+
+/* called with MUTEX_TRANSCODE_JOBS held */
+static void transcode_job_start(transcode_job_t *job)
+{
+    job->state = TRANSCODE_JOB_RUNNING;
+    job->started = osGetSystemTime();
+    job->samples = 0;
+    job->current_source = 0;
+    job->active = false;
+    transcode_job_save();
+    TRACE_INFO("Transcoding job %" PRIu32 " for '%s' started\r\n", job->id, job->target);
+}
+
+static void transcode_job_run(transcode_job_t *job)
+{
+    transcode_job_run_t run;
+    run.job = job;
+    error_t error = completion_init(&run.done);
+
+    /* encoding runs on its own task, so only the encoder gets the lower priority */
+    if (error == NO_ERROR && osCreateTask("TranscodeEncode", &transcode_job_encode_task, &run, 16 * 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        completion_deinit(&run.done);
+        error = ERROR_OUT_OF_RESOURCES;
+    }
+
+    if (error == NO_ERROR)
+    {
+        systime_t last_event = osGetSystemTime();
+        while (!completion_is_done(&run.done))
+        {
+            completion_wait(&run.done, TRANSCODE_JOB_PROGRESS_INTERVAL);
+            /* ffmpeg_stream sets the active flag when it starts, so a cancel is applied again */
+            if (job->cancelled || settings_get_bool("internal.exit"))
+            {
+                job->active = false;
+            }
+            if (osGetSystemTime() - last_event >= TRANSCODE_JOB_PROGRESS_INTERVAL && !completion_is_done(&run.done))
+            {
+                last_event = osGetSystemTime();
+                mutex_lock(MUTEX_TRANSCODE_JOBS);
+                char *jsonString = transcode_job_event_json(job);
+                mutex_unlock(MUTEX_TRANSCODE_JOBS);
+                transcode_job_event(jsonString);
+            }
+        }
+        error = run.done.error;
+        completion_deinit(&run.done);
+    }
+
+    if (settings_get_bool("internal.exit") && !job->cancelled)
+    {
+        /* stays a running job in the job file and starts over on the next start */
+        return;
+    }
+
+    mutex_lock(MUTEX_TRANSCODE_JOBS);
+    char *jsonString = transcode_job_finish(job, error);
+    mutex_unlock(MUTEX_TRANSCODE_JOBS);
+
+    transcode_job_event(jsonString);
+    transcode_job_wake();
+}
+
+static void transcode_job_task(void *param)
+{
+    size_t worker = (size_t)param;
+
+    while (!settings_get_bool("internal.exit"))
+    {
+        if (worker >= settings_get_unsigned("encode.job_workers"))
+        {
+            /* not waiting on the queue, so no job wakeup gets lost to a disabled worker */
+            osDelayTask(1000);
+            continue;
+        }
+
+        /* the oldest queued job first, unless claimed jobs took the free slots */
+        transcode_job_t *job = NULL;
+        char *jsonString = NULL;
+        mutex_lock(MUTEX_TRANSCODE_JOBS);
+        for (size_t i = 0; i < TRANSCODE_JOB_MAX && transcode_job_running() < settings_get_unsigned("encode.job_workers"); i++)
+        {
+            if (transcode_jobs[i].state == TRANSCODE_JOB_QUEUED && (job == NULL || transcode_jobs[i].id < job->id))
+            {
+                job = &transcode_jobs[i];
+            }
+        }
+        if (job != NULL)
+        {
+            transcode_job_start(job);
+            jsonString = transcode_job_event_json(job);
+        }
+        mutex_unlock(MUTEX_TRANSCODE_JOBS);
+
+        if (job == NULL)
+        {
+            completion_wait(&transcode_wake[worker], 1000);
+            continue;
+        }
+
+        transcode_job_event(jsonString);
+        transcode_job_run(job);
+    }
+
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void transcode_job_init()
+{
+    for (size_t worker = 0; worker < TRANSCODE_JOB_WORKERS_MAX; worker++)
+    {
+        if (completion_init(&transcode_wake[worker]) != NO_ERROR)
+        {
+            TRACE_ERROR("Could not create transcoding event\r\n");
+            return;
+        }
+    }
+
+    transcode_job_load();
+
+    for (size_t worker = 0; worker < TRANSCODE_JOB_WORKERS_MAX; worker++)
+    {
+        if (osCreateTask("TranscodeJob", &transcode_job_task, (void *)worker, 16 * 1024, 0) == OS_INVALID_TASK_ID)
+        {
+            TRACE_ERROR("Could not create transcoding worker %" PRIuSIZE "\r\n", worker);
+        }
+    }
+}
+
+static error_t transcode_job_queue(transcode_job_type_t type, const char *target, const char **sources, size_t source_count, uint32_t skip_seconds, bool_t force, uint32_t audio_id, uint32_t *id)
+{
+
+    mutex_lock(MUTEX_TRANSCODE_JOBS);
+    transcode_job_t *job = transcode_job_find_target(target);
+    if (job != NULL)
+    {
+        if (!transcode_job_same(job, type, sources, source_count, skip_seconds, audio_id))
+        {
+            /* both would write the same TAF */
+            TRACE_ERROR("Another transcoding job for '%s' is pending\r\n", target);
+            mutex_unlock(MUTEX_TRANSCODE_JOBS);
+            return ERROR_ALREADY_RUNNING;
+        }
+        if (force && job->state == TRANSCODE_JOB_QUEUED)
+        {
+            job->force = true;
+            transcode_job_save();
+        }
+        *id = job->id;
+        mutex_unlock(MUTEX_TRANSCODE_JOBS);
+        return NO_ERROR;
+    }
+
+    job = transcode_job_insert(type, target, sources, source_count, skip_seconds, force, audio_id);
+    if (job == NULL)
+    {
+        TRACE_ERROR("Too many pending transcoding jobs\r\n");
+        mutex_unlock(MUTEX_TRANSCODE_JOBS);
+        return ERROR_OUT_OF_RESOURCES;
+    }
+    job->id = transcode_next_id++;
+    *id = job->id;
+    transcode_job_save();
+    TRACE_INFO("Queued transcoding job %" PRIu32 " for '%s'\r\n", job->id, target);
+    mutex_unlock(MUTEX_TRANSCODE_JOBS);
+
+    transcode_job_wake();
+    return NO_ERROR;
+}
+
+error_t transcode_job_add(transcode_job_type_t type, const char *target, const char **sources, size_t source_count, uint32_t skip_seconds, bool_t force, uint32_t *id)
+{
+    if (target == NULL || type == TRANSCODE_JOB_PCM || type == TRANSCODE_JOB_MOVE || source_count > TRANSCODE_JOB_SOURCES_MAX || (type == TRANSCODE_JOB_ENCODE && source_count == 0))
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+    return transcode_job_queue(type, target, sources, source_count, skip_seconds, force, 0, id);
+}
+
+error_t transcode_job_add_pcm(const char *target, const char *staging, uint32_t audio_id, uint32_t *id)
+{
+    if (target == NULL || staging == NULL)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+    return transcode_job_queue(TRANSCODE_JOB_PCM, target, &staging, 1, 0, false, audio_id, id);
+}
+
+error_t transcode_job_add_move(const char *target, const char *staging, uint32_t *id)
+{
+    if (target == NULL || staging == NULL)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+    return transcode_job_queue(TRANSCODE_JOB_MOVE, target, &staging, 1, 0, false, 0, id);
+}
+
+error_t transcode_job_claim(transcode_job_type_t type, const char *target, systime_t timeout, uint32_t *id)
+{
+    systime_t start = osGetSystemTime();
+    transcode_job_t *job = NULL;
+
+    mutex_lock(MUTEX_TRANSCODE_JOBS);
+    while (true)
+    {
+        job = transcode_job_find_target(target);
+        if (job != NULL && (job->state == TRANSCODE_JOB_RUNNING || job->type != type))
+        {
+            TRACE_ERROR("Another transcoding job for '%s' is pending\r\n", target);
+            mutex_unlock(MUTEX_TRANSCODE_JOBS);
+            return ERROR_ALREADY_RUNNING;
+        }
+        if (transcode_job_running() < settings_get_unsigned("encode.job_workers"))
+        {
+            break;
+        }
+        mutex_unlock(MUTEX_TRANSCODE_JOBS);
+        if (osGetSystemTime() - start >= timeout || settings_get_bool("internal.exit"))
+        {
+            TRACE_ERROR("No transcoding slot for '%s'\r\n", target);
+            return ERROR_TIMEOUT;
+        }
+        osDelayTask(TRANSCODE_JOB_CLAIM_POLL);
+        mutex_lock(MUTEX_TRANSCODE_JOBS);
+    }
+
+    if (job == NULL)
+    {
+        job = transcode_job_insert(type, target, NULL, 0, 0, false, 0);
+        if (job == NULL)
+        {
+            TRACE_ERROR("Too many pending transcoding jobs\r\n");
+            mutex_unlock(MUTEX_TRANSCODE_JOBS);
+            return ERROR_OUT_OF_RESOURCES;
+        }
+        job->id = transcode_next_id++;
+    }
+    /* a taken over job is dropped from the job file, the claim does its work */
+    job->claimed = true;
+    transcode_job_start(job);
+    *id = job->id;
+    char *jsonString = transcode_job_event_json(job);
+    mutex_unlock(MUTEX_TRANSCODE_JOBS);
+
+    transcode_job_event(jsonString);
+    return NO_ERROR;
+}
+
+void transcode_job_release(uint32_t id, error_t error)
+{
+    mutex_lock(MUTEX_TRANSCODE_JOBS);
+    transcode_job_t *job = transcode_job_find(id);
+    if (job == NULL || !job->claimed || job->state != TRANSCODE_JOB_RUNNING)
+    {
+        mutex_unlock(MUTEX_TRANSCODE_JOBS);
+        return;
+    }
+    char *jsonString = transcode_job_finish(job, error);
+    mutex_unlock(MUTEX_TRANSCODE_JOBS);
+
+    transcode_job_event(jsonString);
+    transcode_job_wake();
+}
+
+bool_t transcode_job_uses(const char *path)
+{
+    bool_t used = false;
+
+    mutex_lock(MUTEX_TRANSCODE_JOBS);
+    for (size_t i = 0; i < TRANSCODE_JOB_MAX && !used; i++)
+    {
+        transcode_job_t *job = &transcode_jobs[i];
+        for (size_t source = 0; transcode_job_pending(job) && source < job->source_count && !used; source++)
+        {
+            used = !osStrcmp(job->sources[source], path);
+        }
+    }
+    mutex_unlock(MUTEX_TRANSCODE_JOBS);
+
+    return used;
+}
+
+error_t transcode_job_cancel(uint32_t id)
+{
+    error_t error = NO_ERROR;
+
+    mutex_lock(MUTEX_TRANSCODE_JOBS);
+    transcode_job_t *job = transcode_job_find(id);
+    if (job == NULL)
+    {
+        error = ERROR_NOT_FOUND;
+    }
+    else if (job->state == TRANSCODE_JOB_QUEUED)
+    {
+        job->state = TRANSCODE_JOB_CANCELLED;
+        transcode_job_save();
+        if (transcode_job_owns_source(job))
+        {
+            fsDeleteFile(job->sources[0]);
+        }
+    }
+    else if (job->state == TRANSCODE_JOB_RUNNING && job->claimed)
+    {
+        /* ends with the stream of its caller */
+        error = ERROR_WRONG_STATE;
+    }
+    else if (job->state == TRANSCODE_JOB_RUNNING)
+    {
+        /* the worker stops the encoder and deletes the partial TAF */
+        job->cancelled = true;
+        job->active = false;
+    }
+    else
+    {
+        error = ERROR_WRONG_STATE;
+    }
+    mutex_unlock(MUTEX_TRANSCODE_JOBS);
+
+    return error;
+}
+
+char *transcode_job_json(uint32_t id)
+{
+    cJSON *json = NULL;
+
+    mutex_lock(MUTEX_TRANSCODE_JOBS);
+    if (id != 0)
+    {
+        transcode_job_t *job = transcode_job_find(id);
+        if (job != NULL)
+        {
+            json = transcode_job_to_json(job, true);
+        }
+    }
+    else
+    {
+        json = cJSON_CreateObject();
+        cJSON *jsonJobs = cJSON_AddArrayToObject(json, "jobs");
+        for (size_t i = 0; i < TRANSCODE_JOB_MAX; i++)
+        {
+            if (transcode_jobs[i].state != TRANSCODE_JOB_UNUSED)
+            {
+                cJSON_AddItemToArray(jsonJobs, transcode_job_to_json(&transcode_jobs[i], true));
+            }
+        }
+    }
+    mutex_unlock(MUTEX_TRANSCODE_JOBS);
+
+    if (json == NULL)
+    {
+        return NULL;
+    }
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    return jsonString;
+}
+
+static void transcode_job_expect(bool_t ok, const char *what, uint32_t *checks, uint32_t *failures)
+{
+    (*checks)++;
+    if (!ok)
+    {
+        TRACE_ERROR("Check failed: %s\r\n", what);
+        (*failures)++;
+    }
+}
+
+static bool_t transcode_job_is(uint32_t id, transcode_job_state_t state)
+{
+    mutex_lock(MUTEX_TRANSCODE_JOBS);
+    transcode_job_t *job = transcode_job_find(id);
+    bool_t is = (job != NULL && job->state == state);
+    mutex_unlock(MUTEX_TRANSCODE_JOBS);
+    return is;
+}
+
+error_t transcode_job_check()
+{
+    const char *sources[] = {"/check/a.mp3", "/check/b.mp3"};
+    const char *other[] = {"/check/c.mp3"};
+    uint32_t checks = 0;
+    uint32_t failures = 0;
+    uint32_t id = 0;
+    uint32_t same = 0;
+    uint32_t next = 0;
+
+    /* no workers run, so queued jobs stay queued */
+    transcode_job_persist = false;
+
+    TRACE_WARNING("**********************************\r\n");
+    error_t error = transcode_job_add(TRANSCODE_JOB_ENCODE, "/check/a.taf", sources, 2, 0, false, &id);
+    transcode_job_expect(error == NO_ERROR && transcode_job_is(id, TRANSCODE_JOB_QUEUED), "add queues a job", &checks, &failures);
+    error = transcode_job_add(TRANSCODE_JOB_ENCODE, "/check/a.taf", sources, 2, 0, false, &same);
+    transcode_job_expect(error == NO_ERROR && same == id, "identical add returns the pending job", &checks, &failures);
+    error = transcode_job_add(TRANSCODE_JOB_ENCODE, "/check/a.taf", other, 1, 0, false, &same);
+    transcode_job_expect(error == ERROR_ALREADY_RUNNING, "other sources for a pending target are refused", &checks, &failures);
+    error = transcode_job_add(TRANSCODE_JOB_ENCODE, "/check/a.taf", sources, 2, 10, false, &same);
+    transcode_job_expect(error == ERROR_ALREADY_RUNNING, "other skip seconds for a pending target are refused", &checks, &failures);
+    error = transcode_job_add(TRANSCODE_JOB_ENCODE, "/check/b.taf", sources, 2, 0, false, &next);
+    transcode_job_expect(error == NO_ERROR && next != id, "add for another target queues a new job", &checks, &failures);
+
+    transcode_job_expect(transcode_job_cancel(id) == NO_ERROR && transcode_job_is(id, TRANSCODE_JOB_CANCELLED), "cancel of a queued job", &checks, &failures);
+    transcode_job_expect(transcode_job_cancel(id) == ERROR_WRONG_STATE, "second cancel is refused", &checks, &failures);
+    transcode_job_expect(transcode_job_cancel(0xFFFFFFFF) == ERROR_NOT_FOUND, "cancel of an unknown job", &checks, &failures);
+    error = transcode_job_add(TRANSCODE_JOB_ENCODE, "/check/a.taf", sources, 2, 0, false, &same);
+    transcode_job_expect(error == NO_ERROR && same != id, "add after cancel queues a new job", &checks, &failures);
+
+    char *json = transcode_job_json(id);
+    transcode_job_expect(json != NULL && osStrstr(json, "\"cancelled\"") != NULL, "cancelled job is reported", &checks, &failures);
+    osFreeMem(json);
+
+    /* the staging file of a PCM upload is spared by the startup sweep until its job ended */
+    uint32_t pcm = 0;
+    error = transcode_job_add_pcm("/check/pcm.taf", "/check/upload/pcm.upload", 1234, &pcm);
+    transcode_job_expect(error == NO_ERROR && transcode_job_uses("/check/upload/pcm.upload"), "queued PCM job keeps its staging file", &checks, &failures);
+    error = transcode_job_add(TRANSCODE_JOB_ENCODE, "/check/pcm.taf", sources, 2, 0, false, &next);
+    transcode_job_expect(error == ERROR_ALREADY_RUNNING, "encode to the target of a PCM job is refused", &checks, &failures);
+    transcode_job_cancel(pcm);
+    transcode_job_expect(!transcode_job_uses("/check/upload/pcm.upload"), "cancelled PCM job releases its staging file", &checks, &failures);
+
+    /* a committed upload is moved by a job that owns its staging file like a PCM job */
+    uint32_t move = 0;
+    error = transcode_job_add_move("/check/move.taf", "/check/upload/move.upload", &move);
+    transcode_job_expect(error == NO_ERROR && transcode_job_uses("/check/upload/move.upload"), "queued move job keeps its staging file", &checks, &failures);
+    transcode_job_cancel(move);
+    transcode_job_expect(!transcode_job_uses("/check/upload/move.upload"), "cancelled move job releases its staging file", &checks, &failures);
+
+    /* a box streaming a TAP claims it, so the queue neither writes the same TAF nor exceeds the workers */
+    uint32_t claim = 0;
+    error = transcode_job_claim(TRANSCODE_JOB_TAP, "/check/box.tap", 0, &claim);
+    transcode_job_expect(error == NO_ERROR && transcode_job_is(claim, TRANSCODE_JOB_RUNNING), "claim runs a job", &checks, &failures);
+    transcode_job_expect(transcode_job_claim(TRANSCODE_JOB_TAP, "/check/box.tap", 0, &next) == ERROR_ALREADY_RUNNING, "second claim of a target is refused", &checks, &failures);
+    error = transcode_job_add(TRANSCODE_JOB_TAP, "/check/box.tap", NULL, 0, 0, false, &next);
+    transcode_job_expect(error == NO_ERROR && next == claim, "TAP job for a claimed TAP returns the claim", &checks, &failures);
+    transcode_job_expect(transcode_job_cancel(claim) == ERROR_WRONG_STATE, "claimed job can't be cancelled", &checks, &failures);
+    uint32_t claims[TRANSCODE_JOB_WORKERS_MAX];
+    size_t claimed = 1;
+    while (claimed < settings_get_unsigned("encode.job_workers"))
+    {
+        char target[32];
+        osSnprintf(target, sizeof(target), "/check/box%" PRIuSIZE ".tap", claimed);
+        if (transcode_job_claim(TRANSCODE_JOB_TAP, target, 0, &claims[claimed]) != NO_ERROR)
+        {
+            break;
+        }
+        claimed++;
+    }
+    error = transcode_job_claim(TRANSCODE_JOB_TAP, "/check/other.tap", 0, &next);
+    transcode_job_expect(error == ERROR_TIMEOUT, "claim waits for a free worker slot", &checks, &failures);
+    while (claimed > 1)
+    {
+        transcode_job_release(claims[--claimed], NO_ERROR);
+    }
+    transcode_job_release(claim, NO_ERROR);
+    transcode_job_expect(transcode_job_is(claim, TRANSCODE_JOB_DONE), "release ends the claimed job", &checks, &failures);
+    error = transcode_job_add(TRANSCODE_JOB_TAP, "/check/box.tap", NULL, 0, 0, false, &next);
+    transcode_job_expect(error == NO_ERROR && transcode_job_claim(TRANSCODE_JOB_TAP, "/check/box.tap", 0, &claim) == NO_ERROR && claim == next, "claim takes over the queued job", &checks, &failures);
+    transcode_job_release(claim, ERROR_ABORTED);
+    transcode_job_expect(transcode_job_is(claim, TRANSCODE_JOB_FAILED), "failed claim is reported", &checks, &failures);
+
+    /* fill all slots with pending jobs, a cancelled one is the only reusable slot */
+    size_t queued = 0;
+    for (size_t i = 0; i < TRANSCODE_JOB_MAX; i++)
+    {
+        char target[32];
+        osSnprintf(target, sizeof(target), "/check/fill%" PRIuSIZE ".taf", i);
+        if (transcode_job_add(TRANSCODE_JOB_ENCODE, target, sources, 2, 0, false, &next) == NO_ERROR)
+        {
+            queued++;
+        }
+    }
+    transcode_job_expect(queued == TRANSCODE_JOB_MAX - 2, "finished jobs give their slot to new ones", &checks, &failures);
+    error = transcode_job_add(TRANSCODE_JOB_ENCODE, "/check/full.taf", sources, 2, 0, false, &next);
+    transcode_job_expect(error == ERROR_OUT_OF_RESOURCES, "add is refused when all jobs are pending", &checks, &failures);
+    transcode_job_cancel(same);
+    error = transcode_job_add(TRANSCODE_JOB_ENCODE, "/check/full.taf", sources, 2, 0, false, &next);
+    transcode_job_expect(error == NO_ERROR, "a cancelled job frees its slot", &checks, &failures);
+
+    mutex_lock(MUTEX_TRANSCODE_JOBS);
+    for (size_t i = 0; i < TRANSCODE_JOB_MAX; i++)
+    {
+        transcode_job_free(&transcode_jobs[i]);
+    }
+    mutex_unlock(MUTEX_TRANSCODE_JOBS);
+    transcode_job_persist = true;
+
+    TRACE_WARNING("Checks:           %" PRIu32 "\r\n", checks);
+    TRACE_WARNING("Failures:         %" PRIu32 "\r\n", failures);
+    TRACE_WARNING("**********************************\r\n");
+
+    return failures ? ERROR_FAILURE : NO_ERROR;
+}
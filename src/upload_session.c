@@ -0,0 +1,495 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "upload_session.h"
+#include "fs_ext.h"
+#include "fs_port.h"
+#include "mutex_manager.h"
+#include "server_helpers.h"
+#include "rand.h"
+#include "os_port.h"
+#include "debug.h"
+#include "settings.h"
+#include "transcode_job.h"
+#include "cJSON.h"
+
+static upload_session_t upload_sessions[UPLOAD_SESSION_MAX];
+static char *upload_session_dir = NULL;
+
+/* created on first use, the self check runs without upload_session_init */
+static const char *upload_session_dir_get()
+{
+    if (upload_session_dir == NULL)
+    {
+        upload_session_dir = custom_asprintf("%s%c%s", settings_get_string("internal.datadirfull"), PATH_SEPARATOR, UPLOAD_SESSION_DIR);
+        if (fsCreateDirEx(upload_session_dir, true) != NO_ERROR && !fsDirExists(upload_session_dir))
+        {
+            TRACE_ERROR("Could not create upload dir '%s'\r\n", upload_session_dir);
+        }
+    }
+    return upload_session_dir;
+}
+
+void upload_session_init()
+{
+    const char *dirPath = upload_session_dir_get();
+    FsDir *dir = fsOpenDir(dirPath);
+    FsDirEntry entry;
+    size_t removed = 0;
+
+    while (dir != NULL && fsReadDir(dir, &entry) == NO_ERROR)
+    {
+        if (entry.attributes & FS_FILE_ATTR_DIRECTORY)
+        {
+            continue;
+        }
+        /* PCM uploads requeued after the restart still need theirs */
+        char *path = custom_asprintf("%s%c%s", dirPath, PATH_SEPARATOR, entry.name);
+        if (!transcode_job_uses(path) && fsDeleteFile(path) == NO_ERROR)
+        {
+            removed++;
+        }
+        osFreeMem(path);
+    }
+    if (dir != NULL)
+    {
+        fsCloseDir(dir);
+    }
+    if (removed > 0)
+    {
+        TRACE_INFO("Removed %" PRIuSIZE " staging files of interrupted uploads\r\n", removed);
+    }
+}
+
+static upload_session_t *upload_session_find(const char *id)
+{
+    if (id == NULL)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < UPLOAD_SESSION_MAX; i++)
+    {
+        if (upload_sessions[i].used && !osStrcmp(upload_sessions[i].id, id))
+        {
+            return &upload_sessions[i];
+        }
+    }
+    return NULL;
+}
+
+void upload_session_free(upload_session_t *session)
+{
+    osFreeMem(session->target);
+    osFreeMem(session->staging);
+    osFreeMem(session->ranges);
+    osMemset(session, 0x00, sizeof(upload_session_t));
+}
+
+static void upload_session_expire(time_t now)
+{
+    for (size_t i = 0; i < UPLOAD_SESSION_MAX; i++)
+    {
+        upload_session_t *session = &upload_sessions[i];
+        if (session->used && session->writers == 0 && now - session->last_active > UPLOAD_SESSION_TIMEOUT)
+        {
+            TRACE_INFO("Upload session %s for '%s' expired\r\n", session->id, session->target);
+            fsDeleteFile(session->staging);
+            upload_session_free(session);
+        }
+    }
+}
+
+static void upload_session_add_range(upload_session_t *session, uint64_t start, uint64_t end)
+{
+    /* find the first range that ends at or after the new start, merge all overlapping ones into it */
+    size_t pos = 0;
+    while (pos < session->n_ranges && session->ranges[pos].end < start)
+    {
+        pos++;
+    }
+    size_t last = pos;
+    while (last < session->n_ranges && session->ranges[last].start <= end)
+    {
+        start = MIN(start, session->ranges[last].start);
+        end = MAX(end, session->ranges[last].end);
+        last++;
+    }
+
+    if (last == pos)
+    {
+        if (session->n_ranges == session->ranges_alloc)
+        {
+            size_t alloc = session->ranges_alloc ? 2 * session->ranges_alloc : 16;
+            upload_range_t *ranges = osAllocMem(alloc * sizeof(upload_range_t));
+            if (ranges == NULL)
+            {
+                return;
+            }
+            if (session->n_ranges > 0)
+            {
+                osMemcpy(ranges, session->ranges, session->n_ranges * sizeof(upload_range_t));
+            }
+            osFreeMem(session->ranges);
+            session->ranges = ranges;
+            session->ranges_alloc = alloc;
+        }
+        osMemmove(&session->ranges[pos + 1], &session->ranges[pos], (session->n_ranges - pos) * sizeof(upload_range_t));
+        session->n_ranges++;
+    }
+    else if (last > pos + 1)
+    {
+        osMemmove(&session->ranges[pos + 1], &session->ranges[last], (session->n_ranges - last) * sizeof(upload_range_t));
+        session->n_ranges -= last - pos - 1;
+    }
+    session->ranges[pos].start = start;
+    session->ranges[pos].end = end;
+}
+
+/* forgets a range whose data can't be trusted anymore, ranges reaching past it keep their other part */
+static void upload_session_remove_range(upload_session_t *session, uint64_t start, uint64_t end)
+{
+    size_t pos = 0;
+    while (pos < session->n_ranges)
+    {
+        upload_range_t *range = &session->ranges[pos];
+        if (range->end <= start || range->start >= end)
+        {
+            pos++;
+        }
+        else if (range->start < start && range->end > end)
+        {
+            uint64_t tail = range->end;
+            range->end = start;
+            upload_session_add_range(session, end, tail);
+            return;
+        }
+        else if (range->start < start)
+        {
+            range->end = start;
+            pos++;
+        }
+        else if (range->end > end)
+        {
+            range->start = end;
+            pos++;
+        }
+        else
+        {
+            osMemmove(range, range + 1, (session->n_ranges - pos - 1) * sizeof(upload_range_t));
+            session->n_ranges--;
+        }
+    }
+}
+
+static bool_t upload_session_complete(upload_session_t *session)
+{
+    if (session->size == 0)
+    {
+        return true;
+    }
+    return session->n_ranges == 1 && session->ranges[0].start == 0 && session->ranges[0].end == session->size;
+}
+
+error_t upload_session_create(const char *target, uint64_t size, bool_t pcm, uint32_t audio_id, char *id)
+{
+    uint8_t random[UPLOAD_SESSION_ID_LEN / 2];
+    error_t error = rand_get_algo()->read(rand_get_context(), random, sizeof(random));
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+
+    mutex_lock(MUTEX_UPLOAD_SESSION);
+    upload_session_expire(time(NULL));
+
+    upload_session_t *session = NULL;
+    for (size_t i = 0; i < UPLOAD_SESSION_MAX; i++)
+    {
+        if (!upload_sessions[i].used)
+        {
+            if (session == NULL)
+            {
+                session = &upload_sessions[i];
+            }
+            continue;
+        }
+        if (!osStrcmp(upload_sessions[i].target, target))
+        {
+            TRACE_ERROR("Upload to '%s' already in progress\r\n", target);
+            mutex_unlock(MUTEX_UPLOAD_SESSION);
+            return ERROR_ALREADY_RUNNING;
+        }
+    }
+    if (session == NULL)
+    {
+        TRACE_ERROR("Too many upload sessions\r\n");
+        mutex_unlock(MUTEX_UPLOAD_SESSION);
+        return ERROR_OUT_OF_RESOURCES;
+    }
+
+    for (size_t i = 0; i < sizeof(random); i++)
+    {
+        osSprintf(&session->id[2 * i], "%02x", random[i]);
+    }
+    session->target = strdup(target);
+    session->staging = custom_asprintf("%s%c%s.upload", upload_session_dir_get(), PATH_SEPARATOR, session->id);
+    session->size = size;
+    session->pcm = pcm;
+    session->audio_id = audio_id;
+    session->last_active = time(NULL);
+
+    FsFile *file = fsOpenFile(session->staging, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    if (file == NULL)
+    {
+        TRACE_ERROR("Cannot create staging file '%s'\r\n", session->staging);
+        upload_session_free(session);
+        mutex_unlock(MUTEX_UPLOAD_SESSION);
+        return ERROR_FILE_OPENING_FAILED;
+    }
+    fsCloseFile(file);
+
+    session->used = true;
+    osStrcpy(id, session->id);
+    TRACE_INFO("Upload session %s for '%s' with %" PRIu64 " bytes\r\n", session->id, target, size);
+    mutex_unlock(MUTEX_UPLOAD_SESSION);
+
+    return NO_ERROR;
+}
+
+error_t upload_session_chunk_begin(const char *id, uint64_t offset, uint64_t length, char **staging)
+{
+    mutex_lock(MUTEX_UPLOAD_SESSION);
+    upload_session_t *session = upload_session_find(id);
+    if (session == NULL)
+    {
+        mutex_unlock(MUTEX_UPLOAD_SESSION);
+        return ERROR_NOT_FOUND;
+    }
+    if (length == 0 || length > UPLOAD_SESSION_CHUNK_MAX || offset > session->size || length > session->size - offset)
+    {
+        TRACE_ERROR("Chunk %" PRIu64 "+%" PRIu64 " outside of upload %s\r\n", offset, length, id);
+        mutex_unlock(MUTEX_UPLOAD_SESSION);
+        return ERROR_INVALID_PARAMETER;
+    }
+    session->writers++;
+    session->last_active = time(NULL);
+    *staging = strdup(session->staging);
+    mutex_unlock(MUTEX_UPLOAD_SESSION);
+
+    return NO_ERROR;
+}
+
+void upload_session_chunk_end(const char *id, uint64_t offset, uint64_t length, bool_t received)
+{
+    mutex_lock(MUTEX_UPLOAD_SESSION);
+    upload_session_t *session = upload_session_find(id);
+    if (session != NULL)
+    {
+        session->writers--;
+        session->last_active = time(NULL);
+        if (received)
+        {
+            upload_session_add_range(session, offset, offset + length);
+        }
+        else
+        {
+            /* a retry of a received chunk may have overwritten it before failing */
+            upload_session_remove_range(session, offset, offset + length);
+        }
+    }
+    mutex_unlock(MUTEX_UPLOAD_SESSION);
+}
+
+char *upload_session_status(const char *id)
+{
+    mutex_lock(MUTEX_UPLOAD_SESSION);
+    upload_session_t *session = upload_session_find(id);
+    if (session == NULL)
+    {
+        mutex_unlock(MUTEX_UPLOAD_SESSION);
+        return NULL;
+    }
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "id", session->id);
+    cJSON_AddNumberToObject(json, "size", session->size);
+    cJSON_AddNumberToObject(json, "chunkSize", UPLOAD_SESSION_CHUNK_SIZE);
+
+    uint64_t received = 0;
+    uint64_t pos = 0;
+    cJSON *jsonMissing = cJSON_AddArrayToObject(json, "missing");
+    for (size_t i = 0; i <= session->n_ranges; i++)
+    {
+        uint64_t next = (i < session->n_ranges) ? session->ranges[i].start : session->size;
+        if (next > pos)
+        {
+            cJSON *jsonRange = cJSON_CreateObject();
+            cJSON_AddNumberToObject(jsonRange, "offset", pos);
+            cJSON_AddNumberToObject(jsonRange, "length", next - pos);
+            cJSON_AddItemToArray(jsonMissing, jsonRange);
+        }
+        if (i < session->n_ranges)
+        {
+            received += session->ranges[i].end - session->ranges[i].start;
+            pos = session->ranges[i].end;
+        }
+    }
+    cJSON_AddNumberToObject(json, "received", received);
+    cJSON_AddBoolToObject(json, "complete", upload_session_complete(session));
+    mutex_unlock(MUTEX_UPLOAD_SESSION);
+
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    return jsonString;
+}
+
+error_t upload_session_take(const char *id, upload_session_t *session)
+{
+    mutex_lock(MUTEX_UPLOAD_SESSION);
+    upload_session_t *found = upload_session_find(id);
+    if (found == NULL)
+    {
+        mutex_unlock(MUTEX_UPLOAD_SESSION);
+        return ERROR_NOT_FOUND;
+    }
+    if (found->writers > 0 || !upload_session_complete(found))
+    {
+        mutex_unlock(MUTEX_UPLOAD_SESSION);
+        return ERROR_WRONG_STATE;
+    }
+    *session = *found;
+    osMemset(found, 0x00, sizeof(upload_session_t));
+    mutex_unlock(MUTEX_UPLOAD_SESSION);
+
+    return NO_ERROR;
+}
+
+error_t upload_session_abort(const char *id)
+{
+    mutex_lock(MUTEX_UPLOAD_SESSION);
+    upload_session_t *session = upload_session_find(id);
+    if (session == NULL || session->writers > 0)
+    {
+        mutex_unlock(MUTEX_UPLOAD_SESSION);
+        return session == NULL ? ERROR_NOT_FOUND : ERROR_WRONG_STATE;
+    }
+    TRACE_INFO("Upload session %s for '%s' aborted\r\n", session->id, session->target);
+    fsDeleteFile(session->staging);
+    upload_session_free(session);
+    mutex_unlock(MUTEX_UPLOAD_SESSION);
+
+    return NO_ERROR;
+}
+
+static void upload_session_expect(bool_t ok, const char *what, uint32_t *checks, uint32_t *failures)
+{
+    (*checks)++;
+    if (!ok)
+    {
+        TRACE_ERROR("Check failed: %s\r\n", what);
+        (*failures)++;
+    }
+}
+
+/* compares the received ranges of a session, given as start/end pairs */
+static bool_t upload_session_has_ranges(const char *id, const uint64_t *ranges, size_t n_ranges)
+{
+    mutex_lock(MUTEX_UPLOAD_SESSION);
+    upload_session_t *session = upload_session_find(id);
+    bool_t same = (session != NULL && session->n_ranges == n_ranges);
+    for (size_t i = 0; same && i < n_ranges; i++)
+    {
+        same = session->ranges[i].start == ranges[2 * i] && session->ranges[i].end == ranges[2 * i + 1];
+    }
+    mutex_unlock(MUTEX_UPLOAD_SESSION);
+    return same;
+}
+
+/* begins and ends a chunk right away, the data itself is not written */
+static error_t upload_session_check_chunk(const char *id, uint64_t offset, uint64_t length, bool_t received)
+{
+    char *staging = NULL;
+    error_t error = upload_session_chunk_begin(id, offset, length, &staging);
+    if (error == NO_ERROR)
+    {
+        upload_session_chunk_end(id, offset, length, received);
+        osFreeMem(staging);
+    }
+    return error;
+}
+
+error_t upload_session_check()
+{
+    uint32_t checks = 0;
+    uint32_t failures = 0;
+    char id[UPLOAD_SESSION_ID_LEN + 1];
+    char other[UPLOAD_SESSION_ID_LEN + 1];
+    char *target = custom_asprintf("%s%c%s", settings_get_string("internal.configdirfull"), PATH_SEPARATOR, "upload_check.bin");
+
+    TRACE_WARNING("**********************************\r\n");
+    error_t error = upload_session_create(target, 1000, false, 0, id);
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Cannot create an upload session for '%s'\r\n", target);
+        osFreeMem(target);
+        return error;
+    }
+    upload_session_expect(upload_session_create(target, 1000, false, 0, other) == ERROR_ALREADY_RUNNING, "second upload to the same target is refused", &checks, &failures);
+    upload_session_expect(upload_session_check_chunk("unknown", 0, 100, true) == ERROR_NOT_FOUND, "chunk for an unknown session", &checks, &failures);
+    upload_session_expect(upload_session_check_chunk(id, 900, 200, true) == ERROR_INVALID_PARAMETER, "chunk past the end is refused", &checks, &failures);
+
+    /* out of order, then the gap from a second connection */
+    upload_session_check_chunk(id, 500, 500, true);
+    upload_session_check_chunk(id, 0, 200, true);
+    const uint64_t gap[] = {0, 200, 500, 1000};
+    upload_session_expect(upload_session_has_ranges(id, gap, 2), "out of order chunks leave the gap missing", &checks, &failures);
+
+    upload_session_t session;
+    upload_session_expect(upload_session_take(id, &session) == ERROR_WRONG_STATE, "incomplete upload can't be committed", &checks, &failures);
+
+    char *staging = NULL;
+    upload_session_chunk_begin(id, 200, 300, &staging);
+    osFreeMem(staging);
+    upload_session_expect(upload_session_take(id, &session) == ERROR_WRONG_STATE, "upload with a chunk being written can't be committed", &checks, &failures);
+    upload_session_chunk_end(id, 200, 300, true);
+    const uint64_t full[] = {0, 1000};
+    upload_session_expect(upload_session_has_ranges(id, full, 1), "gap chunk completes the upload", &checks, &failures);
+
+    /* a failed retry may have overwritten received data, only its own range is missing again */
+    upload_session_check_chunk(id, 100, 200, false);
+    const uint64_t retry[] = {0, 100, 300, 1000};
+    upload_session_expect(upload_session_has_ranges(id, retry, 2), "failed retry drops its range", &checks, &failures);
+    upload_session_check_chunk(id, 0, 50, false);
+    upload_session_check_chunk(id, 950, 50, false);
+    const uint64_t edges[] = {50, 100, 300, 950};
+    upload_session_expect(upload_session_has_ranges(id, edges, 2), "failed chunks at the edges drop their range", &checks, &failures);
+
+    char *status = upload_session_status(id);
+    upload_session_expect(status != NULL && osStrstr(status, "\"received\":700") != NULL && osStrstr(status, "\"complete\":false") != NULL, "status reports the received bytes", &checks, &failures);
+    osFreeMem(status);
+
+    upload_session_check_chunk(id, 0, 1000, true);
+    error = upload_session_take(id, &session);
+    upload_session_expect(error == NO_ERROR, "resent upload can be committed", &checks, &failures);
+    if (error == NO_ERROR)
+    {
+        const char *dir = upload_session_dir_get();
+        upload_session_expect(!osStrncmp(session.staging, dir, osStrlen(dir)) && session.staging[osStrlen(dir)] == PATH_SEPARATOR, "staging file is in the upload dir", &checks, &failures);
+        fsDeleteFile(session.staging);
+        upload_session_free(&session);
+    }
+    else
+    {
+        upload_session_abort(id);
+    }
+    upload_session_expect(upload_session_status(id) == NULL, "committed session is gone", &checks, &failures);
+    osFreeMem(target);
+
+    TRACE_WARNING("Checks:           %" PRIu32 "\r\n", checks);
+    TRACE_WARNING("Failures:         %" PRIu32 "\r\n", failures);
+    TRACE_WARNING("**********************************\r\n");
+
+    return failures ? ERROR_FAILURE : NO_ERROR;
+}